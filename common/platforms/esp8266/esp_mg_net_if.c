@@ -699,6 +699,12 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
       num_timers++;
     }
   }
+  mg_mgr_run_timers(mgr, now);
+  if (mgr->num_timers > 0) {
+    double t = mg_mgr_next_timer(mgr);
+    if (num_timers == 0 || t < min_timer) min_timer = t;
+    num_timers += mgr->num_timers;
+  }
   now = mg_time();
   timeout_ms = MG_POLL_INTERVAL_MS;
   if (num_timers > 0) {
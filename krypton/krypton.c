@@ -26,10 +26,43 @@ int SSL_get_fd(SSL *ssl);
 int SSL_accept(SSL *ssl);
 int SSL_connect(SSL *ssl);
 int SSL_read(SSL *ssl, void *buf, int num);
+int SSL_pending(const SSL *ssl);
 int SSL_write(SSL *ssl, const void *buf, int num);
 int SSL_shutdown(SSL *ssl);
 void SSL_free(SSL *ssl);
 
+/*
+ * Session resumption. A server keeps sessions in its SSL_CTX, up to
+ * KR_SESSION_CACHE_SIZE of them, and hands out RFC 5077 session tickets to
+ * clients that ask for them, unless SSL_OP_NO_TICKET is set. A client offers
+ * the session given to SSL_set_session() or, with SSL_SESS_CACHE_CLIENT, the
+ * last session made by its SSL_CTX with the same verify name.
+ */
+typedef struct ssl_session_st SSL_SESSION;
+SSL_SESSION *SSL_get1_session(SSL *ssl);
+int SSL_set_session(SSL *ssl, SSL_SESSION *session);
+int SSL_session_reused(SSL *ssl);
+void SSL_SESSION_free(SSL_SESSION *session);
+
+/*
+ * Krypton-specific, for established connections: record I/O without copies.
+ *
+ * SSL_kr_write_in_place() is SSL_write() that encrypts the data where it is,
+ * buf holds ciphertext afterwards. Record headers and MACs are kept in the
+ * SSL and go out around it in one gather write, several records at a time.
+ * Returns how many bytes at the start of buf are on the wire and can be
+ * dropped. The rest of the records sealed so far must be passed again, at
+ * the start of buf, which may move in between.
+ *
+ * SSL_kr_read_in_place() reads one record into buf, which must have room for
+ * SSL_KR_MAX_RECORD bytes, and decrypts it in place. *len is the number of
+ * bytes of the record read so far, kept by the caller along with buf across
+ * WANT_READ. Returns the number of bytes of data, which start at buf.
+ */
+#define SSL_KR_MAX_RECORD (5 + (1 << 14) + 2048)
+int SSL_kr_write_in_place(SSL *ssl, void *buf, int num);
+int SSL_kr_read_in_place(SSL *ssl, void *buf, int *len);
+
 #define SSL_ERROR_NONE 0
 #define SSL_ERROR_SSL 1
 #define SSL_ERROR_WANT_READ 2
@@ -53,6 +86,29 @@ SSL_CTX *SSL_CTX_new(const SSL_METHOD *meth);
 #define SSL_CTX_set_mode(ctx, op) SSL_CTX_ctrl((ctx), 33, (op), NULL)
 long SSL_CTX_ctrl(SSL_CTX *, int, long, void *);
 
+#define SSL_OP_NO_TICKET 0x00004000L
+#define SSL_CTX_set_options(ctx, op) SSL_CTX_ctrl((ctx), 32, (op), NULL)
+
+#define SSL_SESS_CACHE_OFF 0x0000
+#define SSL_SESS_CACHE_CLIENT 0x0001
+#define SSL_SESS_CACHE_SERVER 0x0002
+#define SSL_SESS_CACHE_BOTH (SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_SERVER)
+#define SSL_CTX_set_session_cache_mode(ctx, m) \
+  SSL_CTX_ctrl((ctx), 44, (m), NULL)
+
+/*
+ * Ticket keys are 48 bytes: key name, HMAC key and AES key, 16 bytes each.
+ * Random keys are made on first use; servers sharing tickets must set them.
+ */
+#define SSL_CTX_set_tlsext_ticket_keys(ctx, keys, keylen) \
+  SSL_CTX_ctrl((ctx), 59, (keylen), (keys))
+
+/*
+ * Takes OpenSSL cipher names separated by colons, in order of preference.
+ * Names of suites Krypton does not implement are skipped, as are exclusions.
+ * Supported: ECDHE-RSA-AES128-GCM-SHA256, AES128-GCM-SHA256, AES128-SHA256,
+ * AES128-SHA, RC4-SHA, RC4-MD5.
+ */
 int SSL_CTX_set_cipher_list(SSL_CTX *ctx, const char *str);
 
 /* for the client */
@@ -62,6 +118,11 @@ int SSL_CTX_set_cipher_list(SSL_CTX *ctx, const char *str);
 #define SSL_VERIFY_CLIENT_ONCE 0x04
 void SSL_CTX_set_verify(SSL_CTX *ctx, int mode,
                         int (*verify_callback)(int, X509_STORE_CTX *));
+/*
+ * CAfile is a PEM bundle, or an index built from one by tools/mkcaindex.
+ * Issuers are looked up in the index by subject hash, without parsing the
+ * whole bundle on every handshake.
+ */
 int SSL_CTX_load_verify_locations(SSL_CTX *ctx, const char *CAfile,
                                   const char *CAPath);
 
@@ -120,8 +181,10 @@ typedef struct {
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
 #ifdef _MSC_VER
 #include <winsock2.h>
@@ -217,18 +280,62 @@ struct ssl_method_st {
   uint8_t cl_undefined : 1;
 };
 
+/* Number of sessions an SSL_CTX remembers */
+#ifndef KR_SESSION_CACHE_SIZE
+#define KR_SESSION_CACHE_SIZE 8
+#endif
+
+/* How long a session can be resumed for, in seconds */
+#ifndef KR_SESSION_TIMEOUT
+#define KR_SESSION_TIMEOUT 7200
+#endif
+
+/* Longest session ticket a client keeps */
+#ifndef KR_MAX_TICKET_LEN
+#define KR_MAX_TICKET_LEN 4096
+#endif
+
+#define KR_TICKET_KEYS_LEN 48
+
+/* Room for the cipher suites set by SSL_CTX_set_cipher_list() */
+#define KR_MAX_CIPHER_SUITES 8
+
+struct ssl_session_st {
+  int refs;
+  uint16_t cipher_suite;
+  uint8_t id_len;
+  uint8_t id[32];
+  uint8_t master_secret[48];
+  time_t time;
+  /* Client only: ticket issued by the server and verify name of the ctx. */
+  uint8_t *ticket;
+  uint16_t ticket_len;
+  char *name;
+};
+
 struct ssl_ctx_st {
 #ifndef KR_NO_LOAD_CA_STORE
   X509 *ca_store;
 #else
   char *ca_file;
 #endif
+  struct kr_ca_index *ca_index;
   PEM *pem_cert;
   RSA_CTX *rsa_privkey;
   uint8_t mode;
   uint8_t vrfy_mode;
   struct ssl_method_st meth;
   char *verify_name;
+
+  long options;
+  uint8_t sess_cache_mode;
+  uint8_t have_ticket_keys;
+  uint8_t ticket_keys[KR_TICKET_KEYS_LEN];
+  struct ssl_session_st *sessions[KR_SESSION_CACHE_SIZE]; /* Newest first */
+
+  /* Cipher suites to offer or accept, in order of preference */
+  uint16_t cipher_suites[KR_MAX_CIPHER_SUITES];
+  uint8_t num_cipher_suites;
 };
 
 #define STATE_INITIAL 0
@@ -242,6 +349,7 @@ struct ssl_ctx_st {
 #define STATE_CLIENT_FINISHED 8
 #define STATE_ESTABLISHED 9
 #define STATE_CLOSING 10
+#define STATE_SV_FINISHED_RCVD 11
 
 struct ssl_st {
   struct ssl_ctx_st *ctx;
@@ -249,6 +357,12 @@ struct ssl_st {
   struct tls_security *cur;
   struct tls_security *nxt;
 
+  /* Session offered (client) or made by the last handshake */
+  struct ssl_session_st *session;
+  /* Client: ticket received in this handshake */
+  uint8_t *ticket;
+  uint16_t ticket_len;
+
 /* rcv buffer: can be 16bit lens? */
 #define RX_INITIAL_BUF 256
   uint8_t *rx_buf;
@@ -259,9 +373,15 @@ struct ssl_st {
   uint32_t tx_len;
   uint32_t tx_max_len;
 
+  /* Records sealed by SSL_kr_write_in_place() and not sent yet */
+  struct kr_wip *wip;
+
   int fd;
   int err;
 
+  /* Bytes of data in the record SSL_write() is trying to send */
+  int write_len;
+
   /* for handling appdata recvs */
   unsigned int copied;
   struct vec extra_appdata;
@@ -280,6 +400,8 @@ struct ssl_st {
   unsigned int fatal : 1;
   unsigned int write_pending : 1;
   unsigned int cert_requested : 1;
+  unsigned int resumed : 1;
+  unsigned int issue_ticket : 1;
 };
 
 NS_INTERNAL void ssl_err(struct ssl_st *ssl, int err);
@@ -318,7 +440,7 @@ typedef struct _bigint bigint; /**< An alias for _bigint */
 #define KR_ALLOW_NULL_CIPHERS 0
 
 /* just count non-NULL ciphers */
-#define NUM_CIPHER_SUITES 4
+#define NUM_CIPHER_SUITES 6
 
 #define NUM_COMPRESSORS 1
 
@@ -352,6 +474,27 @@ struct tls_EXT_reneg {
   uint8_t ri_len;
 } __packed;
 
+struct tls_EXT_groups {
+  uint16_t type;
+  uint16_t len;
+  uint16_t groups_len;
+  uint16_t group[1];
+} __packed;
+
+struct tls_EXT_point_fmts {
+  uint16_t type;
+  uint16_t len;
+  uint8_t fmts_len;
+  uint8_t fmt[1];
+} __packed;
+
+struct tls_EXT_sig_algs {
+  uint16_t type;
+  uint16_t len;
+  uint16_t algs_len;
+  uint8_t alg[2];
+} __packed;
+
 struct tls_svr_hello {
   uint8_t type;
   uint8_t len_hi;
@@ -380,6 +523,9 @@ struct tls_cl_hello {
   uint16_t ext_len;
 
   struct tls_EXT_reneg ext_reneg;
+  struct tls_EXT_groups ext_groups;
+  struct tls_EXT_point_fmts ext_point_fmts;
+  struct tls_EXT_sig_algs ext_sig_algs;
 } __packed;
 
 struct tls_cert {
@@ -427,6 +573,25 @@ enum TLS_SignatureAlgorithm {
   TLS_SIG_RSA = 1,
 };
 
+/*
+ * This is the RSASSA-PKCS1-v1_5 header for a SHA256 digest,
+ * and translates from ASN.1-speak as follows:
+ * SEQUENCE (2 elem)
+ *   SEQUENCE (2 elem)
+ *     OBJECT IDENTIFIER  2.16.840.1.101.3.4.2.1  (id-sha256)
+ *     NULL
+ *   OCTET STRING (32 byte)
+ */
+#define TLS_SHA256_DIGEST_INFO                                     \
+  "\x30\x31\x30\x0D\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05" \
+  "\x00\x04\x20"
+#define TLS_SHA256_DIGEST_INFO_LEN 19
+
+/* ECDHE parameters, RFC 4492 and RFC 7748 */
+#define TLS_CURVE_NAMED 3
+#define TLS_GROUP_X25519 0x001d
+#define TLS_POINT_UNCOMPRESSED 0
+
 #define TLS_1_2_PROTO 0x0303
 #define TLS_1_1_PROTO 0x0302
 #define TLS_1_0_PROTO 0x0301
@@ -454,6 +619,8 @@ enum TLS_SignatureAlgorithm {
 #define EXT_SESSION_TICKET 0x0023
 #define EXT_HEARTBEAT 0x000f
 #define EXT_SIG_ALGOS 0x000d
+#define EXT_SUPPORTED_GROUPS 0x000a
+#define EXT_EC_POINT_FORMATS 0x000b
 #define EXT_NPN 0x3374
 #define EXT_RENEG_INFO 0xff01
 
@@ -493,6 +660,8 @@ typedef enum {
   TLS_RSA_WITH_RC4_128_SHA = 0x0005,
   TLS_RSA_WITH_AES_128_CBC_SHA = 0x002f,
   TLS_RSA_WITH_AES_128_CBC_SHA256 = 0x003c,
+  TLS_RSA_WITH_AES_128_GCM_SHA256 = 0x009c,
+  TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256 = 0xc02f,
 } kr_cs_id;
 
 #define TLS_EMPTY_RENEGOTIATION_INFO_SCSV 0x00ff
@@ -538,6 +707,9 @@ extern void kr_hash_sha256_v(size_t num_msgs, const uint8_t *msgs[],
 #define kr_recv recv
 #if defined(_POSIX_VERSION)
 #include <sys/socket.h>
+#include <sys/uio.h>
+/* Records sealed in place go out with one sendmsg() */
+#define KR_HAVE_SENDMSG
 #endif
 #endif
 
@@ -549,6 +721,11 @@ extern void kr_hash_sha256_v(size_t num_msgs, const uint8_t *msgs[],
 #endif
 #endif
 
+/* Map the trust anchor index instead of reading it. */
+#if defined(_POSIX_VERSION) && !defined(KR_NO_MMAP)
+#define KR_USE_MMAP
+#endif
+
 #endif /* CS_KRYPTON_SRC_KEXTERNS_H_ */
 #ifdef KR_MODULE_LINES
 #line 1 "src/src/crypto.h"
@@ -594,6 +771,19 @@ NS_INTERNAL void SHA256_Final(uint8_t digest[32], SHA256_CTX *);
 #define AES256_KEY_SIZE 32
 #define MAX_KEY_SIZE AES256_KEY_SIZE
 
+/* AES-GCM records, RFC 5288: implicit salt, explicit nonce and tag */
+#define GCM_SALT_SIZE 4
+#define GCM_NONCE_SIZE 8
+#define GCM_TAG_SIZE 16
+
+#define X25519_KEY_SIZE 32
+
+/* AES-NI and PCLMULQDQ, used on x86-64 if the CPU has them */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(KR_NO_AESNI)
+#define KR_AESNI
+NS_INTERNAL int kr_cpu_has_aesni(void);
+#endif
+
 /* RSA */
 NS_INTERNAL void RSA_priv_key_new(RSA_CTX **rsa_ctx, const uint8_t *modulus,
                                   int mod_len, const uint8_t *pub_exp,
@@ -657,8 +847,27 @@ NS_INTERNAL void kr_cbc_decrypt(const kr_cipher_info *ci, void *cctx,
                                 const uint8_t *msg, int len, const uint8_t *iv,
                                 uint8_t *out);
 
+NS_INTERNAL int kr_cs_is_aead(kr_cs_id cs);
+NS_INTERNAL int kr_cs_is_ecdhe(kr_cs_id cs);
+
 const kr_cipher_info *kr_rc4_cs_info();
 const kr_cipher_info *kr_aes128_cs_info();
+const kr_cipher_info *kr_aes128_gcm_cs_info();
+
+/* AES-GCM with a 12 byte nonce, context is made by kr_aes128_gcm_cs_info() */
+NS_INTERNAL void kr_gcm_encrypt(void *gctx, const uint8_t *nonce,
+                                const uint8_t *aad, size_t aad_len,
+                                const uint8_t *in, size_t len, uint8_t *out,
+                                uint8_t *tag);
+NS_INTERNAL int kr_gcm_decrypt(void *gctx, const uint8_t *nonce,
+                               const uint8_t *aad, size_t aad_len,
+                               const uint8_t *in, size_t len, uint8_t *out,
+                               const uint8_t *tag);
+
+/* X25519, RFC 7748. Returns 0 if the shared secret is all zeroes. */
+NS_INTERNAL int kr_x25519(uint8_t *out, const uint8_t *scalar,
+                          const uint8_t *point);
+NS_INTERNAL void kr_x25519_base(uint8_t *out, const uint8_t *scalar);
 
 #endif /* CS_KRYPTON_SRC_CRYPTO_H_ */
 #ifdef KR_MODULE_LINES
@@ -910,6 +1119,8 @@ typedef struct tls_security {
    * server_write_MAC_key
    * client_write_key
    * server_write_key
+   * client_write_IV
+   * server_write_IV
   */
   uint8_t keys[MAX_DIGEST_SIZE * 2 + MAX_KEY_SIZE * 2 + MAX_IV_SIZE * 2];
 
@@ -922,10 +1133,18 @@ typedef struct tls_security {
 
   uint8_t cipher_negotiated : 1;
   uint8_t compressor_negotiated : 1;
-  uint8_t bitpad : 6;
+  uint8_t peer_key_rcvd : 1;
+  uint8_t bitpad : 5;
+
+  uint8_t sess_id_len;
+  uint8_t sess_id[32];
 
   RSA_CTX *svr_key;
 
+  /* ECDHE: our ephemeral X25519 key and the peer's public key */
+  uint8_t ecdh_priv[X25519_KEY_SIZE];
+  uint8_t ecdh_peer[X25519_KEY_SIZE];
+
   uint8_t master_secret[48];
   struct tls_random cl_rnd;
   struct tls_random sv_rnd;
@@ -936,15 +1155,43 @@ typedef struct tls_security {
   SHA256_CTX handshakes_hash;
 } * tls_sec_t;
 
+/*
+ * Record sealed in the caller's buffer by SSL_kr_write_in_place(). Only the
+ * header with the explicit IV or nonce and the trailer are kept here. CBC
+ * encrypts the last partial block of data as part of the trailer.
+ */
+#define KR_WIP_RECORDS 4
+#define KR_WIP_MAX_HDR (5 + MAX_IV_SIZE)
+/* Partial block, MAC and padding */
+#define KR_WIP_MAX_TRAILER (MAX_IV_SIZE - 1 + MAX_DIGEST_SIZE + MAX_IV_SIZE)
+struct kr_wip_rec {
+  uint8_t hdr[KR_WIP_MAX_HDR];
+  uint8_t trailer[KR_WIP_MAX_TRAILER];
+  uint8_t hdr_len;
+  uint8_t trailer_len;
+  uint16_t body_len; /* Bytes of data encrypted in place */
+  uint16_t data_len; /* Bytes of data in the record */
+};
+
+struct kr_wip {
+  int num;
+  size_t sent; /* Bytes of the first record that are on the wire */
+  struct kr_wip_rec rec[KR_WIP_RECORDS];
+};
+
 NS_INTERNAL tls_sec_t tls_new_security(void);
 NS_INTERNAL void tls_free_security(tls_sec_t sec);
 
 /* generic */
 NS_INTERNAL int tls_handle_recv(SSL *ssl, uint8_t *out, size_t out_len);
+NS_INTERNAL int tls_handle_record(SSL *ssl, uint8_t *buf, size_t len);
 NS_INTERNAL void tls_generate_keys(tls_sec_t sec, int is_server);
+NS_INTERNAL const uint8_t *tls_write_iv(tls_sec_t sec, int server_write);
 NS_INTERNAL int tls_send(SSL *ssl, uint8_t type, const void *buf, size_t len);
 NS_INTERNAL int tls_tx_push(SSL *ssl, const void *data, size_t len);
 NS_INTERNAL ssize_t tls_write(SSL *ssl, const uint8_t *buf, size_t sz);
+NS_INTERNAL int tls_seal_in_place(SSL *ssl, uint8_t *buf, size_t len,
+                                  struct kr_wip_rec *rec);
 NS_INTERNAL int tls_alert(SSL *ssl, uint8_t level, uint8_t desc);
 NS_INTERNAL int tls_close_notify(SSL *ssl);
 NS_INTERNAL void tls_add_handshake_to_hash(SSL *ssl, const void *data,
@@ -958,18 +1205,42 @@ NS_INTERNAL int tls_check_server_finished(tls_sec_t sec, const uint8_t *vrfy,
                                           size_t vrfy_len);
 NS_INTERNAL void tls_generate_client_finished(tls_sec_t sec, uint8_t *vrfy,
                                               size_t vrfy_len);
+NS_INTERNAL void tls_cl_save_session(SSL *ssl);
 
 /* server */
 NS_INTERNAL int tls_sv_hello(SSL *ssl);
 NS_INTERNAL int tls_sv_finish(SSL *ssl);
+NS_INTERNAL int tls_sv_resume(SSL *ssl, const uint8_t *sess_id,
+                              size_t sess_id_len, const uint8_t *ticket,
+                              int ticket_len, const uint16_t *cipher_suites,
+                              unsigned int num_ciphers);
+NS_INTERNAL void tls_sv_save_session(SSL *ssl);
 
 NS_INTERNAL int tls_check_client_finished(tls_sec_t sec, const uint8_t *vrfy,
                                           size_t vrfy_len);
 NS_INTERNAL void tls_generate_server_finished(tls_sec_t sec, uint8_t *vrfy,
                                               size_t vrfy_len);
 
-NS_INTERNAL void tls_compute_master_secret(tls_sec_t sec,
-                                           struct tls_premaster_secret *pre);
+NS_INTERNAL void tls_compute_master_secret(tls_sec_t sec, const uint8_t *pre,
+                                           size_t pre_len);
+NS_INTERNAL void tls_key_exch_digest(tls_sec_t sec, const uint8_t *params,
+                                     size_t len, uint8_t *out);
+
+/* sessions */
+NS_INTERNAL SSL_SESSION *kr_session_new(tls_sec_t sec);
+NS_INTERNAL int kr_session_expired(const SSL_SESSION *sess);
+NS_INTERNAL void kr_session_cache_add(SSL_CTX *ctx, SSL_SESSION *sess,
+                                      int is_server);
+NS_INTERNAL SSL_SESSION *kr_session_cache_find(SSL_CTX *ctx,
+                                               const uint8_t *id,
+                                               size_t id_len,
+                                               const char *name);
+NS_INTERNAL void kr_session_cache_free(SSL_CTX *ctx);
+#define KR_TICKET_LEN (16 + 16 + 64 + SHA256_SIZE)
+NS_INTERNAL int kr_ticket_seal(SSL_CTX *ctx, const SSL_SESSION *sess,
+                               uint8_t *out);
+NS_INTERNAL int kr_ticket_open(SSL_CTX *ctx, const uint8_t *ticket,
+                               size_t len, SSL_SESSION *sess);
 
 #endif /* CS_KRYPTON_SRC_TLS_H_ */
 #ifdef KR_MODULE_LINES
@@ -1106,6 +1377,13 @@ NS_INTERNAL int X509_verify_name(X509 *cert, const char *name);
 
 NS_INTERNAL int kr_match_domain_name(struct ro_vec pat, struct ro_vec dom);
 
+/* Trust anchor index, see ca_index.c */
+struct kr_ca_index;
+NS_INTERNAL int kr_ca_index_open(const char *file, struct kr_ca_index **out);
+NS_INTERNAL X509 *kr_ca_index_find(struct kr_ca_index *ci, struct vec *subject);
+NS_INTERNAL void kr_ca_index_free(struct kr_ca_index *ci);
+NS_INTERNAL uint32_t kr_ca_index_hash(const uint8_t *p, size_t len);
+
 #endif /* CS_KRYPTON_SRC_X509_H_ */
 #ifdef KR_MODULE_LINES
 #line 1 "src/src/b64.c"
@@ -2791,6 +3069,220 @@ NS_INTERNAL bigint *bi_crt(BI_CTX *ctx, bigint *bi, bigint *dP, bigint *dQ,
 }
 /** @} */
 #ifdef KR_MODULE_LINES
+#line 1 "src/src/ca_index.c"
+#endif
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * Trust anchor index: CA certificates in DER, preceded by a hash table of
+ * their subjects, so that finding the issuer of a chain costs one bucket
+ * lookup and one X509_new() instead of parsing the whole PEM bundle.
+ * Built on the host by tools/mkcaindex. All numbers are big-endian.
+ *
+ *   "KRCA"
+ *   u32 num_buckets                   (a power of two)
+ *   u32 num_certs
+ *   u32 bucket_start[num_buckets + 1] (first entry of each bucket)
+ *   struct { u32 hash, offset, len; } entries[num_certs]
+ *   certificates
+ *
+ * With KR_USE_MMAP the file is mapped and nothing is copied, otherwise
+ * the table is kept in memory and certificates are read on demand.
+ */
+
+#ifdef KR_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define KR_CA_INDEX_HDR_LEN 12
+#define KR_CA_INDEX_MAX_CERTS 65536
+
+struct kr_ca_index {
+  const uint8_t *table; /* bucket_start, then entries */
+  uint32_t num_buckets;
+  uint32_t num_certs;
+#ifdef KR_USE_MMAP
+  uint8_t *map;
+  size_t map_len;
+#else
+  char *file;
+#endif
+};
+
+static uint32_t kr_ca_get32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
+
+/* FNV-1a */
+NS_INTERNAL uint32_t kr_ca_index_hash(const uint8_t *p, size_t len) {
+  uint32_t h = 2166136261U;
+  while (len-- > 0) {
+    h ^= *p++;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+/* Check the table against the file size, so that lookups need not. */
+static int kr_ca_index_check(struct kr_ca_index *ci, size_t file_len) {
+  const uint8_t *entries = ci->table + 4 * (ci->num_buckets + 1);
+  uint32_t i, prev = 0;
+
+  for (i = 0; i <= ci->num_buckets; i++) {
+    uint32_t start = kr_ca_get32(ci->table + 4 * i);
+    if (start < prev || start > ci->num_certs) return 0;
+    prev = start;
+  }
+  if (prev != ci->num_certs) return 0;
+
+  for (i = 0; i < ci->num_certs; i++) {
+    uint32_t off = kr_ca_get32(entries + 12 * i + 4);
+    uint32_t len = kr_ca_get32(entries + 12 * i + 8);
+    if (off > file_len || len > file_len - off) return 0;
+  }
+  return 1;
+}
+
+/*
+ * Returns 1 and the index in `out`, 0 if the index is corrupted, or -1 if
+ * the file is not an index at all.
+ */
+NS_INTERNAL int kr_ca_index_open(const char *file, struct kr_ca_index **out) {
+  struct kr_ca_index *ci = NULL;
+  uint8_t hdr[KR_CA_INDEX_HDR_LEN];
+  size_t table_len, file_len;
+  int ret = 0;
+  FILE *f;
+
+  *out = NULL;
+  f = fopen(file, "rb");
+  if (NULL == f) return -1;
+  if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+      memcmp(hdr, "KRCA", 4) != 0) {
+    ret = -1; /* Most likely a PEM bundle */
+    goto out;
+  }
+
+  ci = calloc(1, sizeof(*ci));
+  if (NULL == ci) goto out;
+  ci->num_buckets = kr_ca_get32(hdr + 4);
+  ci->num_certs = kr_ca_get32(hdr + 8);
+  if (ci->num_buckets == 0 || (ci->num_buckets & (ci->num_buckets - 1)) ||
+      ci->num_buckets > KR_CA_INDEX_MAX_CERTS ||
+      ci->num_certs > KR_CA_INDEX_MAX_CERTS) {
+    dprintf(("%s: bad CA index header\n", file));
+    goto err;
+  }
+  table_len = 4 * (ci->num_buckets + 1) + 12 * ci->num_certs;
+
+  if (fseek(f, 0, SEEK_END) != 0) goto err;
+  file_len = (size_t) ftell(f);
+  if (file_len < KR_CA_INDEX_HDR_LEN + table_len) goto err;
+
+#ifdef KR_USE_MMAP
+  ci->map = mmap(NULL, file_len, PROT_READ, MAP_SHARED, fileno(f), 0);
+  if (ci->map == MAP_FAILED) {
+    ci->map = NULL;
+    goto err;
+  }
+  ci->map_len = file_len;
+  ci->table = ci->map + KR_CA_INDEX_HDR_LEN;
+#else
+  {
+    uint8_t *table = malloc(table_len);
+    ci->table = table;
+    if (NULL == table || fseek(f, KR_CA_INDEX_HDR_LEN, SEEK_SET) != 0 ||
+        fread(table, 1, table_len, f) != table_len) {
+      goto err;
+    }
+  }
+  ci->file = strdup(file);
+  if (NULL == ci->file) goto err;
+#endif
+
+  if (!kr_ca_index_check(ci, file_len)) {
+    dprintf(("%s: corrupted CA index\n", file));
+    goto err;
+  }
+  *out = ci;
+  ret = 1;
+  goto out;
+
+err:
+  kr_ca_index_free(ci);
+out:
+  fclose(f);
+  return ret;
+}
+
+/* Returns the anchor with the given subject, to be freed by the caller. */
+NS_INTERNAL X509 *kr_ca_index_find(struct kr_ca_index *ci,
+                                   struct vec *subject) {
+  const uint8_t *entries, *e;
+  uint32_t h, b, i, end;
+  X509 *cert = NULL;
+#ifndef KR_USE_MMAP
+  FILE *f = NULL;
+  uint8_t *der = NULL;
+#endif
+
+  if (ci == NULL) return NULL;
+
+  h = kr_ca_index_hash(subject->ptr, subject->len);
+  b = h & (ci->num_buckets - 1);
+  entries = ci->table + 4 * (ci->num_buckets + 1);
+  end = kr_ca_get32(ci->table + 4 * (b + 1));
+
+  for (i = kr_ca_get32(ci->table + 4 * b); i < end && cert == NULL; i++) {
+    uint32_t off, len;
+
+    e = entries + 12 * i;
+    if (kr_ca_get32(e) != h) continue;
+    off = kr_ca_get32(e + 4);
+    len = kr_ca_get32(e + 8);
+#ifdef KR_USE_MMAP
+    cert = X509_new(ci->map + off, len);
+#else
+    if (f == NULL && (f = fopen(ci->file, "rb")) == NULL) break;
+    free(der);
+    der = malloc(len);
+    if (NULL == der || fseek(f, off, SEEK_SET) != 0 ||
+        fread(der, 1, len, f) != len) {
+      break;
+    }
+    cert = X509_new(der, len);
+#endif
+    /* A hash collision */
+    if (cert != NULL && !x509_issued_by(&cert->subject, subject)) {
+      X509_free(cert);
+      cert = NULL;
+    }
+  }
+
+#ifndef KR_USE_MMAP
+  free(der);
+  if (f != NULL) fclose(f);
+#endif
+  return cert;
+}
+
+NS_INTERNAL void kr_ca_index_free(struct kr_ca_index *ci) {
+  if (ci == NULL) return;
+#ifdef KR_USE_MMAP
+  if (ci->map != NULL) munmap(ci->map, ci->map_len);
+#else
+  free((uint8_t *) ci->table);
+  free(ci->file);
+#endif
+  free(ci);
+}
+#ifdef KR_MODULE_LINES
 #line 1 "src/src/ctx.c"
 #endif
 /*
@@ -2805,6 +3297,27 @@ NS_INTERNAL bigint *bi_crt(BI_CTX *ctx, bigint *bi, bigint *dP, bigint *dQ,
 /* Amalgamated: #include "x509.h" */
 /* Amalgamated: #include "pem.h" */
 
+static const uint16_t kr_default_cipher_suites[] = {
+#if KR_ALLOW_NULL_CIPHERS
+    /* if we allow them, it's for testing reasons, so NULL comes first */
+    TLS_RSA_WITH_NULL_MD5,
+#endif
+    TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256, TLS_RSA_WITH_AES_128_GCM_SHA256,
+    TLS_RSA_WITH_AES_128_CBC_SHA256,       TLS_RSA_WITH_AES_128_CBC_SHA,
+    TLS_RSA_WITH_RC4_128_SHA,              TLS_RSA_WITH_RC4_128_MD5};
+
+static const struct {
+  const char *name;
+  uint16_t suite;
+} kr_cipher_names[] = {
+    {"ECDHE-RSA-AES128-GCM-SHA256", TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256},
+    {"AES128-GCM-SHA256", TLS_RSA_WITH_AES_128_GCM_SHA256},
+    {"AES128-SHA256", TLS_RSA_WITH_AES_128_CBC_SHA256},
+    {"AES128-SHA", TLS_RSA_WITH_AES_128_CBC_SHA},
+    {"RC4-SHA", TLS_RSA_WITH_RC4_128_SHA},
+    {"RC4-MD5", TLS_RSA_WITH_RC4_128_MD5},
+};
+
 SSL_CTX *SSL_CTX_new(const SSL_METHOD *meth) {
   SSL_CTX *ctx;
 
@@ -2814,6 +3327,11 @@ SSL_CTX *SSL_CTX_new(const SSL_METHOD *meth) {
   assert(meth != NULL);
 
   ctx->meth = *meth;
+  ctx->sess_cache_mode = SSL_SESS_CACHE_SERVER;
+  memcpy(ctx->cipher_suites, kr_default_cipher_suites,
+         sizeof(kr_default_cipher_suites));
+  ctx->num_cipher_suites =
+      sizeof(kr_default_cipher_suites) / sizeof(kr_default_cipher_suites[0]);
 
   /* success */
   goto out;
@@ -2828,20 +3346,55 @@ out:
 }
 
 long SSL_CTX_ctrl(SSL_CTX *ctx, int cmd, long mode, void *ptr) {
-  (void) ctx;
-  (void) cmd;
-  (void) ptr;
-  if (cmd == 33) {
-    ctx->mode |= mode;
+  long ret;
+  switch (cmd) {
+    case 32: /* SSL_CTX_set_options */
+      ctx->options |= mode;
+      return ctx->options;
+    case 44: /* SSL_CTX_set_session_cache_mode */
+      ret = ctx->sess_cache_mode;
+      ctx->sess_cache_mode = mode;
+      return ret;
+    case 59: /* SSL_CTX_set_tlsext_ticket_keys */
+      if (mode != KR_TICKET_KEYS_LEN || ptr == NULL) return 0;
+      memcpy(ctx->ticket_keys, ptr, KR_TICKET_KEYS_LEN);
+      ctx->have_ticket_keys = 1;
+      return 1;
+    case 33: /* SSL_CTX_set_mode */
+      ctx->mode |= mode;
+      break;
   }
   return ctx->mode;
 }
 
 int SSL_CTX_set_cipher_list(SSL_CTX *ctx, const char *str) {
-  /* TODO(rojer): Implement this. */
-  (void) ctx;
-  (void) str;
-  return 0;
+  uint16_t suites[KR_MAX_CIPHER_SUITES];
+  unsigned int i, j, num = 0;
+  size_t len;
+
+  while (*str != '\0') {
+    len = strcspn(str, ":, ");
+    for (i = 0; i < sizeof(kr_cipher_names) / sizeof(kr_cipher_names[0]);
+         i++) {
+      if (strlen(kr_cipher_names[i].name) != len ||
+          strncmp(kr_cipher_names[i].name, str, len) != 0) {
+        continue;
+      }
+      for (j = 0; j < num && suites[j] != kr_cipher_names[i].suite; j++) {
+      }
+      if (j == num && num < KR_MAX_CIPHER_SUITES) {
+        suites[num++] = kr_cipher_names[i].suite;
+      }
+    }
+    str += len;
+    if (*str != '\0') str++;
+  }
+
+  /* Like OpenSSL, fail and keep the old list if nothing matched */
+  if (num == 0) return 0;
+  memcpy(ctx->cipher_suites, suites, num * sizeof(suites[0]));
+  ctx->num_cipher_suites = num;
+  return 1;
 }
 
 void SSL_CTX_set_verify(SSL_CTX *ctx, int mode,
@@ -2871,6 +3424,7 @@ static enum pem_filter_result pem_no_filter(const DER *obj, int type,
 
 int SSL_CTX_load_verify_locations(SSL_CTX *ctx, const char *CAfile,
                                   const char *CAPath) {
+  struct kr_ca_index *ci;
   unsigned int i;
   int ret = 0;
   X509 *ca;
@@ -2885,6 +3439,17 @@ int SSL_CTX_load_verify_locations(SSL_CTX *ctx, const char *CAfile,
     return 0;
   }
 
+  /* A pre-built index is used in place, see ca_index.c */
+  ret = kr_ca_index_open(CAfile, &ci);
+  if (ret >= 0) {
+    if (ret) {
+      kr_ca_index_free(ctx->ca_index);
+      ctx->ca_index = ci;
+    }
+    return ret;
+  }
+  ret = 0;
+
 #ifndef KR_NO_LOAD_CA_STORE
   p = pem_load_types(CAfile, PEM_SIG_CERT);
   if (NULL == p) goto out;
@@ -3078,9 +3643,11 @@ void SSL_CTX_free(SSL_CTX *ctx) {
 #else
   free(ctx->ca_file);
 #endif
+  kr_ca_index_free(ctx->ca_index);
   pem_free(ctx->pem_cert);
   RSA_free(ctx->rsa_privkey);
   free(ctx->verify_name);
+  kr_session_cache_free(ctx);
   free(ctx);
 }
 #ifdef KR_MODULE_LINES
@@ -4352,6 +4919,10 @@ NS_INTERNAL int kr_hmac_len(kr_cs_id cs) {
       return SHA1_SIZE;
     case TLS_RSA_WITH_AES_128_CBC_SHA256:
       return SHA256_SIZE;
+    case TLS_RSA_WITH_AES_128_GCM_SHA256:
+    case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+      /* AEAD, records are authenticated by the cipher */
+      return 0;
   }
   return -1;
 }
@@ -4415,6 +4986,9 @@ NS_INTERNAL void kr_ssl_hmac(SSL *ssl, int cs, size_t num_msgs,
     case TLS_RSA_WITH_AES_128_CBC_SHA256:
       hf = kr_hash_sha256_v;
       break;
+    case TLS_RSA_WITH_AES_128_GCM_SHA256:
+    case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+      return;
   }
   kr_hmac_v(hf, key, mac_len, num_msgs, msgs, msg_lens, digest, mac_len);
 }
@@ -4802,23 +5376,33 @@ int get_random_nonzero(uint8_t *out, size_t len) {
 #ifndef KR_EXT_AES
 
 /**
- * AES implementation - this is a small code version. There are much faster
- * versions around but they are much larger in size (i.e. they use large
- * submix tables).
+ * AES implementation. Rounds use one 1K table per direction, rotated for
+ * the other three columns, which is much faster than computing MixColumn
+ * byte by byte and still small enough for devices. On x86-64 AES-NI is
+ * used instead if the CPU has it.
  */
 
 /* Amalgamated: #include "ktypes.h" */
+/* Amalgamated: #include "crypto.h" */
 
 #define AES_BLOCK_SIZE 16
 
 #include <string.h>
 
+#ifdef KR_AESNI
+#include <wmmintrin.h>
+#endif
+
 #define AES_MAX_ROUNDS 14
 
 typedef struct aes_key_st {
   uint16_t rounds;
   uint16_t key_size;
+  /* Round keys are kept in byte order with AES-NI, as words otherwise */
   uint32_t ks[(AES_MAX_ROUNDS + 1) * 8];
+#ifdef KR_AESNI
+  int aesni;
+#endif
 } kr_aes_ctx;
 
 typedef enum { AES_MODE_128, AES_MODE_256 } AES_MODE;
@@ -4911,11 +5495,212 @@ static const unsigned char Rcon[30] = {
     0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91,
 };
 
-/* Perform doubling in Galois Field GF(2^8) using the irreducible polynomial
-   x^8+x^4+x^3+x+1 */
-static unsigned char kr_aes_xtime(uint32_t x) {
-  return (x & 0x80) ? (x << 1) ^ 0x1b : x << 1;
+/*
+ * S-box output multiplied by the MixColumn coefficients {02, 01, 01, 03}.
+ * Rotating the entry gives the contribution of the other rows.
+ */
+static const uint32_t kr_aes_te[256] = {
+    0xc66363a5, 0xf87c7c84, 0xee777799, 0xf67b7b8d, 0xfff2f20d, 0xd66b6bbd,
+    0xde6f6fb1, 0x91c5c554, 0x60303050, 0x02010103, 0xce6767a9, 0x562b2b7d,
+    0xe7fefe19, 0xb5d7d762, 0x4dababe6, 0xec76769a, 0x8fcaca45, 0x1f82829d,
+    0x89c9c940, 0xfa7d7d87, 0xeffafa15, 0xb25959eb, 0x8e4747c9, 0xfbf0f00b,
+    0x41adadec, 0xb3d4d467, 0x5fa2a2fd, 0x45afafea, 0x239c9cbf, 0x53a4a4f7,
+    0xe4727296, 0x9bc0c05b, 0x75b7b7c2, 0xe1fdfd1c, 0x3d9393ae, 0x4c26266a,
+    0x6c36365a, 0x7e3f3f41, 0xf5f7f702, 0x83cccc4f, 0x6834345c, 0x51a5a5f4,
+    0xd1e5e534, 0xf9f1f108, 0xe2717193, 0xabd8d873, 0x62313153, 0x2a15153f,
+    0x0804040c, 0x95c7c752, 0x46232365, 0x9dc3c35e, 0x30181828, 0x379696a1,
+    0x0a05050f, 0x2f9a9ab5, 0x0e070709, 0x24121236, 0x1b80809b, 0xdfe2e23d,
+    0xcdebeb26, 0x4e272769, 0x7fb2b2cd, 0xea75759f, 0x1209091b, 0x1d83839e,
+    0x582c2c74, 0x341a1a2e, 0x361b1b2d, 0xdc6e6eb2, 0xb45a5aee, 0x5ba0a0fb,
+    0xa45252f6, 0x763b3b4d, 0xb7d6d661, 0x7db3b3ce, 0x5229297b, 0xdde3e33e,
+    0x5e2f2f71, 0x13848497, 0xa65353f5, 0xb9d1d168, 0x00000000, 0xc1eded2c,
+    0x40202060, 0xe3fcfc1f, 0x79b1b1c8, 0xb65b5bed, 0xd46a6abe, 0x8dcbcb46,
+    0x67bebed9, 0x7239394b, 0x944a4ade, 0x984c4cd4, 0xb05858e8, 0x85cfcf4a,
+    0xbbd0d06b, 0xc5efef2a, 0x4faaaae5, 0xedfbfb16, 0x864343c5, 0x9a4d4dd7,
+    0x66333355, 0x11858594, 0x8a4545cf, 0xe9f9f910, 0x04020206, 0xfe7f7f81,
+    0xa05050f0, 0x783c3c44, 0x259f9fba, 0x4ba8a8e3, 0xa25151f3, 0x5da3a3fe,
+    0x804040c0, 0x058f8f8a, 0x3f9292ad, 0x219d9dbc, 0x70383848, 0xf1f5f504,
+    0x63bcbcdf, 0x77b6b6c1, 0xafdada75, 0x42212163, 0x20101030, 0xe5ffff1a,
+    0xfdf3f30e, 0xbfd2d26d, 0x81cdcd4c, 0x180c0c14, 0x26131335, 0xc3ecec2f,
+    0xbe5f5fe1, 0x359797a2, 0x884444cc, 0x2e171739, 0x93c4c457, 0x55a7a7f2,
+    0xfc7e7e82, 0x7a3d3d47, 0xc86464ac, 0xba5d5de7, 0x3219192b, 0xe6737395,
+    0xc06060a0, 0x19818198, 0x9e4f4fd1, 0xa3dcdc7f, 0x44222266, 0x542a2a7e,
+    0x3b9090ab, 0x0b888883, 0x8c4646ca, 0xc7eeee29, 0x6bb8b8d3, 0x2814143c,
+    0xa7dede79, 0xbc5e5ee2, 0x160b0b1d, 0xaddbdb76, 0xdbe0e03b, 0x64323256,
+    0x743a3a4e, 0x140a0a1e, 0x924949db, 0x0c06060a, 0x4824246c, 0xb85c5ce4,
+    0x9fc2c25d, 0xbdd3d36e, 0x43acacef, 0xc46262a6, 0x399191a8, 0x319595a4,
+    0xd3e4e437, 0xf279798b, 0xd5e7e732, 0x8bc8c843, 0x6e373759, 0xda6d6db7,
+    0x018d8d8c, 0xb1d5d564, 0x9c4e4ed2, 0x49a9a9e0, 0xd86c6cb4, 0xac5656fa,
+    0xf3f4f407, 0xcfeaea25, 0xca6565af, 0xf47a7a8e, 0x47aeaee9, 0x10080818,
+    0x6fbabad5, 0xf0787888, 0x4a25256f, 0x5c2e2e72, 0x381c1c24, 0x57a6a6f1,
+    0x73b4b4c7, 0x97c6c651, 0xcbe8e823, 0xa1dddd7c, 0xe874749c, 0x3e1f1f21,
+    0x964b4bdd, 0x61bdbddc, 0x0d8b8b86, 0x0f8a8a85, 0xe0707090, 0x7c3e3e42,
+    0x71b5b5c4, 0xcc6666aa, 0x904848d8, 0x06030305, 0xf7f6f601, 0x1c0e0e12,
+    0xc26161a3, 0x6a35355f, 0xae5757f9, 0x69b9b9d0, 0x17868691, 0x99c1c158,
+    0x3a1d1d27, 0x279e9eb9, 0xd9e1e138, 0xebf8f813, 0x2b9898b3, 0x22111133,
+    0xd26969bb, 0xa9d9d970, 0x078e8e89, 0x339494a7, 0x2d9b9bb6, 0x3c1e1e22,
+    0x15878792, 0xc9e9e920, 0x87cece49, 0xaa5555ff, 0x50282878, 0xa5dfdf7a,
+    0x038c8c8f, 0x59a1a1f8, 0x09898980, 0x1a0d0d17, 0x65bfbfda, 0xd7e6e631,
+    0x844242c6, 0xd06868b8, 0x824141c3, 0x299999b0, 0x5a2d2d77, 0x1e0f0f11,
+    0x7bb0b0cb, 0xa85454fc, 0x6dbbbbd6, 0x2c16163a,
+};
+
+/* Same for the inverse S-box and InvMixColumn, {0e, 09, 0d, 0b} */
+static const uint32_t kr_aes_td[256] = {
+    0x51f4a750, 0x7e416553, 0x1a17a4c3, 0x3a275e96, 0x3bab6bcb, 0x1f9d45f1,
+    0xacfa58ab, 0x4be30393, 0x2030fa55, 0xad766df6, 0x88cc7691, 0xf5024c25,
+    0x4fe5d7fc, 0xc52acbd7, 0x26354480, 0xb562a38f, 0xdeb15a49, 0x25ba1b67,
+    0x45ea0e98, 0x5dfec0e1, 0xc32f7502, 0x814cf012, 0x8d4697a3, 0x6bd3f9c6,
+    0x038f5fe7, 0x15929c95, 0xbf6d7aeb, 0x955259da, 0xd4be832d, 0x587421d3,
+    0x49e06929, 0x8ec9c844, 0x75c2896a, 0xf48e7978, 0x99583e6b, 0x27b971dd,
+    0xbee14fb6, 0xf088ad17, 0xc920ac66, 0x7dce3ab4, 0x63df4a18, 0xe51a3182,
+    0x97513360, 0x62537f45, 0xb16477e0, 0xbb6bae84, 0xfe81a01c, 0xf9082b94,
+    0x70486858, 0x8f45fd19, 0x94de6c87, 0x527bf8b7, 0xab73d323, 0x724b02e2,
+    0xe31f8f57, 0x6655ab2a, 0xb2eb2807, 0x2fb5c203, 0x86c57b9a, 0xd33708a5,
+    0x302887f2, 0x23bfa5b2, 0x02036aba, 0xed16825c, 0x8acf1c2b, 0xa779b492,
+    0xf307f2f0, 0x4e69e2a1, 0x65daf4cd, 0x0605bed5, 0xd134621f, 0xc4a6fe8a,
+    0x342e539d, 0xa2f355a0, 0x058ae132, 0xa4f6eb75, 0x0b83ec39, 0x4060efaa,
+    0x5e719f06, 0xbd6e1051, 0x3e218af9, 0x96dd063d, 0xdd3e05ae, 0x4de6bd46,
+    0x91548db5, 0x71c45d05, 0x0406d46f, 0x605015ff, 0x1998fb24, 0xd6bde997,
+    0x894043cc, 0x67d99e77, 0xb0e842bd, 0x07898b88, 0xe7195b38, 0x79c8eedb,
+    0xa17c0a47, 0x7c420fe9, 0xf8841ec9, 0x00000000, 0x09808683, 0x322bed48,
+    0x1e1170ac, 0x6c5a724e, 0xfd0efffb, 0x0f853856, 0x3daed51e, 0x362d3927,
+    0x0a0fd964, 0x685ca621, 0x9b5b54d1, 0x24362e3a, 0x0c0a67b1, 0x9357e70f,
+    0xb4ee96d2, 0x1b9b919e, 0x80c0c54f, 0x61dc20a2, 0x5a774b69, 0x1c121a16,
+    0xe293ba0a, 0xc0a02ae5, 0x3c22e043, 0x121b171d, 0x0e090d0b, 0xf28bc7ad,
+    0x2db6a8b9, 0x141ea9c8, 0x57f11985, 0xaf75074c, 0xee99ddbb, 0xa37f60fd,
+    0xf701269f, 0x5c72f5bc, 0x44663bc5, 0x5bfb7e34, 0x8b432976, 0xcb23c6dc,
+    0xb6edfc68, 0xb8e4f163, 0xd731dcca, 0x42638510, 0x13972240, 0x84c61120,
+    0x854a247d, 0xd2bb3df8, 0xaef93211, 0xc729a16d, 0x1d9e2f4b, 0xdcb230f3,
+    0x0d8652ec, 0x77c1e3d0, 0x2bb3166c, 0xa970b999, 0x119448fa, 0x47e96422,
+    0xa8fc8cc4, 0xa0f03f1a, 0x567d2cd8, 0x223390ef, 0x87494ec7, 0xd938d1c1,
+    0x8ccaa2fe, 0x98d40b36, 0xa6f581cf, 0xa57ade28, 0xdab78e26, 0x3fadbfa4,
+    0x2c3a9de4, 0x5078920d, 0x6a5fcc9b, 0x547e4662, 0xf68d13c2, 0x90d8b8e8,
+    0x2e39f75e, 0x82c3aff5, 0x9f5d80be, 0x69d0937c, 0x6fd52da9, 0xcf2512b3,
+    0xc8ac993b, 0x10187da7, 0xe89c636e, 0xdb3bbb7b, 0xcd267809, 0x6e5918f4,
+    0xec9ab701, 0x834f9aa8, 0xe6956e65, 0xaaffe67e, 0x21bccf08, 0xef15e8e6,
+    0xbae79bd9, 0x4a6f36ce, 0xea9f09d4, 0x29b07cd6, 0x31a4b2af, 0x2a3f2331,
+    0xc6a59430, 0x35a266c0, 0x744ebc37, 0xfc82caa6, 0xe090d0b0, 0x33a7d815,
+    0xf104984a, 0x41ecdaf7, 0x7fcd500e, 0x1791f62f, 0x764dd68d, 0x43efb04d,
+    0xccaa4d54, 0xe49604df, 0x9ed1b5e3, 0x4c6a881b, 0xc12c1fb8, 0x4665517f,
+    0x9d5eea04, 0x018c355d, 0xfa877473, 0xfb0b412e, 0xb3671d5a, 0x92dbd252,
+    0xe9105633, 0x6dd64713, 0x9ad7618c, 0x37a10c7a, 0x59f8148e, 0xeb133c89,
+    0xcea927ee, 0xb761c935, 0xe11ce5ed, 0x7a47b13c, 0x9cd2df59, 0x55f2733f,
+    0x1814ce79, 0x73c737bf, 0x53f7cdea, 0x5ffdaa5b, 0xdf3d6f14, 0x7844db86,
+    0xcaaff381, 0xb968c43e, 0x3824342c, 0xc2a3405f, 0x161dc372, 0xbce2250c,
+    0x283c498b, 0xff0d9541, 0x39a80171, 0x080cb3de, 0xd8b4e49c, 0x6456c190,
+    0x7bcb8461, 0xd532b670, 0x486c5c74, 0xd0b85742,
+};
+
+static uint32_t kr_aes_get32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void kr_aes_put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+#ifdef KR_AESNI
+__attribute__((target("aes"))) static void kr_aesni_convert_key(
+    kr_aes_ctx *ctx) {
+  __m128i *k = (__m128i *) ctx->ks;
+  int i;
+  for (i = 1; i < ctx->rounds; i++) {
+    _mm_storeu_si128(k + i, _mm_aesimc_si128(_mm_loadu_si128(k + i)));
+  }
+}
+
+#define KR_AESNI_ROUND4(f, rk) \
+  do {                         \
+    b0 = f(b0, rk);            \
+    b1 = f(b1, rk);            \
+    b2 = f(b2, rk);            \
+    b3 = f(b3, rk);            \
+  } while (0)
+
+/* Four blocks are interleaved to keep the AES unit busy */
+__attribute__((target("aes"))) static void kr_aesni_encrypt(
+    const kr_aes_ctx *ctx, const uint8_t *in, int len, uint8_t *out) {
+  const __m128i *k = (const __m128i *) ctx->ks;
+  __m128i b0, b1, b2, b3, rk;
+  int i;
+
+  for (; len >= 4 * AES_BLOCK_SIZE; len -= 4 * AES_BLOCK_SIZE) {
+    rk = _mm_loadu_si128(k);
+    b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in), rk);
+    b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 1), rk);
+    b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 2), rk);
+    b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 3), rk);
+    for (i = 1; i < ctx->rounds; i++) {
+      rk = _mm_loadu_si128(k + i);
+      KR_AESNI_ROUND4(_mm_aesenc_si128, rk);
+    }
+    rk = _mm_loadu_si128(k + i);
+    KR_AESNI_ROUND4(_mm_aesenclast_si128, rk);
+    _mm_storeu_si128((__m128i *) out, b0);
+    _mm_storeu_si128((__m128i *) out + 1, b1);
+    _mm_storeu_si128((__m128i *) out + 2, b2);
+    _mm_storeu_si128((__m128i *) out + 3, b3);
+    in += 4 * AES_BLOCK_SIZE;
+    out += 4 * AES_BLOCK_SIZE;
+  }
+
+  for (; len > 0; len -= AES_BLOCK_SIZE) {
+    b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+                       _mm_loadu_si128(k));
+    for (i = 1; i < ctx->rounds; i++) {
+      b0 = _mm_aesenc_si128(b0, _mm_loadu_si128(k + i));
+    }
+    b0 = _mm_aesenclast_si128(b0, _mm_loadu_si128(k + i));
+    _mm_storeu_si128((__m128i *) out, b0);
+    in += AES_BLOCK_SIZE;
+    out += AES_BLOCK_SIZE;
+  }
+}
+
+__attribute__((target("aes"))) static void kr_aesni_decrypt(
+    const kr_aes_ctx *ctx, const uint8_t *in, int len, uint8_t *out) {
+  const __m128i *k = (const __m128i *) ctx->ks;
+  __m128i b0, b1, b2, b3, rk;
+  int i;
+
+  for (; len >= 4 * AES_BLOCK_SIZE; len -= 4 * AES_BLOCK_SIZE) {
+    rk = _mm_loadu_si128(k + ctx->rounds);
+    b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in), rk);
+    b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 1), rk);
+    b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 2), rk);
+    b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in + 3), rk);
+    for (i = ctx->rounds - 1; i > 0; i--) {
+      rk = _mm_loadu_si128(k + i);
+      KR_AESNI_ROUND4(_mm_aesdec_si128, rk);
+    }
+    rk = _mm_loadu_si128(k);
+    KR_AESNI_ROUND4(_mm_aesdeclast_si128, rk);
+    _mm_storeu_si128((__m128i *) out, b0);
+    _mm_storeu_si128((__m128i *) out + 1, b1);
+    _mm_storeu_si128((__m128i *) out + 2, b2);
+    _mm_storeu_si128((__m128i *) out + 3, b3);
+    in += 4 * AES_BLOCK_SIZE;
+    out += 4 * AES_BLOCK_SIZE;
+  }
+
+  for (; len > 0; len -= AES_BLOCK_SIZE) {
+    b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+                       _mm_loadu_si128(k + ctx->rounds));
+    for (i = ctx->rounds - 1; i > 0; i--) {
+      b0 = _mm_aesdec_si128(b0, _mm_loadu_si128(k + i));
+    }
+    b0 = _mm_aesdeclast_si128(b0, _mm_loadu_si128(k));
+    _mm_storeu_si128((__m128i *) out, b0);
+    in += AES_BLOCK_SIZE;
+    out += AES_BLOCK_SIZE;
+  }
 }
+#endif /* KR_AESNI */
 
 /**
  * Set up AES with the key/iv and cipher size.
@@ -4976,6 +5761,13 @@ void kr_aes_set_key(kr_aes_ctx *ctx, const uint8_t *key, AES_MODE mode) {
 
     W[i] = W[i - words] ^ tmp;
   }
+
+#ifdef KR_AESNI
+  ctx->aesni = kr_cpu_has_aesni();
+  if (ctx->aesni) {
+    for (i = 0; i < ii; i++) kr_aes_put32((uint8_t *) &W[i], W[i]);
+  }
+#endif
 }
 
 /**
@@ -4985,6 +5777,13 @@ void kr_aes_convert_key(kr_aes_ctx *ctx) {
   int i;
   uint32_t *k, w, t1, t2, t3, t4;
 
+#ifdef KR_AESNI
+  if (ctx->aesni) {
+    kr_aesni_convert_key(ctx);
+    return;
+  }
+#endif
+
   k = ctx->ks;
   k += 4;
 
@@ -4998,100 +5797,120 @@ void kr_aes_convert_key(kr_aes_ctx *ctx) {
 /**
  * Encrypt a single block (16 bytes) of data
  */
-static void kr_aes_encrypt_block(const kr_aes_ctx *ctx, const uint32_t *in,
-                                 uint32_t *out) {
-  /* To make this code smaller, generate the sbox entries on the fly.
-   * This will have a really heavy effect upon performance.
-   */
-  uint32_t tmp[4];
-  uint32_t tmp1, old_a0, a0, a1, a2, a3, row;
-  int curr_rnd;
-  int rounds = ctx->rounds;
+static void kr_aes_encrypt_block(const kr_aes_ctx *ctx, const uint8_t *in,
+                                 uint8_t *out) {
   const uint32_t *k = ctx->ks;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
 
   /* Pre-round key addition */
-  for (row = 0; row < 4; row++) out[row] = be32toh(in[row]) ^ *(k++);
-
-  /* Encrypt one block. */
-  for (curr_rnd = 0; curr_rnd < rounds; curr_rnd++) {
-    /* Perform ByteSub and ShiftRow operations together */
-    for (row = 0; row < 4; row++) {
-      a0 = (uint32_t) aes_sbox[(out[row % 4] >> 24) & 0xFF];
-      a1 = (uint32_t) aes_sbox[(out[(row + 1) % 4] >> 16) & 0xFF];
-      a2 = (uint32_t) aes_sbox[(out[(row + 2) % 4] >> 8) & 0xFF];
-      a3 = (uint32_t) aes_sbox[(out[(row + 3) % 4]) & 0xFF];
-
-      /* Perform MixColumn iff not last round */
-      if (curr_rnd < (rounds - 1)) {
-        tmp1 = a0 ^ a1 ^ a2 ^ a3;
-        old_a0 = a0;
-        a0 ^= tmp1 ^ kr_aes_xtime(a0 ^ a1);
-        a1 ^= tmp1 ^ kr_aes_xtime(a1 ^ a2);
-        a2 ^= tmp1 ^ kr_aes_xtime(a2 ^ a3);
-        a3 ^= tmp1 ^ kr_aes_xtime(a3 ^ old_a0);
-      }
-
-      tmp[row] = ((a0 << 24) | (a1 << 16) | (a2 << 8) | a3);
-    }
-
-    /* KeyAddition - note that it is vital that this loop is separate from
-       the MixColumn operation, which must be atomic...*/
-    for (row = 0; row < 4; row++) out[row] = tmp[row] ^ *(k++);
-  }
-
-  for (row = 0; row < 4; row++) out[row] = htobe32(out[row]);
+  s0 = kr_aes_get32(in) ^ k[0];
+  s1 = kr_aes_get32(in + 4) ^ k[1];
+  s2 = kr_aes_get32(in + 8) ^ k[2];
+  s3 = kr_aes_get32(in + 12) ^ k[3];
+
+  /* SubBytes, ShiftRows and MixColumn are one lookup per byte */
+  for (r = 1; r < ctx->rounds; r++) {
+    k += 4;
+    t0 = kr_aes_te[s0 >> 24] ^ rot1(kr_aes_te[(s1 >> 16) & 0xff]) ^
+         rot2(kr_aes_te[(s2 >> 8) & 0xff]) ^ rot3(kr_aes_te[s3 & 0xff]) ^
+         k[0];
+    t1 = kr_aes_te[s1 >> 24] ^ rot1(kr_aes_te[(s2 >> 16) & 0xff]) ^
+         rot2(kr_aes_te[(s3 >> 8) & 0xff]) ^ rot3(kr_aes_te[s0 & 0xff]) ^
+         k[1];
+    t2 = kr_aes_te[s2 >> 24] ^ rot1(kr_aes_te[(s3 >> 16) & 0xff]) ^
+         rot2(kr_aes_te[(s0 >> 8) & 0xff]) ^ rot3(kr_aes_te[s1 & 0xff]) ^
+         k[2];
+    t3 = kr_aes_te[s3 >> 24] ^ rot1(kr_aes_te[(s0 >> 16) & 0xff]) ^
+         rot2(kr_aes_te[(s1 >> 8) & 0xff]) ^ rot3(kr_aes_te[s2 & 0xff]) ^
+         k[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  /* No MixColumn in the last round */
+  k += 4;
+  kr_aes_put32(out, ((uint32_t) aes_sbox[s0 >> 24] << 24 |
+                     (uint32_t) aes_sbox[(s1 >> 16) & 0xff] << 16 |
+                     (uint32_t) aes_sbox[(s2 >> 8) & 0xff] << 8 |
+                     (uint32_t) aes_sbox[s3 & 0xff]) ^
+                        k[0]);
+  kr_aes_put32(out + 4, ((uint32_t) aes_sbox[s1 >> 24] << 24 |
+                         (uint32_t) aes_sbox[(s2 >> 16) & 0xff] << 16 |
+                         (uint32_t) aes_sbox[(s3 >> 8) & 0xff] << 8 |
+                         (uint32_t) aes_sbox[s0 & 0xff]) ^
+                            k[1]);
+  kr_aes_put32(out + 8, ((uint32_t) aes_sbox[s2 >> 24] << 24 |
+                         (uint32_t) aes_sbox[(s3 >> 16) & 0xff] << 16 |
+                         (uint32_t) aes_sbox[(s0 >> 8) & 0xff] << 8 |
+                         (uint32_t) aes_sbox[s1 & 0xff]) ^
+                            k[2]);
+  kr_aes_put32(out + 12, ((uint32_t) aes_sbox[s3 >> 24] << 24 |
+                          (uint32_t) aes_sbox[(s0 >> 16) & 0xff] << 16 |
+                          (uint32_t) aes_sbox[(s1 >> 8) & 0xff] << 8 |
+                          (uint32_t) aes_sbox[s2 & 0xff]) ^
+                             k[3]);
 }
 
 /**
- * Decrypt a single block (16 bytes) of data
- */
-static void kr_aes_decrypt_block(const kr_aes_ctx *ctx, const uint32_t *in,
-                                 uint32_t *out) {
-  uint32_t tmp[4];
-  uint32_t xt0, xt1, xt2, xt3, xt4, xt5, xt6;
-  uint32_t a0, a1, a2, a3, row;
-  int curr_rnd;
-  int rounds = ctx->rounds;
-  const uint32_t *k = ctx->ks + ((rounds + 1) * 4);
-
-  /* pre-round key addition */
-  for (row = 4; row > 0; row--) out[row - 1] = be32toh(in[row - 1]) ^ *(--k);
-
-  /* Decrypt one block */
-  for (curr_rnd = 0; curr_rnd < rounds; curr_rnd++) {
-    /* Perform ByteSub and ShiftRow operations together */
-    for (row = 4; row > 0; row--) {
-      a0 = aes_isbox[(out[(row + 3) % 4] >> 24) & 0xFF];
-      a1 = aes_isbox[(out[(row + 2) % 4] >> 16) & 0xFF];
-      a2 = aes_isbox[(out[(row + 1) % 4] >> 8) & 0xFF];
-      a3 = aes_isbox[(out[row % 4]) & 0xFF];
-
-      /* Perform MixColumn iff not last round */
-      if (curr_rnd < (rounds - 1)) {
-        /* The MDS cofefficients (0x09, 0x0B, 0x0D, 0x0E)
-           are quite large compared to encryption; this
-           operation slows decryption down noticeably. */
-        xt0 = kr_aes_xtime(a0 ^ a1);
-        xt1 = kr_aes_xtime(a1 ^ a2);
-        xt2 = kr_aes_xtime(a2 ^ a3);
-        xt3 = kr_aes_xtime(a3 ^ a0);
-        xt4 = kr_aes_xtime(xt0 ^ xt1);
-        xt5 = kr_aes_xtime(xt1 ^ xt2);
-        xt6 = kr_aes_xtime(xt4 ^ xt5);
-
-        xt0 ^= a1 ^ a2 ^ a3 ^ xt4 ^ xt6;
-        xt1 ^= a0 ^ a2 ^ a3 ^ xt5 ^ xt6;
-        xt2 ^= a0 ^ a1 ^ a3 ^ xt4 ^ xt6;
-        xt3 ^= a0 ^ a1 ^ a2 ^ xt5 ^ xt6;
-        tmp[row - 1] = ((xt0 << 24) | (xt1 << 16) | (xt2 << 8) | xt3);
-      } else
-        tmp[row - 1] = ((a0 << 24) | (a1 << 16) | (a2 << 8) | a3);
-    }
-
-    for (row = 4; row > 0; row--) out[row - 1] = tmp[row - 1] ^ *(--k);
-  }
+ * Decrypt a single block (16 bytes) of data. Round keys have been through
+ * kr_aes_convert_key(), so InvMixColumn can follow InvSubBytes directly.
+ */
+static void kr_aes_decrypt_block(const kr_aes_ctx *ctx, const uint8_t *in,
+                                 uint8_t *out) {
+  const uint32_t *k = ctx->ks + ctx->rounds * 4;
+  uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+  int r;
 
-  for (row = 0; row < 4; row++) out[row] = htobe32(out[row]);
+  /* Pre-round key addition */
+  s0 = kr_aes_get32(in) ^ k[0];
+  s1 = kr_aes_get32(in + 4) ^ k[1];
+  s2 = kr_aes_get32(in + 8) ^ k[2];
+  s3 = kr_aes_get32(in + 12) ^ k[3];
+
+  for (r = 1; r < ctx->rounds; r++) {
+    k -= 4;
+    t0 = kr_aes_td[s0 >> 24] ^ rot1(kr_aes_td[(s3 >> 16) & 0xff]) ^
+         rot2(kr_aes_td[(s2 >> 8) & 0xff]) ^ rot3(kr_aes_td[s1 & 0xff]) ^
+         k[0];
+    t1 = kr_aes_td[s1 >> 24] ^ rot1(kr_aes_td[(s0 >> 16) & 0xff]) ^
+         rot2(kr_aes_td[(s3 >> 8) & 0xff]) ^ rot3(kr_aes_td[s2 & 0xff]) ^
+         k[1];
+    t2 = kr_aes_td[s2 >> 24] ^ rot1(kr_aes_td[(s1 >> 16) & 0xff]) ^
+         rot2(kr_aes_td[(s0 >> 8) & 0xff]) ^ rot3(kr_aes_td[s3 & 0xff]) ^
+         k[2];
+    t3 = kr_aes_td[s3 >> 24] ^ rot1(kr_aes_td[(s2 >> 16) & 0xff]) ^
+         rot2(kr_aes_td[(s1 >> 8) & 0xff]) ^ rot3(kr_aes_td[s0 & 0xff]) ^
+         k[3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+
+  k -= 4;
+  kr_aes_put32(out, ((uint32_t) aes_isbox[s0 >> 24] << 24 |
+                     (uint32_t) aes_isbox[(s3 >> 16) & 0xff] << 16 |
+                     (uint32_t) aes_isbox[(s2 >> 8) & 0xff] << 8 |
+                     (uint32_t) aes_isbox[s1 & 0xff]) ^
+                        k[0]);
+  kr_aes_put32(out + 4, ((uint32_t) aes_isbox[s1 >> 24] << 24 |
+                         (uint32_t) aes_isbox[(s0 >> 16) & 0xff] << 16 |
+                         (uint32_t) aes_isbox[(s3 >> 8) & 0xff] << 8 |
+                         (uint32_t) aes_isbox[s2 & 0xff]) ^
+                            k[1]);
+  kr_aes_put32(out + 8, ((uint32_t) aes_isbox[s2 >> 24] << 24 |
+                         (uint32_t) aes_isbox[(s1 >> 16) & 0xff] << 16 |
+                         (uint32_t) aes_isbox[(s0 >> 8) & 0xff] << 8 |
+                         (uint32_t) aes_isbox[s3 & 0xff]) ^
+                            k[2]);
+  kr_aes_put32(out + 12, ((uint32_t) aes_isbox[s3 >> 24] << 24 |
+                          (uint32_t) aes_isbox[(s2 >> 16) & 0xff] << 16 |
+                          (uint32_t) aes_isbox[(s1 >> 8) & 0xff] << 8 |
+                          (uint32_t) aes_isbox[s0 & 0xff]) ^
+                             k[3]);
 }
 
 NS_INTERNAL void kr_aes_setup_enc(void *ctxv, const uint8_t *key) {
@@ -5108,8 +5927,14 @@ NS_INTERNAL void kr_aes_setup_dec(void *ctxv, const uint8_t *key) {
 NS_INTERNAL void kr_aes_encrypt(void *ctxv, const uint8_t *in, int len,
                                 uint8_t *out) {
   const kr_aes_ctx *ctx = (const kr_aes_ctx *) ctxv;
+#ifdef KR_AESNI
+  if (ctx->aesni) {
+    kr_aesni_encrypt(ctx, in, len, out);
+    return;
+  }
+#endif
   while (len > 0) {
-    kr_aes_encrypt_block(ctx, (const uint32_t *) in, (uint32_t *) out);
+    kr_aes_encrypt_block(ctx, in, out);
     in += AES_BLOCK_SIZE;
     out += AES_BLOCK_SIZE;
     len -= AES_BLOCK_SIZE;
@@ -5119,8 +5944,14 @@ NS_INTERNAL void kr_aes_encrypt(void *ctxv, const uint8_t *in, int len,
 NS_INTERNAL void kr_aes_decrypt(void *ctxv, const uint8_t *in, int len,
                                 uint8_t *out) {
   const kr_aes_ctx *ctx = (const kr_aes_ctx *) ctxv;
+#ifdef KR_AESNI
+  if (ctx->aesni) {
+    kr_aesni_decrypt(ctx, in, len, out);
+    return;
+  }
+#endif
   while (len > 0) {
-    kr_aes_decrypt_block(ctx, (const uint32_t *) in, (uint32_t *) out);
+    kr_aes_decrypt_block(ctx, in, out);
     in += AES_BLOCK_SIZE;
     out += AES_BLOCK_SIZE;
     len -= AES_BLOCK_SIZE;
@@ -5303,71 +6134,573 @@ NS_INTERNAL const kr_cipher_info *kr_cipher_get_info(kr_cs_id cs) {
     case TLS_RSA_WITH_AES_128_CBC_SHA:
     case TLS_RSA_WITH_AES_128_CBC_SHA256:
       return kr_aes128_cs_info();
+    case TLS_RSA_WITH_AES_128_GCM_SHA256:
+    case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+      return kr_aes128_gcm_cs_info();
   }
   return NULL;
 }
 
+/* Records of AEAD suites are sealed with kr_gcm_encrypt() instead */
+NS_INTERNAL int kr_cs_is_aead(kr_cs_id cs) {
+  return cs == TLS_RSA_WITH_AES_128_GCM_SHA256 ||
+         cs == TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256;
+}
+
+NS_INTERNAL int kr_cs_is_ecdhe(kr_cs_id cs) {
+  return cs == TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256;
+}
+
+#ifdef KR_AESNI
+#include <cpuid.h>
+
+NS_INTERNAL int kr_cpu_has_aesni(void) {
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d)) return 0;
+  return (c & bit_AES) && (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+#endif
+
 NS_INTERNAL void kr_cbc_encrypt(const kr_cipher_info *ci, void *cctx,
                                 const uint8_t *in, int len, const uint8_t *iv,
                                 uint8_t *out) {
   int i;
-  uint32_t d32[4], xor[4];
+  uint8_t d[16];
+  const uint8_t *xor = iv;
 
   assert(ci->iv_len == 16);
   assert(ci->block_len == 16);
 
-  memcpy (xor, iv, ci->iv_len);
+  /* Each block chains from the previous one, already in out */
+  for (; len >= 16; len -= 16) {
+    for (i = 0; i < 16; i++) d[i] = in[i] ^ xor[i];
+    in += 16;
 
-  for (len -= ci->block_len; len >= 0; len -= ci->block_len) {
-    memcpy(d32, in, ci->block_len);
-    in += ci->block_len;
+    ci->encrypt(cctx, d, 16, out);
 
-    for (i = 0; i < 4; i++) d32[i] ^= xor[i];
-
-    ci->encrypt(cctx, (const uint8_t *) d32, ci->block_len, (uint8_t *) d32);
-
-    memcpy (xor, d32, ci->block_len);
-    memcpy(out, d32, ci->block_len);
-    out += ci->block_len;
+    xor = out;
+    out += 16;
   }
 }
 
+/* Blocks are deciphered four at a time, which lets AES-NI overlap them */
 NS_INTERNAL void kr_cbc_decrypt(const kr_cipher_info *ci, void *cctx,
                                 const uint8_t *in, int len, const uint8_t *iv,
                                 uint8_t *out) {
-  int i;
-  uint32_t d32[4], xor[4];
+  int i, n;
+  uint8_t d[64], xor[16];
 
   assert(ci->iv_len == 16);
   assert(ci->block_len == 16);
-  memcpy (xor, iv, ci->iv_len);
+  memcpy(xor, iv, 16);
 
-  for (len -= ci->block_len; len >= 0; len -= ci->block_len) {
-    memcpy(d32, in, ci->block_len);
+  for (; len >= 16; len -= n) {
+    n = len < (int) sizeof(d) ? len & ~15 : (int) sizeof(d);
+    memcpy(d, in, n);
 
-    ci->decrypt(cctx, (const uint8_t *) d32, ci->block_len, (uint8_t *) d32);
+    ci->decrypt(cctx, d, n, d);
 
-    for (i = 0; i < 4; i++) d32[i] ^= xor[i];
+    /* Chain from the ciphertext before out, which may be in, is written */
+    for (i = 0; i < 16; i++) d[i] ^= xor[i];
+    for (i = 16; i < n; i++) d[i] ^= in[i - 16];
 
-    memcpy (xor, in, ci->block_len);
-    in += ci->block_len;
+    memcpy(xor, in + n - 16, 16);
+    in += n;
 
-    memcpy(out, d32, ci->block_len);
-    out += ci->block_len;
+    memcpy(out, d, n);
+    out += n;
   }
 }
 #ifdef KR_MODULE_LINES
-#line 1 "src/src/rsa.c"
+#line 1 "src/src/gcm.c"
 #endif
 /*
- * Copyright (c) 2007-2014, Cameron Rich
- *
- * All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions are met:
- *
- * * Redistributions of source code must retain the above copyright notice,
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * AES-GCM, NIST SP 800-38D. Counter mode encryption and GHASH are done in
+ * one pass over the record. GHASH uses Shoup's 4-bit tables, 256 bytes per
+ * key, which is a reasonable trade-off between speed and RAM for devices,
+ * or PCLMULQDQ on x86-64 CPUs that have it.
+ */
+
+/* Amalgamated: #include "ktypes.h" */
+/* Amalgamated: #include "crypto.h" */
+
+typedef struct {
+  const kr_cipher_info *ci;
+  void *cctx;
+  /* H * i for every 4-bit i, high and low halves */
+  uint64_t hh[16];
+  uint64_t hl[16];
+#ifdef KR_AESNI
+  uint8_t h[16]; /* H, byte reversed */
+  int clmul;
+#endif
+} kr_gcm_ctx;
+
+/* Reduction of the 4 bits shifted out, by x^128 + x^7 + x^2 + x + 1 */
+static const uint16_t kr_gcm_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0};
+
+static uint64_t kr_gcm_get64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; i++) v = (v << 8) | p[i];
+  return v;
+}
+
+static void kr_gcm_put64(uint8_t *p, uint64_t v) {
+  int i;
+  for (i = 7; i >= 0; i--) {
+    p[i] = v & 0xff;
+    v >>= 8;
+  }
+}
+
+#ifdef KR_AESNI
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+/*
+ * Carry-less multiplication followed by reduction of the 256-bit product,
+ * after Intel's "Carry-Less Multiplication and Its Usage for Computing the
+ * GCM Mode". Operands are byte reversed, GCM bit order is kept by shifting
+ * the product left by one.
+ */
+__attribute__((target("pclmul,ssse3"))) static void kr_gcm_mult_clmul(
+    const uint8_t *h, uint8_t *x) {
+  const __m128i bswap =
+      _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i a, b, lo, mid, hi, t1, t2, t3;
+
+  a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) x), bswap);
+  b = _mm_loadu_si128((const __m128i *) h);
+
+  lo = _mm_clmulepi64_si128(a, b, 0x00);
+  hi = _mm_clmulepi64_si128(a, b, 0x11);
+  mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                      _mm_clmulepi64_si128(a, b, 0x01));
+  lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+  hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+  /* Shift hi:lo left by one bit */
+  t1 = _mm_srli_epi32(lo, 31);
+  t2 = _mm_srli_epi32(hi, 31);
+  lo = _mm_slli_epi32(lo, 1);
+  hi = _mm_slli_epi32(hi, 1);
+  t3 = _mm_srli_si128(t1, 12);
+  t2 = _mm_slli_si128(t2, 4);
+  t1 = _mm_slli_si128(t1, 4);
+  lo = _mm_or_si128(lo, t1);
+  hi = _mm_or_si128(_mm_or_si128(hi, t2), t3);
+
+  /* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+  t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+                                   _mm_slli_epi32(lo, 30)),
+                     _mm_slli_epi32(lo, 25));
+  t2 = _mm_srli_si128(t1, 4);
+  lo = _mm_xor_si128(lo, _mm_slli_si128(t1, 12));
+  t1 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+                                   _mm_srli_epi32(lo, 2)),
+                     _mm_xor_si128(_mm_srli_epi32(lo, 7), t2));
+  hi = _mm_xor_si128(hi, _mm_xor_si128(lo, t1));
+
+  _mm_storeu_si128((__m128i *) x, _mm_shuffle_epi8(hi, bswap));
+}
+#endif
+
+static void kr_gcm_mult(const kr_gcm_ctx *ctx, uint8_t *x) {
+  uint64_t zh, zl;
+  uint8_t lo, hi, rem;
+  int i;
+
+#ifdef KR_AESNI
+  if (ctx->clmul) {
+    kr_gcm_mult_clmul(ctx->h, x);
+    return;
+  }
+#endif
+
+  lo = x[15] & 0xf;
+  zh = ctx->hh[lo];
+  zl = ctx->hl[lo];
+
+  for (i = 15; i >= 0; i--) {
+    lo = x[i] & 0xf;
+    hi = x[i] >> 4;
+
+    if (i != 15) {
+      rem = zl & 0xf;
+      zl = (zh << 60) | (zl >> 4);
+      zh = (zh >> 4) ^ ((uint64_t) kr_gcm_last4[rem] << 48);
+      zh ^= ctx->hh[lo];
+      zl ^= ctx->hl[lo];
+    }
+
+    rem = zl & 0xf;
+    zl = (zh << 60) | (zl >> 4);
+    zh = (zh >> 4) ^ ((uint64_t) kr_gcm_last4[rem] << 48);
+    zh ^= ctx->hh[hi];
+    zl ^= ctx->hl[hi];
+  }
+
+  kr_gcm_put64(x, zh);
+  kr_gcm_put64(x + 8, zl);
+}
+
+static void kr_gcm_ghash(const kr_gcm_ctx *ctx, uint8_t *y, const uint8_t *p,
+                         size_t len) {
+  size_t i, n;
+  while (len > 0) {
+    n = len < 16 ? len : 16;
+    for (i = 0; i < n; i++) y[i] ^= p[i];
+    kr_gcm_mult(ctx, y);
+    p += n;
+    len -= n;
+  }
+}
+
+NS_INTERNAL void *kr_gcm_new_ctx() {
+  kr_gcm_ctx *ctx = calloc(1, sizeof(*ctx));
+  if (ctx == NULL) return NULL;
+  ctx->ci = kr_aes128_cs_info();
+  if ((ctx->cctx = ctx->ci->new_ctx()) == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/* Both directions use the forward cipher */
+NS_INTERNAL void kr_gcm_setup(void *ctxv, const uint8_t *key) {
+  kr_gcm_ctx *ctx = (kr_gcm_ctx *) ctxv;
+  uint32_t h32[4];
+  uint64_t vh, vl;
+  int i, j;
+
+  ctx->ci->setup_enc(ctx->cctx, key);
+  memset(h32, 0, sizeof(h32));
+  ctx->ci->encrypt(ctx->cctx, (uint8_t *) h32, 16, (uint8_t *) h32);
+  vh = kr_gcm_get64((uint8_t *) h32);
+  vl = kr_gcm_get64((uint8_t *) h32 + 8);
+
+  /* 8 is H itself (bits are reflected), 4, 2, 1 are H * x, x^2, x^3 */
+  ctx->hh[0] = ctx->hl[0] = 0;
+  ctx->hh[8] = vh;
+  ctx->hl[8] = vl;
+  for (i = 4; i > 0; i >>= 1) {
+    uint64_t t = (vl & 1) * 0xe100000000000000ULL;
+    vl = (vh << 63) | (vl >> 1);
+    vh = (vh >> 1) ^ t;
+    ctx->hh[i] = vh;
+    ctx->hl[i] = vl;
+  }
+  /* The rest are sums of those */
+  for (i = 2; i <= 8; i *= 2) {
+    for (j = 1; j < i; j++) {
+      ctx->hh[i + j] = ctx->hh[i] ^ ctx->hh[j];
+      ctx->hl[i + j] = ctx->hl[i] ^ ctx->hl[j];
+    }
+  }
+#ifdef KR_AESNI
+  ctx->clmul = kr_cpu_has_aesni();
+  for (i = 0; i < 16; i++) ctx->h[i] = ((uint8_t *) h32)[15 - i];
+#endif
+  memset(h32, 0, sizeof(h32));
+}
+
+NS_INTERNAL void kr_gcm_free_ctx(void *ctxv) {
+  kr_gcm_ctx *ctx = (kr_gcm_ctx *) ctxv;
+  ctx->ci->free_ctx(ctx->cctx);
+  memset(ctx, 0, sizeof(*ctx));
+  free(ctx);
+}
+
+static void kr_gcm_crypt(kr_gcm_ctx *ctx, const uint8_t *nonce,
+                         const uint8_t *aad, size_t aad_len, const uint8_t *in,
+                         size_t len, uint8_t *out, uint8_t *tag, int is_enc) {
+  uint32_t ctr[16], ks[16], ek0[4];
+  uint8_t y[16], lens[16];
+  uint8_t *k;
+  uint32_t c = 1;
+  size_t i, j, n, nb;
+  const size_t total = len;
+
+  memcpy(ctr, nonce, 12);
+  ctr[3] = htobe32(c);
+  ctx->ci->encrypt(ctx->cctx, (uint8_t *) ctr, 16, (uint8_t *) ek0);
+
+  memset(y, 0, sizeof(y));
+  kr_gcm_ghash(ctx, y, aad, aad_len);
+
+  /* Key stream is made four blocks at a time */
+  for (j = 1; j < 4; j++) memcpy(ctr + 4 * j, nonce, 12);
+  while (len > 0) {
+    nb = (len + 15) / 16;
+    if (nb > 4) nb = 4;
+    for (j = 0; j < nb; j++) ctr[4 * j + 3] = htobe32(++c);
+    ctx->ci->encrypt(ctx->cctx, (uint8_t *) ctr, nb * 16, (uint8_t *) ks);
+    for (j = 0, k = (uint8_t *) ks; j < nb; j++, k += 16) {
+      n = len < 16 ? len : 16;
+      /* GHASH runs over the ciphertext, which may be overwritten in place */
+      if (n == 16) {
+        uint64_t p[2], x[2], h[2];
+        memcpy(p, in, 16);
+        memcpy(x, k, 16);
+        memcpy(h, y, 16);
+        x[0] ^= p[0];
+        x[1] ^= p[1];
+        h[0] ^= is_enc ? x[0] : p[0];
+        h[1] ^= is_enc ? x[1] : p[1];
+        memcpy(out, x, 16);
+        memcpy(y, h, 16);
+      } else {
+        for (i = 0; i < n; i++) {
+          uint8_t ct = is_enc ? in[i] ^ k[i] : in[i];
+          out[i] = in[i] ^ k[i];
+          y[i] ^= ct;
+        }
+      }
+      kr_gcm_mult(ctx, y);
+      in += n;
+      out += n;
+      len -= n;
+    }
+  }
+
+  kr_gcm_put64(lens, (uint64_t) aad_len * 8);
+  kr_gcm_put64(lens + 8, (uint64_t) total * 8);
+  kr_gcm_ghash(ctx, y, lens, sizeof(lens));
+
+  for (i = 0; i < 16; i++) tag[i] = y[i] ^ ((uint8_t *) ek0)[i];
+  memset(ks, 0, sizeof(ks));
+}
+
+NS_INTERNAL void kr_gcm_encrypt(void *gctx, const uint8_t *nonce,
+                                const uint8_t *aad, size_t aad_len,
+                                const uint8_t *in, size_t len, uint8_t *out,
+                                uint8_t *tag) {
+  kr_gcm_crypt((kr_gcm_ctx *) gctx, nonce, aad, aad_len, in, len, out, tag, 1);
+}
+
+/* Returns 1 if the tag matches. Output is written regardless. */
+NS_INTERNAL int kr_gcm_decrypt(void *gctx, const uint8_t *nonce,
+                               const uint8_t *aad, size_t aad_len,
+                               const uint8_t *in, size_t len, uint8_t *out,
+                               const uint8_t *tag) {
+  uint8_t check[GCM_TAG_SIZE], diff = 0;
+  int i;
+
+  kr_gcm_crypt((kr_gcm_ctx *) gctx, nonce, aad, aad_len, in, len, out, check,
+               0);
+  for (i = 0; i < GCM_TAG_SIZE; i++) diff |= check[i] ^ tag[i];
+  return diff == 0;
+}
+
+/*
+ * Record layer calls kr_gcm_encrypt() and kr_gcm_decrypt() directly, iv_len
+ * is the length of the implicit part of the nonce.
+ */
+const kr_cipher_info *kr_aes128_gcm_cs_info() {
+  static const kr_cipher_info aes128_gcm_cs_info = {
+      1, AES128_KEY_SIZE, GCM_SALT_SIZE, kr_gcm_new_ctx, kr_gcm_setup,
+      kr_gcm_setup, NULL, NULL, kr_gcm_free_ctx};
+  return &aes128_gcm_cs_info;
+}
+#ifdef KR_MODULE_LINES
+#line 1 "src/src/x25519.c"
+#endif
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/*
+ * X25519 Diffie-Hellman, RFC 7748. Field elements are 16 limbs of 16 bits
+ * held in 64-bit integers, after TweetNaCl: small, portable and constant
+ * time, which matters more here than raw speed.
+ */
+
+/* Amalgamated: #include "ktypes.h" */
+/* Amalgamated: #include "crypto.h" */
+
+typedef int64_t kr_fe[16];
+
+static void kr_fe_carry(kr_fe o) {
+  int64_t c;
+  int i;
+  for (i = 0; i < 16; i++) {
+    o[i] += (int64_t) 1 << 16;
+    c = o[i] >> 16;
+    /* 2^256 = 38 mod 2^255 - 19 */
+    if (i < 15) {
+      o[i + 1] += c - 1;
+    } else {
+      o[0] += 38 * (c - 1);
+    }
+    o[i] -= c * 65536;
+  }
+}
+
+/* Swaps p and q if b is 1, without branching on b */
+static void kr_fe_cswap(kr_fe p, kr_fe q, int b) {
+  int64_t t, mask = ~((int64_t) b - 1);
+  int i;
+  for (i = 0; i < 16; i++) {
+    t = mask & (p[i] ^ q[i]);
+    p[i] ^= t;
+    q[i] ^= t;
+  }
+}
+
+static void kr_fe_unpack(kr_fe o, const uint8_t *n) {
+  int i;
+  for (i = 0; i < 16; i++) o[i] = n[2 * i] + ((int64_t) n[2 * i + 1] << 8);
+  o[15] &= 0x7fff;
+}
+
+static void kr_fe_pack(uint8_t *o, const kr_fe n) {
+  kr_fe m, t;
+  int i, j, b;
+
+  memcpy(t, n, sizeof(t));
+  kr_fe_carry(t);
+  kr_fe_carry(t);
+  kr_fe_carry(t);
+  /* Subtract p at most twice to get the canonical value */
+  for (j = 0; j < 2; j++) {
+    m[0] = t[0] - 0xffed;
+    for (i = 1; i < 15; i++) {
+      m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+      m[i - 1] &= 0xffff;
+    }
+    m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+    b = (m[15] >> 16) & 1;
+    m[14] &= 0xffff;
+    kr_fe_cswap(t, m, 1 - b);
+  }
+  for (i = 0; i < 16; i++) {
+    o[2 * i] = t[i] & 0xff;
+    o[2 * i + 1] = (t[i] >> 8) & 0xff;
+  }
+}
+
+static void kr_fe_add(kr_fe o, const kr_fe a, const kr_fe b) {
+  int i;
+  for (i = 0; i < 16; i++) o[i] = a[i] + b[i];
+}
+
+static void kr_fe_sub(kr_fe o, const kr_fe a, const kr_fe b) {
+  int i;
+  for (i = 0; i < 16; i++) o[i] = a[i] - b[i];
+}
+
+static void kr_fe_mul(kr_fe o, const kr_fe a, const kr_fe b) {
+  int64_t t[31];
+  int i, j;
+
+  memset(t, 0, sizeof(t));
+  for (i = 0; i < 16; i++) {
+    for (j = 0; j < 16; j++) t[i + j] += a[i] * b[j];
+  }
+  for (i = 0; i < 15; i++) t[i] += 38 * t[i + 16];
+  for (i = 0; i < 16; i++) o[i] = t[i];
+  kr_fe_carry(o);
+  kr_fe_carry(o);
+}
+
+static void kr_fe_sq(kr_fe o, const kr_fe a) {
+  kr_fe_mul(o, a, a);
+}
+
+/* a^(p - 2) */
+static void kr_fe_inv(kr_fe o, const kr_fe a) {
+  kr_fe c;
+  int i;
+
+  memcpy(c, a, sizeof(c));
+  for (i = 253; i >= 0; i--) {
+    kr_fe_sq(c, c);
+    if (i != 2 && i != 4) kr_fe_mul(c, c, a);
+  }
+  memcpy(o, c, sizeof(c));
+}
+
+NS_INTERNAL int kr_x25519(uint8_t *out, const uint8_t *scalar,
+                          const uint8_t *point) {
+  static const kr_fe a24 = {0xdb41, 1}; /* (486662 - 2) / 4 */
+  kr_fe x1, x2, z2, x3, z3, e, f;
+  uint8_t k[X25519_KEY_SIZE], diff = 0;
+  int i, bit;
+
+  memcpy(k, scalar, sizeof(k));
+  k[0] &= 248;
+  k[31] = (k[31] & 127) | 64;
+
+  kr_fe_unpack(x1, point);
+  memset(x2, 0, sizeof(x2));
+  memset(z2, 0, sizeof(z2));
+  memset(z3, 0, sizeof(z3));
+  memcpy(x3, x1, sizeof(x3));
+  x2[0] = z3[0] = 1;
+
+  /* Montgomery ladder */
+  for (i = 254; i >= 0; i--) {
+    bit = (k[i >> 3] >> (i & 7)) & 1;
+    kr_fe_cswap(x2, x3, bit);
+    kr_fe_cswap(z2, z3, bit);
+    kr_fe_add(e, x2, z2);
+    kr_fe_sub(x2, x2, z2);
+    kr_fe_add(z2, x3, z3);
+    kr_fe_sub(x3, x3, z3);
+    kr_fe_sq(z3, e);
+    kr_fe_sq(f, x2);
+    kr_fe_mul(x2, z2, x2);
+    kr_fe_mul(z2, x3, e);
+    kr_fe_add(e, x2, z2);
+    kr_fe_sub(x2, x2, z2);
+    kr_fe_sq(x3, x2);
+    kr_fe_sub(z2, z3, f);
+    kr_fe_mul(x2, z2, a24);
+    kr_fe_add(x2, x2, z3);
+    kr_fe_mul(z2, z2, x2);
+    kr_fe_mul(x2, z3, f);
+    kr_fe_mul(z3, x3, x1);
+    kr_fe_sq(x3, e);
+    kr_fe_cswap(x2, x3, bit);
+    kr_fe_cswap(z2, z3, bit);
+  }
+
+  kr_fe_inv(z2, z2);
+  kr_fe_mul(x2, x2, z2);
+  kr_fe_pack(out, x2);
+  memset(k, 0, sizeof(k));
+
+  /* Low order points give an all zero secret, RFC 7748 section 6.1 */
+  for (i = 0; i < X25519_KEY_SIZE; i++) diff |= out[i];
+  return diff != 0;
+}
+
+NS_INTERNAL void kr_x25519_base(uint8_t *out, const uint8_t *scalar) {
+  static const uint8_t base[X25519_KEY_SIZE] = {9};
+  kr_x25519(out, scalar, base);
+}
+#ifdef KR_MODULE_LINES
+#line 1 "src/src/rsa.c"
+#endif
+/*
+ * Copyright (c) 2007-2014, Cameron Rich
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
  *   this list of conditions and the following disclaimer.
  * * Redistributions in binary form must reproduce the above copyright notice,
  *   this list of conditions and the following disclaimer in the documentation
@@ -5686,7 +7019,11 @@ static int do_send(SSL *ssl) {
   buf = ssl->tx_buf;
   len = ssl->tx_len;
 
-  if (!len) {
+  /*
+   * Records sealed in place are ahead of these on the wire, the rest is sent
+   * by SSL_kr_write_in_place() once they are out.
+   */
+  if (!len || (ssl->wip != NULL && ssl->wip->num > 0)) {
     ssl->write_pending = 0;
     return 1;
   }
@@ -5838,9 +7175,7 @@ int SSL_accept(SSL *ssl) {
     return 0;
   }
 
-  while (ssl->tx_len) {
-    if (!do_send(ssl)) return -1;
-  }
+  if (ssl->tx_len > 0 && !do_send(ssl)) return -1;
 
   switch (ssl->state) {
     case STATE_INITIAL:
@@ -5861,6 +7196,10 @@ int SSL_accept(SSL *ssl) {
       if (!tls_sv_hello(ssl)) {
         return 0;
       }
+      /* When resuming a session, server is the first to finish. */
+      if (ssl->resumed && !tls_sv_finish(ssl)) {
+        return 0;
+      }
 
       ssl->state = STATE_SV_HELLO_SENT;
       if (!do_send(ssl)) return -1;
@@ -5875,7 +7214,7 @@ int SSL_accept(SSL *ssl) {
 
     /* fall through */
     case STATE_CLIENT_FINISHED:
-      if (!tls_sv_finish(ssl)) {
+      if (!ssl->resumed && !tls_sv_finish(ssl)) {
         return 0;
       }
 
@@ -5909,9 +7248,7 @@ int SSL_connect(SSL *ssl) {
     return 0;
   }
 
-  while (ssl->tx_len) {
-    if (!do_send(ssl)) return -1;
-  }
+  if (ssl->tx_len > 0 && !do_send(ssl)) return -1;
 
   switch (ssl->state) {
     case STATE_INITIAL:
@@ -5925,6 +7262,12 @@ int SSL_connect(SSL *ssl) {
       }
       ssl->nxt = sec;
 
+      if (ssl->session == NULL &&
+          (ssl->ctx->sess_cache_mode & SSL_SESS_CACHE_CLIENT)) {
+        SSL_set_session(ssl, kr_session_cache_find(ssl->ctx, NULL, 0,
+                                                   ssl->ctx->verify_name));
+      }
+
       if (!tls_cl_hello(ssl)) {
         dprintf(("failed to construct hello\n"));
         ssl_err(ssl, SSL_ERROR_SYSCALL);
@@ -5939,7 +7282,8 @@ int SSL_connect(SSL *ssl) {
     case STATE_CL_HELLO_SENT:
     case STATE_SV_HELLO_RCVD:
     case STATE_SV_CERT_RCVD:
-      while (ssl->state != STATE_SV_DONE_RCVD) {
+      while (ssl->state != STATE_SV_DONE_RCVD &&
+             ssl->state != STATE_SV_FINISHED_RCVD) {
         if (!do_recv(ssl, NULL, 0)) {
           return -1;
         }
@@ -5947,6 +7291,7 @@ int SSL_connect(SSL *ssl) {
 
     /* fall through */
     case STATE_SV_DONE_RCVD:
+    case STATE_SV_FINISHED_RCVD:
       if (ssl->cert_requested) {
         const PEM *cert = ssl->ctx->pem_cert;
         PEM empty;
@@ -5968,7 +7313,8 @@ int SSL_connect(SSL *ssl) {
         return -1;
       }
 
-      ssl->state = STATE_CLIENT_FINISHED;
+      /* Resumed session is established once we have finished too. */
+      ssl->state = ssl->resumed ? STATE_ESTABLISHED : STATE_CLIENT_FINISHED;
       if (!do_send(ssl)) return -1;
 
     /* fall through */
@@ -6030,6 +7376,11 @@ int SSL_read(SSL *ssl, void *buf, int num) {
       ssl_err(ssl, SSL_ERROR_SSL);
       return 0;
     }
+    /* The buffer may end with the peer's close_notify */
+    if (!ssl->got_appdata && ssl->close_notify) {
+      ssl_err(ssl, SSL_ERROR_ZERO_RETURN);
+      return 0;
+    }
   }
 
   while (!ssl->got_appdata) {
@@ -6052,6 +7403,15 @@ int SSL_read(SSL *ssl, void *buf, int num) {
   return ssl->copied;
 }
 
+/*
+ * Decrypted application data that can be read without touching the socket.
+ * Records that arrive right behind the peer's Finished are decrypted by
+ * the handshake and held here.
+ */
+int SSL_pending(const SSL *ssl) {
+  return ssl->extra_appdata.len;
+}
+
 int SSL_write(SSL *ssl, const void *buf, int num) {
   int res = num;
   if (num == 0 && ssl->tx_len > 0) {
@@ -6085,17 +7445,252 @@ int SSL_write(SSL *ssl, const void *buf, int num) {
    * his mind after a WANT_READ or a WANT_WRITE.
   */
   if (num > 0 && !ssl->write_pending) {
-    if ((res = tls_write(ssl, buf, num)) <= 0) {
+    if ((ssl->write_len = tls_write(ssl, buf, num)) <= 0) {
       return -1;
     }
     ssl->write_pending = 1;
   }
+  if (num > 0) res = ssl->write_len;
   if (!do_send(ssl)) return -1;
 
   ssl_err(ssl, SSL_ERROR_NONE);
   return res;
 }
 
+static ssize_t kr_sendv(int fd, const struct vec *v, int n) {
+#ifdef KR_HAVE_SENDMSG
+  struct iovec iov[KR_WIP_RECORDS * 3];
+  struct msghdr msg;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    iov[i].iov_base = v[i].ptr;
+    iov[i].iov_len = v[i].len;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  return sendmsg(fd, &msg, MSG_NOSIGNAL);
+#else
+  ssize_t ret, total = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    ret = kr_send(fd, v[i].ptr, v[i].len, MSG_NOSIGNAL);
+    if (ret < 0) return total > 0 ? total : ret;
+    total += ret;
+    if ((size_t) ret < v[i].len) break;
+  }
+  return total;
+#endif
+}
+
+int SSL_kr_write_in_place(SSL *ssl, void *buf, int num) {
+  struct kr_wip *wip;
+  struct vec v[KR_WIP_RECORDS * 3];
+  uint8_t *data = (uint8_t *) buf;
+  size_t off, skip;
+  ssize_t ret;
+  int i, n = 0, done = 0;
+
+  if (ssl->fatal) {
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return -1;
+  }
+  if (ssl->close_notify || ssl->state == STATE_CLOSING) {
+    ssl_err(ssl, SSL_ERROR_ZERO_RETURN);
+    return 0;
+  }
+
+  if (ssl->state != STATE_ESTABLISHED) {
+    int ret;
+    if (ssl->is_server) {
+      ret = SSL_accept(ssl);
+    } else {
+      ret = SSL_connect(ssl);
+    }
+    if (ret <= 0) return ret;
+  }
+
+  if (ssl->wip == NULL) {
+    /* Records made by SSL_write() and alerts go first */
+    if (ssl->tx_len > 0 && !do_send(ssl)) return -1;
+    if (num == 0) return 0;
+    ssl->wip = (struct kr_wip *) calloc(1, sizeof(*ssl->wip));
+    if (ssl->wip == NULL) {
+      ssl_err(ssl, SSL_ERROR_SYSCALL);
+      return -1;
+    }
+  }
+  wip = ssl->wip;
+
+  for (i = 0, off = 0; i < wip->num; i++) off += wip->rec[i].data_len;
+  if (off > (size_t) num) {
+    dprintf(("sealed records dropped by the caller\n"));
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return -1;
+  }
+  while (wip->num < KR_WIP_RECORDS && off < (size_t) num) {
+    off += tls_seal_in_place(ssl, data + off, num - off, &wip->rec[wip->num]);
+    wip->num++;
+  }
+
+  for (i = 0, off = 0; i < wip->num; i++) {
+    struct kr_wip_rec *rec = &wip->rec[i];
+    v[n].ptr = rec->hdr;
+    v[n++].len = rec->hdr_len;
+    v[n].ptr = data + off;
+    v[n++].len = rec->body_len;
+    v[n].ptr = rec->trailer;
+    v[n++].len = rec->trailer_len;
+    off += rec->data_len;
+  }
+  for (i = 0, skip = wip->sent; skip >= v[i].len; i++) skip -= v[i].len;
+  v[i].ptr += skip;
+  v[i].len -= skip;
+
+  ret = kr_sendv(ssl->fd, v + i, n - i);
+  dprintf(("kr_sendv(%d, %d records) = %d\n", ssl->fd, wip->num, (int) ret));
+  if (ret < 0) {
+    if (SOCKET_ERRNO != EWOULDBLOCK) {
+      ssl_err(ssl, SSL_ERROR_SYSCALL);
+      return -1;
+    }
+    ret = 0;
+  }
+
+  /* Drop the records that are out */
+  wip->sent += ret;
+  for (i = 0; i < wip->num; i++) {
+    const struct kr_wip_rec *rec = &wip->rec[i];
+    size_t rec_len = rec->hdr_len + rec->body_len + rec->trailer_len;
+    if (wip->sent < rec_len) break;
+    wip->sent -= rec_len;
+    done += rec->data_len;
+  }
+  wip->num -= i;
+  memmove(wip->rec, wip->rec + i, wip->num * sizeof(wip->rec[0]));
+
+  if (wip->num == 0) {
+    /* Keep idle memory consumption low. */
+    free(ssl->wip);
+    ssl->wip = NULL;
+    /* Anything queued meanwhile, such as alerts */
+    if (ssl->tx_len > 0 && !do_send(ssl) && done == 0) return -1;
+  }
+
+  if (done == 0) {
+    ssl_err(ssl, SSL_ERROR_WANT_WRITE);
+    return -1;
+  }
+  ssl_err(ssl, SSL_ERROR_NONE);
+  return done;
+}
+
+int SSL_kr_read_in_place(SSL *ssl, void *buf, int *len) {
+  uint8_t *p = (uint8_t *) buf;
+  ssize_t ret;
+  int n;
+
+  if (ssl->fatal) {
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return -1;
+  }
+
+  if (ssl->state != STATE_ESTABLISHED && !ssl->close_notify &&
+      ssl->state != STATE_CLOSING) {
+    int ret;
+    if (ssl->is_server) {
+      ret = SSL_accept(ssl);
+    } else {
+      ret = SSL_connect(ssl);
+    }
+    if (ret <= 0) return ret;
+  }
+
+  /* Data decrypted along with the handshake comes first */
+  if (ssl->extra_appdata.len > 0) {
+    return SSL_read(ssl, buf, SSL_KR_MAX_RECORD);
+  }
+  if (ssl->close_notify || ssl->state == STATE_CLOSING) {
+    ssl_err(ssl, SSL_ERROR_ZERO_RETURN);
+    return 0;
+  }
+
+  /* Then the records read with it, one at a time */
+  if (ssl->rx_len > 0 && *len == 0) {
+    size_t want = ssl->rx_len;
+    if (want >= sizeof(struct tls_hdr)) {
+      want = sizeof(struct tls_hdr) +
+             be16toh(((struct tls_hdr *) ssl->rx_buf)->len);
+      if (want > ssl->rx_len) want = ssl->rx_len;
+    }
+    if (want > SSL_KR_MAX_RECORD) want = SSL_KR_MAX_RECORD;
+    memcpy(p, ssl->rx_buf, want);
+    *len = want;
+    ssl->rx_len -= want;
+    if (ssl->rx_len > 0) {
+      memmove(ssl->rx_buf, ssl->rx_buf + want, ssl->rx_len);
+    } else {
+      free(ssl->rx_buf);
+      ssl->rx_buf = NULL;
+      ssl->rx_max_len = 0;
+    }
+  }
+
+  for (;;) {
+    size_t want = sizeof(struct tls_hdr);
+
+    if ((size_t) *len >= want) {
+      want += be16toh(((struct tls_hdr *) p)->len);
+      if (want > SSL_KR_MAX_RECORD) {
+        dprintf(("record too long: %d\n", (int) want));
+        tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_RECORD_OVERFLOW);
+        do_send(ssl);
+        ssl_err(ssl, SSL_ERROR_SSL);
+        return -1;
+      }
+    }
+
+    if ((size_t) *len < want) {
+      ret = kr_recv(ssl->fd, p + *len, want - *len, MSG_NOSIGNAL);
+      dprintf(("kr_recv(%d, %p, %d): %d\n", ssl->fd, p + *len,
+               (int) (want - *len), (int) ret));
+      if (ret < 0) {
+        ssl_err(ssl, SOCKET_ERRNO == EWOULDBLOCK ? SSL_ERROR_WANT_READ
+                                                  : SSL_ERROR_SYSCALL);
+        return -1;
+      }
+      if (ret == 0) {
+        dprintf(("peer hung up\n"));
+        ssl_err(ssl, SSL_ERROR_ZERO_RETURN);
+        return 0;
+      }
+      *len += ret;
+      continue;
+    }
+
+    n = tls_handle_record(ssl, p, want);
+    *len = 0;
+
+    /* In case any alerts are queued */
+    do_send(ssl);
+
+    if (n < 0 || ssl->fatal) {
+      ssl_err(ssl, SSL_ERROR_SSL);
+      return -1;
+    }
+    if (n > 0) {
+      ssl_err(ssl, SSL_ERROR_NONE);
+      return n;
+    }
+    if (ssl->close_notify) {
+      ssl_err(ssl, SSL_ERROR_ZERO_RETURN);
+      return 0;
+    }
+  }
+}
+
 int SSL_get_error(const SSL *ssl, int ret) {
   (void) ret;
   return ssl->err;
@@ -6133,8 +7728,11 @@ void SSL_free(SSL *ssl) {
   if (ssl) {
     tls_free_security(ssl->cur);
     tls_free_security(ssl->nxt);
+    SSL_SESSION_free(ssl->session);
+    free(ssl->ticket);
     free(ssl->rx_buf);
     free(ssl->tx_buf);
+    free(ssl->wip);
     free(ssl);
   }
 }
@@ -6163,6 +7761,219 @@ void ssl_err(SSL *ssl, int err) {
   ssl->err = err;
 }
 #ifdef KR_MODULE_LINES
+#line 1 "src/src/session.c"
+#endif
+/*
+ * Copyright (c) 2015 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "ktypes.h" */
+
+NS_INTERNAL SSL_SESSION *kr_session_new(tls_sec_t sec) {
+  SSL_SESSION *sess = calloc(1, sizeof(*sess));
+  if (sess == NULL) return NULL;
+  sess->refs = 1;
+  sess->cipher_suite = sec->cipher_suite;
+  sess->id_len = sec->sess_id_len;
+  memcpy(sess->id, sec->sess_id, sec->sess_id_len);
+  memcpy(sess->master_secret, sec->master_secret, sizeof(sess->master_secret));
+  sess->time = time(NULL);
+  return sess;
+}
+
+void SSL_SESSION_free(SSL_SESSION *sess) {
+  if (sess == NULL || --sess->refs > 0) return;
+  memset(sess->master_secret, 0, sizeof(sess->master_secret));
+  free(sess->ticket);
+  free(sess->name);
+  free(sess);
+}
+
+SSL_SESSION *SSL_get1_session(SSL *ssl) {
+  if (ssl->session != NULL) ssl->session->refs++;
+  return ssl->session;
+}
+
+int SSL_set_session(SSL *ssl, SSL_SESSION *sess) {
+  if (sess != NULL) sess->refs++;
+  SSL_SESSION_free(ssl->session);
+  ssl->session = sess;
+  return 1;
+}
+
+int SSL_session_reused(SSL *ssl) {
+  return ssl->resumed;
+}
+
+NS_INTERNAL int kr_session_expired(const SSL_SESSION *sess) {
+  time_t now = time(NULL);
+  return now < sess->time || now - sess->time > KR_SESSION_TIMEOUT;
+}
+
+static int kr_session_name_eq(const char *a, const char *b) {
+  if (a == NULL || b == NULL) return a == b;
+  return strcmp(a, b) == 0;
+}
+
+static void kr_session_cache_remove(SSL_CTX *ctx, int i) {
+  SSL_SESSION_free(ctx->sessions[i]);
+  memmove(&ctx->sessions[i], &ctx->sessions[i + 1],
+          (KR_SESSION_CACHE_SIZE - i - 1) * sizeof(ctx->sessions[0]));
+  ctx->sessions[KR_SESSION_CACHE_SIZE - 1] = NULL;
+}
+
+/*
+ * Servers look sessions up by id (non-NULL `id`), clients by the verify name
+ * of their context.
+ */
+NS_INTERNAL SSL_SESSION *kr_session_cache_find(SSL_CTX *ctx,
+                                               const uint8_t *id,
+                                               size_t id_len,
+                                               const char *name) {
+  SSL_SESSION *sess;
+  int i;
+
+  for (i = 0; i < KR_SESSION_CACHE_SIZE && ctx->sessions[i] != NULL; i++) {
+    sess = ctx->sessions[i];
+    if (id != NULL ? (sess->id_len != id_len || memcmp(sess->id, id, id_len))
+                   : !kr_session_name_eq(sess->name, name)) {
+      continue;
+    }
+    if (kr_session_expired(sess)) {
+      kr_session_cache_remove(ctx, i);
+      return NULL;
+    }
+    /* Move to the front, so that the least recently used is evicted first. */
+    memmove(&ctx->sessions[1], &ctx->sessions[0], i * sizeof(sess));
+    ctx->sessions[0] = sess;
+    return sess;
+  }
+  return NULL;
+}
+
+NS_INTERNAL void kr_session_cache_add(SSL_CTX *ctx, SSL_SESSION *sess,
+                                      int is_server) {
+  int i;
+
+  /* Client keeps one session per server, the latest one. */
+  for (i = 0; i < KR_SESSION_CACHE_SIZE && ctx->sessions[i] != NULL; i++) {
+    SSL_SESSION *old = ctx->sessions[i];
+    if (is_server ? old->id_len == sess->id_len &&
+                        !memcmp(old->id, sess->id, sess->id_len)
+                  : kr_session_name_eq(old->name, sess->name)) {
+      kr_session_cache_remove(ctx, i);
+      break;
+    }
+  }
+  if (ctx->sessions[KR_SESSION_CACHE_SIZE - 1] != NULL) {
+    kr_session_cache_remove(ctx, KR_SESSION_CACHE_SIZE - 1);
+  }
+  memmove(&ctx->sessions[1], &ctx->sessions[0],
+          (KR_SESSION_CACHE_SIZE - 1) * sizeof(sess));
+  ctx->sessions[0] = sess;
+  sess->refs++;
+}
+
+NS_INTERNAL void kr_session_cache_free(SSL_CTX *ctx) {
+  int i;
+  for (i = 0; i < KR_SESSION_CACHE_SIZE; i++) {
+    SSL_SESSION_free(ctx->sessions[i]);
+    ctx->sessions[i] = NULL;
+  }
+}
+
+/*
+ * Session tickets, in the format suggested by RFC 5077:
+ *
+ *   key_name[16] iv[16] state[64] mac[32]
+ *
+ * where state is the AES-128-CBC encrypted protocol version, cipher suite,
+ * master secret and creation time of the session, padded with zeros, and
+ * mac is HMAC-SHA256 of everything before it.
+ */
+#define KR_TICKET_STATE_LEN 64
+
+static int kr_ticket_keys(SSL_CTX *ctx) {
+  if (!ctx->have_ticket_keys) {
+    if (!kr_get_random(ctx->ticket_keys, sizeof(ctx->ticket_keys))) return 0;
+    ctx->have_ticket_keys = 1;
+  }
+  return 1;
+}
+
+static void kr_ticket_mac(SSL_CTX *ctx, const uint8_t *ticket,
+                          uint8_t *digest) {
+  const uint8_t *msgs[1];
+  size_t msgl[1];
+  msgs[0] = ticket;
+  msgl[0] = 16 + 16 + KR_TICKET_STATE_LEN;
+  kr_hmac_sha256_v(ctx->ticket_keys + 16, 16, 1, msgs, msgl, digest);
+}
+
+NS_INTERNAL int kr_ticket_seal(SSL_CTX *ctx, const SSL_SESSION *sess,
+                               uint8_t *out) {
+  const kr_cipher_info *ci = kr_aes128_cs_info();
+  uint8_t state[KR_TICKET_STATE_LEN], *p = state;
+  uint32_t t = htobe32((uint32_t) sess->time);
+  void *cctx;
+
+  if (!kr_ticket_keys(ctx) || !kr_get_random(out + 16, 16)) return 0;
+
+  memset(state, 0, sizeof(state));
+  *p++ = TLS_1_2_PROTO >> 8;
+  *p++ = TLS_1_2_PROTO & 0xff;
+  *p++ = sess->cipher_suite >> 8;
+  *p++ = sess->cipher_suite & 0xff;
+  memcpy(p, sess->master_secret, sizeof(sess->master_secret));
+  p += sizeof(sess->master_secret);
+  memcpy(p, &t, sizeof(t));
+
+  if ((cctx = ci->new_ctx()) == NULL) return 0;
+  ci->setup_enc(cctx, ctx->ticket_keys + 32);
+  memcpy(out, ctx->ticket_keys, 16);
+  kr_cbc_encrypt(ci, cctx, state, sizeof(state), out + 16, out + 32);
+  ci->free_ctx(cctx);
+  memset(state, 0, sizeof(state));
+
+  kr_ticket_mac(ctx, out, out + 32 + KR_TICKET_STATE_LEN);
+  return KR_TICKET_LEN;
+}
+
+NS_INTERNAL int kr_ticket_open(SSL_CTX *ctx, const uint8_t *ticket,
+                               size_t len, SSL_SESSION *sess) {
+  const kr_cipher_info *ci = kr_aes128_cs_info();
+  uint8_t state[KR_TICKET_STATE_LEN], digest[SHA256_SIZE], diff = 0;
+  uint32_t t;
+  void *cctx;
+  int i;
+
+  if (len != KR_TICKET_LEN || !ctx->have_ticket_keys ||
+      memcmp(ticket, ctx->ticket_keys, 16) != 0) {
+    return 0;
+  }
+  kr_ticket_mac(ctx, ticket, digest);
+  for (i = 0; i < SHA256_SIZE; i++) {
+    diff |= digest[i] ^ ticket[32 + KR_TICKET_STATE_LEN + i];
+  }
+  if (diff != 0) return 0;
+
+  if ((cctx = ci->new_ctx()) == NULL) return 0;
+  ci->setup_dec(cctx, ctx->ticket_keys + 32);
+  kr_cbc_decrypt(ci, cctx, ticket + 32, sizeof(state), ticket + 16, state);
+  ci->free_ctx(cctx);
+
+  memset(sess, 0, sizeof(*sess));
+  if (((state[0] << 8) | state[1]) == TLS_1_2_PROTO) {
+    sess->cipher_suite = (state[2] << 8) | state[3];
+    memcpy(sess->master_secret, state + 4, sizeof(sess->master_secret));
+    memcpy(&t, state + 4 + sizeof(sess->master_secret), sizeof(t));
+    sess->time = be32toh(t);
+  }
+  memset(state, 0, sizeof(state));
+  return sess->cipher_suite != 0 && !kr_session_expired(sess);
+}
+#ifdef KR_MODULE_LINES
 #line 1 "src/src/tls.c"
 #endif
 /*
@@ -6193,15 +8004,15 @@ NS_INTERNAL void tls_free_security(tls_sec_t sec) {
   }
 }
 
-NS_INTERNAL void tls_compute_master_secret(tls_sec_t sec,
-                                           struct tls_premaster_secret *pre) {
+NS_INTERNAL void tls_compute_master_secret(tls_sec_t sec, const uint8_t *pre,
+                                           size_t pre_len) {
   uint8_t buf[13 + sizeof(sec->cl_rnd) + sizeof(sec->sv_rnd)];
 
   memcpy(buf, "master secret", 13);
   memcpy(buf + 13, &sec->cl_rnd, sizeof(sec->cl_rnd));
   memcpy(buf + 13 + sizeof(sec->cl_rnd), &sec->sv_rnd, sizeof(sec->sv_rnd));
 
-  prf((uint8_t *) pre, sizeof(*pre), buf, sizeof(buf), sec->master_secret,
+  prf(pre, pre_len, buf, sizeof(buf), sec->master_secret,
       sizeof(sec->master_secret));
 #if 0
 	printf(" + pre-material\n");
@@ -6211,6 +8022,23 @@ NS_INTERNAL void tls_compute_master_secret(tls_sec_t sec,
 #endif
 }
 
+/*
+ * What the server signs in ServerKeyExchange: SHA256 of both randoms and the
+ * ECDH params, as a PKCS#1 DigestInfo of TLS_SHA256_DIGEST_INFO_LEN +
+ * SHA256_SIZE bytes.
+ */
+NS_INTERNAL void tls_key_exch_digest(tls_sec_t sec, const uint8_t *params,
+                                     size_t len, uint8_t *out) {
+  SHA256_CTX sha;
+
+  memcpy(out, TLS_SHA256_DIGEST_INFO, TLS_SHA256_DIGEST_INFO_LEN);
+  SHA256_Init(&sha);
+  SHA256_Update(&sha, (uint8_t *) &sec->cl_rnd, sizeof(sec->cl_rnd));
+  SHA256_Update(&sha, (uint8_t *) &sec->sv_rnd, sizeof(sec->sv_rnd));
+  SHA256_Update(&sha, params, len);
+  SHA256_Final(out + TLS_SHA256_DIGEST_INFO_LEN, &sha);
+}
+
 NS_INTERNAL int tls_check_server_finished(tls_sec_t sec, const uint8_t *vrfy,
                                           size_t vrfy_len) {
   uint8_t buf[15 + SHA256_SIZE];
@@ -6304,6 +8132,13 @@ NS_INTERNAL void tls_generate_keys(tls_sec_t sec, int is_server) {
   }
 }
 
+/* Implicit part of the nonce for AEAD suites, follows MAC and write keys */
+NS_INTERNAL const uint8_t *tls_write_iv(tls_sec_t sec, int server_write) {
+  const kr_cipher_info *ci = kr_cipher_get_info(sec->cipher_suite);
+  return sec->keys + 2 * kr_hmac_len(sec->cipher_suite) + 2 * ci->key_len +
+         (server_write ? ci->iv_len : 0);
+}
+
 NS_INTERNAL int tls_tx_push(SSL *ssl, const void *data, size_t len) {
   if (ssl->tx_len + len > ssl->tx_max_len) {
     size_t new_len;
@@ -6327,6 +8162,56 @@ NS_INTERNAL int tls_tx_push(SSL *ssl, const void *data, size_t len) {
   return 1;
 }
 
+/*
+ * AEAD record: explicit nonce, ciphertext and tag. The sequence number is
+ * used as the explicit nonce, it never repeats under the same key.
+ */
+static int tls_send_aead(SSL *ssl, uint8_t type, const void *buf,
+                         size_t len) {
+  struct tls_hdr hdr;
+  struct tls_hmac_hdr phdr;
+  uint8_t nonce[GCM_SALT_SIZE + GCM_NONCE_SIZE], tag[GCM_TAG_SIZE];
+  uint64_t *seq = ssl->is_server ? &ssl->cur->server_write_seq
+                                 : &ssl->cur->client_write_seq;
+  void *cctx =
+      ssl->is_server ? ssl->cur->server_write_ctx : ssl->cur->client_write_ctx;
+  int enc_offset;
+
+  if (len > (1 << 14)) len = (1 << 14);
+
+  hdr.type = type;
+  hdr.vers = htobe16(TLS_1_2_PROTO);
+  hdr.len = htobe16(GCM_NONCE_SIZE + len + GCM_TAG_SIZE);
+
+  /* Additional data is the same as the MAC header of CBC suites */
+  phdr.seq = htobe64(*seq);
+  phdr.type = type;
+  phdr.vers = hdr.vers;
+  phdr.len = htobe16(len);
+
+  memcpy(nonce, tls_write_iv(ssl->cur, ssl->is_server), GCM_SALT_SIZE);
+  memcpy(nonce + GCM_SALT_SIZE, &phdr.seq, GCM_NONCE_SIZE);
+
+  if (!tls_tx_push(ssl, &hdr, sizeof(hdr))) return 0;
+  if (!tls_tx_push(ssl, nonce + GCM_SALT_SIZE, GCM_NONCE_SIZE)) return 0;
+  enc_offset = ssl->tx_len;
+  if (!tls_tx_push(ssl, buf, len)) return 0;
+
+  kr_gcm_encrypt(cctx, nonce, (uint8_t *) &phdr, sizeof(phdr),
+                 ssl->tx_buf + enc_offset, len, ssl->tx_buf + enc_offset, tag);
+  if (!tls_tx_push(ssl, tag, sizeof(tag))) return 0;
+
+  (*seq)++;
+
+  return len;
+}
+
+/* Padding that fills up the last block, peers don't all take a whole one */
+static uint8_t tls_cbc_pad_len(const kr_cipher_info *ci, size_t len,
+                               int mac_len) {
+  return (ci->block_len - (len + mac_len + 1) % ci->block_len) % ci->block_len;
+}
+
 NS_INTERNAL int tls_send_enc(SSL *ssl, uint8_t type, const void *buf,
                              size_t len) {
   struct tls_hdr hdr;
@@ -6334,7 +8219,7 @@ NS_INTERNAL int tls_send_enc(SSL *ssl, uint8_t type, const void *buf,
 
   const int mac_len = kr_hmac_len(ssl->cur->cipher_suite);
   const kr_cipher_info *ci = kr_cipher_get_info(ssl->cur->cipher_suite);
-  /* Only CBC mode for block ciphers for now, so block cipher -> CBC. */
+  /* AEAD suites aside, block cipher -> CBC. */
   const int is_cbc = (ci->block_len > 1);
   const size_t max =
       (1 << 14) - mac_len - (is_cbc ? ci->iv_len + ci->block_len : 0);
@@ -6343,11 +8228,15 @@ NS_INTERNAL int tls_send_enc(SSL *ssl, uint8_t type, const void *buf,
   uint8_t pad_len = 0;
   uint8_t iv[MAX_IV_SIZE];
 
+  if (kr_cs_is_aead(ssl->cur->cipher_suite)) {
+    return tls_send_aead(ssl, type, buf, len);
+  }
+
   if (len > max) len = max;
 
   /* Header */
   if (is_cbc) {
-    pad_len = ci->block_len - ((len + mac_len + 1) % ci->block_len);
+    pad_len = tls_cbc_pad_len(ci, len, mac_len);
   }
 
   hdr.type = type;
@@ -6428,6 +8317,97 @@ NS_INTERNAL int tls_send_enc(SSL *ssl, uint8_t type, const void *buf,
   return len;
 }
 
+/*
+ * Seals an application data record for SSL_kr_write_in_place(), encrypting
+ * the data in buf. Returns the number of bytes of buf in the record.
+ */
+NS_INTERNAL int tls_seal_in_place(SSL *ssl, uint8_t *buf, size_t len,
+                                  struct kr_wip_rec *rec) {
+  struct tls_hdr hdr;
+  struct tls_hmac_hdr phdr;
+  const int mac_len = kr_hmac_len(ssl->cur->cipher_suite);
+  const kr_cipher_info *ci = kr_cipher_get_info(ssl->cur->cipher_suite);
+  const int is_cbc = (ci->block_len > 1);
+  uint64_t *seq = ssl->is_server ? &ssl->cur->server_write_seq
+                                 : &ssl->cur->client_write_seq;
+  void *cctx =
+      ssl->is_server ? ssl->cur->server_write_ctx : ssl->cur->client_write_ctx;
+
+  hdr.type = TLS_APP_DATA;
+  hdr.vers = htobe16(TLS_1_2_PROTO);
+  phdr.seq = htobe64(*seq);
+  phdr.type = hdr.type;
+  phdr.vers = hdr.vers;
+  rec->hdr_len = sizeof(hdr);
+
+  if (kr_cs_is_aead(ssl->cur->cipher_suite)) {
+    /* Same as tls_send_aead() */
+    uint8_t nonce[GCM_SALT_SIZE + GCM_NONCE_SIZE];
+
+    if (len > (1 << 14)) len = (1 << 14);
+    phdr.len = htobe16(len);
+    memcpy(nonce, tls_write_iv(ssl->cur, ssl->is_server), GCM_SALT_SIZE);
+    memcpy(nonce + GCM_SALT_SIZE, &phdr.seq, GCM_NONCE_SIZE);
+    memcpy(rec->hdr + rec->hdr_len, &phdr.seq, GCM_NONCE_SIZE);
+    rec->hdr_len += GCM_NONCE_SIZE;
+
+    kr_gcm_encrypt(cctx, nonce, (uint8_t *) &phdr, sizeof(phdr), buf, len, buf,
+                   rec->trailer);
+    rec->body_len = len;
+    rec->trailer_len = GCM_TAG_SIZE;
+  } else {
+    /* Same as tls_send_enc(), MAC and padding go to the trailer */
+    const size_t max =
+        (1 << 14) - mac_len - (is_cbc ? ci->iv_len + ci->block_len : 0);
+    const uint8_t *msgs[2];
+    size_t msgl[2];
+    uint8_t *mac;
+
+    if (len > max) len = max;
+    phdr.len = htobe16(len);
+    rec->body_len = is_cbc ? len - len % ci->block_len : len;
+    memcpy(rec->trailer, buf + rec->body_len, len - rec->body_len);
+    mac = rec->trailer + (len - rec->body_len);
+
+    msgs[0] = (uint8_t *) &phdr;
+    msgl[0] = sizeof(phdr);
+    msgs[1] = buf;
+    msgl[1] = len;
+    kr_ssl_hmac(ssl, ssl->is_server ? KR_SERVER_MAC : KR_CLIENT_MAC, 2, msgs,
+                msgl, mac);
+    rec->trailer_len = (mac - rec->trailer) + mac_len;
+
+    if (is_cbc) {
+      uint8_t *iv = rec->hdr + rec->hdr_len;
+      uint8_t pad_len = tls_cbc_pad_len(ci, len, mac_len);
+
+      memset(rec->trailer + rec->trailer_len, pad_len, pad_len + 1);
+      rec->trailer_len += pad_len + 1;
+
+      kr_get_random(iv, ci->iv_len);
+      prf(iv, ci->iv_len, (uint8_t *) ssl, sizeof(*ssl), iv, ci->iv_len);
+      rec->hdr_len += ci->iv_len;
+
+      kr_cbc_encrypt(ci, cctx, buf, rec->body_len, iv, buf);
+      kr_cbc_encrypt(ci, cctx, rec->trailer, rec->trailer_len,
+                     rec->body_len > 0 ? buf + rec->body_len - ci->block_len
+                                       : iv,
+                     rec->trailer);
+    } else {
+      ci->encrypt(cctx, buf, len, buf);
+      ci->encrypt(cctx, rec->trailer, rec->trailer_len, rec->trailer);
+    }
+  }
+
+  hdr.len = htobe16(rec->hdr_len - sizeof(hdr) + rec->body_len +
+                    rec->trailer_len);
+  memcpy(rec->hdr, &hdr, sizeof(hdr));
+  rec->data_len = len;
+  (*seq)++;
+
+  return len;
+}
+
 NS_INTERNAL int tls_send(SSL *ssl, uint8_t type, const void *buf, size_t len) {
   if (type == TLS_HANDSHAKE &&
       ((const uint8_t *) buf)[0] != HANDSHAKE_HELLO_REQ) {
@@ -6535,46 +8515,117 @@ NS_INTERNAL int tls_close_notify(SSL *ssl) {
 
 #include <time.h>
 
+static void set16(unsigned char *p, uint16_t v) {
+  p[0] = (v >> 8) & 0xff;
+  p[1] = v & 0xff;
+}
+
+/* Session to offer, if it can be resumed */
+static const SSL_SESSION *tls_cl_offer(SSL *ssl) {
+  const SSL_SESSION *sess = ssl->session;
+  if (sess == NULL || kr_session_expired(sess)) return NULL;
+  if (sess->ticket != NULL && !(ssl->ctx->options & SSL_OP_NO_TICKET)) {
+    return sess;
+  }
+  return sess->id_len > 0 ? sess : NULL;
+}
+
 NS_INTERNAL int tls_cl_hello(SSL *ssl) {
-  int i = 0;
+  int i = 0, ret;
   struct tls_cl_hello hello;
+  const SSL_SESSION *sess = tls_cl_offer(ssl);
+  const size_t id_offset = offsetof(struct tls_cl_hello, cipher_suites_len);
+  const size_t cs_offset = offsetof(struct tls_cl_hello, cipher_suite);
+  const size_t comp_offset = offsetof(struct tls_cl_hello, num_compressors);
+  const size_t ext_offset = offsetof(struct tls_cl_hello, ext_reneg);
+  size_t ticket_len = 0, len;
+  uint8_t *buf, *p;
+  int want_ticket = !(ssl->ctx->options & SSL_OP_NO_TICKET);
 
   /* hello */
   hello.type = HANDSHAKE_CLIENT_HELLO;
-  hello.len_hi = 0;
-  hello.len = htobe16(sizeof(hello) - 4);
   hello.version = htobe16(0x0303);
   hello.random.time = htobe32(time(NULL));
   if (!kr_get_random(hello.random.opaque, sizeof(hello.random.opaque))) {
     ssl_err(ssl, SSL_ERROR_SYSCALL);
     return 0;
   }
-  hello.sess_id_len = 0;
-#if KR_ALLOW_NULL_CIPHERS
-  /* if we allow them, it's for testing reasons, so NULL comes first */
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_NULL_MD5);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_AES_128_CBC_SHA256);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_AES_128_CBC_SHA);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_RC4_128_SHA);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_RC4_128_MD5);
-  hello.cipher_suite[i++] = htobe16(TLS_EMPTY_RENEGOTIATION_INFO_SCSV);
-#else
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_AES_128_CBC_SHA256);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_AES_128_CBC_SHA);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_RC4_128_SHA);
-  hello.cipher_suite[i++] = htobe16(TLS_RSA_WITH_RC4_128_MD5);
+  if (sess != NULL) {
+    if (sess->id_len > 0) {
+      ssl->nxt->sess_id_len = sess->id_len;
+      memcpy(ssl->nxt->sess_id, sess->id, sess->id_len);
+    } else {
+      /* Server echoes this id if it accepts the ticket (RFC 5077 3.4) */
+      ssl->nxt->sess_id_len = sizeof(ssl->nxt->sess_id);
+      if (!kr_get_random(ssl->nxt->sess_id, ssl->nxt->sess_id_len)) {
+        ssl_err(ssl, SSL_ERROR_SYSCALL);
+        return 0;
+      }
+    }
+    if (want_ticket && sess->ticket != NULL) ticket_len = sess->ticket_len;
+  }
+  hello.sess_id_len = ssl->nxt->sess_id_len;
+  for (i = 0; i < ssl->ctx->num_cipher_suites; i++) {
+    hello.cipher_suite[i] = htobe16(ssl->ctx->cipher_suites[i]);
+  }
   hello.cipher_suite[i++] = htobe16(TLS_EMPTY_RENEGOTIATION_INFO_SCSV);
-#endif
   hello.cipher_suites_len = htobe16(i * 2);
   hello.num_compressors = 1;
   hello.compressor[0] = COMPRESSOR_NULL;
-  hello.ext_len = htobe16(sizeof(hello.ext_reneg));
+  hello.ext_len = htobe16(sizeof(hello) - ext_offset +
+                          (want_ticket ? 4 + ticket_len : 0));
 
   hello.ext_reneg.type = htobe16(EXT_RENEG_INFO);
   hello.ext_reneg.len = htobe16(1);
   hello.ext_reneg.ri_len = 0;
 
-  if (!tls_send(ssl, TLS_HANDSHAKE, &hello, sizeof(hello))) return 0;
+  /* X25519 is the only group we do, and we only sign with SHA256 */
+  hello.ext_groups.type = htobe16(EXT_SUPPORTED_GROUPS);
+  hello.ext_groups.len = htobe16(4);
+  hello.ext_groups.groups_len = htobe16(2);
+  hello.ext_groups.group[0] = htobe16(TLS_GROUP_X25519);
+
+  hello.ext_point_fmts.type = htobe16(EXT_EC_POINT_FORMATS);
+  hello.ext_point_fmts.len = htobe16(2);
+  hello.ext_point_fmts.fmts_len = 1;
+  hello.ext_point_fmts.fmt[0] = TLS_POINT_UNCOMPRESSED;
+
+  hello.ext_sig_algs.type = htobe16(EXT_SIG_ALGOS);
+  hello.ext_sig_algs.len = htobe16(4);
+  hello.ext_sig_algs.algs_len = htobe16(2);
+  hello.ext_sig_algs.alg[0] = TLS_HASH_SHA256;
+  hello.ext_sig_algs.alg[1] = TLS_SIG_RSA;
+
+  /*
+   * Session id, cipher suites and ticket are variable length, assemble the
+   * message.
+   */
+  len = sizeof(hello) - (comp_offset - cs_offset) + i * 2 +
+        hello.sess_id_len + (want_ticket ? 4 + ticket_len : 0);
+  hello.len_hi = (len - 4) >> 16;
+  hello.len = htobe16((len - 4) & 0xffff);
+  buf = p = malloc(len);
+  if (buf == NULL) {
+    ssl_err(ssl, SSL_ERROR_SYSCALL);
+    return 0;
+  }
+  memcpy(p, &hello, id_offset);
+  p += id_offset;
+  memcpy(p, ssl->nxt->sess_id, hello.sess_id_len);
+  p += hello.sess_id_len;
+  memcpy(p, (uint8_t *) &hello + id_offset, cs_offset - id_offset + i * 2);
+  p += cs_offset - id_offset + i * 2;
+  memcpy(p, (uint8_t *) &hello + comp_offset, sizeof(hello) - comp_offset);
+  p += sizeof(hello) - comp_offset;
+  if (want_ticket) {
+    set16(p, EXT_SESSION_TICKET);
+    set16(p + 2, ticket_len);
+    if (ticket_len > 0) memcpy(p + 4, sess->ticket, ticket_len);
+  }
+
+  ret = tls_send(ssl, TLS_HANDSHAKE, buf, len);
+  free(buf);
+  if (!ret) return 0;
 
   /* store the random we generated */
   memcpy(&ssl->nxt->cl_rnd, &hello.random, sizeof(ssl->nxt->cl_rnd));
@@ -6582,28 +8633,52 @@ NS_INTERNAL int tls_cl_hello(SSL *ssl) {
   return 1;
 }
 
-static void set16(unsigned char *p, uint16_t v) {
-  p[0] = (v >> 8) & 0xff;
-  p[1] = v & 0xff;
+/* Our X25519 share for the one server sent, premaster is the shared secret */
+static int tls_cl_ecdh_key_exch(SSL *ssl, unsigned char *buf) {
+  tls_sec_t sec = ssl->nxt;
+  uint8_t shared[X25519_KEY_SIZE];
+  int ok;
+
+  if (!sec->peer_key_rcvd) {
+    dprintf(("no server key exchange\n"));
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return 0;
+  }
+  if (!kr_get_random(sec->ecdh_priv, sizeof(sec->ecdh_priv))) {
+    ssl_err(ssl, SSL_ERROR_SYSCALL);
+    return 0;
+  }
+
+  buf[0] = HANDSHAKE_CLIENT_KEY_EXCH;
+  buf[1] = 0;
+  set16(buf + 2, 1 + X25519_KEY_SIZE);
+  buf[4] = X25519_KEY_SIZE;
+  kr_x25519_base(buf + 5, sec->ecdh_priv);
+
+  ok = kr_x25519(shared, sec->ecdh_priv, sec->ecdh_peer);
+  memset(sec->ecdh_priv, 0, sizeof(sec->ecdh_priv));
+  if (!ok) {
+    dprintf(("bad server ECDH share\n"));
+    tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_ILLEGAL_PARAMETER);
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return 0;
+  }
+  tls_compute_master_secret(sec, shared, sizeof(shared));
+  memset(shared, 0, sizeof(shared));
+
+  return 5 + X25519_KEY_SIZE;
 }
 
-NS_INTERNAL int tls_cl_finish(SSL *ssl) {
-  struct tls_change_cipher_spec cipher;
-  struct tls_finished finished;
+static int tls_cl_rsa_key_exch(SSL *ssl, unsigned char *buf) {
   size_t buf_len = 6 + RSA_block_size(ssl->nxt->svr_key);
-  unsigned char buf[6 + 512];
   struct tls_premaster_secret in;
 
-  assert(buf_len < sizeof(buf)); /* Fix this */
-
   in.version = htobe16(0x0303);
   if (!kr_get_random(in.opaque, sizeof(in.opaque))) {
     ssl_err(ssl, SSL_ERROR_SYSCALL);
     return 0;
   }
-  tls_compute_master_secret(ssl->nxt, &in);
-  tls_generate_keys(ssl->nxt, ssl->is_server);
-  dprintf((" + master secret computed\n"));
+  tls_compute_master_secret(ssl->nxt, (uint8_t *) &in, sizeof(in));
 
   if (RSA_encrypt(ssl->nxt->svr_key, (uint8_t *) &in, sizeof(in), buf + 6, 0) <=
       1) {
@@ -6616,12 +8691,35 @@ NS_INTERNAL int tls_cl_finish(SSL *ssl) {
   buf[1] = 0;
   set16(buf + 2, buf_len - 4);
   set16(buf + 4, buf_len - 6);
+  return buf_len;
+}
+
+static int tls_cl_key_exch(SSL *ssl) {
+  size_t buf_len;
+  unsigned char buf[6 + 512];
+
+  if (ssl->nxt->svr_key == NULL ||
+      (size_t) RSA_block_size(ssl->nxt->svr_key) + 6 > sizeof(buf)) {
+    dprintf(("no usable server key\n"));
+    ssl_err(ssl, SSL_ERROR_SSL);
+    return 0;
+  }
+
+  if (kr_cs_is_ecdhe(ssl->nxt->cipher_suite)) {
+    buf_len = tls_cl_ecdh_key_exch(ssl, buf);
+  } else {
+    buf_len = tls_cl_rsa_key_exch(ssl, buf);
+  }
+  if (buf_len == 0) return 0;
+  tls_generate_keys(ssl->nxt, ssl->is_server);
+  dprintf((" + master secret computed\n"));
+
   if (!tls_send(ssl, TLS_HANDSHAKE, buf, buf_len)) return 0;
 
   /* cert verify, if required */
   if (ssl->cert_requested && ssl->ctx->pem_cert != NULL) {
     SHA256_CTX tmp_hash;
-    uint8_t tmp_digest[SHA256_SIZE + 19];
+    uint8_t tmp_digest[TLS_SHA256_DIGEST_INFO_LEN + SHA256_SIZE];
     uint8_t *p = buf;
     *p++ = HANDSHAKE_CERTIFICATE_VRFY;
     *p++ = 0;
@@ -6631,20 +8729,8 @@ NS_INTERNAL int tls_cl_finish(SSL *ssl) {
     *p++ = TLS_HASH_SHA256;
     *p++ = TLS_SIG_RSA;
     memcpy(&tmp_hash, &ssl->nxt->handshakes_hash, sizeof(tmp_hash));
-    /*
-     * This is the RSASSA-PKCS1-v1_5 header for a SHA256 digest,
-     * and translates from ASN.1-speak as follows:\
-     * SEQUENCE (2 elem)
-     *   SEQUENCE (2 elem)
-     *     OBJECT IDENTIFIER  2.16.840.1.101.3.4.2.1  (id-sha256)
-     *     NULL
-     *   OCTET STRING (32 byte)
-     */
-    memcpy(tmp_digest,
-           "\x30\x31\x30\x0D\x06\x09\x60\x86\x48\x01\x65\x03\x04\x02\x01\x05"
-           "\x00\x04\x20",
-           19);
-    SHA256_Final(tmp_digest + 19, &tmp_hash);
+    memcpy(tmp_digest, TLS_SHA256_DIGEST_INFO, TLS_SHA256_DIGEST_INFO_LEN);
+    SHA256_Final(tmp_digest + TLS_SHA256_DIGEST_INFO_LEN, &tmp_hash);
     set16(p, RSA_block_size(ssl->ctx->rsa_privkey));
     p += 2;
     if (RSA_encrypt(ssl->ctx->rsa_privkey, tmp_digest, sizeof(tmp_digest), p,
@@ -6658,15 +8744,25 @@ NS_INTERNAL int tls_cl_finish(SSL *ssl) {
     if (!tls_send(ssl, TLS_HANDSHAKE, buf, p - buf)) return 0;
   }
 
+  return 1;
+}
+
+NS_INTERNAL int tls_cl_finish(SSL *ssl) {
+  struct tls_change_cipher_spec cipher;
+  struct tls_finished finished;
+
+  /* Resumed session has the keys already, and server has switched to them */
+  if (!ssl->resumed && !tls_cl_key_exch(ssl)) return 0;
+
   /* change cipher spec */
   cipher.one = 1;
   if (!tls_send(ssl, TLS_CHANGE_CIPHER_SPEC, &cipher, sizeof(cipher))) return 0;
 
-  if (ssl->cur) {
+  if (ssl->nxt != NULL) {
     tls_free_security(ssl->cur);
+    ssl->cur = ssl->nxt;
+    ssl->nxt = NULL;
   }
-  ssl->cur = ssl->nxt;
-  ssl->nxt = NULL;
   ssl->tx_enc = 1;
 
   /* finished */
@@ -6678,8 +8774,34 @@ NS_INTERNAL int tls_cl_finish(SSL *ssl) {
 
   if (!tls_send(ssl, TLS_HANDSHAKE, &finished, sizeof(finished))) return 0;
 
+  if (ssl->resumed) tls_cl_save_session(ssl);
+
   return 1;
 }
+
+/*
+ * Remember the session once the handshake is complete. Resumed session is
+ * only replaced if the server has issued a new ticket for it.
+ */
+NS_INTERNAL void tls_cl_save_session(SSL *ssl) {
+  SSL_SESSION *sess;
+
+  if (ssl->resumed && ssl->ticket == NULL) return;
+  if ((sess = kr_session_new(ssl->cur)) == NULL) return;
+  sess->ticket = ssl->ticket;
+  sess->ticket_len = ssl->ticket_len;
+  ssl->ticket = NULL;
+  ssl->ticket_len = 0;
+  if (ssl->ctx->verify_name != NULL) {
+    sess->name = strdup(ssl->ctx->verify_name);
+  }
+
+  SSL_SESSION_free(ssl->session);
+  ssl->session = sess;
+  if (ssl->ctx->sess_cache_mode & SSL_SESS_CACHE_CLIENT) {
+    kr_session_cache_add(ssl->ctx, sess, 0);
+  }
+}
 #ifdef KR_MODULE_LINES
 #line 1 "src/src/tls_recv.c"
 #endif
@@ -6690,8 +8812,17 @@ NS_INTERNAL int tls_cl_finish(SSL *ssl) {
 
 /* Amalgamated: #include "ktypes.h" */
 
-static int check_cipher(uint16_t suite) {
-  return kr_cipher_get_info(suite) != NULL && kr_hmac_len(suite) >= 0;
+static int cipher_enabled(SSL *ssl, uint16_t suite) {
+  unsigned int i;
+  for (i = 0; i < ssl->ctx->num_cipher_suites; i++) {
+    if (ssl->ctx->cipher_suites[i] == suite) return 1;
+  }
+  return 0;
+}
+
+static int check_cipher(SSL *ssl, uint16_t suite) {
+  return kr_cipher_get_info(suite) != NULL && kr_hmac_len(suite) >= 0 &&
+         cipher_enabled(ssl, suite);
 }
 
 static int check_compressor(uint8_t compressor) {
@@ -6703,8 +8834,10 @@ static int check_compressor(uint8_t compressor) {
   }
 }
 
-static void cipher_suite_negotiate(SSL *ssl, kr_cs_id cs) {
-  if (ssl->nxt->cipher_negotiated) return;
+static void cipher_suite_negotiate(SSL *ssl, kr_cs_id cs, int have_x25519) {
+  if (ssl->nxt->cipher_negotiated || !cipher_enabled(ssl, cs)) return;
+  /* Client must be able to do our curve */
+  if (kr_cs_is_ecdhe(cs) && !have_x25519) return;
   switch (cs) {
 #if ALLOW_NULL_CIPHERS
     case TLS_RSA_WITH_NULL_MD5:
@@ -6713,6 +8846,8 @@ static void cipher_suite_negotiate(SSL *ssl, kr_cs_id cs) {
     case TLS_RSA_WITH_RC4_128_SHA:
     case TLS_RSA_WITH_AES_128_CBC_SHA:
     case TLS_RSA_WITH_AES_128_CBC_SHA256:
+    case TLS_RSA_WITH_AES_128_GCM_SHA256:
+    case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
       ssl->nxt->cipher_suite = cs;
       ssl->nxt->cipher_negotiated = 1;
   }
@@ -6753,6 +8888,8 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
   const uint16_t *cipher_suites;
   const uint8_t *compressions;
   const uint8_t *rand;
+  const uint8_t *sess_id, *ticket = NULL;
+  int ticket_len = -1, have_x25519 = 0;
   unsigned int i;
   size_t ext_len;
   uint8_t sess_id_len;
@@ -6787,9 +8924,11 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
   rand = buf;
   buf += sizeof(struct tls_random);
 
-  /* skip over session id len + session id */
+  /* session id len + session id */
   if (buf + 1 > end) goto err;
   sess_id_len = buf[0];
+  sess_id = buf + 1;
+  if (sess_id_len > sizeof(ssl->nxt->sess_id)) goto err;
 
   buf += 1 + sess_id_len;
   if (buf > end) goto err;
@@ -6855,6 +8994,8 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
           break;
         case EXT_SESSION_TICKET:
           dprintf((" + EXT: session ticket\n"));
+          ticket = buf;
+          ticket_len = ext_len;
           break;
         case EXT_HEARTBEAT:
           dprintf((" + EXT: heartbeat\n"));
@@ -6863,6 +9004,12 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
           /* XXX: spec requires care to be taken of this */
           dprintf((" + EXT: signature algorithms\n"));
           break;
+        case EXT_SUPPORTED_GROUPS:
+          dprintf((" + EXT: supported groups\n"));
+          for (i = 2; i + 1 < ext_len; i += 2) {
+            if (kr_load_be16(buf + i) == TLS_GROUP_X25519) have_x25519 = 1;
+          }
+          break;
         case EXT_NPN:
           dprintf((" + EXT: npn\n"));
           break;
@@ -6897,9 +9044,9 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
     dprintf((" + %s cipher_suite[%u]: 0x%.4x\n",
              (ssl->is_server) ? "server" : "client", i, suite));
     if (ssl->is_server) {
-      cipher_suite_negotiate(ssl, suite);
+      cipher_suite_negotiate(ssl, suite, have_x25519);
     } else {
-      if (check_cipher(suite)) {
+      if (check_cipher(ssl, suite)) {
         ssl->nxt->cipher_suite = suite;
         ssl->nxt->cipher_negotiated = 1;
       }
@@ -6925,13 +9072,28 @@ static int handle_hello(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
   }
   if (ssl->is_server) {
     memcpy(&ssl->nxt->cl_rnd, rand, sizeof(ssl->nxt->cl_rnd));
-    if (sess_id_len) {
-      dprintf(("Impossible session resume\n"));
-      goto bad_param;
+    if (!tls_sv_resume(ssl, sess_id, sess_id_len, ticket, ticket_len,
+                       cipher_suites, num_ciphers)) {
+      tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_INTERNAL_ERROR);
+      return 0;
     }
     ssl->state = STATE_CL_HELLO_RCVD;
   } else {
     memcpy(&ssl->nxt->sv_rnd, rand, sizeof(ssl->nxt->sv_rnd));
+    /* Server agrees to resume the session by echoing the id we offered. */
+    if (sess_id_len > 0 && sess_id_len == ssl->nxt->sess_id_len &&
+        !memcmp(sess_id, ssl->nxt->sess_id, sess_id_len)) {
+      if (ssl->nxt->cipher_suite != ssl->session->cipher_suite) {
+        dprintf(("cipher suite of resumed session changed\n"));
+        goto bad_param;
+      }
+      memcpy(ssl->nxt->master_secret, ssl->session->master_secret,
+             sizeof(ssl->nxt->master_secret));
+      ssl->resumed = 1;
+      dprintf(("resuming session\n"));
+    }
+    ssl->nxt->sess_id_len = sess_id_len;
+    memcpy(ssl->nxt->sess_id, sess_id, sess_id_len);
     ssl->state = STATE_SV_HELLO_RCVD;
   }
 
@@ -7081,7 +9243,7 @@ static int handle_key_exch(SSL *ssl, const struct tls_hdr *hdr,
     dprintf(("Bad pre-master secret\n"));
   }
 
-  tls_compute_master_secret(ssl->nxt, (struct tls_premaster_secret *) out);
+  tls_compute_master_secret(ssl->nxt, out, sizeof(struct tls_premaster_secret));
   free(out);
   dprintf((" + master secret computed\n"));
 
@@ -7092,6 +9254,89 @@ err:
   return 0;
 }
 
+/* Client's X25519 share, see tls_sv_key_exch() */
+static int handle_ecdh_key_exch(SSL *ssl, const uint8_t *buf,
+                                const uint8_t *end) {
+  tls_sec_t sec = ssl->nxt;
+  uint8_t shared[X25519_KEY_SIZE];
+  int ok;
+
+  if (buf + 4 + 1 + X25519_KEY_SIZE > end || buf[4] != X25519_KEY_SIZE) {
+    tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_DECODE_ERROR);
+    return 0;
+  }
+
+  ok = kr_x25519(shared, sec->ecdh_priv, buf + 5);
+  memset(sec->ecdh_priv, 0, sizeof(sec->ecdh_priv));
+  if (!ok) {
+    dprintf(("bad client ECDH share\n"));
+    tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_ILLEGAL_PARAMETER);
+    return 0;
+  }
+  tls_compute_master_secret(sec, shared, sizeof(shared));
+  memset(shared, 0, sizeof(shared));
+  dprintf((" + master secret computed\n"));
+
+  return 1;
+}
+
+/* Server's signed X25519 share, client side */
+static int handle_sv_key_exch(SSL *ssl, const uint8_t *buf,
+                              const uint8_t *end) {
+  tls_sec_t sec = ssl->nxt;
+  const uint8_t *params = buf;
+  uint8_t digest[TLS_SHA256_DIGEST_INFO_LEN + SHA256_SIZE], *dec = NULL;
+  int alert = ALERT_DECODE_ERROR;
+  size_t sig_len;
+
+  if (!kr_cs_is_ecdhe(sec->cipher_suite) || sec->svr_key == NULL) {
+    alert = ALERT_UNEXPECTED_MESSAGE;
+    goto err;
+  }
+
+  /* curve type, named curve and the share */
+  if (buf + 4 + X25519_KEY_SIZE + 4 > end) goto err;
+  if (buf[0] != TLS_CURVE_NAMED || kr_load_be16(buf + 1) != TLS_GROUP_X25519 ||
+      buf[3] != X25519_KEY_SIZE) {
+    alert = ALERT_ILLEGAL_PARAMETER;
+    goto err;
+  }
+  memcpy(sec->ecdh_peer, buf + 4, X25519_KEY_SIZE);
+  buf += 4 + X25519_KEY_SIZE;
+
+  /* signature, we only asked for RSA with SHA256 */
+  if (buf[0] != TLS_HASH_SHA256 || buf[1] != TLS_SIG_RSA) {
+    alert = ALERT_ILLEGAL_PARAMETER;
+    goto err;
+  }
+  sig_len = kr_load_be16(buf + 2);
+  buf += 4;
+  if (buf + sig_len > end || sig_len != (size_t) RSA_block_size(sec->svr_key)) {
+    goto err;
+  }
+  if ((dec = malloc(sig_len)) == NULL) {
+    alert = ALERT_INTERNAL_ERROR;
+    goto err;
+  }
+
+  tls_key_exch_digest(sec, params, 4 + X25519_KEY_SIZE, digest);
+  if (RSA_decrypt(sec->svr_key, buf, dec, sig_len, 0) != sizeof(digest) ||
+      memcmp(dec, digest, sizeof(digest)) != 0) {
+    dprintf(("bad server key exchange signature\n"));
+    alert = ALERT_DECRYPT_ERROR;
+    goto err;
+  }
+
+  free(dec);
+  sec->peer_key_rcvd = 1;
+  return 1;
+
+err:
+  free(dec);
+  tls_alert(ssl, ALERT_LEVEL_FATAL, alert);
+  return 0;
+}
+
 static int handle_finished(SSL *ssl, const struct tls_hdr *hdr,
                            const uint8_t *buf, const uint8_t *end) {
   uint32_t len;
@@ -7114,9 +9359,16 @@ static int handle_finished(SSL *ssl, const struct tls_hdr *hdr,
   if (ssl->is_server) {
     ret = tls_check_client_finished(ssl->cur, buf, len);
     ssl->state = STATE_CLIENT_FINISHED;
+    if (ret && !ssl->resumed) tls_sv_save_session(ssl);
   } else {
     ret = tls_check_server_finished(ssl->cur, buf, len);
-    ssl->state = STATE_ESTABLISHED;
+    if (ssl->resumed) {
+      /* Our turn to finish, see SSL_connect(). */
+      ssl->state = STATE_SV_FINISHED_RCVD;
+    } else {
+      ssl->state = STATE_ESTABLISHED;
+      if (ret) tls_cl_save_session(ssl);
+    }
   }
   if (!ret) {
     tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_DECRYPT_ERROR);
@@ -7129,6 +9381,31 @@ err:
   return 0;
 }
 
+static int handle_new_ticket(SSL *ssl, const uint8_t *buf,
+                             const uint8_t *end) {
+  uint16_t ticket_len;
+
+  /* lifetime hint, ticket length, ticket */
+  if (buf + 6 > end) goto err;
+  ticket_len = kr_load_be16(buf + 4);
+  buf += 6;
+  if (buf + ticket_len > end) goto err;
+
+  free(ssl->ticket);
+  ssl->ticket = NULL;
+  ssl->ticket_len = 0;
+  /* Empty ticket means server has changed its mind. */
+  if (ticket_len == 0 || ticket_len > KR_MAX_TICKET_LEN) return 1;
+  if ((ssl->ticket = malloc(ticket_len)) == NULL) return 1;
+  memcpy(ssl->ticket, buf, ticket_len);
+  ssl->ticket_len = ticket_len;
+  return 1;
+
+err:
+  tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_DECODE_ERROR);
+  return 0;
+}
+
 static int handle_sv_handshake(SSL *ssl, const struct tls_hdr *hdr,
                                const uint8_t *buf, const uint8_t *end) {
   uint8_t type;
@@ -7148,7 +9425,15 @@ static int handle_sv_handshake(SSL *ssl, const struct tls_hdr *hdr,
       break;
     case HANDSHAKE_CLIENT_KEY_EXCH:
       dprintf(("key exch\n"));
-      ret = handle_key_exch(ssl, hdr, buf, end);
+      if (ssl->nxt == NULL || ssl->resumed) {
+        tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_UNEXPECTED_MESSAGE);
+        return 0;
+      }
+      if (kr_cs_is_ecdhe(ssl->nxt->cipher_suite)) {
+        ret = handle_ecdh_key_exch(ssl, buf, end);
+      } else {
+        ret = handle_key_exch(ssl, hdr, buf, end);
+      }
       break;
     case HANDSHAKE_FINISHED:
       ret = handle_finished(ssl, hdr, buf, end);
@@ -7177,6 +9462,14 @@ static int handle_cl_handshake(SSL *ssl, const struct tls_hdr *hdr,
     len = kr_load_be32(buf) & 0xffffff;
     if (buf + len > end) return 0;
 
+    /* Abbreviated handshake: server hello, [new ticket], finished. */
+    if (ssl->resumed && type != HANDSHAKE_HELLO_REQ &&
+        type != HANDSHAKE_NEW_SESSION_TICKET && type != HANDSHAKE_FINISHED) {
+      dprintf(("unexpected type 0x%.2x in resumed handshake\n", type));
+      tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_UNEXPECTED_MESSAGE);
+      return 0;
+    }
+
     switch (type) {
       case HANDSHAKE_HELLO_REQ:
         dprintf(("hello req\n"));
@@ -7187,6 +9480,7 @@ static int handle_cl_handshake(SSL *ssl, const struct tls_hdr *hdr,
         break;
       case HANDSHAKE_NEW_SESSION_TICKET:
         dprintf(("new session ticket\n"));
+        ret = handle_new_ticket(ssl, buf + 4, buf + 4 + len);
         break;
       case HANDSHAKE_CERTIFICATE:
         dprintf(("certificate\n"));
@@ -7194,7 +9488,7 @@ static int handle_cl_handshake(SSL *ssl, const struct tls_hdr *hdr,
         break;
       case HANDSHAKE_SERVER_KEY_EXCH:
         dprintf(("server key exch\n"));
-        ret = handle_key_exch(ssl, hdr, buf, end);
+        ret = handle_sv_key_exch(ssl, buf + 4, buf + 4 + len);
         break;
       case HANDSHAKE_CERTIFICATE_REQ:
         dprintf(("cert req\n"));
@@ -7241,15 +9535,20 @@ static int handle_change_cipher(SSL *ssl, const struct tls_hdr *hdr,
   (void) hdr;
   (void) end;
   (void) buf;
-  if (ssl->is_server) {
-    tls_generate_keys(ssl->nxt, ssl->is_server);
-    if (ssl->nxt) {
-      if (ssl->cur) {
-        free(ssl->cur);
-      }
-      ssl->cur = ssl->nxt;
-      ssl->nxt = NULL;
+  /*
+   * Peer switches to the new keys first: client in a full handshake, server
+   * when resuming a session.
+   */
+  if (ssl->nxt != NULL) {
+    if (!ssl->is_server && !ssl->resumed) {
+      dprintf(("premature change cipher spec\n"));
+      tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_UNEXPECTED_MESSAGE);
+      return 0;
     }
+    tls_generate_keys(ssl->nxt, ssl->is_server);
+    tls_free_security(ssl->cur);
+    ssl->cur = ssl->nxt;
+    ssl->nxt = NULL;
   }
   ssl->rx_enc = 1;
   return 1;
@@ -7324,8 +9623,55 @@ static int handle_alert(SSL *ssl, const struct tls_hdr *hdr, const uint8_t *buf,
   return 1;
 }
 
+/* Opens an AEAD record, see tls_send_aead() */
+static int decrypt_aead(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
+                        uint8_t *dst, struct vec *out) {
+  struct tls_hmac_hdr phdr;
+  uint8_t nonce[GCM_SALT_SIZE + GCM_NONCE_SIZE];
+  uint64_t *seq = ssl->is_server ? &ssl->cur->client_write_seq
+                                 : &ssl->cur->server_write_seq;
+  void *cctx =
+      ssl->is_server ? ssl->cur->client_write_ctx : ssl->cur->server_write_ctx;
+  int len = be16toh(hdr->len) - GCM_NONCE_SIZE - GCM_TAG_SIZE;
+  int ok;
+
+  if (len < 0) {
+    dprintf(("No room for nonce/tag\n"));
+    tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_DECRYPT_ERROR);
+    return 0;
+  }
+
+  memcpy(nonce, tls_write_iv(ssl->cur, !ssl->is_server), GCM_SALT_SIZE);
+  memcpy(nonce + GCM_SALT_SIZE, buf, GCM_NONCE_SIZE);
+
+  phdr.seq = htobe64(*seq);
+  phdr.type = hdr->type;
+  phdr.vers = hdr->vers;
+  phdr.len = htobe16(len);
+
+  buf += GCM_NONCE_SIZE;
+  out->ptr = dst != NULL ? dst : buf;
+  out->len = len;
+  ok = kr_gcm_decrypt(cctx, nonce, (uint8_t *) &phdr, sizeof(phdr), buf, len,
+                      out->ptr, buf + len);
+  (*seq)++;
+
+  if (!ok) {
+    dprintf(("Bad tag %d\n", len));
+    tls_alert(ssl, ALERT_LEVEL_FATAL, ALERT_BAD_RECORD_MAC);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Decrypts the record body at buf to dst, or in place if dst is NULL. Data
+ * only ever moves towards the start of the record, dst can be its header.
+ */
 static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
-                            const uint8_t *end, struct vec *out) {
+                            const uint8_t *end, uint8_t *dst,
+                            struct vec *out) {
   struct tls_hmac_hdr phdr;
   uint8_t digest[MAX_DIGEST_SIZE];
   const uint8_t *msgs[2];
@@ -7333,7 +9679,7 @@ static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
   const uint8_t *mac;
   const int mac_len = kr_hmac_len(ssl->cur->cipher_suite);
   const kr_cipher_info *ci = kr_cipher_get_info(ssl->cur->cipher_suite);
-  /* Only CBC mode for block ciphers for now, so block cipher -> CBC. */
+  /* AEAD suites aside, block cipher -> CBC. */
   const int is_cbc = (ci->block_len > 1);
   void *cctx =
       ssl->is_server ? ssl->cur->client_write_ctx : ssl->cur->server_write_ctx;
@@ -7346,6 +9692,10 @@ static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
     return 1;
   }
 
+  if (kr_cs_is_aead(ssl->cur->cipher_suite)) {
+    return decrypt_aead(ssl, hdr, buf, dst, out);
+  }
+
   if (len > end - buf ||
       (ci->block_len > 0 && (end - buf) % ci->block_len != 0)) {
     dprintf(("Bad record length (%d)\n", (int) (end - buf)));
@@ -7363,12 +9713,16 @@ static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
     uint8_t *iv = buf;
     buf += ci->iv_len;
     len -= ci->iv_len;
-    kr_cbc_decrypt(ci, cctx, buf, len, iv, buf);
+    if (dst == NULL) dst = buf;
+    kr_cbc_decrypt(ci, cctx, buf, len, iv, dst);
   } else {
+    /* RC4 only works in place */
     ci->decrypt(cctx, buf, len, buf);
+    if (dst == NULL) dst = buf;
+    memmove(dst, buf, len);
   }
 
-  out->ptr = buf;
+  out->ptr = dst;
   out->len = len;
 
   if (is_cbc) {
@@ -7377,7 +9731,7 @@ static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
     if (pad_len < ci->block_len && pad_len < out->len) {
       pad_ok = 1;
       for (i = 1; i <= pad_len; i++) {
-        if (buf[len - i] != pad_len) pad_ok = 0;
+        if (out->ptr[len - i] != pad_len) pad_ok = 0;
       }
     }
     if (!pad_ok) {
@@ -7429,6 +9783,14 @@ static int decrypt_and_vrfy(SSL *ssl, const struct tls_hdr *hdr, uint8_t *buf,
   return 1;
 }
 
+/* Checks known SSL/TLS versions */
+static int known_vers(const struct tls_hdr *hdr) {
+  return hdr->vers == htobe16(TLS_1_2_PROTO) ||
+         hdr->vers == htobe16(TLS_1_1_PROTO) ||
+         hdr->vers == htobe16(TLS_1_0_PROTO) ||
+         hdr->vers == htobe16(SSL_3_0_PROTO);
+}
+
 int tls_handle_recv(SSL *ssl, uint8_t *out, size_t out_len) {
   const struct tls_hdr *hdr;
   uint8_t *buf = ssl->rx_buf, *end = buf + ssl->rx_len;
@@ -7452,11 +9814,7 @@ int tls_handle_recv(SSL *ssl, uint8_t *out, size_t out_len) {
     hdr = (struct tls_hdr *) buf;
     msg = buf + sizeof(*hdr);
 
-    /* check known ssl/tls versions */
-    if (hdr->vers != htobe16(TLS_1_2_PROTO) &&
-        hdr->vers != htobe16(TLS_1_1_PROTO) &&
-        hdr->vers != htobe16(TLS_1_0_PROTO) &&
-        hdr->vers != htobe16(SSL_3_0_PROTO)) {
+    if (!known_vers(hdr)) {
       dprintf(("bad framing version: 0x%.4x\n", be16toh(hdr->vers)));
       ssl->rx_len = 0;
       return 0;
@@ -7475,7 +9833,7 @@ int tls_handle_recv(SSL *ssl, uint8_t *out, size_t out_len) {
     }
 
     if (ssl->cur) {
-      if (!decrypt_and_vrfy(ssl, hdr, msg, msg_end, &v)) {
+      if (!decrypt_and_vrfy(ssl, hdr, msg, msg_end, NULL, &v)) {
         goto out;
       }
     } else {
@@ -7531,6 +9889,54 @@ out:
 
   return ret;
 }
+
+/*
+ * Handles the whole record at buf for SSL_kr_read_in_place(). Application
+ * data is decrypted to the start of buf and its length is returned, other
+ * records give 0. Returns -1 on error.
+ */
+NS_INTERNAL int tls_handle_record(SSL *ssl, uint8_t *buf, size_t len) {
+  struct tls_hdr hdr;
+  struct vec v = {NULL, 0};
+  int iret;
+
+  /* The header is overwritten by the data */
+  memcpy(&hdr, buf, sizeof(hdr));
+  if (!known_vers(&hdr)) {
+    dprintf(("bad framing version: 0x%.4x\n", be16toh(hdr.vers)));
+    return -1;
+  }
+
+  if (ssl->cur) {
+    if (!decrypt_and_vrfy(ssl, &hdr, buf + sizeof(hdr), buf + len, buf, &v)) {
+      return -1;
+    }
+  } else {
+    v.ptr = buf + sizeof(hdr);
+    v.len = len - sizeof(hdr);
+  }
+
+  switch (hdr.type) {
+    case TLS_HANDSHAKE:
+      iret = handle_handshake(ssl, &hdr, v.ptr, v.ptr + v.len);
+      break;
+    case TLS_CHANGE_CIPHER_SPEC:
+      iret = handle_change_cipher(ssl, &hdr, v.ptr, v.ptr + v.len);
+      break;
+    case TLS_ALERT:
+      iret = handle_alert(ssl, &hdr, v.ptr, v.len);
+      break;
+    case TLS_APP_DATA:
+      memmove(buf, v.ptr, v.len);
+      return v.len;
+    default:
+      dprintf(("unknown header type 0x%.2x\n", hdr.type));
+      iret = 0;
+      break;
+  }
+
+  return iret ? 0 : -1;
+}
 #ifdef KR_MODULE_LINES
 #line 1 "src/src/tls_sv.c"
 #endif
@@ -7547,53 +9953,230 @@ out:
 
 #include <time.h>
 
+NS_INTERNAL int tls_sv_resume(SSL *ssl, const uint8_t *sess_id,
+                              size_t sess_id_len, const uint8_t *ticket,
+                              int ticket_len, const uint16_t *cipher_suites,
+                              unsigned int num_ciphers) {
+  SSL_CTX *ctx = ssl->ctx;
+  SSL_SESSION tmp, *sess = NULL;
+  unsigned int i;
+
+  if (ticket_len >= 0 && !(ctx->options & SSL_OP_NO_TICKET)) {
+    /* Without a session id to echo we cannot tell client we accept it */
+    if (ticket_len > 0 && sess_id_len > 0 &&
+        kr_ticket_open(ctx, ticket, ticket_len, &tmp)) {
+      sess = &tmp;
+    } else {
+      ssl->issue_ticket = 1;
+    }
+  }
+  if (sess == NULL && sess_id_len > 0 &&
+      (ctx->sess_cache_mode & SSL_SESS_CACHE_SERVER)) {
+    sess = kr_session_cache_find(ctx, sess_id, sess_id_len, NULL);
+  }
+
+  /* Client must still be willing to use the cipher suite of the session */
+  for (i = 0; sess != NULL && i < num_ciphers; i++) {
+    if (be16toh(cipher_suites[i]) == sess->cipher_suite) break;
+  }
+  if (sess != NULL && i < num_ciphers) {
+    dprintf(("resuming session\n"));
+    ssl->resumed = 1;
+    ssl->issue_ticket = 0;
+    ssl->nxt->cipher_suite = sess->cipher_suite;
+    memcpy(ssl->nxt->master_secret, sess->master_secret,
+           sizeof(ssl->nxt->master_secret));
+    ssl->nxt->sess_id_len = sess_id_len;
+    memcpy(ssl->nxt->sess_id, sess_id, sess_id_len);
+  } else if (ssl->issue_ticket ||
+             (ctx->sess_cache_mode & SSL_SESS_CACHE_SERVER)) {
+    ssl->nxt->sess_id_len = sizeof(ssl->nxt->sess_id);
+    if (!kr_get_random(ssl->nxt->sess_id, ssl->nxt->sess_id_len)) return 0;
+  }
+  memset(&tmp, 0, sizeof(tmp));
+
+  return 1;
+}
+
+/*
+ * Sessions that a ticket was issued for are not cached, client will present
+ * the ticket. Connection does not keep a reference to the session, so that
+ * it can be handed over to another thread after the handshake.
+ */
+NS_INTERNAL void tls_sv_save_session(SSL *ssl) {
+  SSL_SESSION *sess;
+
+  if (ssl->issue_ticket || ssl->cur->sess_id_len == 0 ||
+      !(ssl->ctx->sess_cache_mode & SSL_SESS_CACHE_SERVER)) {
+    return;
+  }
+  if ((sess = kr_session_new(ssl->cur)) == NULL) return;
+  kr_session_cache_add(ssl->ctx, sess, 1);
+  SSL_SESSION_free(sess);
+}
+
+/*
+ * ECDHE: our X25519 share, signed along with both randoms with the RSA key
+ * of the certificate (RFC 4492 section 5.4).
+ */
+static int tls_sv_key_exch(SSL *ssl) {
+  tls_sec_t sec = ssl->nxt;
+  RSA_CTX *key = ssl->ctx->rsa_privkey;
+  uint8_t digest[TLS_SHA256_DIGEST_INFO_LEN + SHA256_SIZE];
+  uint8_t *buf, *params, *p;
+  size_t sig_len, len;
+  int ret;
+
+  if (key == NULL) return 0;
+  sig_len = RSA_block_size(key);
+  len = 4 + 4 + X25519_KEY_SIZE + 4 + sig_len;
+  if (!kr_get_random(sec->ecdh_priv, sizeof(sec->ecdh_priv)) ||
+      (buf = malloc(len)) == NULL) {
+    return 0;
+  }
+
+  buf[0] = HANDSHAKE_SERVER_KEY_EXCH;
+  buf[1] = 0;
+  buf[2] = (len - 4) >> 8;
+  buf[3] = (len - 4) & 0xff;
+
+  params = p = buf + 4;
+  *p++ = TLS_CURVE_NAMED;
+  *p++ = TLS_GROUP_X25519 >> 8;
+  *p++ = TLS_GROUP_X25519 & 0xff;
+  *p++ = X25519_KEY_SIZE;
+  kr_x25519_base(p, sec->ecdh_priv);
+  p += X25519_KEY_SIZE;
+
+  *p++ = TLS_HASH_SHA256;
+  *p++ = TLS_SIG_RSA;
+  *p++ = sig_len >> 8;
+  *p++ = sig_len & 0xff;
+  tls_key_exch_digest(sec, params, p - 4 - params, digest);
+  if (RSA_encrypt(key, digest, sizeof(digest), p, 1 /* is_signing */) !=
+      (int) sig_len) {
+    dprintf(("RSA sign failed\n"));
+    free(buf);
+    return 0;
+  }
+
+  ret = tls_send(ssl, TLS_HANDSHAKE, buf, len);
+  free(buf);
+  return ret;
+}
+
 NS_INTERNAL int tls_sv_hello(SSL *ssl) {
   struct tls_svr_hello hello;
   struct tls_svr_hello_done done;
+  const size_t id_offset = offsetof(struct tls_svr_hello, cipher_suite);
+  const int is_ecdhe = kr_cs_is_ecdhe(ssl->nxt->cipher_suite);
+  uint8_t buf[sizeof(hello) + 32 + 4 + 6], *p = buf;
+  size_t len = sizeof(hello) + ssl->nxt->sess_id_len +
+               (ssl->issue_ticket ? 4 : 0) + (is_ecdhe ? 6 : 0);
 
   /* hello */
   hello.type = HANDSHAKE_SERVER_HELLO;
   hello.len_hi = 0;
-  hello.len = htobe16(sizeof(hello) - 4);
+  hello.len = htobe16(len - 4);
   hello.version = htobe16(TLS_1_2_PROTO);
   hello.random.time = htobe32(time(NULL));
   if (!kr_get_random(hello.random.opaque, sizeof(hello.random.opaque))) {
     return 0;
   }
-  hello.sess_id_len = 0;
+  hello.sess_id_len = ssl->nxt->sess_id_len;
   hello.cipher_suite = htobe16(ssl->nxt->cipher_suite);
   hello.compressor = ssl->nxt->compressor;
-  hello.ext_len = htobe16(sizeof(hello.ext_reneg));
+  hello.ext_len = htobe16(sizeof(hello.ext_reneg) +
+                          (ssl->issue_ticket ? 4 : 0) + (is_ecdhe ? 6 : 0));
 
   hello.ext_reneg.type = htobe16(EXT_RENEG_INFO);
   hello.ext_reneg.len = htobe16(1);
   hello.ext_reneg.ri_len = 0;
 
-  if (!tls_send(ssl, TLS_HANDSHAKE, &hello, sizeof(hello))) return 0;
+  /* session id goes in the middle, ticket extension at the end */
+  memcpy(p, &hello, id_offset);
+  p += id_offset;
+  memcpy(p, ssl->nxt->sess_id, ssl->nxt->sess_id_len);
+  p += ssl->nxt->sess_id_len;
+  memcpy(p, (uint8_t *) &hello + id_offset, sizeof(hello) - id_offset);
+  p += sizeof(hello) - id_offset;
+  if (ssl->issue_ticket) {
+    *p++ = EXT_SESSION_TICKET >> 8;
+    *p++ = EXT_SESSION_TICKET & 0xff;
+    *p++ = 0;
+    *p++ = 0;
+  }
+  if (is_ecdhe) {
+    *p++ = EXT_EC_POINT_FORMATS >> 8;
+    *p++ = EXT_EC_POINT_FORMATS & 0xff;
+    *p++ = 0;
+    *p++ = 2;
+    *p++ = 1;
+    *p++ = TLS_POINT_UNCOMPRESSED;
+  }
+
+  if (!tls_send(ssl, TLS_HANDSHAKE, buf, len)) return 0;
+
+  /* store the random we generated */
+  memcpy(&ssl->nxt->sv_rnd, &hello.random, sizeof(ssl->nxt->sv_rnd));
+
+  /* Resumed session skips the key exchange */
+  if (ssl->resumed) return 1;
 
   /* certificate(s) */
   if (!tls_send_certs(ssl, ssl->ctx->pem_cert)) return 0;
 
+  if (is_ecdhe && !tls_sv_key_exch(ssl)) return 0;
+
   /* hello done */
   done.type = HANDSHAKE_SERVER_HELLO_DONE;
   done.len_hi = 0;
   done.len = 0;
   if (!tls_send(ssl, TLS_HANDSHAKE, &done, sizeof(done))) return 0;
 
-  /* store the random we generated */
-  memcpy(&ssl->nxt->sv_rnd, &hello.random, sizeof(ssl->nxt->sv_rnd));
-
   return 1;
 }
 
+static int tls_sv_new_ticket(SSL *ssl) {
+  uint8_t buf[4 + 4 + 2 + KR_TICKET_LEN];
+  SSL_SESSION *sess;
+  int ret;
+
+  if ((sess = kr_session_new(ssl->cur)) == NULL) return 0;
+  ret = kr_ticket_seal(ssl->ctx, sess, buf + 10);
+  SSL_SESSION_free(sess);
+  if (!ret) return 0;
+
+  buf[0] = HANDSHAKE_NEW_SESSION_TICKET;
+  buf[1] = 0;
+  buf[2] = 0;
+  buf[3] = sizeof(buf) - 4;
+  buf[4] = (KR_SESSION_TIMEOUT >> 24) & 0xff;
+  buf[5] = (KR_SESSION_TIMEOUT >> 16) & 0xff;
+  buf[6] = (KR_SESSION_TIMEOUT >> 8) & 0xff;
+  buf[7] = KR_SESSION_TIMEOUT & 0xff;
+  buf[8] = 0;
+  buf[9] = KR_TICKET_LEN;
+  return tls_send(ssl, TLS_HANDSHAKE, buf, sizeof(buf));
+}
+
 NS_INTERNAL int tls_sv_finish(SSL *ssl) {
   struct tls_change_cipher_spec cipher;
   struct tls_finished finished;
 
+  if (ssl->issue_ticket && !tls_sv_new_ticket(ssl)) return 0;
+
   /* change cipher spec */
   cipher.one = 1;
   if (!tls_send(ssl, TLS_CHANGE_CIPHER_SPEC, &cipher, sizeof(cipher))) return 0;
 
+  /* When resuming, we switch to the new keys before the client. */
+  if (ssl->nxt != NULL) {
+    tls_generate_keys(ssl->nxt, ssl->is_server);
+    tls_free_security(ssl->cur);
+    ssl->cur = ssl->nxt;
+    ssl->nxt = NULL;
+  }
   ssl->tx_enc = 1;
 
   /* finished */
@@ -8268,7 +10851,9 @@ static enum pem_filter_result pem_issuer_filter(const DER *obj, int type,
 }
 
 static X509 *find_anchor(SSL_CTX *ctx, X509 *chain) {
-  PEM *p = pem_load(ctx->ca_file, pem_issuer_filter, &chain->issuer);
+  PEM *p;
+  if (ctx->ca_file == NULL) return NULL;
+  p = pem_load(ctx->ca_file, pem_issuer_filter, &chain->issuer);
   if (p != NULL && p->num_obj == 1) {
     X509 *new = X509_new(p->obj->der, p->obj->der_len);
     if (new != NULL && x509_issued_by(&new->subject, &chain->issuer)) {
@@ -8284,9 +10869,15 @@ static X509 *find_anchor(SSL_CTX *ctx, X509 *chain) {
 
 int X509_verify(SSL_CTX *ctx, X509 *chain) {
   int res;
-  X509 *anchor;
+  X509 *anchor, *own;
 
-  anchor = find_anchor(ctx, chain);
+  anchor = own = kr_ca_index_find(ctx->ca_index, &chain->issuer);
+  if (NULL == anchor) {
+    anchor = find_anchor(ctx, chain);
+#ifdef KR_NO_LOAD_CA_STORE
+    own = anchor;
+#endif
+  }
   if (NULL == anchor) {
     dprintf(("vrfy: Cannot find trust anchor\n"));
     return 0;
@@ -8298,8 +10889,6 @@ int X509_verify(SSL_CTX *ctx, X509 *chain) {
 #endif
 
   res = do_verify(anchor, chain);
-#ifdef KR_NO_LOAD_CA_STORE
-  X509_free(anchor);
-#endif
+  X509_free(own);
   return res;
 }
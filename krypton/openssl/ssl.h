@@ -23,10 +23,43 @@ int SSL_get_fd(SSL *ssl);
 int SSL_accept(SSL *ssl);
 int SSL_connect(SSL *ssl);
 int SSL_read(SSL *ssl, void *buf, int num);
+int SSL_pending(const SSL *ssl);
 int SSL_write(SSL *ssl, const void *buf, int num);
 int SSL_shutdown(SSL *ssl);
 void SSL_free(SSL *ssl);
 
+/*
+ * Session resumption. A server keeps sessions in its SSL_CTX, up to
+ * KR_SESSION_CACHE_SIZE of them, and hands out RFC 5077 session tickets to
+ * clients that ask for them, unless SSL_OP_NO_TICKET is set. A client offers
+ * the session given to SSL_set_session() or, with SSL_SESS_CACHE_CLIENT, the
+ * last session made by its SSL_CTX with the same verify name.
+ */
+typedef struct ssl_session_st SSL_SESSION;
+SSL_SESSION *SSL_get1_session(SSL *ssl);
+int SSL_set_session(SSL *ssl, SSL_SESSION *session);
+int SSL_session_reused(SSL *ssl);
+void SSL_SESSION_free(SSL_SESSION *session);
+
+/*
+ * Krypton-specific, for established connections: record I/O without copies.
+ *
+ * SSL_kr_write_in_place() is SSL_write() that encrypts the data where it is,
+ * buf holds ciphertext afterwards. Record headers and MACs are kept in the
+ * SSL and go out around it in one gather write, several records at a time.
+ * Returns how many bytes at the start of buf are on the wire and can be
+ * dropped. The rest of the records sealed so far must be passed again, at
+ * the start of buf, which may move in between.
+ *
+ * SSL_kr_read_in_place() reads one record into buf, which must have room for
+ * SSL_KR_MAX_RECORD bytes, and decrypts it in place. *len is the number of
+ * bytes of the record read so far, kept by the caller along with buf across
+ * WANT_READ. Returns the number of bytes of data, which start at buf.
+ */
+#define SSL_KR_MAX_RECORD (5 + (1 << 14) + 2048)
+int SSL_kr_write_in_place(SSL *ssl, void *buf, int num);
+int SSL_kr_read_in_place(SSL *ssl, void *buf, int *len);
+
 #define SSL_ERROR_NONE 0
 #define SSL_ERROR_SSL 1
 #define SSL_ERROR_WANT_READ 2
@@ -50,6 +83,29 @@ SSL_CTX *SSL_CTX_new(const SSL_METHOD *meth);
 #define SSL_CTX_set_mode(ctx, op) SSL_CTX_ctrl((ctx), 33, (op), NULL)
 long SSL_CTX_ctrl(SSL_CTX *, int, long, void *);
 
+#define SSL_OP_NO_TICKET 0x00004000L
+#define SSL_CTX_set_options(ctx, op) SSL_CTX_ctrl((ctx), 32, (op), NULL)
+
+#define SSL_SESS_CACHE_OFF 0x0000
+#define SSL_SESS_CACHE_CLIENT 0x0001
+#define SSL_SESS_CACHE_SERVER 0x0002
+#define SSL_SESS_CACHE_BOTH (SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_SERVER)
+#define SSL_CTX_set_session_cache_mode(ctx, m) \
+  SSL_CTX_ctrl((ctx), 44, (m), NULL)
+
+/*
+ * Ticket keys are 48 bytes: key name, HMAC key and AES key, 16 bytes each.
+ * Random keys are made on first use; servers sharing tickets must set them.
+ */
+#define SSL_CTX_set_tlsext_ticket_keys(ctx, keys, keylen) \
+  SSL_CTX_ctrl((ctx), 59, (keylen), (keys))
+
+/*
+ * Takes OpenSSL cipher names separated by colons, in order of preference.
+ * Names of suites Krypton does not implement are skipped, as are exclusions.
+ * Supported: ECDHE-RSA-AES128-GCM-SHA256, AES128-GCM-SHA256, AES128-SHA256,
+ * AES128-SHA, RC4-SHA, RC4-MD5.
+ */
 int SSL_CTX_set_cipher_list(SSL_CTX *ctx, const char *str);
 
 /* for the client */
@@ -59,6 +115,11 @@ int SSL_CTX_set_cipher_list(SSL_CTX *ctx, const char *str);
 #define SSL_VERIFY_CLIENT_ONCE 0x04
 void SSL_CTX_set_verify(SSL_CTX *ctx, int mode,
                         int (*verify_callback)(int, X509_STORE_CTX *));
+/*
+ * CAfile is a PEM bundle, or an index built from one by tools/mkcaindex.
+ * Issuers are looked up in the index by subject hash, without parsing the
+ * whole bundle on every handshake.
+ */
 int SSL_CTX_load_verify_locations(SSL_CTX *ctx, const char *CAfile,
                                   const char *CAPath);
 
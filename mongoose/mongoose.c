@@ -58,6 +58,38 @@
 
 #define MG_CTL_MSG_MESSAGE_SIZE 8192
 
+/*
+ * Element of mg_connection::send_queue. Data that is sent without copying it
+ * into send_mbuf is queued, and so is whatever was in send_mbuf at the time,
+ * to keep the order. Writes always start at the head of the queue.
+ */
+struct mg_send_seg {
+  struct mg_send_seg *next;
+  enum { MG_SEG_OWNED, MG_SEG_BORROWED, MG_SEG_FILE } type;
+  char *mem;   /* OWNED: mbuf memory to free. BORROWED: buffer to release. */
+  char *buf;   /* OWNED, BORROWED: data that is not sent yet */
+  size_t len;  /* Number of bytes not sent yet */
+#ifndef MG_DISABLE_FILESYSTEM
+  FILE *fp;    /* FILE: file to send */
+  int64_t off; /* FILE: offset of data that is not sent yet */
+  int close_fp;
+#endif
+  mg_send_free_cb_t free_cb;
+  void *cb_data;
+};
+
+MG_INTERNAL void mg_send_seg_free(struct mg_send_seg *seg);
+
+/*
+ * With the epoll backend, puts the connection on the list of those whose
+ * events, timer and close flags mg_mgr_poll() has to look at again.
+ */
+#if !defined(MG_DISABLE_SOCKET_IF) && defined(MG_ENABLE_EPOLL)
+MG_INTERNAL void mg_epoll_changed(struct mg_connection *nc);
+#else
+#define mg_epoll_changed(nc)
+#endif
+
 /* internals that need to be accessible in unit tests */
 MG_INTERNAL struct mg_connection *mg_do_connect(struct mg_connection *nc,
                                                 int proto,
@@ -67,9 +99,24 @@ MG_INTERNAL int mg_parse_address(const char *str, union socket_address *sa,
                                  int *proto, char *host, size_t host_len);
 MG_INTERNAL void mg_call(struct mg_connection *nc,
                          mg_event_handler_t ev_handler, int ev, void *ev_data);
+#ifndef MG_DISABLE_RESOLVER
+MG_INTERNAL int mg_resolve_from_hosts(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *usa);
+MG_INTERNAL int mg_resolve_from_cache(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *usa);
+MG_INTERNAL void mg_resolve_cache_free(struct mg_mgr *mgr);
+#endif
+#ifdef MG_ENABLE_SSL
+MG_INTERNAL void mg_ssl_session_reuse(struct mg_connection *nc,
+                                      const char *address, const char *cert,
+                                      const char *ca_cert,
+                                      const char *server_name);
+MG_INTERNAL void mg_ssl_sessions_free(struct mg_mgr *mgr);
+#endif
 void mg_forward(struct mg_connection *from, struct mg_connection *to);
 MG_INTERNAL void mg_add_conn(struct mg_mgr *mgr, struct mg_connection *c);
 MG_INTERNAL void mg_remove_conn(struct mg_connection *c);
+void mg_ev_mgr_remove_conn(struct mg_connection *nc);
 MG_INTERNAL struct mg_connection *mg_create_connection(
     struct mg_mgr *mgr, mg_event_handler_t callback,
     struct mg_add_sock_opts opts);
@@ -112,6 +159,8 @@ struct ctl_msg {
 #ifndef MG_DISABLE_MQTT
 struct mg_mqtt_message;
 MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm);
+MG_INTERNAL size_t mg_mqtt_encode_header(uint8_t *buf, uint8_t cmd,
+                                         uint8_t flags, size_t len);
 #endif
 
 /* Forward declarations for testing. */
@@ -2082,6 +2131,7 @@ MG_INTERNAL void mg_remove_conn(struct mg_connection *conn) {
   if (conn->prev == NULL) conn->mgr->active_connections = conn->next;
   if (conn->prev) conn->prev->next = conn->next;
   if (conn->next) conn->next->prev = conn->prev;
+  conn->next = conn->prev = NULL;
   mg_ev_mgr_remove_conn(conn);
 }
 
@@ -2158,9 +2208,18 @@ static void mg_destroy_conn(struct mg_connection *conn) {
 #ifdef MG_ENABLE_SSL
   if (conn->ssl != NULL) SSL_free(conn->ssl);
   if (conn->ssl_ctx != NULL) SSL_CTX_free(conn->ssl_ctx);
+  MG_FREE(conn->ssl_session_key);
+#ifdef SSL_KRYPTON
+  MG_FREE(conn->ssl_rx_buf);
+#endif
 #endif
   mbuf_free(&conn->recv_mbuf);
   mbuf_free(&conn->send_mbuf);
+  while (conn->send_queue != NULL) {
+    struct mg_send_seg *seg = conn->send_queue;
+    conn->send_queue = seg->next;
+    mg_send_seg_free(seg);
+  }
 
   memset(conn, 0, sizeof(*conn));
   MG_FREE(conn);
@@ -2251,6 +2310,19 @@ void mg_mgr_free(struct mg_mgr *m) {
     mg_close_conn(conn);
   }
 
+#ifndef MG_DISABLE_RESOLVER
+  mg_resolve_cache_free(m);
+#endif
+#ifdef MG_ENABLE_SSL
+  mg_ssl_sessions_free(m);
+#endif
+
+  MG_FREE(m->timers);
+  MG_FREE(m->timer_heap);
+  m->timers = NULL;
+  m->timer_heap = NULL;
+  m->num_timer_slots = m->num_timers = m->free_timer_slot = 0;
+
   mg_ev_mgr_free(m);
 }
 
@@ -2407,10 +2479,9 @@ MG_INTERNAL int mg_parse_address(const char *str, union socket_address *sa,
 #ifndef MG_DISABLE_RESOLVER
   } else if (strlen(str) < host_len &&
              sscanf(str, "%[^ :]:%u%n", host, &port, &len) == 2) {
+    /* Host name, see mg_resolve_from_hosts() and mg_resolve_from_cache() */
     sa->sin.sin_port = htons((uint16_t) port);
-    if (mg_resolve_from_hosts_file(host, sa) != 0) {
-      return 0;
-    }
+    return 0;
 #endif
   } else if (sscanf(str, ":%u%n", &port, &len) == 1 ||
              sscanf(str, "%u%n", &port, &len) == 1) {
@@ -2600,6 +2671,113 @@ const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
 #endif
   return result;
 }
+
+/*
+ * Client sessions are kept in the event manager, most recently used first,
+ * keyed by the address and the SSL settings they were negotiated with.
+ */
+struct mg_ssl_session {
+  struct mg_ssl_session *next;
+  char *key;
+  SSL_SESSION *sess;
+};
+
+static struct mg_ssl_session **mg_ssl_session_find(struct mg_mgr *mgr,
+                                                   const char *key) {
+  struct mg_ssl_session **p;
+  for (p = &mgr->ssl_sessions; *p != NULL; p = &(*p)->next) {
+    if (strcmp((*p)->key, key) == 0) break;
+  }
+  return p;
+}
+
+static void mg_ssl_session_free(struct mg_ssl_session *s) {
+  SSL_SESSION_free(s->sess);
+  MG_FREE(s->key);
+  MG_FREE(s);
+}
+
+/*
+ * Offer the session remembered for these settings, if any, on the
+ * not yet connected `nc`. The outcome of the handshake is recorded by
+ * mg_ssl_session_update().
+ */
+MG_INTERNAL void mg_ssl_session_reuse(struct mg_connection *nc,
+                                      const char *address, const char *cert,
+                                      const char *ca_cert,
+                                      const char *server_name) {
+  struct mg_ssl_session *s;
+  size_t len;
+
+  if (nc->ssl == NULL) return;
+  if (cert == NULL) cert = "";
+  if (ca_cert == NULL) ca_cert = "";
+  if (server_name == NULL) server_name = "";
+  len = strlen(address) + strlen(cert) + strlen(ca_cert) + strlen(server_name) +
+        4;
+  MG_FREE(nc->ssl_session_key);
+  if ((nc->ssl_session_key = (char *) MG_MALLOC(len)) == NULL) return;
+  snprintf(nc->ssl_session_key, len, "%s|%s|%s|%s", address, cert, ca_cert,
+           server_name);
+
+  if ((s = *mg_ssl_session_find(nc->mgr, nc->ssl_session_key)) != NULL) {
+    SSL_set_session(nc->ssl, s->sess);
+  }
+}
+
+/*
+ * Remember the session of a completed client handshake, or forget the
+ * session that was offered if the connection failed.
+ */
+static void mg_ssl_session_update(struct mg_connection *nc, int err) {
+  struct mg_mgr *mgr = nc->mgr;
+  struct mg_ssl_session **p, *s;
+  SSL_SESSION *sess;
+  int n;
+
+  if (nc->ssl_session_key == NULL) return;
+  p = mg_ssl_session_find(mgr, nc->ssl_session_key);
+  if ((s = *p) != NULL) *p = s->next;
+
+  if (err == 0 && (sess = SSL_get1_session(nc->ssl)) != NULL) {
+    if (s != NULL) {
+      SSL_SESSION_free(s->sess);
+    } else if ((s = (struct mg_ssl_session *) MG_CALLOC(1, sizeof(*s))) !=
+               NULL) {
+      s->key = nc->ssl_session_key;
+      nc->ssl_session_key = NULL;
+    } else {
+      SSL_SESSION_free(sess);
+    }
+    if (s != NULL) {
+      s->sess = sess;
+      s->next = mgr->ssl_sessions;
+      mgr->ssl_sessions = s;
+      /* Evict the least recently used sessions */
+      for (n = 1, p = &s->next; *p != NULL && n < MG_SSL_SESSION_CACHE_SIZE;
+           n++) {
+        p = &(*p)->next;
+      }
+      while ((s = *p) != NULL) {
+        *p = s->next;
+        mg_ssl_session_free(s);
+      }
+    }
+  } else if (s != NULL) {
+    mg_ssl_session_free(s);
+  }
+
+  MG_FREE(nc->ssl_session_key);
+  nc->ssl_session_key = NULL;
+}
+
+MG_INTERNAL void mg_ssl_sessions_free(struct mg_mgr *mgr) {
+  struct mg_ssl_session *s;
+  while ((s = mgr->ssl_sessions) != NULL) {
+    mgr->ssl_sessions = s->next;
+    mg_ssl_session_free(s);
+  }
+}
 #endif /* MG_ENABLE_SSL */
 
 struct mg_connection *mg_if_accept_new_conn(struct mg_connection *lc) {
@@ -2639,6 +2817,122 @@ void mg_send(struct mg_connection *nc, const void *buf, int len) {
 #endif
 }
 
+size_t mg_send_queue_len(const struct mg_connection *nc) {
+  const struct mg_send_seg *seg;
+  size_t len = nc->send_mbuf.len;
+  for (seg = nc->send_queue; seg != NULL; seg = seg->next) {
+    len += seg->len;
+  }
+  return len;
+}
+
+MG_INTERNAL void mg_send_seg_free(struct mg_send_seg *seg) {
+  switch (seg->type) {
+    case MG_SEG_OWNED:
+      MBUF_FREE(seg->mem);
+      break;
+    case MG_SEG_BORROWED:
+      if (seg->free_cb != NULL) seg->free_cb(seg->mem, seg->cb_data);
+      break;
+    case MG_SEG_FILE:
+#ifndef MG_DISABLE_FILESYSTEM
+      if (seg->close_fp) fclose(seg->fp);
+#endif
+      break;
+  }
+  MG_FREE(seg);
+}
+
+#ifndef MG_DISABLE_SOCKET_IF
+/*
+ * Appends a segment to the send queue, behind everything that has been sent
+ * so far. The contents of send_mbuf are queued first, without copying them.
+ */
+static void mg_send_queue_append(struct mg_connection *nc,
+                                 struct mg_send_seg *seg) {
+  struct mg_send_seg **tail = &nc->send_queue;
+  mg_epoll_changed(nc);
+  while (*tail != NULL) tail = &(*tail)->next;
+  if (nc->send_mbuf.len > 0) {
+    struct mg_send_seg *owned =
+        (struct mg_send_seg *) MG_CALLOC(1, sizeof(*owned));
+    if (owned == NULL) {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mg_send_seg_free(seg);
+      return;
+    }
+    owned->type = MG_SEG_OWNED;
+    owned->mem = owned->buf = nc->send_mbuf.buf;
+    owned->len = nc->send_mbuf.len;
+    mbuf_init(&nc->send_mbuf, 0);
+    *tail = owned;
+    tail = &owned->next;
+  }
+  *tail = seg;
+}
+#endif
+
+void mg_send_buf(struct mg_connection *nc, const void *buf, size_t len,
+                 mg_send_free_cb_t free_cb, void *cb_data) {
+#ifndef MG_DISABLE_SOCKET_IF
+  struct mg_send_seg *seg;
+  if (len > 0 && !(nc->flags & MG_F_UDP) &&
+      (seg = (struct mg_send_seg *) MG_CALLOC(1, sizeof(*seg))) != NULL) {
+    nc->last_io_time = mg_time();
+    seg->type = MG_SEG_BORROWED;
+    seg->mem = seg->buf = (char *) buf;
+    seg->len = len;
+    seg->free_cb = free_cb;
+    seg->cb_data = cb_data;
+    mg_send_queue_append(nc, seg);
+#if !defined(NO_LIBC) && !defined(MG_DISABLE_HEXDUMP)
+    if (nc->mgr && nc->mgr->hexdump_file != NULL) {
+      mg_hexdump_connection(nc, nc->mgr->hexdump_file, buf, len, MG_EV_SEND);
+    }
+#endif
+    return;
+  }
+#endif
+  mg_send(nc, buf, len);
+  if (free_cb != NULL) free_cb((void *) buf, cb_data);
+}
+
+#ifndef MG_DISABLE_FILESYSTEM
+void mg_send_file_range(struct mg_connection *nc, FILE *fp, int64_t offset,
+                        size_t len, int close_fp) {
+#ifndef MG_DISABLE_SOCKET_IF
+  struct mg_send_seg *seg;
+  if (len > 0 && !(nc->flags & MG_F_UDP) &&
+      (seg = (struct mg_send_seg *) MG_CALLOC(1, sizeof(*seg))) != NULL) {
+    nc->last_io_time = mg_time();
+    seg->type = MG_SEG_FILE;
+    seg->fp = fp;
+    seg->off = offset;
+    seg->len = len;
+    seg->close_fp = close_fp;
+    mg_send_queue_append(nc, seg);
+    return;
+  }
+#endif
+  {
+    char buf[MG_MAX_HTTP_SEND_MBUF];
+    size_t n;
+#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
+    _XOPEN_SOURCE >= 600
+    fseeko(fp, offset, SEEK_SET);
+#else
+    fseek(fp, offset, SEEK_SET);
+#endif
+    while (len > 0 &&
+           (n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), fp)) > 0) {
+      mg_send(nc, buf, n);
+      len -= n;
+    }
+    if (close_fp) fclose(fp);
+  }
+}
+#endif
+
 void mg_if_sent_cb(struct mg_connection *nc, int num_sent) {
   if (num_sent < 0) {
     nc->flags |= MG_F_CLOSE_IMMEDIATELY;
@@ -2747,6 +3041,9 @@ void mg_if_connect_cb(struct mg_connection *nc, int err) {
   if (err != 0) {
     nc->flags |= MG_F_CLOSE_IMMEDIATELY;
   }
+#ifdef MG_ENABLE_SSL
+  mg_ssl_session_update(nc, err);
+#endif
   mg_call(nc, NULL, MG_EV_CONNECT, &err);
 }
 
@@ -2848,6 +3145,10 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
       return NULL;
 #endif /* SSL_KRYPTON */
     }
+    if (!opts.ssl_no_session_reuse) {
+      mg_ssl_session_reuse(nc, address, opts.ssl_cert, opts.ssl_ca_cert,
+                           opts.ssl_server_name);
+    }
   }
 #endif /* MG_ENABLE_SSL */
 
@@ -2859,6 +3160,9 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
      */
     struct mg_connection *dns_conn = NULL;
     struct mg_resolve_async_opts o;
+    if (mg_resolve_from_cache(mgr, host, &nc->sa) == 0) {
+      return mg_do_connect(nc, proto, &nc->sa);
+    }
     memset(&o, 0, sizeof(o));
     o.dns_conn = &dns_conn;
     if (mg_resolve_async_opt(nc->mgr, host, MG_DNS_A_RECORD, resolve_cb, nc,
@@ -2899,7 +3203,11 @@ struct mg_connection *mg_bind_opt(struct mg_mgr *mgr, const char *address,
 
   MG_COPY_COMMON_CONNECTION_OPTIONS(&add_sock_opts, &opts);
 
-  if (mg_parse_address(address, &sa, &proto, host, sizeof(host)) <= 0) {
+  rc = mg_parse_address(address, &sa, &proto, host, sizeof(host));
+#ifndef MG_DISABLE_RESOLVER
+  if (rc == 0 && mg_resolve_from_hosts(mgr, host, &sa) == 0) rc = 1;
+#endif
+  if (rc <= 0) {
     MG_SET_PTRPTR(opts.error_string, "cannot parse address");
     return NULL;
   }
@@ -3021,6 +3329,7 @@ void mg_forward(struct mg_connection *from, struct mg_connection *to) {
 double mg_set_timer(struct mg_connection *c, double timestamp) {
   double result = c->ev_timer_time;
   c->ev_timer_time = timestamp;
+  mg_epoll_changed(c);
   /*
    * If this connection is resolving, it's not in the list of active
    * connections, so not processed yet. It has a DNS resolver connection
@@ -3030,10 +3339,171 @@ double mg_set_timer(struct mg_connection *c, double timestamp) {
        (unsigned long) timestamp));
   if ((c->flags & MG_F_RESOLVING) && c->priv_2 != NULL) {
     ((struct mg_connection *) c->priv_2)->ev_timer_time = timestamp;
+    mg_epoll_changed((struct mg_connection *) c->priv_2);
   }
   return result;
 }
 
+/*
+ * mg_add_timer() timers live in the mg_mgr::timers slots, the free ones
+ * chained through `pos`. Active timers are in the binary min-heap
+ * mg_mgr::timer_heap and `pos` is their position there. A timer ID is its
+ * slot number plus a per-slot generation count, which changes whenever the
+ * slot is freed, so a stale ID doesn't cancel someone else's timer.
+ */
+#define MG_TIMER_SLOT_BITS 16
+#define MG_TIMER_SLOT_MASK ((1U << MG_TIMER_SLOT_BITS) - 1)
+
+struct mg_timer {
+  double at;       /* When the handler should be called */
+  double interval; /* Repeat interval, or 0 for a one-shot timer */
+  mg_timer_handler_t handler;
+  void *user_data;
+  unsigned int id;  /* 0 if the slot is free */
+  unsigned int gen; /* Generation count, part of the ID */
+  unsigned int pos; /* Index in timer_heap, or next free slot plus one */
+};
+
+static void mg_timer_heap_set(struct mg_mgr *mgr, unsigned int pos,
+                              unsigned int slot) {
+  mgr->timer_heap[pos] = slot;
+  mgr->timers[slot].pos = pos;
+}
+
+static void mg_timer_sift_up(struct mg_mgr *mgr, unsigned int pos) {
+  unsigned int slot = mgr->timer_heap[pos];
+  double at = mgr->timers[slot].at;
+  while (pos > 0) {
+    unsigned int parent = (pos - 1) / 2;
+    if (!(at < mgr->timers[mgr->timer_heap[parent]].at)) break;
+    mg_timer_heap_set(mgr, pos, mgr->timer_heap[parent]);
+    pos = parent;
+  }
+  mg_timer_heap_set(mgr, pos, slot);
+}
+
+static void mg_timer_sift_down(struct mg_mgr *mgr, unsigned int pos) {
+  unsigned int slot = mgr->timer_heap[pos], child;
+  double at = mgr->timers[slot].at;
+  while ((child = 2 * pos + 1) < mgr->num_timers) {
+    if (child + 1 < mgr->num_timers &&
+        mgr->timers[mgr->timer_heap[child + 1]].at <
+            mgr->timers[mgr->timer_heap[child]].at) {
+      child++;
+    }
+    if (!(mgr->timers[mgr->timer_heap[child]].at < at)) break;
+    mg_timer_heap_set(mgr, pos, mgr->timer_heap[child]);
+    pos = child;
+  }
+  mg_timer_heap_set(mgr, pos, slot);
+}
+
+/* Removes the timer at heap position `pos` and frees its slot */
+static void mg_timer_remove(struct mg_mgr *mgr, unsigned int pos) {
+  unsigned int slot = mgr->timer_heap[pos];
+  struct mg_timer *t = &mgr->timers[slot];
+  unsigned int last = mgr->timer_heap[--mgr->num_timers];
+
+  if (pos < mgr->num_timers) {
+    mg_timer_heap_set(mgr, pos, last);
+    mg_timer_sift_down(mgr, pos);
+    mg_timer_sift_up(mgr, mgr->timers[last].pos);
+  }
+
+  t->id = 0;
+  t->gen = (t->gen + 1) & (0xffffffffU >> MG_TIMER_SLOT_BITS);
+  if (t->gen == 0) t->gen = 1;
+  t->pos = mgr->free_timer_slot;
+  mgr->free_timer_slot = slot + 1;
+}
+
+static int mg_timer_grow(struct mg_mgr *mgr) {
+  unsigned int i, n = mgr->num_timer_slots * 2;
+  struct mg_timer *timers;
+  unsigned int *heap;
+
+  if (n == 0) n = 4;
+  if (n > MG_TIMER_SLOT_MASK + 1) n = MG_TIMER_SLOT_MASK + 1;
+  if (n == mgr->num_timer_slots) return 0;
+
+  heap = (unsigned int *) MG_REALLOC(mgr->timer_heap, n * sizeof(*heap));
+  if (heap == NULL) return 0;
+  mgr->timer_heap = heap;
+  timers = (struct mg_timer *) MG_REALLOC(mgr->timers, n * sizeof(*timers));
+  if (timers == NULL) return 0;
+  mgr->timers = timers;
+
+  for (i = mgr->num_timer_slots; i < n; i++) {
+    timers[i].id = 0;
+    timers[i].gen = 1;
+    timers[i].pos = i + 1 < n ? i + 2 : mgr->free_timer_slot;
+  }
+  mgr->free_timer_slot = mgr->num_timer_slots + 1;
+  mgr->num_timer_slots = n;
+  return 1;
+}
+
+unsigned int mg_add_timer(struct mg_mgr *mgr, double timestamp,
+                          double interval, mg_timer_handler_t handler,
+                          void *user_data) {
+  unsigned int slot;
+  struct mg_timer *t;
+
+  if (mgr->free_timer_slot == 0 && !mg_timer_grow(mgr)) return 0;
+  slot = mgr->free_timer_slot - 1;
+  t = &mgr->timers[slot];
+  mgr->free_timer_slot = t->pos;
+
+  t->at = timestamp;
+  t->interval = interval > 0 ? interval : 0;
+  t->handler = handler;
+  t->user_data = user_data;
+  t->id = (t->gen << MG_TIMER_SLOT_BITS) | slot;
+  mgr->timer_heap[mgr->num_timers] = slot;
+  mg_timer_sift_up(mgr, mgr->num_timers++);
+
+  return t->id;
+}
+
+void *mg_cancel_timer(struct mg_mgr *mgr, unsigned int id) {
+  unsigned int slot = id & MG_TIMER_SLOT_MASK;
+  void *user_data;
+
+  if (id == 0 || slot >= mgr->num_timer_slots ||
+      mgr->timers[slot].id != id) {
+    return NULL;
+  }
+  user_data = mgr->timers[slot].user_data;
+  mg_timer_remove(mgr, mgr->timers[slot].pos);
+  return user_data;
+}
+
+double mg_mgr_next_timer(struct mg_mgr *mgr) {
+  return mgr->num_timers > 0 ? mgr->timers[mgr->timer_heap[0]].at : 0;
+}
+
+void mg_mgr_run_timers(struct mg_mgr *mgr, double now) {
+  /* Don't let handlers that keep adding timers stall the poll loop */
+  unsigned int budget = mgr->num_timers;
+
+  while (budget-- > 0 && mgr->num_timers > 0) {
+    unsigned int slot = mgr->timer_heap[0];
+    struct mg_timer *t = &mgr->timers[slot];
+    mg_timer_handler_t handler = t->handler;
+    void *user_data = t->user_data;
+
+    if (t->at > now) break;
+    if (t->interval > 0) {
+      t->at = now + t->interval;
+      mg_timer_sift_down(mgr, 0);
+    } else {
+      mg_timer_remove(mgr, 0);
+    }
+    /* The handler may add or cancel timers, `t` can't be used after this */
+    handler(mgr, user_data);
+  }
+}
+
 struct mg_connection *mg_add_sock_opt(struct mg_mgr *s, sock_t sock,
                                       mg_event_handler_t callback,
                                       struct mg_add_sock_opts opts) {
@@ -3153,10 +3623,12 @@ int mg_if_listen_udp(struct mg_connection *nc, union socket_address *sa) {
 
 void mg_if_tcp_send(struct mg_connection *nc, const void *buf, size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
+  mg_epoll_changed(nc);
 }
 
 void mg_if_udp_send(struct mg_connection *nc, const void *buf, size_t len) {
   mbuf_append(&nc->send_mbuf, buf, len);
+  mg_epoll_changed(nc);
 }
 
 void mg_if_recved(struct mg_connection *nc, size_t len) {
@@ -3265,16 +3737,164 @@ static sock_t mg_open_listening_socket(union socket_address *sa, int proto) {
   return sock;
 }
 
+#if !defined(_WIN32) && !defined(MG_LWIP) && !defined(MG_SOCKET_SIMPLELINK)
+#include <sys/uio.h>
+#define _MG_HAVE_WRITEV
+#endif
+
+#if defined(__linux__) && !defined(MG_DISABLE_SENDFILE) && \
+    !defined(MG_DISABLE_FILESYSTEM)
+#include <sys/sendfile.h>
+#define _MG_HAVE_SENDFILE 1
+#else
+#define _MG_HAVE_SENDFILE 0
+#endif
+
+#ifndef MG_SEND_IOV_MAX
+#define MG_SEND_IOV_MAX 16
+#endif
+
+/*
+ * With Krypton, TLS records are encrypted where the data is queued and
+ * decrypted where it is received, instead of being copied through the SSL.
+ */
+#if defined(MG_ENABLE_SSL) && defined(SSL_KRYPTON) && \
+    !defined(MG_DISABLE_SSL_IN_PLACE)
+#define MG_SSL_IN_PLACE
+#endif
+
+#ifndef MG_SEND_FILE_CHUNK_SIZE
+#define MG_SEND_FILE_CHUNK_SIZE 8192
+#endif
+
+/* Removes `n` bytes that have been written from the front of the data */
+static void mg_send_queue_consume(struct mg_connection *nc, size_t n) {
+  struct mbuf *io = &nc->send_mbuf;
+  struct mg_send_seg *seg;
+
+  while (n > 0 && (seg = nc->send_queue) != NULL) {
+    size_t k = n < seg->len ? n : seg->len;
+    if (seg->type == MG_SEG_FILE) {
+#ifndef MG_DISABLE_FILESYSTEM
+      seg->off += k;
+#endif
+    } else {
+      seg->buf += k;
+    }
+    seg->len -= k;
+    n -= k;
+    if (seg->len == 0) {
+      nc->send_queue = seg->next;
+      mg_send_seg_free(seg);
+    }
+  }
+
+  if (n == 0) return;
+  if (n < io->len && nc->send_queue == NULL &&
+      (seg = (struct mg_send_seg *) MG_CALLOC(1, sizeof(*seg))) != NULL) {
+    /*
+     * Partial write. Rather than moving the rest to the front of send_mbuf,
+     * queue send_mbuf's memory as it is and start a new send_mbuf.
+     */
+    seg->type = MG_SEG_OWNED;
+    seg->mem = io->buf;
+    seg->buf = io->buf + n;
+    seg->len = io->len - n;
+    mbuf_init(io, 0);
+    nc->send_queue = seg;
+  } else {
+    mbuf_remove(io, n);
+  }
+}
+
+#ifndef MG_DISABLE_FILESYSTEM
+/*
+ * Reads the next chunk of the file segment at the head of the queue into a
+ * buffer segment in front of it, for when the file can't be sent directly.
+ */
+static int mg_send_queue_read_file(struct mg_connection *nc) {
+  struct mg_send_seg *fseg = nc->send_queue, *seg;
+  size_t len = fseg->len < MG_SEND_FILE_CHUNK_SIZE ? fseg->len
+                                                     : MG_SEND_FILE_CHUNK_SIZE;
+  if ((seg = (struct mg_send_seg *) MG_CALLOC(1, sizeof(*seg))) == NULL ||
+      (seg->mem = (char *) MBUF_REALLOC(NULL, len)) == NULL) {
+    MG_FREE(seg);
+    return -1;
+  }
+  seg->type = MG_SEG_OWNED;
+  seg->buf = seg->mem;
+#if _FILE_OFFSET_BITS == 64 || _POSIX_C_SOURCE >= 200112L || \
+    _XOPEN_SOURCE >= 600
+  fseeko(fseg->fp, fseg->off, SEEK_SET);
+#else
+  fseek(fseg->fp, fseg->off, SEEK_SET);
+#endif
+  if ((seg->len = fread(seg->buf, 1, len, fseg->fp)) == 0) {
+    /* The file is shorter than promised, give up on the connection */
+    DBG(("%p file read error %d", nc, errno));
+    mg_send_seg_free(seg);
+    return -1;
+  }
+  fseg->off += seg->len;
+  fseg->len -= seg->len;
+  if (fseg->len == 0) {
+    seg->next = fseg->next;
+    mg_send_seg_free(fseg);
+  } else {
+    seg->next = fseg;
+  }
+  nc->send_queue = seg;
+  return 0;
+}
+#endif
+
+/*
+ * Writes as much as possible from the head of the send queue to a plain TCP
+ * socket: with one `writev()` for consecutive buffers, or with `sendfile()`.
+ */
+static int mg_send_queue_write(struct mg_connection *nc) {
+  struct mg_send_seg *seg = nc->send_queue;
+#ifdef _MG_HAVE_WRITEV
+  struct iovec iov[MG_SEND_IOV_MAX];
+  int n = 0;
+#endif
+
+#if _MG_HAVE_SENDFILE
+  if (seg->type == MG_SEG_FILE) {
+    off_t off = (off_t) seg->off;
+    size_t len = seg->len < (1 << 30) ? seg->len : (1 << 30);
+    return (int) sendfile(nc->sock, fileno(seg->fp), &off, len);
+  }
+#endif
+
+#ifdef _MG_HAVE_WRITEV
+  for (; seg != NULL && n < MG_SEND_IOV_MAX; seg = seg->next) {
+    if (seg->type == MG_SEG_FILE) break;
+    iov[n].iov_base = seg->buf;
+    iov[n].iov_len = seg->len;
+    n++;
+  }
+  if (seg == NULL && n < MG_SEND_IOV_MAX && nc->send_mbuf.len > 0) {
+    iov[n].iov_base = nc->send_mbuf.buf;
+    iov[n].iov_len = nc->send_mbuf.len;
+    n++;
+  }
+  return (int) writev(nc->sock, iov, n);
+#else
+  return (int) MG_SEND_FUNC(nc->sock, seg->buf, seg->len, 0);
+#endif
+}
+
 static void mg_write_to_socket(struct mg_connection *nc) {
   struct mbuf *io = &nc->send_mbuf;
   int n = 0;
 
 #ifdef MG_LWIP
   /* With LWIP we don't know if the socket is ready */
-  if (io->len == 0) return;
+  if (io->len == 0 && nc->send_queue == NULL) return;
 #endif
 
-  assert(io->len > 0);
+  assert(io->len > 0 || nc->send_queue != NULL);
 
   if (nc->flags & MG_F_UDP) {
     int n =
@@ -3288,10 +3908,38 @@ static void mg_write_to_socket(struct mg_connection *nc) {
     return;
   }
 
+#ifndef MG_DISABLE_FILESYSTEM
+  /* Files go through memory unless they can be sent directly */
+  if (nc->send_queue != NULL && nc->send_queue->type == MG_SEG_FILE &&
+      (nc->ssl != NULL || !_MG_HAVE_SENDFILE) &&
+      mg_send_queue_read_file(nc) != 0) {
+    mg_if_sent_cb(nc, -1);
+    return;
+  }
+#endif
+
 #ifdef MG_ENABLE_SSL
   if (nc->ssl != NULL) {
     if (nc->flags & MG_F_SSL_HANDSHAKE_DONE) {
-      n = SSL_write(nc->ssl, io->buf, io->len);
+      char *buf = io->buf;
+      size_t len = io->len;
+      if (nc->send_queue != NULL) {
+        buf = nc->send_queue->buf;
+        len = nc->send_queue->len;
+      }
+#ifdef MG_SSL_IN_PLACE
+      /*
+       * Borrowed memory is not ours to overwrite. Records sealed in place
+       * stay at the front until they are sent, appending doesn't move them.
+       */
+      if (nc->send_queue == NULL || nc->send_queue->type == MG_SEG_OWNED) {
+        n = SSL_kr_write_in_place(nc->ssl, buf, len);
+      } else {
+        n = SSL_write(nc->ssl, buf, len);
+      }
+#else
+      n = SSL_write(nc->ssl, buf, len);
+#endif
       DBG(("%p %d bytes -> %d (SSL)", nc, n, nc->sock));
       if (n <= 0) {
         int ssl_err = mg_ssl_err(nc, n);
@@ -3309,12 +3957,16 @@ static void mg_write_to_socket(struct mg_connection *nc) {
   } else
 #endif
   {
-    n = (int) MG_SEND_FUNC(nc->sock, io->buf, io->len, 0);
+    if (nc->send_queue != NULL) {
+      n = mg_send_queue_write(nc);
+    } else {
+      n = (int) MG_SEND_FUNC(nc->sock, io->buf, io->len, 0);
+    }
     DBG(("%p %d bytes -> %d", nc, n, nc->sock));
   }
 
   if (n > 0) {
-    mbuf_remove(io, n);
+    mg_send_queue_consume(nc, n);
   }
   mg_if_sent_cb(nc, n);
 }
@@ -3326,10 +3978,55 @@ MG_INTERNAL size_t recv_avail_size(struct mg_connection *conn, size_t max) {
   return avail > max ? max : avail;
 }
 
+#ifdef MG_SSL_IN_PLACE
+/*
+ * Each record is read into a buffer of its own and decrypted there, which
+ * then becomes recv_mbuf or is appended to it.
+ */
+static void mg_ssl_read_in_place(struct mg_connection *conn) {
+  char *buf;
+  int n;
+
+  for (;;) {
+    if (conn->ssl_rx_buf == NULL &&
+        (conn->ssl_rx_buf = (char *) MG_MALLOC(SSL_KR_MAX_RECORD)) == NULL) {
+      DBG(("OOM"));
+      return;
+    }
+    n = SSL_kr_read_in_place(conn->ssl, conn->ssl_rx_buf, &conn->ssl_rx_len);
+    if (n <= 0) break;
+    DBG(("%p %d bytes <- %d (SSL)", conn, n, conn->sock));
+    buf = conn->ssl_rx_buf;
+    conn->ssl_rx_buf = NULL;
+    if (n < SSL_KR_MAX_RECORD / 2) {
+      /* Don't hold on to a whole record's worth of memory */
+      char *p = (char *) MG_REALLOC(buf, n);
+      if (p != NULL) buf = p;
+    }
+    mg_if_recv_tcp_cb(conn, buf, n);
+    if (conn->flags & MG_F_CLOSE_IMMEDIATELY) break;
+  }
+  if (conn->ssl_rx_len == 0) {
+    /* Keep idle memory consumption low. */
+    MG_FREE(conn->ssl_rx_buf);
+    conn->ssl_rx_buf = NULL;
+  }
+  mg_ssl_err(conn, n);
+}
+#endif
+
 static void mg_read_from_socket(struct mg_connection *conn) {
   int n = 0;
-  char *buf = (char *) MG_MALLOC(MG_TCP_RECV_BUFFER_SIZE);
+  char *buf;
+
+#ifdef MG_SSL_IN_PLACE
+  if (conn->ssl != NULL && (conn->flags & MG_F_SSL_HANDSHAKE_DONE)) {
+    mg_ssl_read_in_place(conn);
+    return;
+  }
+#endif
 
+  buf = (char *) MG_MALLOC(MG_TCP_RECV_BUFFER_SIZE);
   if (buf == NULL) {
     DBG(("OOM"));
     return;
@@ -3431,8 +4128,19 @@ static void mg_ssl_begin(struct mg_connection *nc) {
       (void) getpeername(nc->sock, &sa.sa, &sa_len);
       mg_if_accept_tcp_cb(nc, &sa, sa_len);
     } else {
-      mg_if_connect_cb(nc, 0);
-    }
+#ifdef TCP_NODELAY
+      if (SSL_session_reused(nc->ssl)) {
+        /*
+         * After an abbreviated handshake the client is the last to speak, so
+         * Nagle would hold its first request until the server's delayed ACK.
+         */
+        int on = 1;
+        setsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on,
+                   sizeof(on));
+      }
+#endif
+      mg_if_connect_cb(nc, 0);
+    }
   } else {
     int ssl_err = mg_ssl_err(nc, res);
     if (ssl_err != SSL_ERROR_WANT_READ && ssl_err != SSL_ERROR_WANT_WRITE) {
@@ -3443,6 +4151,16 @@ static void mg_ssl_begin(struct mg_connection *nc) {
     }
   }
 }
+
+/*
+ * Krypton reads ahead, so application data sent right behind the peer's
+ * Finished can be left in the SSL object with nothing on the socket to
+ * wake up the poll.
+ */
+static int mg_ssl_has_pending(struct mg_connection *nc) {
+  return nc->ssl != NULL && (nc->flags & MG_F_SSL_HANDSHAKE_DONE) &&
+         SSL_pending(nc->ssl) > 0;
+}
 #endif /* MG_ENABLE_SSL */
 
 #define _MG_F_FD_CAN_READ 1
@@ -3453,6 +4171,10 @@ void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
   DBG(("%p fd=%d fd_flags=%d nc_flags=%lu rmbl=%d smbl=%d", nc, nc->sock,
        fd_flags, nc->flags, (int) nc->recv_mbuf.len, (int) nc->send_mbuf.len));
 
+#ifdef MG_ENABLE_SSL
+  if (mg_ssl_has_pending(nc)) fd_flags |= _MG_F_FD_CAN_READ;
+#endif
+
   if (nc->flags & MG_F_CONNECTING) {
     if (fd_flags != 0) {
       int err = 0;
@@ -3503,7 +4225,7 @@ void mg_mgr_handle_conn(struct mg_connection *nc, int fd_flags, double now) {
     if (nc->flags & MG_F_CLOSE_IMMEDIATELY) return;
   }
 
-  if ((fd_flags & _MG_F_FD_CAN_WRITE) && nc->send_mbuf.len > 0) {
+  if ((fd_flags & _MG_F_FD_CAN_WRITE) && mg_send_queue_len(nc) > 0) {
     mg_write_to_socket(nc);
   }
 
@@ -3541,6 +4263,393 @@ void mg_sock_set(struct mg_connection *nc, sock_t sock) {
   DBG(("%p %d", nc, sock));
 }
 
+/* Whether the connection is interested in reading from its socket */
+static int mg_conn_wants_read(const struct mg_connection *nc) {
+  return !(nc->flags & MG_F_WANT_WRITE) &&
+         nc->recv_mbuf.len < nc->recv_mbuf_limit &&
+         (!(nc->flags & MG_F_UDP) || nc->listener == NULL);
+}
+
+/* Whether the connection is waiting for its socket to become writable */
+static int mg_conn_wants_write(const struct mg_connection *nc) {
+  return ((nc->flags & MG_F_CONNECTING) && !(nc->flags & MG_F_WANT_READ)) ||
+         (mg_send_queue_len(nc) > 0 && !(nc->flags & MG_F_CONNECTING));
+}
+
+/*
+ * Returns `timeout_ms` shortened so that a timer expiring at `min_timer` is
+ * not missed.
+ */
+static int mg_timer_timeout_ms(double min_timer, int timeout_ms) {
+  double timer_timeout_ms = (min_timer - mg_time()) * 1000 + 1 /* rounding */;
+  if (timer_timeout_ms < timeout_ms) {
+    timeout_ms = timer_timeout_ms;
+  }
+  return timeout_ms < 0 ? 0 : timeout_ms;
+}
+
+/* Whether the connection has asked to be closed and can be closed now */
+static int mg_conn_wants_close(const struct mg_connection *nc) {
+  return (nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
+         (mg_send_queue_len(nc) == 0 && (nc->flags & MG_F_SEND_AND_CLOSE));
+}
+
+#ifdef MG_ENABLE_EPOLL
+
+/*
+ * epoll(7) event backend, Linux only. Each connection's socket is registered
+ * with the epoll instance and `nc->mgr_data` keeps the events it's registered
+ * for, so `epoll_ctl()` is only called when they change. There is no
+ * `FD_SETSIZE` limit.
+ *
+ * The connections that were handled, sent to or had their timer set go on a
+ * change list, and only those get their events, `ev_timer_time` and close
+ * flags looked at. `ev_timer_time` is kept on the `mg_add_timer()` heap.
+ *
+ * Like with select(), each `mg_mgr_poll()` delivers MG_EV_POLL to the
+ * connections without I/O and rechecks all of them, which takes a pass over
+ * the connection list. With MG_POLL_INTERVAL_MS set, that pass is made by a
+ * heap timer instead, at most once per MG_POLL_INTERVAL_MS, and
+ * `mg_mgr_poll()` only looks at the change list. Flags set from outside the
+ * connection's own events are then acted on within that interval.
+ */
+
+#include <sys/epoll.h>
+
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 100
+#endif
+
+#ifndef MG_POLL_INTERVAL_MS
+#define MG_POLL_INTERVAL_MS 0 /* Every mg_mgr_poll() */
+#endif
+
+#define _MG_EPOLL_EVENTS_MASK (EPOLLIN | EPOLLOUT)
+#define _MG_EPOLL_F_ADDED (1 << 16)   /* socket is registered */
+#define _MG_EPOLL_F_HANDLED (1 << 17) /* handled in this mg_mgr_poll() */
+#define _MG_EPOLL_F_CHANGED (1 << 18) /* on mg_epoll_mgr::changed */
+#define _MG_EPOLL_F_KICKED (1 << 19)  /* on mg_epoll_mgr::kicked */
+
+/* UDP "connections" accepted by a listener share the listener's socket */
+#define _MG_IS_UDP_CHILD(nc) (((nc)->flags & MG_F_UDP) && (nc)->listener != NULL)
+
+struct mg_epoll_mgr {
+  int fd;
+  struct mg_connection *changed; /* To bring up to date, see above */
+  struct mg_connection *kicked;  /* To handle whether their socket is ready */
+};
+
+static struct mg_epoll_mgr *mg_epoll_mgr(struct mg_mgr *mgr) {
+  return (struct mg_epoll_mgr *) mgr->mgr_data;
+}
+
+static void mg_epoll_link(struct mg_connection **list,
+                          struct mg_connection *nc) {
+  nc->prev_changed = NULL;
+  nc->next_changed = *list;
+  if (*list != NULL) (*list)->prev_changed = nc;
+  *list = nc;
+}
+
+static void mg_epoll_unlink(struct mg_connection **list,
+                            struct mg_connection *nc) {
+  if (nc->prev_changed != NULL) {
+    nc->prev_changed->next_changed = nc->next_changed;
+  } else {
+    *list = nc->next_changed;
+  }
+  if (nc->next_changed != NULL) {
+    nc->next_changed->prev_changed = nc->prev_changed;
+  }
+  nc->next_changed = nc->prev_changed = NULL;
+}
+
+MG_INTERNAL void mg_epoll_changed(struct mg_connection *nc) {
+  intptr_t state = (intptr_t) nc->mgr_data;
+  struct mg_mgr *mgr = nc->mgr;
+
+  if (state & (_MG_EPOLL_F_CHANGED | _MG_EPOLL_F_KICKED)) return;
+  /* Resolving connections are not in the manager yet */
+  if (mgr == NULL || mgr->mgr_data == NULL ||
+      (nc->prev == NULL && mgr->active_connections != nc)) {
+    return;
+  }
+  nc->mgr_data = (void *) (state | _MG_EPOLL_F_CHANGED);
+  mg_epoll_link(&mg_epoll_mgr(mgr)->changed, nc);
+}
+
+/* Brings the epoll registration of the connection's socket up to date */
+static void mg_epoll_update(struct mg_connection *nc) {
+  intptr_t state = (intptr_t) nc->mgr_data;
+  struct epoll_event ev;
+  int op;
+
+  if (nc->sock == INVALID_SOCKET || _MG_IS_UDP_CHILD(nc)) return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (mg_conn_wants_read(nc) ? EPOLLIN : 0) |
+              (mg_conn_wants_write(nc) ? EPOLLOUT : 0);
+  ev.data.ptr = nc;
+
+  if (!(state & _MG_EPOLL_F_ADDED)) {
+    if (ev.events == 0) return;
+    op = EPOLL_CTL_ADD;
+  } else if (ev.events == (uint32_t)(state & _MG_EPOLL_EVENTS_MASK)) {
+    return;
+  } else if (ev.events == 0) {
+    /*
+     * Like select(), don't report hangups nobody is waiting for: with
+     * level-triggered epoll they would keep waking us up.
+     */
+    op = EPOLL_CTL_DEL;
+  } else {
+    op = EPOLL_CTL_MOD;
+  }
+
+  if (epoll_ctl(mg_epoll_mgr(nc->mgr)->fd, op, nc->sock, &ev) != 0) {
+    DBG(("%p epoll_ctl(%d, %d): %d", nc, op, nc->sock, errno));
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  state &= ~(_MG_EPOLL_F_ADDED | _MG_EPOLL_EVENTS_MASK);
+  if (op != EPOLL_CTL_DEL) state |= _MG_EPOLL_F_ADDED | ev.events;
+  nc->mgr_data = (void *) state;
+}
+
+static void mg_epoll_conn_timer(struct mg_mgr *mgr, void *user_data) {
+  struct mg_connection *nc = (struct mg_connection *) user_data;
+  (void) mgr;
+  nc->ev_timer_id = 0;
+  mg_if_timer(nc, mg_time());
+  mg_epoll_changed(nc);
+}
+
+/* Moves the connection's heap timer to `ev_timer_time` if that has changed */
+static void mg_epoll_update_timer(struct mg_connection *nc) {
+  struct mg_mgr *mgr = nc->mgr;
+
+  if (nc->ev_timer_id != 0) {
+    unsigned int slot = nc->ev_timer_id & MG_TIMER_SLOT_MASK;
+    if (mgr->timers[slot].at == nc->ev_timer_time) return;
+    mg_cancel_timer(mgr, nc->ev_timer_id);
+    nc->ev_timer_id = 0;
+  }
+  if (nc->ev_timer_time > 0) {
+    /* If out of memory, the MG_EV_POLL pass delivers it */
+    nc->ev_timer_id =
+        mg_add_timer(mgr, nc->ev_timer_time, 0, mg_epoll_conn_timer, nc);
+  }
+}
+
+/* Whether the connection must be handled even if its socket isn't ready */
+static int mg_epoll_needs_kick(struct mg_connection *nc) {
+  /* UDP sockets are always writable, see _MG_IS_UDP_CHILD() */
+  if (_MG_IS_UDP_CHILD(nc) && nc->send_mbuf.len > 0) return 1;
+  if ((nc->flags & MG_F_CONNECTING) && nc->err != 0) return 1;
+#ifdef MG_ENABLE_SSL
+  if (mg_ssl_has_pending(nc)) return 1;
+#endif
+  return 0;
+}
+
+/*
+ * Goes through the change list: closes the connections that asked for it,
+ * updates the registrations and timers of the rest.
+ */
+static void mg_epoll_flush(struct mg_mgr *mgr) {
+  struct mg_epoll_mgr *em = mg_epoll_mgr(mgr);
+  struct mg_connection *nc;
+
+  while ((nc = em->changed) != NULL) {
+    intptr_t state = (intptr_t) nc->mgr_data;
+    mg_epoll_unlink(&em->changed, nc);
+    nc->mgr_data =
+        (void *) (state & ~(_MG_EPOLL_F_CHANGED | _MG_EPOLL_F_HANDLED));
+
+    if (!mg_conn_wants_close(nc)) {
+      mg_epoll_update_timer(nc);
+      mg_epoll_update(nc);
+    }
+    if (mg_conn_wants_close(nc)) {
+      mg_close_conn(nc);
+    } else if (mg_epoll_needs_kick(nc)) {
+      nc->mgr_data = (void *) ((intptr_t) nc->mgr_data | _MG_EPOLL_F_KICKED);
+      mg_epoll_link(&em->kicked, nc);
+    }
+  }
+}
+
+/*
+ * Delivers MG_EV_POLL and due MG_EV_TIMER to the connections, skipping the
+ * ones handled in this mg_mgr_poll() unless `all` is set, and puts every
+ * connection on the change list.
+ */
+static void mg_epoll_poll_conns(struct mg_mgr *mgr, double now, int all) {
+  struct mg_connection *nc, *tmp;
+
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    if (all || !((intptr_t) nc->mgr_data & _MG_EPOLL_F_HANDLED)) {
+      mg_if_poll(nc, now);
+      mg_if_timer(nc, now);
+    }
+    mg_epoll_changed(nc);
+  }
+}
+
+#if MG_POLL_INTERVAL_MS > 0
+static void mg_epoll_poll_timer(struct mg_mgr *mgr, void *user_data) {
+  (void) user_data;
+  mg_epoll_poll_conns(mgr, mg_time(), 1);
+}
+#endif
+
+void mg_ev_mgr_init(struct mg_mgr *mgr) {
+  struct mg_epoll_mgr *em;
+  DBG(("%p using epoll()", mgr));
+#ifndef MG_DISABLE_SOCKETPAIR
+  do {
+    mg_socketpair(mgr->ctl, SOCK_DGRAM);
+  } while (mgr->ctl[0] == INVALID_SOCKET);
+#endif
+  em = (struct mg_epoll_mgr *) MG_CALLOC(1, sizeof(*em));
+  if (em == NULL) {
+    DBG(("OOM"));
+    abort();
+  }
+  em->fd = epoll_create(MG_EPOLL_MAX_EVENTS /* size hint, must be > 0 */);
+  if (em->fd < 0) {
+    DBG(("epoll_create: %d", errno));
+    abort();
+  }
+  mg_set_close_on_exec(em->fd);
+  mgr->mgr_data = em;
+#ifndef MG_DISABLE_SOCKETPAIR
+  {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /* marks the control socket */
+    if (epoll_ctl(em->fd, EPOLL_CTL_ADD, mgr->ctl[1], &ev) != 0) {
+      DBG(("epoll_ctl: %d", errno));
+      abort();
+    }
+  }
+#endif
+#if MG_POLL_INTERVAL_MS > 0
+  if (mg_add_timer(mgr, mg_time() + MG_POLL_INTERVAL_MS / 1000.0,
+                   MG_POLL_INTERVAL_MS / 1000.0, mg_epoll_poll_timer,
+                   NULL) == 0) {
+    DBG(("OOM"));
+    abort();
+  }
+#endif
+}
+
+void mg_ev_mgr_free(struct mg_mgr *mgr) {
+  struct mg_epoll_mgr *em = mg_epoll_mgr(mgr);
+  close(em->fd);
+  MG_FREE(em);
+  mgr->mgr_data = NULL;
+}
+
+void mg_ev_mgr_add_conn(struct mg_connection *nc) {
+  /* the socket is registered when the change list is flushed */
+  nc->mgr_data = NULL;
+  mg_epoll_changed(nc);
+}
+
+void mg_ev_mgr_remove_conn(struct mg_connection *nc) {
+  struct mg_epoll_mgr *em = mg_epoll_mgr(nc->mgr);
+  intptr_t state = (intptr_t) nc->mgr_data;
+
+  if (state & _MG_EPOLL_F_ADDED) {
+    struct epoll_event ev; /* non-NULL for kernels before 2.6.9 */
+    epoll_ctl(em->fd, EPOLL_CTL_DEL, nc->sock, &ev);
+  }
+  if (state & _MG_EPOLL_F_CHANGED) mg_epoll_unlink(&em->changed, nc);
+  if (state & _MG_EPOLL_F_KICKED) mg_epoll_unlink(&em->kicked, nc);
+  if (nc->ev_timer_id != 0) {
+    mg_cancel_timer(nc->mgr, nc->ev_timer_id);
+    nc->ev_timer_id = 0;
+  }
+  nc->mgr_data = NULL;
+  /* A connection handed off to a worker thread stays until it's closed */
+  mg_epoll_changed(nc);
+}
+
+time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
+  struct mg_epoll_mgr *em = mg_epoll_mgr(mgr);
+  struct epoll_event events[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *nc;
+  double now;
+  int i, num_ev;
+
+  /* Pick up what the application did since the last call */
+  mg_epoll_flush(mgr);
+
+  if (mgr->num_timers > 0) {
+    timeout_ms = mg_timer_timeout_ms(mg_mgr_next_timer(mgr), timeout_ms);
+  }
+  if (timeout_ms < 0 || em->kicked != NULL) timeout_ms = 0;
+
+  num_ev = epoll_wait(em->fd, events, MG_EPOLL_MAX_EVENTS, timeout_ms);
+  now = mg_time();
+  DBG(("epoll_wait @ %ld num_ev=%d, timeout=%d", (long) now, num_ev,
+       timeout_ms));
+
+  for (i = 0; i < num_ev; i++) {
+    uint32_t ev = events[i].events;
+    intptr_t state;
+    int fd_flags;
+
+    nc = (struct mg_connection *) events[i].data.ptr;
+    if (nc == NULL) {
+#ifndef MG_DISABLE_SOCKETPAIR
+      struct mg_connection *c;
+      mg_mgr_handle_ctl_sock(mgr);
+      /* The broadcast callback could have done anything to any of them */
+      for (c = mgr->active_connections; c != NULL; c = c->next) {
+        mg_epoll_changed(c);
+      }
+#endif
+      continue;
+    }
+
+    /* errors and hangups are delivered as readiness for what we wait for */
+    state = (intptr_t) nc->mgr_data;
+    if (ev & (EPOLLERR | EPOLLHUP)) ev |= state & _MG_EPOLL_EVENTS_MASK;
+    fd_flags = ((ev & EPOLLIN) ? _MG_F_FD_CAN_READ : 0) |
+               ((ev & EPOLLOUT) ? _MG_F_FD_CAN_WRITE : 0) |
+               ((ev & EPOLLERR) ? _MG_F_FD_ERROR : 0);
+    nc->mgr_data = (void *) (state | _MG_EPOLL_F_HANDLED);
+    mg_mgr_handle_conn(nc, fd_flags, now);
+    mg_epoll_changed(nc);
+  }
+
+  while ((nc = em->kicked) != NULL) {
+    intptr_t state = (intptr_t) nc->mgr_data;
+    mg_epoll_unlink(&em->kicked, nc);
+    nc->mgr_data =
+        (void *) ((state & ~_MG_EPOLL_F_KICKED) | _MG_EPOLL_F_HANDLED);
+    if (!(state & _MG_EPOLL_F_HANDLED)) {
+      mg_mgr_handle_conn(nc, _MG_IS_UDP_CHILD(nc) ? _MG_F_FD_CAN_WRITE : 0,
+                         now);
+    }
+    mg_epoll_changed(nc);
+  }
+
+#if MG_POLL_INTERVAL_MS == 0
+  mg_epoll_poll_conns(mgr, now, 0);
+#endif
+  mg_mgr_run_timers(mgr, now);
+  mg_epoll_flush(mgr);
+
+  return now;
+}
+
+#else /* MG_ENABLE_EPOLL */
+
 void mg_ev_mgr_init(struct mg_mgr *mgr) {
   (void) mgr;
   DBG(("%p using select()", mgr));
@@ -3563,6 +4672,14 @@ void mg_ev_mgr_remove_conn(struct mg_connection *nc) {
   (void) nc;
 }
 
+static void mg_mgr_close_conns(struct mg_mgr *mgr) {
+  struct mg_connection *nc, *tmp;
+  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
+    tmp = nc->next;
+    if (mg_conn_wants_close(nc)) mg_close_conn(nc);
+  }
+}
+
 void mg_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
   if (sock != INVALID_SOCKET) {
     FD_SET(sock, set);
@@ -3599,18 +4716,18 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
     if (nc->sock != INVALID_SOCKET) {
       num_fds++;
 
-      if (!(nc->flags & MG_F_WANT_WRITE) &&
-          nc->recv_mbuf.len < nc->recv_mbuf_limit &&
-          (!(nc->flags & MG_F_UDP) || nc->listener == NULL)) {
+      if (mg_conn_wants_read(nc)) {
         mg_add_to_set(nc->sock, &read_set, &max_fd);
       }
 
-      if (((nc->flags & MG_F_CONNECTING) && !(nc->flags & MG_F_WANT_READ)) ||
-          (nc->send_mbuf.len > 0 && !(nc->flags & MG_F_CONNECTING))) {
+      if (mg_conn_wants_write(nc)) {
         mg_add_to_set(nc->sock, &write_set, &max_fd);
         mg_add_to_set(nc->sock, &err_set, &max_fd);
       }
     }
+#ifdef MG_ENABLE_SSL
+    if (mg_ssl_has_pending(nc)) timeout_ms = 0;
+#endif
 
     if (nc->ev_timer_time > 0) {
       if (num_timers == 0 || nc->ev_timer_time < min_timer) {
@@ -3625,10 +4742,10 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
    * adjust the timeout.
    */
   if (num_timers > 0) {
-    double timer_timeout_ms = (min_timer - mg_time()) * 1000 + 1 /* rounding */;
-    if (timer_timeout_ms < timeout_ms) {
-      timeout_ms = timer_timeout_ms;
-    }
+    timeout_ms = mg_timer_timeout_ms(min_timer, timeout_ms);
+  }
+  if (mgr->num_timers > 0) {
+    timeout_ms = mg_timer_timeout_ms(mg_mgr_next_timer(mgr), timeout_ms);
   }
   if (timeout_ms < 0) timeout_ms = 0;
 
@@ -3661,7 +4778,7 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
 #ifdef MG_SOCKET_SIMPLELINK
       /* SimpleLink does not report UDP sockets as writeable. */
       if (nc->flags & MG_F_UDP &&
-          (nc->send_mbuf.len > 0 || nc->flags & MG_F_CONNECTING)) {
+          (mg_send_queue_len(nc) > 0 || nc->flags & MG_F_CONNECTING)) {
         fd_flags |= _MG_F_FD_CAN_WRITE;
       }
 #endif
@@ -3674,17 +4791,14 @@ time_t mg_mgr_poll(struct mg_mgr *mgr, int timeout_ms) {
     mg_mgr_handle_conn(nc, fd_flags, now);
   }
 
-  for (nc = mgr->active_connections; nc != NULL; nc = tmp) {
-    tmp = nc->next;
-    if ((nc->flags & MG_F_CLOSE_IMMEDIATELY) ||
-        (nc->send_mbuf.len == 0 && (nc->flags & MG_F_SEND_AND_CLOSE))) {
-      mg_close_conn(nc);
-    }
-  }
+  mg_mgr_run_timers(mgr, now);
+  mg_mgr_close_conns(mgr);
 
   return now;
 }
 
+#endif /* MG_ENABLE_EPOLL */
+
 #ifndef MG_DISABLE_SOCKETPAIR
 int mg_socketpair(sock_t sp[2], int sock_type) {
   union socket_address sa;
@@ -3867,54 +4981,324 @@ void mg_enable_multithreading(struct mg_connection *nc) {
   nc->priv_1.f = nc->handler;
   nc->handler = multithreaded_ev_handler;
 }
-#endif
-#ifdef MG_MODULE_LINES
-#line 1 "./src/uri.c"
-#endif
+
 /*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
+ * Worker pool. Every worker thread runs its own event manager and is linked
+ * to the listener's manager by a socketpair. The listener thread pushes
+ * accepted sockets down the link, the worker pushes its load back.
  */
 
-/* Amalgamated: #include "mongoose/src/internal.h" */
-/* Amalgamated: #include "mongoose/src/uri.h" */
+/* Listener -> worker: take over this socket */
+struct mg_handoff_msg {
+  sock_t sock;
+  union socket_address sa;
+  struct mg_connection *listener;
+  mg_event_handler_t handler;
+  mg_event_handler_t proto_handler;
+  void *user_data;
+  size_t recv_mbuf_limit;
+  SSL *ssl;
+};
 
-/*
- * scan string until `sep`, keeping track of component boundaries in `res`.
- *
- * `p` will point to the char after the separator or it will be `end`.
- */
-static void parse_uri_component(const char **p, const char *end, char sep,
-                                struct mg_str *res) {
-  res->p = *p;
-  for (; *p < end; (*p)++) {
-    if (**p == sep) {
-      break;
+/* Worker -> listener: current load */
+struct mg_worker_report {
+  unsigned int accepted; /* Handoffs processed so far */
+  unsigned int live;     /* Connections being served */
+};
+
+/* Worker thread state, stored in its manager's user_data */
+struct mg_worker_state {
+  unsigned int accepted;
+  struct mg_worker_report reported;
+};
+
+/* Listener's view of a worker */
+struct mg_worker {
+  struct mg_connection *link; /* Listener's end, NULL when worker is gone */
+  unsigned int handed_off;
+  struct mg_worker_report report;
+};
+
+struct mg_worker_pool {
+  int num_workers;
+  int refs; /* The listener plus every open link */
+  struct mg_worker *workers;
+};
+
+static void mg_worker_take_over(struct mg_mgr *mgr, struct mg_handoff_msg *m) {
+  struct mg_connection *nc = mg_add_sock(mgr, m->sock, m->handler);
+
+  if (nc == NULL) {
+    DBG(("OOM"));
+    closesocket(m->sock);
+#ifdef MG_ENABLE_SSL
+    if (m->ssl != NULL) SSL_free(m->ssl);
+#endif
+    return;
+  }
+
+  /* Dress nc as the connection accepted in the listener thread */
+  nc->listener = m->listener;
+  nc->sa = m->sa;
+  nc->proto_handler = m->proto_handler;
+  nc->user_data = m->user_data;
+  nc->recv_mbuf_limit = m->recv_mbuf_limit;
+  if (m->ssl != NULL) {
+    nc->ssl = m->ssl;
+    nc->flags |= MG_F_SSL_HANDSHAKE_DONE;
+  }
+  mg_call(nc, NULL, MG_EV_ACCEPT, &nc->sa);
+}
+
+/* Worker's end of the link */
+static void mg_worker_link_handler(struct mg_connection *nc, int ev, void *p) {
+  struct mg_worker_state *ws = (struct mg_worker_state *) nc->mgr->user_data;
+  struct mg_handoff_msg m;
+  struct mg_worker_report r;
+  struct mg_connection *c;
+
+  (void) p;
+  if (ev == MG_EV_RECV) {
+    while (nc->recv_mbuf.len >= sizeof(m)) {
+      memcpy(&m, nc->recv_mbuf.buf, sizeof(m));
+      mbuf_remove(&nc->recv_mbuf, sizeof(m));
+      mg_worker_take_over(nc->mgr, &m);
+      ws->accepted++;
+    }
+  } else if (ev == MG_EV_POLL) {
+    r.accepted = ws->accepted;
+    r.live = 0;
+    for (c = mg_next(nc->mgr, NULL); c != NULL; c = mg_next(nc->mgr, c)) {
+      if (c != nc) r.live++;
+    }
+    if (r.accepted != ws->reported.accepted || r.live != ws->reported.live) {
+      mg_send(nc, &r, sizeof(r));
+      ws->reported = r;
     }
   }
-  res->len = (*p) - res->p;
-  if (*p < end) (*p)++;
 }
 
-int mg_parse_uri(struct mg_str uri, struct mg_str *scheme,
-                 struct mg_str *user_info, struct mg_str *host,
-                 unsigned int *port, struct mg_str *path, struct mg_str *query,
-                 struct mg_str *fragment) {
-  struct mg_str rscheme = {0, 0}, ruser_info = {0, 0}, rhost = {0, 0},
-                rpath = {0, 0}, rquery = {0, 0}, rfragment = {0, 0};
-  unsigned int rport = 0;
-  enum {
-    P_START,
-    P_SCHEME_OR_PORT,
-    P_USER_INFO,
-    P_HOST,
-    P_PORT,
-    P_REST
-  } state = P_START;
+/*
+ * Worker thread. Runs until the listener is closed and all connections
+ * handed over to this worker are gone.
+ */
+static void *worker_thread_function(void *param) {
+  struct mg_connection *link = (struct mg_connection *) param;
+  struct mg_worker_state ws;
+  struct mg_mgr m;
 
-  const char *p = uri.p, *end = p + uri.len;
-  while (p < end) {
-    switch (state) {
+  memset(&ws, 0, sizeof(ws));
+  mg_mgr_init(&m, &ws);
+  mg_add_conn(&m, link);
+  while (m.active_connections != NULL) {
+    mg_mgr_poll(&m, 1000);
+  }
+  mg_mgr_free(&m);
+
+  return param;
+}
+
+static void mg_pool_release(struct mg_worker_pool *pool) {
+  if (--pool->refs == 0) {
+    MG_FREE(pool->workers);
+    MG_FREE(pool);
+  }
+}
+
+/* Listener's end of the link */
+static void mg_pool_link_handler(struct mg_connection *nc, int ev, void *p) {
+  struct mg_worker *w = (struct mg_worker *) nc->user_data;
+  size_t n = nc->recv_mbuf.len / sizeof(w->report);
+
+  (void) p;
+  if (ev == MG_EV_RECV && n > 0) {
+    /* Only the latest report matters */
+    memcpy(&w->report, nc->recv_mbuf.buf + (n - 1) * sizeof(w->report),
+           sizeof(w->report));
+    mbuf_remove(&nc->recv_mbuf, n * sizeof(w->report));
+  } else if (ev == MG_EV_CLOSE) {
+    w->link = NULL;
+    mg_pool_release((struct mg_worker_pool *) nc->priv_2);
+  }
+}
+
+static struct mg_worker *mg_pool_pick(struct mg_worker_pool *pool) {
+  struct mg_worker *w, *best = NULL;
+  unsigned int load, best_load = 0;
+  int i;
+
+  for (i = 0; i < pool->num_workers; i++) {
+    w = &pool->workers[i];
+    if (w->link == NULL) continue;
+    /* Connections in flight are not in the report yet */
+    load = w->report.live + (w->handed_off - w->report.accepted);
+    if (best == NULL || load < best_load) {
+      best = w;
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+static void mg_pool_hand_off(struct mg_connection *nc) {
+  struct mg_worker_pool *pool = (struct mg_worker_pool *) nc->listener->priv_2;
+  struct mg_worker *w = pool != NULL ? mg_pool_pick(pool) : NULL;
+  struct mg_handoff_msg m;
+
+  if (w == NULL) {
+    /* No workers left, serve the connection in this thread */
+    nc->handler = nc->listener->priv_1.f;
+    mg_call(nc, nc->handler, MG_EV_ACCEPT, &nc->sa);
+    return;
+  }
+
+  memset(&m, 0, sizeof(m));
+  m.sock = nc->sock;
+  m.sa = nc->sa;
+  m.listener = nc->listener;
+  m.handler = nc->listener->priv_1.f;
+  m.proto_handler = nc->proto_handler;
+  m.user_data = nc->user_data;
+  m.recv_mbuf_limit = nc->recv_mbuf_limit;
+  m.ssl = nc->ssl;
+  mg_send(w->link, &m, sizeof(m));
+  w->handed_off++;
+
+  /*
+   * The socket belongs to the worker now. Drop it from this manager without
+   * closing it; proto_data stays here and is destroyed with nc.
+   */
+  mg_ev_mgr_remove_conn(nc);
+  nc->sock = INVALID_SOCKET;
+  nc->ssl = NULL;
+  nc->proto_handler = NULL;
+  nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+}
+
+static void mg_pool_ev_handler(struct mg_connection *c, int ev, void *p) {
+  struct mg_worker_pool *pool = (struct mg_worker_pool *) c->priv_2;
+  int i;
+
+  (void) p;
+  if (ev == MG_EV_ACCEPT) {
+    mg_pool_hand_off(c);
+  } else if (ev == MG_EV_CLOSE && (c->flags & MG_F_LISTENING) &&
+             pool != NULL) {
+    /* Let workers finish pending handoffs and exit when idle */
+    for (i = 0; i < pool->num_workers; i++) {
+      if (pool->workers[i].link != NULL) {
+        pool->workers[i].link->flags |= MG_F_SEND_AND_CLOSE;
+      }
+    }
+    c->priv_2 = NULL;
+    mg_pool_release(pool);
+  }
+}
+
+static void mg_pool_start_worker(struct mg_worker_pool *pool,
+                                 struct mg_worker *w, struct mg_mgr *mgr) {
+  struct mg_mgr dummy;
+  sock_t sp[2];
+  struct mg_connection *c[2];
+
+  if (!mg_socketpair(sp, SOCK_STREAM)) return;
+  if ((c[0] = mg_add_sock(mgr, sp[0], mg_pool_link_handler)) == NULL) {
+    closesocket(sp[0]);
+    closesocket(sp[1]);
+    return;
+  }
+  c[0]->user_data = w;
+  c[0]->priv_2 = pool;
+  w->link = c[0];
+  pool->refs++;
+
+  /* Like in spawn_handling_thread(), worker adopts c[1] into its manager */
+  memset(&dummy, 0, sizeof(dummy));
+  if ((c[1] = mg_add_sock(&dummy, sp[1], mg_worker_link_handler)) == NULL) {
+    closesocket(sp[1]);
+    c[0]->flags |= MG_F_CLOSE_IMMEDIATELY;
+    return;
+  }
+  mg_start_thread(worker_thread_function, c[1]);
+}
+
+void mg_enable_multithreading_opt(struct mg_connection *nc,
+                                  struct mg_multithreading_opts opts) {
+  struct mg_worker_pool *pool;
+  int i;
+
+  if (opts.num_workers <= 0) {
+    mg_enable_multithreading(nc);
+    return;
+  }
+
+  pool = (struct mg_worker_pool *) MG_CALLOC(1, sizeof(*pool));
+  if (pool == NULL) return;
+  pool->workers =
+      (struct mg_worker *) MG_CALLOC(opts.num_workers, sizeof(*pool->workers));
+  if (pool->workers == NULL) {
+    MG_FREE(pool);
+    return;
+  }
+  pool->num_workers = opts.num_workers;
+  pool->refs = 1;
+  for (i = 0; i < opts.num_workers; i++) {
+    mg_pool_start_worker(pool, &pool->workers[i], nc->mgr);
+  }
+
+  nc->priv_1.f = nc->handler;
+  nc->priv_2 = pool;
+  nc->handler = mg_pool_ev_handler;
+}
+#endif
+#ifdef MG_MODULE_LINES
+#line 1 "./src/uri.c"
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "mongoose/src/internal.h" */
+/* Amalgamated: #include "mongoose/src/uri.h" */
+
+/*
+ * scan string until `sep`, keeping track of component boundaries in `res`.
+ *
+ * `p` will point to the char after the separator or it will be `end`.
+ */
+static void parse_uri_component(const char **p, const char *end, char sep,
+                                struct mg_str *res) {
+  res->p = *p;
+  for (; *p < end; (*p)++) {
+    if (**p == sep) {
+      break;
+    }
+  }
+  res->len = (*p) - res->p;
+  if (*p < end) (*p)++;
+}
+
+int mg_parse_uri(struct mg_str uri, struct mg_str *scheme,
+                 struct mg_str *user_info, struct mg_str *host,
+                 unsigned int *port, struct mg_str *path, struct mg_str *query,
+                 struct mg_str *fragment) {
+  struct mg_str rscheme = {0, 0}, ruser_info = {0, 0}, rhost = {0, 0},
+                rpath = {0, 0}, rquery = {0, 0}, rfragment = {0, 0};
+  unsigned int rport = 0;
+  enum {
+    P_START,
+    P_SCHEME_OR_PORT,
+    P_USER_INFO,
+    P_HOST,
+    P_PORT,
+    P_REST
+  } state = P_START;
+
+  const char *p = uri.p, *end = p + uri.len;
+  while (p < end) {
+    switch (state) {
       case P_START:
         /*
          * expecting on of:
@@ -4062,6 +5446,26 @@ int mg_normalize_uri_path(const struct mg_str *in, struct mg_str *out) {
 
 #ifndef MG_DISABLE_HTTP_WEBSOCKET
 #define MG_WS_NO_HOST_HEADER_MAGIC ((char *) 0x1)
+
+#if defined(__SSE2__) && !defined(MG_DISABLE_WS_SIMD)
+#include <emmintrin.h>
+#define _MG_WS_MASK_SSE2
+#elif defined(__ARM_NEON) && !defined(MG_DISABLE_WS_SIMD)
+#include <arm_neon.h>
+#define _MG_WS_MASK_NEON
+#endif
+
+#ifdef MG_ENABLE_WS_DEFLATE
+/* Declarations only, miniz.c is built separately */
+#define MINIZ_HEADER_FILE_ONLY
+#ifndef MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#endif
+#include "common/miniz.c"
+#undef MINIZ_HEADER_FILE_ONLY
+
+#define _MG_WS_COMPRESSED 0x200 /* Internal op flag: set RSV1 */
+#endif
 #endif
 
 enum mg_http_proto_data_type { DATA_NONE, DATA_FILE, DATA_PUT };
@@ -4109,6 +5513,57 @@ struct mg_http_multipart_stream {
   int processing_part;
 };
 
+/*
+ * Progress of parsing the message at the front of recv_mbuf, carried over
+ * between MG_EV_RECV events so that what's buffered is not scanned again.
+ */
+struct mg_http_proto_data_parse {
+  size_t io_len;   /* recv_mbuf length when we were done with it last time */
+  size_t scanned;  /* This many bytes don't contain the end of headers */
+  int req_len;     /* Length of headers once received */
+  size_t body_end; /* Message length if it's not complete yet, or 0 */
+};
+
+#ifndef MG_DISABLE_HTTP_WEBSOCKET
+/*
+ * Fragmented message reassembly state. Payloads of the fragments received
+ * so far are packed at the start of `recv_mbuf`, each moved there once,
+ * when its frame is complete. Frames still to be parsed start at
+ * `frame_pos`; the bytes in between are spent headers and control frames.
+ */
+#ifdef MG_ENABLE_WS_DEFLATE
+/*
+ * Negotiated permessage-deflate state. Compressor and decompressor are
+ * allocated on first use, and dropped after every message when the
+ * respective side doesn't take over the context.
+ */
+struct mg_ws_deflate {
+  unsigned char enabled;        /* Extension negotiated */
+  unsigned char tx_ok;          /* Peer accepts our 32K compression window */
+  unsigned char rx_bits;        /* Peer's compression window bits */
+  unsigned char rx_no_takeover; /* Peer resets its context every message */
+  unsigned char tx_no_takeover; /* We reset ours every message */
+  unsigned char rx_msg;         /* Message being received is compressed */
+  unsigned char tx_msg;         /* Message being sent is compressed */
+  tinfl_decompressor *inflater;
+  unsigned char *rx_dict; /* Ring of the last 2^rx_bits inflated bytes */
+  size_t rx_dict_ofs;
+  tdefl_compressor *deflater;
+  struct mbuf *tx_out; /* Where the compressor writes to */
+};
+#endif
+
+struct mg_http_proto_data_ws {
+  size_t unmasked;         /* Payload bytes of the pending frame unmasked */
+  size_t msg_len;          /* Reassembled payload length */
+  size_t frame_pos;        /* Offset of the pending frame in recv_mbuf */
+  unsigned char msg_flags; /* First fragment's flags, 0 if not reassembling */
+#ifdef MG_ENABLE_WS_DEFLATE
+  struct mg_ws_deflate deflate;
+#endif
+};
+#endif
+
 struct mg_http_proto_data {
 #ifndef MG_DISABLE_FILESYSTEM
   struct mg_http_proto_data_file file;
@@ -4120,6 +5575,10 @@ struct mg_http_proto_data {
   struct mg_http_multipart_stream mp_stream;
 #endif
   struct mg_http_proto_data_chuncked chunk;
+  struct mg_http_proto_data_parse parse;
+#ifndef MG_DISABLE_HTTP_WEBSOCKET
+  struct mg_http_proto_data_ws ws;
+#endif
   struct mg_http_endpoint *endpoints;
   mg_event_handler_t endpoint_handler;
 };
@@ -4181,6 +5640,25 @@ static void mg_http_free_proto_data_endpoints(struct mg_http_endpoint **ep) {
   ep = NULL;
 }
 
+#if !defined(MG_DISABLE_HTTP_WEBSOCKET) && defined(MG_ENABLE_WS_DEFLATE)
+static void mg_ws_deflate_free_rx(struct mg_ws_deflate *d) {
+  MG_FREE(d->inflater);
+  MG_FREE(d->rx_dict);
+  d->inflater = NULL;
+  d->rx_dict = NULL;
+}
+
+static void mg_ws_deflate_free_tx(struct mg_ws_deflate *d) {
+  MG_FREE(d->deflater);
+  d->deflater = NULL;
+}
+
+static void mg_ws_deflate_free(struct mg_ws_deflate *d) {
+  mg_ws_deflate_free_rx(d);
+  mg_ws_deflate_free_tx(d);
+}
+#endif
+
 static void mg_http_conn_destructor(void *proto_data) {
   struct mg_http_proto_data *pd = (struct mg_http_proto_data *) proto_data;
 #ifndef MG_DISABLE_FILESYSTEM
@@ -4193,6 +5671,9 @@ static void mg_http_conn_destructor(void *proto_data) {
   mg_http_free_proto_data_mp_stream(&pd->mp_stream);
 #endif
   mg_http_free_proto_data_endpoints(&pd->endpoints);
+#if !defined(MG_DISABLE_HTTP_WEBSOCKET) && defined(MG_ENABLE_WS_DEFLATE)
+  mg_ws_deflate_free(&pd->ws.deflate);
+#endif
   free(proto_data);
 }
 
@@ -4317,16 +5798,18 @@ static struct mg_str mg_get_mime_type(const char *path, const char *dflt,
 #endif
 
 /*
- * Check whether full request is buffered. Return:
+ * Check whether full request is buffered, starting the check at offset
+ * `start` because everything before has been checked already. Return:
  *   -1  if request is malformed
  *    0  if request is not yet fully buffered
  *   >0  actual request length, including last \r\n\r\n
  */
-static int mg_http_get_request_len(const char *s, int buf_len) {
+static int mg_http_get_request_len_from(const char *s, int buf_len,
+                                        int start) {
   const unsigned char *buf = (unsigned char *) s;
   int i;
 
-  for (i = 0; i < buf_len; i++) {
+  for (i = start; i < buf_len; i++) {
     if (!isprint(buf[i]) && buf[i] != '\r' && buf[i] != '\n' && buf[i] < 128) {
       return -1;
     } else if (buf[i] == '\n' && i + 1 < buf_len && buf[i + 1] == '\n') {
@@ -4340,9 +5823,43 @@ static int mg_http_get_request_len(const char *s, int buf_len) {
   return 0;
 }
 
+static int mg_http_get_request_len(const char *s, int buf_len) {
+  return mg_http_get_request_len_from(s, buf_len, 0);
+}
+
+/* Headers indexed in http_message::header_index */
+static const struct mg_str mg_http_indexed_headers[] = {
+    MG_MK_STR("Host"),          MG_MK_STR("Range"),
+    MG_MK_STR("Depth"),         MG_MK_STR("Cookie"),
+    MG_MK_STR("Status"),        MG_MK_STR("Upgrade"),
+    MG_MK_STR("Location"),      MG_MK_STR("Connection"),
+    MG_MK_STR("Destination"),   MG_MK_STR("Content-Type"),
+    MG_MK_STR("Authorization"), MG_MK_STR("Content-Range"),
+    MG_MK_STR("If-None-Match"), MG_MK_STR("Content-Length"),
+    MG_MK_STR("Transfer-Encoding"), MG_MK_STR("Sec-WebSocket-Key"),
+    MG_MK_STR("If-Modified-Since"), MG_MK_STR("Sec-WebSocket-Accept")};
+#define MG_HTTP_HDR_CONTENT_LENGTH 13 /* Position in the list above */
+
+/* Fails to compile if MG_HTTP_NUM_INDEXED_HEADERS is out of sync */
+typedef char mg_http_indexed_headers_check
+    [ARRAY_SIZE(mg_http_indexed_headers) == MG_HTTP_NUM_INDEXED_HEADERS ? 1
+                                                                        : -1];
+
+/* Returns position of header `name` in mg_http_indexed_headers, or -1 */
+static int mg_http_indexed_header(const char *name, size_t len) {
+  int i;
+  for (i = 0; i < MG_HTTP_NUM_INDEXED_HEADERS; i++) {
+    const struct mg_str *h = &mg_http_indexed_headers[i];
+    if (h->len == len && mg_ncasecmp(h->p, name, len) == 0) return i;
+  }
+  return -1;
+}
+
 static const char *mg_http_parse_headers(const char *s, const char *end,
                                          int len, struct http_message *req) {
-  int i;
+  int i, idx;
+  memset(req->header_index, 0, sizeof(req->header_index));
+  req->header_index_valid = 1;
   for (i = 0; i < (int) ARRAY_SIZE(req->header_names) - 1; i++) {
     struct mg_str *k = &req->header_names[i], *v = &req->header_values[i];
 
@@ -4359,7 +5876,11 @@ static const char *mg_http_parse_headers(const char *s, const char *end,
       break;
     }
 
-    if (!mg_ncasecmp(k->p, "Content-Length", 14)) {
+    idx = mg_http_indexed_header(k->p, k->len);
+    if (idx < 0 || req->header_index[idx] != 0) continue;
+    req->header_index[idx] = (unsigned short) (i + 1);
+
+    if (idx == MG_HTTP_HDR_CONTENT_LENGTH) {
       req->body.len = to64(v->p);
       req->message.len = len + req->body.len;
     }
@@ -4368,11 +5889,10 @@ static const char *mg_http_parse_headers(const char *s, const char *end,
   return s;
 }
 
-int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
+/* Parses a message whose headers are known to be `len` bytes long */
+static int mg_http_parse_message(const char *s, int len,
+                                 struct http_message *hm, int is_req) {
   const char *end, *qs;
-  int len = mg_http_get_request_len(s, n);
-
-  if (len <= 0) return len;
 
   memset(hm, 0, sizeof(*hm));
   hm->message.p = s;
@@ -4432,8 +5952,39 @@ int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
   return len;
 }
 
+int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req) {
+  int len = mg_http_get_request_len(s, n);
+  return len <= 0 ? len : mg_http_parse_message(s, len, hm, is_req);
+}
+
+/*
+ * Same as mg_parse_http() for the message at the front of `io`, but doesn't
+ * look again at the bytes `ps` says have been checked by a previous call.
+ */
+static int mg_http_parse_recv(struct mg_http_proto_data_parse *ps,
+                              struct mbuf *io, struct http_message *hm,
+                              int is_req) {
+  if (ps->req_len == 0) {
+    int len = mg_http_get_request_len_from(io->buf, io->len, ps->scanned);
+    if (len <= 0) {
+      /* The end of headers may start in the last two bytes */
+      ps->scanned = io->len > 2 ? io->len - 2 : 0;
+      return len;
+    }
+    ps->req_len = len;
+  }
+  return mg_http_parse_message(io->buf, ps->req_len, hm, is_req);
+}
+
 struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
   size_t i, len = strlen(name);
+  int idx;
+
+  if (hm->header_index_valid &&
+      (idx = mg_http_indexed_header(name, len)) >= 0) {
+    i = hm->header_index[idx];
+    return i > 0 ? &hm->header_values[i - 1] : NULL;
+  }
 
   for (i = 0; hm->header_names[i].len > 0; i++) {
     struct mg_str *h = &hm->header_names[i], *v = &hm->header_values[i];
@@ -4446,10 +5997,6 @@ struct mg_str *mg_get_http_header(struct http_message *hm, const char *name) {
 
 #ifndef MG_DISABLE_HTTP_WEBSOCKET
 
-static int mg_is_ws_fragment(unsigned char flags) {
-  return (flags & 0x80) == 0 || (flags & 0x0f) == 0;
-}
-
 static int mg_is_ws_first_fragment(unsigned char flags) {
   return (flags & 0x80) == 0 && (flags & 0x0f) != 0;
 }
@@ -4463,131 +6010,559 @@ static void mg_handle_incoming_websocket_frame(struct mg_connection *nc,
   }
 }
 
-static int mg_deliver_websocket_data(struct mg_connection *nc) {
-  /* Using unsigned char *, cause of integer arithmetic below */
-  uint64_t i, data_len = 0, frame_len = 0, buf_len = nc->recv_mbuf.len, len,
-              mask_len = 0, header_len = 0;
-  unsigned char *p = (unsigned char *) nc->recv_mbuf.buf, *buf = p,
-                *e = p + buf_len;
-  unsigned *sizep = (unsigned *) &p[1]; /* Size ptr for defragmented frames */
-  int ok, reass = buf_len > 0 && mg_is_ws_fragment(p[0]) &&
-                  !(nc->flags & MG_F_WEBSOCKET_NO_DEFRAG);
+/*
+ * XOR `len` bytes with the 4-byte masking `key`, starting at key byte `off`.
+ * Once `data` is word aligned, it's processed a vector or a word at a time.
+ */
+static void mg_ws_mask(unsigned char *data, size_t len,
+                       const unsigned char *key, size_t off) {
+  unsigned char k[16];
+  size_t i, j, kw;
 
-  /* If that's a continuation frame that must be reassembled, handle it */
-  if (reass && !mg_is_ws_first_fragment(p[0]) &&
-      buf_len >= 1 + sizeof(*sizep) && buf_len >= 1 + sizeof(*sizep) + *sizep) {
-    buf += 1 + sizeof(*sizep) + *sizep;
-    buf_len -= 1 + sizeof(*sizep) + *sizep;
+  for (i = 0; i < len && ((size_t)(data + i) & (sizeof(kw) - 1)) != 0; i++) {
+    data[i] ^= key[(off + i) & 3];
   }
 
-  if (buf_len >= 2) {
-    len = buf[1] & 127;
-    mask_len = buf[1] & 128 ? 4 : 0;
-    if (len < 126 && buf_len >= mask_len) {
-      data_len = len;
-      header_len = 2 + mask_len;
-    } else if (len == 126 && buf_len >= 4 + mask_len) {
-      header_len = 4 + mask_len;
-      data_len = ntohs(*(uint16_t *) &buf[2]);
-    } else if (buf_len >= 10 + mask_len) {
-      header_len = 10 + mask_len;
-      data_len = (((uint64_t) ntohl(*(uint32_t *) &buf[2])) << 32) +
-                 ntohl(*(uint32_t *) &buf[6]);
+  /* Chunks are multiples of 4 bytes, so the key phase stays the same */
+  for (j = 0; j < sizeof(k); j++) {
+    k[j] = key[(off + i + j) & 3];
+  }
+
+#if defined(_MG_WS_MASK_SSE2)
+  {
+    __m128i kv = _mm_loadu_si128((const __m128i *) k);
+    for (; len - i >= 16; i += 16) {
+      __m128i *v = (__m128i *) (data + i);
+      _mm_storeu_si128(v, _mm_xor_si128(_mm_loadu_si128(v), kv));
     }
   }
+#elif defined(_MG_WS_MASK_NEON)
+  {
+    uint8x16_t kv = vld1q_u8(k);
+    for (; len - i >= 16; i += 16) {
+      vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), kv));
+    }
+  }
+#endif
 
-  frame_len = header_len + data_len;
-  ok = frame_len > 0 && frame_len <= buf_len;
+  memcpy(&kw, k, sizeof(kw));
+  for (; len - i >= sizeof(kw); i += sizeof(kw)) {
+    *(size_t *) (data + i) ^= kw;
+  }
+
+  for (; i < len; i++) {
+    data[i] ^= key[(off + i) & 3];
+  }
+}
 
-  if (ok) {
-    struct websocket_message wsm;
+#ifdef MG_ENABLE_WS_DEFLATE
 
-    wsm.size = (size_t) data_len;
-    wsm.data = buf + header_len;
-    wsm.flags = buf[0];
+/* permessage-deflate parameters of an offer or a response */
+struct mg_ws_deflate_params {
+  int server_max_window_bits; /* -1 if absent, 0 if present without value */
+  int client_max_window_bits;
+  int server_no_context_takeover;
+  int client_no_context_takeover;
+};
 
-    /* Apply mask if necessary */
-    if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        buf[i + header_len] ^= (buf + header_len - mask_len)[i % 4];
-      }
-    }
+static struct mg_str mg_ws_trim(const char *p, const char *end) {
+  struct mg_str s;
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+  s.p = p;
+  s.len = end - p;
+  return s;
+}
 
-    if (reass) {
-      /* On first fragmented frame, nullify size */
-      if (mg_is_ws_first_fragment(wsm.flags)) {
-        mbuf_resize(&nc->recv_mbuf, nc->recv_mbuf.size + sizeof(*sizep));
-        p[0] &= ~0x0f; /* Next frames will be treated as continuation */
-        buf = p + 1 + sizeof(*sizep);
-        *sizep = 0; /* TODO(lsm): fix. this can stomp over frame data */
-      }
+static int mg_ws_parse_window_bits(const struct mg_str *v, int *bits) {
+  char buf[4];
+  if (v->p == NULL) {
+    *bits = 0;
+    return 1;
+  }
+  if (v->len == 0 || v->len >= sizeof(buf)) return 0;
+  memcpy(buf, v->p, v->len);
+  buf[v->len] = '\0';
+  *bits = atoi(buf);
+  return *bits >= 8 && *bits <= 15;
+}
 
-      /* Append this frame to the reassembled buffer */
-      memmove(buf, wsm.data, e - wsm.data);
-      (*sizep) += wsm.size;
-      nc->recv_mbuf.len -= wsm.data - buf;
-
-      /* On last fragmented frame - call user handler and remove data */
-      if (wsm.flags & 0x80) {
-        wsm.data = p + 1 + sizeof(*sizep);
-        wsm.size = *sizep;
-        mg_handle_incoming_websocket_frame(nc, &wsm);
-        mbuf_remove(&nc->recv_mbuf, 1 + sizeof(*sizep) + *sizep);
+/*
+ * Parse one extension list entry, like
+ * "permessage-deflate; client_max_window_bits". Returns 0 if that's another
+ * extension, or if it has parameters we don't know.
+ */
+static int mg_ws_deflate_parse(const char *p, const char *end,
+                               struct mg_ws_deflate_params *dp) {
+  const char *sep, *eq;
+  int first = 1;
+
+  dp->server_max_window_bits = dp->client_max_window_bits = -1;
+  dp->server_no_context_takeover = dp->client_no_context_takeover = 0;
+
+  for (; p < end; p = sep + 1) {
+    struct mg_str name, value = {NULL, 0};
+    if ((sep = (const char *) memchr(p, ';', end - p)) == NULL) sep = end;
+    if ((eq = (const char *) memchr(p, '=', sep - p)) != NULL) {
+      name = mg_ws_trim(p, eq);
+      value = mg_ws_trim(eq + 1, sep);
+      if (value.len >= 2 && value.p[0] == '"' &&
+          value.p[value.len - 1] == '"') {
+        value.p++;
+        value.len -= 2;
       }
     } else {
-      /* TODO(lsm): properly handle OOB control frames during defragmentation */
-      mg_handle_incoming_websocket_frame(nc, &wsm);
-      mbuf_remove(&nc->recv_mbuf, (size_t) frame_len); /* Cleanup frame */
-    }
-
-    /* If client closes, close too */
-    if ((buf[0] & 0x0f) == WEBSOCKET_OP_CLOSE) {
-      nc->flags |= MG_F_SEND_AND_CLOSE;
+      name = mg_ws_trim(p, sep);
+    }
+
+    if (first) {
+      if (mg_vcasecmp(&name, "permessage-deflate") != 0) return 0;
+      first = 0;
+    } else if (mg_vcasecmp(&name, "server_no_context_takeover") == 0) {
+      dp->server_no_context_takeover = 1;
+    } else if (mg_vcasecmp(&name, "client_no_context_takeover") == 0) {
+      dp->client_no_context_takeover = 1;
+    } else if (mg_vcasecmp(&name, "server_max_window_bits") == 0) {
+      if (!mg_ws_parse_window_bits(&value, &dp->server_max_window_bits)) {
+        return 0;
+      }
+    } else if (mg_vcasecmp(&name, "client_max_window_bits") == 0) {
+      if (!mg_ws_parse_window_bits(&value, &dp->client_max_window_bits)) {
+        return 0;
+      }
+    } else {
+      return 0;
     }
   }
 
-  return ok;
+  return !first;
 }
 
-struct ws_mask_ctx {
-  size_t pos; /* zero means unmasked */
-  uint32_t mask;
-};
-
-static uint32_t mg_ws_random_mask(void) {
-  uint32_t mask;
 /*
- * The spec requires WS client to generate hard to
- * guess mask keys. From RFC6455, Section 5.3:
- *
- * The unpredictability of the masking key is essential to prevent
- * authors of malicious applications from selecting the bytes that appear on
- * the wire.
- *
- * Hence this feature is essential when the actual end user of this API
- * is untrusted code that wouldn't have access to a lower level net API
- * anyway (e.g. web browsers). Hence this feature is low prio for most
- * mongoose use cases and thus can be disabled, e.g. when porting to a platform
- * that lacks random().
+ * Set up `d` from a client's offer (on a server) or a server's response
+ * (on a client). Returns 0 if we can't use these parameters.
  */
-#ifdef MG_DISABLE_WS_RANDOM_MASK
-  mask = 0xefbeadde; /* generated with a random number generator, I swear */
-#else
-  if (sizeof(long) >= 4) {
-    mask = (uint32_t) random();
-  } else if (sizeof(long) == 2) {
-    mask = (uint32_t) random() << 16 | (uint32_t) random();
+static int mg_ws_deflate_apply(struct mg_ws_deflate *d,
+                               const struct mg_ws_deflate_params *dp,
+                               int is_server) {
+  int bits = MG_WS_DEFLATE_WINDOW_BITS;
+
+  if (is_server) {
+    /* Without client_max_window_bits, the client may use a 32K window */
+    if (dp->client_max_window_bits < 0 && bits < 15) return 0;
+    if (dp->client_max_window_bits > 0 && dp->client_max_window_bits < bits) {
+      bits = dp->client_max_window_bits;
+    }
+    /* miniz always compresses with a 32K window */
+    d->tx_ok = dp->server_max_window_bits <= 0 ||
+               dp->server_max_window_bits == 15;
+    d->rx_no_takeover = dp->client_no_context_takeover;
+    d->tx_no_takeover = dp->server_no_context_takeover;
+  } else {
+    int server_bits =
+        dp->server_max_window_bits > 0 ? dp->server_max_window_bits : 15;
+    if (server_bits > bits) return 0;
+    bits = server_bits;
+    d->tx_ok = dp->client_max_window_bits <= 0 ||
+               dp->client_max_window_bits == 15;
+    d->rx_no_takeover = dp->server_no_context_takeover;
+    d->tx_no_takeover = dp->client_no_context_takeover;
   }
+
+#ifdef MG_WS_DEFLATE_NO_CONTEXT_TAKEOVER
+  d->rx_no_takeover = d->tx_no_takeover = 1;
 #endif
-  return mask;
+  d->rx_bits = (unsigned char) bits;
+  d->enabled = 1;
+
+  return 1;
 }
 
-static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
+/*
+ * Go through the permessage-deflate entries of all Sec-WebSocket-Extensions
+ * headers and take the first usable one. Returns 0 if there's none.
+ */
+static int mg_ws_deflate_negotiate(struct mg_ws_deflate *d,
+                                   struct http_message *hm, int is_server,
+                                   struct mg_ws_deflate_params *dp) {
+  int i;
+
+  for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++) {
+    const char *p = hm->header_values[i].p, *sep,
+               *end = p + hm->header_values[i].len;
+    if (mg_vcasecmp(&hm->header_names[i], "Sec-WebSocket-Extensions") != 0) {
+      continue;
+    }
+    for (; p < end; p = sep + 1) {
+      if ((sep = (const char *) memchr(p, ',', end - p)) == NULL) sep = end;
+      if (mg_ws_deflate_parse(p, sep, dp) &&
+          (mg_ws_deflate_apply(d, dp, is_server) || !is_server)) {
+        /* Servers try the next offer, clients must take the response */
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Print the client's offer header */
+static void mg_ws_deflate_offer(struct mg_connection *nc) {
+  mg_printf(nc, "Sec-WebSocket-Extensions: permessage-deflate");
+  if (MG_WS_DEFLATE_WINDOW_BITS < 15) {
+    mg_printf(nc, "; server_max_window_bits=%d", MG_WS_DEFLATE_WINDOW_BITS);
+  }
+#ifdef MG_WS_DEFLATE_NO_CONTEXT_TAKEOVER
+  mg_printf(nc, "; server_no_context_takeover; client_no_context_takeover");
+#endif
+  mg_printf(nc, "\r\n");
+}
+
+/* Accept a client's offer, if any, and print the response header */
+static void mg_ws_deflate_accept(struct mg_connection *nc,
+                                 struct http_message *hm) {
+  struct mg_ws_deflate *d = &mg_http_get_proto_data(nc)->ws.deflate;
+  struct mg_ws_deflate_params dp;
+
+  if (!mg_ws_deflate_negotiate(d, hm, 1, &dp) || !d->enabled) return;
+
+  mg_printf(nc, "Sec-WebSocket-Extensions: permessage-deflate");
+  if (dp.server_max_window_bits >= 0) {
+    mg_printf(nc, "; server_max_window_bits=%d",
+              dp.server_max_window_bits > 0 ? dp.server_max_window_bits : 15);
+  }
+  if (d->rx_bits < 15) {
+    mg_printf(nc, "; client_max_window_bits=%d", d->rx_bits);
+  }
+  if (d->tx_no_takeover) {
+    mg_printf(nc, "; server_no_context_takeover");
+  }
+  if (d->rx_no_takeover) {
+    mg_printf(nc, "; client_no_context_takeover");
+  }
+  mg_printf(nc, "\r\n");
+}
+
+/* Apply the server's response. Returns 0 if it can't be accepted. */
+static int mg_ws_deflate_accepted(struct mg_connection *nc,
+                                  struct http_message *hm) {
+  struct mg_ws_deflate *d = &mg_http_get_proto_data(nc)->ws.deflate;
+  struct mg_ws_deflate_params dp;
+  return !mg_ws_deflate_negotiate(d, hm, 0, &dp) || d->enabled;
+}
+
+static mz_bool mg_ws_deflate_put(const void *buf, int len, void *user) {
+  struct mg_ws_deflate *d = (struct mg_ws_deflate *) user;
+  return mbuf_append(d->tx_out, buf, len) == (size_t) len;
+}
+
+/*
+ * If data frame `op` belongs to a compressed message, compress its payload
+ * into `out` and return non-zero. Short unfragmented messages are sent as
+ * they are.
+ */
+static int mg_ws_deflate_frame(struct mg_connection *nc, int op,
+                               const struct mg_str *strv, int strvcnt,
+                               struct mbuf *out) {
+  struct mg_ws_deflate *d = &mg_http_get_proto_data(nc)->ws.deflate;
+  int i, fin = !(op & WEBSOCKET_DONT_FIN);
+  size_t len = 0;
+
+  if (!d->enabled || !d->tx_ok || (op & 0x8)) return 0;
+
+  for (i = 0; i < strvcnt; i++) {
+    len += strv[i].len;
+  }
+
+  if ((op & 0x0f) != WEBSOCKET_OP_CONTINUE) {
+    d->tx_msg = !fin || len >= MG_WS_DEFLATE_MIN_SIZE;
+    if (d->tx_msg && d->deflater == NULL) {
+      d->deflater = (tdefl_compressor *) MG_MALLOC(sizeof(*d->deflater));
+      if (d->deflater == NULL) {
+        d->tx_msg = 0;
+      } else {
+        tdefl_init(d->deflater, mg_ws_deflate_put, d,
+                   TDEFL_DEFAULT_MAX_PROBES);
+      }
+    }
+  }
+  if (!d->tx_msg) return 0;
+
+  d->tx_out = out;
+  for (i = 0; i < strvcnt; i++) {
+    tdefl_compress_buffer(d->deflater, strv[i].p, strv[i].len, TDEFL_NO_FLUSH);
+  }
+  tdefl_compress_buffer(d->deflater, NULL, 0, TDEFL_SYNC_FLUSH);
+
+  if (fin) {
+    /* A message ends without the sync flush marker, RFC 7692 7.2.1 */
+    if (out->len >= 4 &&
+        memcmp(out->buf + out->len - 4, "\0\0\xff\xff", 4) == 0) {
+      out->len -= 4;
+    }
+    d->tx_msg = 0;
+    if (d->tx_no_takeover) mg_ws_deflate_free_tx(d);
+  }
+
+  return 1;
+}
+
+/* Feed compressed data to the decompressor. Returns a close status or 0. */
+static int mg_ws_inflate(struct mg_ws_deflate *d, const unsigned char *in,
+                         size_t len, struct mbuf *out) {
+  size_t dict_mask = ((size_t) 1 << d->rx_bits) - 1;
+
+  for (;;) {
+    size_t in_size = len, out_size = dict_mask + 1 - d->rx_dict_ofs;
+    tinfl_status status = tinfl_decompress(
+        d->inflater, in, &in_size, d->rx_dict, d->rx_dict + d->rx_dict_ofs,
+        &out_size, TINFL_FLAG_HAS_MORE_INPUT);
+
+    in += in_size;
+    len -= in_size;
+    mbuf_append(out, d->rx_dict + d->rx_dict_ofs, out_size);
+    d->rx_dict_ofs = (d->rx_dict_ofs + out_size) & dict_mask;
+
+    if (MG_MAX_WEBSOCKET_MESSAGE_SIZE > 0 &&
+        out->len > MG_MAX_WEBSOCKET_MESSAGE_SIZE) {
+      return 1009;
+    }
+    if (status < 0) return 1007;
+    if (status == TINFL_STATUS_DONE) {
+      /* Final block seen, the rest of the message is ignored */
+      tinfl_init(d->inflater);
+      return 0;
+    }
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) return 0;
+  }
+}
+
+/*
+ * If `wsm` belongs to a compressed message, inflate its payload into `out`
+ * and point `wsm` there. Returns a close status or 0.
+ */
+static int mg_ws_inflate_frame(struct mg_connection *nc,
+                               struct websocket_message *wsm,
+                               struct mbuf *out) {
+  struct mg_ws_deflate *d = &mg_http_get_proto_data(nc)->ws.deflate;
+  int status;
+
+  if (wsm->flags & 0x8) return 0;
+  if ((wsm->flags & 0x0f) != WEBSOCKET_OP_CONTINUE) {
+    d->rx_msg = d->enabled && (wsm->flags & 0x40);
+  }
+  if (!d->rx_msg) return 0;
+
+  if (d->inflater == NULL) {
+    d->inflater = (tinfl_decompressor *) MG_MALLOC(sizeof(*d->inflater));
+    d->rx_dict = (unsigned char *) MG_MALLOC((size_t) 1 << d->rx_bits);
+    d->rx_dict_ofs = 0;
+    if (d->inflater == NULL || d->rx_dict == NULL) {
+      mg_ws_deflate_free_rx(d);
+      return 1011;
+    }
+    tinfl_init(d->inflater);
+  }
+
+  status = mg_ws_inflate(d, wsm->data, wsm->size, out);
+  if (status == 0 && (wsm->flags & 0x80)) {
+    status = mg_ws_inflate(d, (const unsigned char *) "\0\0\xff\xff", 4, out);
+    d->rx_msg = 0;
+    if (d->rx_no_takeover) mg_ws_deflate_free_rx(d);
+  }
+
+  wsm->data = (unsigned char *) out->buf;
+  wsm->size = out->len;
+  wsm->flags &= ~0x40;
+
+  return status;
+}
+
+#endif /* MG_ENABLE_WS_DEFLATE */
+
+static void mg_ws_reset_message(struct mg_connection *nc,
+                                struct mg_http_proto_data_ws *ws) {
+  mbuf_remove(&nc->recv_mbuf, ws->frame_pos);
+  ws->msg_len = ws->frame_pos = 0;
+  ws->msg_flags = 0;
+}
+
+/* Send a close frame with `code` and drop everything received */
+static void mg_ws_fail(struct mg_connection *nc,
+                       struct mg_http_proto_data_ws *ws, int code) {
+  uint16_t status = htons((uint16_t) code);
+  mg_send_websocket_frame(nc, WEBSOCKET_OP_CLOSE, &status, sizeof(status));
+  ws->frame_pos = nc->recv_mbuf.len;
+  mg_ws_reset_message(nc, ws);
+}
+
+/*
+ * Hand a frame or a reassembled message to the handler, inflating it first
+ * if it's compressed. Returns 0 if the connection has been failed instead.
+ */
+static int mg_ws_deliver(struct mg_connection *nc,
+                         struct mg_http_proto_data_ws *ws,
+                         struct websocket_message *wsm) {
+#ifdef MG_ENABLE_WS_DEFLATE
+  struct mbuf inflated;
+  int status;
+
+  mbuf_init(&inflated, 0);
+  if ((status = mg_ws_inflate_frame(nc, wsm, &inflated)) != 0) {
+    mbuf_free(&inflated);
+    mg_ws_fail(nc, ws, status);
+    return 0;
+  }
+  mg_handle_incoming_websocket_frame(nc, wsm);
+  mbuf_free(&inflated);
+#else
+  (void) ws;
+  mg_handle_incoming_websocket_frame(nc, wsm);
+#endif
+  return 1;
+}
+
+static int mg_deliver_websocket_data(struct mg_connection *nc) {
+  /* Using unsigned char *, cause of integer arithmetic below */
+  struct mg_http_proto_data_ws *ws = &mg_http_get_proto_data(nc)->ws;
+  uint64_t data_len = 0, frame_len = 0, len, mask_len = 0, header_len = 0,
+           buf_len = nc->recv_mbuf.len - ws->frame_pos;
+  unsigned char *buf = (unsigned char *) nc->recv_mbuf.buf + ws->frame_pos;
+  struct websocket_message wsm;
+  int ok;
+
+  /* Once closing, whatever the peer sends is dropped */
+  if (nc->flags & MG_F_SEND_AND_CLOSE) {
+    ws->frame_pos = nc->recv_mbuf.len;
+    mg_ws_reset_message(nc, ws);
+    return 0;
+  }
+
+  if (buf_len >= 2) {
+    len = buf[1] & 127;
+    mask_len = buf[1] & 128 ? 4 : 0;
+    if (len < 126 && buf_len >= mask_len) {
+      data_len = len;
+      header_len = 2 + mask_len;
+    } else if (len == 126 && buf_len >= 4 + mask_len) {
+      header_len = 4 + mask_len;
+      data_len = ntohs(*(uint16_t *) &buf[2]);
+    } else if (buf_len >= 10 + mask_len) {
+      header_len = 10 + mask_len;
+      data_len = (((uint64_t) ntohl(*(uint32_t *) &buf[2])) << 32) +
+                 ntohl(*(uint32_t *) &buf[6]);
+    }
+  }
+
+  /* Refuse oversized messages as soon as the frame header tells */
+  if (MG_MAX_WEBSOCKET_MESSAGE_SIZE > 0 && header_len > 0 &&
+      data_len + (buf[0] & 0x8 ? 0 : ws->msg_len) >
+          MG_MAX_WEBSOCKET_MESSAGE_SIZE) {
+    mg_ws_fail(nc, ws, 1009);
+    return 0;
+  }
+
+  frame_len = header_len + data_len;
+  ok = frame_len > 0 && frame_len <= buf_len;
+
+  /*
+   * Unmask the payload as it arrives, while it's still in cache, rather
+   * than all of it once the frame is complete.
+   */
+  if (mask_len > 0 && header_len > 0 && buf_len > header_len) {
+    uint64_t avail = buf_len - header_len;
+    if (avail > data_len) avail = data_len;
+    if (avail > ws->unmasked) {
+      mg_ws_mask(buf + header_len + ws->unmasked,
+                 (size_t)(avail - ws->unmasked), buf + header_len - mask_len,
+                 ws->unmasked);
+      ws->unmasked = (size_t) avail;
+    }
+  }
+
+  if (!ok) return 0;
+
+  wsm.size = (size_t) data_len;
+  wsm.data = buf + header_len;
+  wsm.flags = buf[0];
+  ws->unmasked = 0;
+
+  if ((wsm.flags & 0x8) || (nc->flags & MG_F_WEBSOCKET_NO_DEFRAG) ||
+      (ws->msg_flags == 0 && !mg_is_ws_first_fragment(wsm.flags))) {
+    /* Deliver in place. Inside a fragmented message, just skip it */
+    if (!mg_ws_deliver(nc, ws, &wsm)) return 0;
+    if (ws->msg_flags == 0) {
+      mbuf_remove(&nc->recv_mbuf, (size_t) frame_len); /* Cleanup frame */
+    } else {
+      ws->frame_pos += (size_t) frame_len;
+    }
+  } else {
+    /* Append the payload to the reassembled message; the tail stays put */
+    if (ws->msg_flags == 0) ws->msg_flags = wsm.flags;
+    memmove(nc->recv_mbuf.buf + ws->msg_len, wsm.data, wsm.size);
+    ws->msg_len += wsm.size;
+    ws->frame_pos += (size_t) frame_len;
+
+    /* On last fragmented frame - call user handler and remove data */
+    if (wsm.flags & 0x80) {
+      wsm.data = (unsigned char *) nc->recv_mbuf.buf;
+      wsm.size = ws->msg_len;
+      wsm.flags = 0x80 | (ws->msg_flags & 0x7f);
+      if (!mg_ws_deliver(nc, ws, &wsm)) return 0;
+      mg_ws_reset_message(nc, ws);
+    }
+  }
+
+  /* If client closes, close too */
+  if ((wsm.flags & 0x0f) == WEBSOCKET_OP_CLOSE) {
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+  }
+
+  return ok;
+}
+
+struct ws_mask_ctx {
+  size_t pos; /* zero means unmasked */
+  uint32_t mask;
+};
+
+static uint32_t mg_ws_random_mask(void) {
+  uint32_t mask;
+/*
+ * The spec requires WS client to generate hard to
+ * guess mask keys. From RFC6455, Section 5.3:
+ *
+ * The unpredictability of the masking key is essential to prevent
+ * authors of malicious applications from selecting the bytes that appear on
+ * the wire.
+ *
+ * Hence this feature is essential when the actual end user of this API
+ * is untrusted code that wouldn't have access to a lower level net API
+ * anyway (e.g. web browsers). Hence this feature is low prio for most
+ * mongoose use cases and thus can be disabled, e.g. when porting to a platform
+ * that lacks random().
+ */
+#ifdef MG_DISABLE_WS_RANDOM_MASK
+  mask = 0xefbeadde; /* generated with a random number generator, I swear */
+#else
+  if (sizeof(long) >= 4) {
+    mask = (uint32_t) random();
+  } else if (sizeof(long) == 2) {
+    mask = (uint32_t) random() << 16 | (uint32_t) random();
+  }
+#endif
+  return mask;
+}
+
+static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
                               struct ws_mask_ctx *ctx) {
   int header_len;
   unsigned char header[10];
 
   header[0] = (op & WEBSOCKET_DONT_FIN ? 0x0 : 0x80) + (op & 0x0f);
+#ifdef MG_ENABLE_WS_DEFLATE
+  if (op & _MG_WS_COMPRESSED) header[0] |= 0x40; /* RSV1 */
+#endif
   if (len < 126) {
     header[1] = len;
     header_len = 2;
@@ -4620,17 +6595,47 @@ static void mg_send_ws_header(struct mg_connection *nc, int op, size_t len,
 }
 
 static void mg_ws_mask_frame(struct mbuf *mbuf, struct ws_mask_ctx *ctx) {
-  size_t i;
   if (ctx->pos == 0) return;
-  for (i = 0; i < (mbuf->len - ctx->pos); i++) {
-    mbuf->buf[ctx->pos + i] ^= ((char *) &ctx->mask)[i % 4];
+  mg_ws_mask((unsigned char *) mbuf->buf + ctx->pos, mbuf->len - ctx->pos,
+             (unsigned char *) &ctx->mask, 0);
+}
+
+#ifdef MG_ENABLE_WS_DEFLATE
+/* Send a data frame compressed, if it should be. Returns 0 if it wasn't */
+static int mg_ws_send_deflated(struct mg_connection *nc, int op,
+                               const struct mg_str *strv, int strvcnt) {
+  struct ws_mask_ctx ctx;
+  struct mbuf out;
+
+  mbuf_init(&out, 0);
+  if (!mg_ws_deflate_frame(nc, op, strv, strvcnt, &out)) {
+    mbuf_free(&out);
+    return 0;
   }
+
+  /* RSV1 marks the first frame of a compressed message */
+  if ((op & 0x0f) != WEBSOCKET_OP_CONTINUE) op |= _MG_WS_COMPRESSED;
+  mg_send_ws_header(nc, op, out.len, &ctx);
+  mg_send(nc, out.buf, out.len);
+  mg_ws_mask_frame(&nc->send_mbuf, &ctx);
+  mbuf_free(&out);
+
+  return 1;
 }
+#endif
 
 void mg_send_websocket_frame(struct mg_connection *nc, int op, const void *data,
                              size_t len) {
   struct ws_mask_ctx ctx;
   DBG(("%p %d %d", nc, op, (int) len));
+#ifdef MG_ENABLE_WS_DEFLATE
+  {
+    struct mg_str str;
+    str.p = (const char *) data;
+    str.len = len;
+    if (mg_ws_send_deflated(nc, op, &str, 1)) return;
+  }
+#endif
   mg_send_ws_header(nc, op, len, &ctx);
   mg_send(nc, data, len);
 
@@ -4646,6 +6651,9 @@ void mg_send_websocket_framev(struct mg_connection *nc, int op,
   struct ws_mask_ctx ctx;
   int i;
   int len = 0;
+#ifdef MG_ENABLE_WS_DEFLATE
+  if (mg_ws_send_deflated(nc, op, strv, strvcnt)) return;
+#endif
   for (i = 0; i < strvcnt; i++) {
     len += strv[i].len;
   }
@@ -4704,8 +6712,8 @@ static void mg_websocket_handler(struct mg_connection *nc, int ev,
   }
 }
 
-static void mg_ws_handshake(struct mg_connection *nc,
-                            const struct mg_str *key) {
+static void mg_ws_handshake(struct mg_connection *nc, const struct mg_str *key,
+                            struct http_message *hm) {
   static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   char buf[MG_VPRINTF_BUFFER_SIZE], sha[20], b64_sha[sizeof(sha) * 2];
   cs_sha1_ctx sha_ctx;
@@ -4722,7 +6730,13 @@ static void mg_ws_handshake(struct mg_connection *nc,
             "Upgrade: websocket\r\n"
             "Connection: Upgrade\r\n"
             "Sec-WebSocket-Accept: ",
-            b64_sha, "\r\n\r\n");
+            b64_sha, "\r\n");
+#ifdef MG_ENABLE_WS_DEFLATE
+  mg_ws_deflate_accept(nc, hm);
+#else
+  (void) hm;
+#endif
+  mg_printf(nc, "\r\n");
   DBG(("%p %.*s %s", nc, (int) key->len, key->p, b64_sha));
 }
 
@@ -4736,9 +6750,9 @@ static void mg_http_transfer_file_data(struct mg_connection *nc) {
   size_t n = 0, to_read = 0;
 
   if (pd->file.type == DATA_FILE) {
-    struct mbuf *io = &nc->send_mbuf;
-    if (io->len < sizeof(buf)) {
-      to_read = sizeof(buf) - io->len;
+    size_t queued = mg_send_queue_len(nc);
+    if (queued < sizeof(buf)) {
+      to_read = sizeof(buf) - queued;
     }
 
     if (left > 0 && to_read > (size_t) left) {
@@ -5006,7 +7020,17 @@ void mg_http_handler(struct mg_connection *nc, int ev, void *ev_data) {
     }
 #endif /* MG_ENABLE_HTTP_STREAMING_MULTIPART */
 
-    req_len = mg_parse_http(io->buf, io->len, hm, is_req);
+    if (io->len != pd->parse.io_len + *(int *) ev_data) {
+      /* Somebody else has consumed data, start over */
+      memset(&pd->parse, 0, sizeof(pd->parse));
+    }
+  again:
+    if (pd->parse.body_end > io->len) {
+      /* Headers are parsed already, the body is not fully buffered yet */
+      pd->parse.io_len = io->len;
+      return;
+    }
+    req_len = mg_http_parse_recv(&pd->parse, io, hm, is_req);
 
     if (req_len > 0 &&
         (s = mg_get_http_header(hm, "Transfer-Encoding")) != NULL &&
@@ -5036,6 +7060,13 @@ void mg_http_handler(struct mg_connection *nc, int ev, void *ev_data) {
              mg_get_http_header(hm, "Sec-WebSocket-Accept")) {
       /* We're websocket client, got handshake response from server. */
       /* TODO(lsm): check the validity of accept Sec-WebSocket-Accept */
+#ifdef MG_ENABLE_WS_DEFLATE
+      if (!mg_ws_deflate_accepted(nc, hm)) {
+        DBG(("%p bad permessage-deflate response", nc));
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+        return;
+      }
+#endif
       mbuf_remove(io, req_len);
       nc->proto_handler = mg_websocket_handler;
       nc->flags |= MG_F_IS_WEBSOCKET;
@@ -5051,8 +7082,8 @@ void mg_http_handler(struct mg_connection *nc, int ev, void *ev_data) {
       /* Send handshake */
       mg_call(nc, nc->handler, MG_EV_WEBSOCKET_HANDSHAKE_REQUEST, hm);
       if (!(nc->flags & MG_F_CLOSE_IMMEDIATELY)) {
-        if (nc->send_mbuf.len == 0) {
-          mg_ws_handshake(nc, vec);
+        if (mg_send_queue_len(nc) == 0) {
+          mg_ws_handshake(nc, vec, hm);
         }
         mg_call(nc, nc->handler, MG_EV_WEBSOCKET_HANDSHAKE_DONE, NULL);
         mg_websocket_handler(nc, MG_EV_RECV, ev_data);
@@ -5112,7 +7143,24 @@ void mg_http_handler(struct mg_connection *nc, int ev, void *ev_data) {
     mg_http_call_endpoint_handler(nc, trigger_ev, hm);
 #endif
       mbuf_remove(io, hm->message.len);
+      memset(&pd->parse, 0, sizeof(pd->parse));
+
+      /*
+       * Pipelined requests that are already buffered won't get another
+       * MG_EV_RECV. Serve them now, unless the reply is still being sent.
+       */
+      if (io->len > 0 && nc->proto_handler == mg_http_handler &&
+#ifndef MG_DISABLE_FILESYSTEM
+          pd->file.fp == NULL &&
+#endif
+          !(nc->flags & (MG_F_CLOSE_IMMEDIATELY | MG_F_SEND_AND_CLOSE))) {
+        goto again;
+      }
+    } else if (mg_get_http_header(hm, "Transfer-Encoding") == NULL) {
+      /* Don't parse the headers again until the whole body is here */
+      pd->parse.body_end = hm->message.len;
     }
+    pd->parse.io_len = io->len;
   }
   (void) pd;
 }
@@ -5539,6 +7587,9 @@ void mg_send_websocket_handshake2(struct mg_connection *nc, const char *path,
   if (extra_headers != NULL) {
     mg_printf(nc, "%s", extra_headers);
   }
+#ifdef MG_ENABLE_WS_DEFLATE
+  mg_ws_deflate_offer(nc);
+#endif
   mg_printf(nc, "\r\n");
 }
 
@@ -5911,6 +7962,18 @@ static void mg_http_send_file2(struct mg_connection *nc, const char *path,
               current_time, last_modified, (int) mime_type.len, mime_type.p,
               (size_t) cl, range, etag);
 
+#ifndef MG_DISABLE_SOCKET_IF
+    if (!(nc->flags & MG_F_UDP)) {
+      /* The send queue streams the file from disk, no need to keep it here */
+      mg_send_file_range(nc, pd->file.fp, r1, (size_t) cl, 1);
+      pd->file.fp = NULL;
+      mg_http_free_proto_data_file(&pd->file);
+#ifdef MG_DISABLE_HTTP_KEEP_ALIVE
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+#endif
+      return;
+    }
+#endif
     pd->file.cl = cl;
     pd->file.type = DATA_FILE;
     mg_http_transfer_file_data(nc);
@@ -7612,6 +9675,9 @@ struct mg_connection *mg_connect_http_base(
        * NULL, NULL
        */
       mg_set_ssl(nc, NULL, NULL);
+      if (!opts.ssl_no_session_reuse) {
+        mg_ssl_session_reuse(nc, *addr, NULL, NULL, NULL);
+      }
     }
 #endif
     mg_set_protocol_http_websocket(nc);
@@ -8312,10 +10378,12 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
 
   /* decode mqtt variable length */
   do {
-    len += (*vlen & 127) << 7 * (vlen - &io->buf[1]);
-  } while ((*vlen++ & 128) != 0 && ((size_t)(vlen - io->buf) <= io->len));
+    if ((size_t)(vlen - io->buf) >= io->len) return -1;
+    len += (size_t)(*vlen & 127) << 7 * (vlen - &io->buf[1]);
+  } while ((*vlen++ & 128) != 0 && vlen - &io->buf[1] < 4);
 
-  if (len != 0 && io->len < (size_t)(len - 1)) return -1;
+  /* wait for the whole message */
+  if (io->len < (size_t)(vlen - io->buf) + len) return -1;
 
   mbuf_remove(io, 1 + (vlen - &io->buf[1]));
   mm->cmd = cmd;
@@ -8343,16 +10411,19 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
       mm->topic[topic_len] = 0;
       strncpy(mm->topic, io->buf + 2, topic_len);
       var_len = topic_len + 2;
+      mm->retain = header & MG_MQTT_RETAIN;
 
       if (MG_MQTT_GET_QOS(header) > 0) {
-        mm->message_id = ntohs(*(uint16_t *) io->buf);
+        mm->message_id = (uint8_t) io->buf[var_len] << 8 |
+                         (uint8_t) io->buf[var_len + 1];
         var_len += 2;
       }
     } break;
     case MG_MQTT_CMD_SUBSCRIBE:
+    case MG_MQTT_CMD_UNSUBSCRIBE:
       /*
        * topic expressions are left in the payload and can be parsed with
-       * `mg_mqtt_next_subscribe_topic`
+       * `mg_mqtt_next_subscribe_topic` or `mg_mqtt_next_unsubscribe_topic`
        */
       mm->message_id = ntohs(*(uint16_t *) io->buf);
       var_len = 2;
@@ -8366,27 +10437,50 @@ MG_INTERNAL int parse_mqtt(struct mbuf *io, struct mg_mqtt_message *mm) {
   return len - var_len;
 }
 
+static int mg_mqtt_inflight_handle(struct mg_mqtt_inflight *w,
+                                   struct mg_mqtt_message *mm);
+static void mg_mqtt_inflight_poll(struct mg_mqtt_inflight *w);
+
 static void mqtt_handler(struct mg_connection *nc, int ev, void *ev_data) {
   int len;
   struct mbuf *io = &nc->recv_mbuf;
   struct mg_mqtt_message mm;
+  struct mg_mqtt_inflight *w;
   memset(&mm, 0, sizeof(mm));
 
   nc->handler(nc, ev, ev_data);
 
+  /* The handler can attach or free the delivery state */
+  w = (struct mg_mqtt_inflight *) nc->proto_data;
+
   switch (ev) {
     case MG_EV_RECV:
-      len = parse_mqtt(io, &mm);
-      if (len == -1) break; /* not fully buffered */
-      mm.payload.p = io->buf;
-      mm.payload.len = len;
-
-      nc->handler(nc, MG_MQTT_EVENT_BASE + mm.cmd, &mm);
+      /* a single read can carry several messages, e.g. pipelined publishes */
+      while ((len = parse_mqtt(io, &mm)) != -1) {
+        mm.payload.p = io->buf;
+        mm.payload.len = len;
+
+        w = (struct mg_mqtt_inflight *) nc->proto_data;
+        if (w == NULL || mg_mqtt_inflight_handle(w, &mm)) {
+          nc->handler(nc, MG_MQTT_EVENT_BASE + mm.cmd, &mm);
+        }
 
-      if (mm.topic) {
-        MG_FREE(mm.topic);
+        if (mm.topic) {
+          MG_FREE(mm.topic);
+        }
+        mbuf_remove(io, mm.payload.len);
+        memset(&mm, 0, sizeof(mm));
+      }
+      break;
+    case MG_EV_POLL:
+      if (w != NULL) mg_mqtt_inflight_poll(w);
+      break;
+    case MG_EV_CLOSE:
+      if (w != NULL) {
+        w->nc = NULL;
+        w->ready = 0;
+        nc->proto_data = NULL;
       }
-      mbuf_remove(io, mm.payload.len);
       break;
   }
 }
@@ -8430,17 +10524,16 @@ void mg_send_mqtt_handshake_opt(struct mg_connection *nc, const char *client_id,
   mg_send(nc, client_id, strlen(client_id));
 }
 
-static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
-                                   uint8_t flags, size_t len) {
-  size_t off = nc->send_mbuf.len - len;
-  uint8_t header = cmd << 4 | (uint8_t) flags;
-
-  uint8_t buf[1 + sizeof(size_t)];
+/*
+ * Encode a fixed header for a message with `len` bytes of variable header
+ * and payload into `buf`, which must hold at least `1 + sizeof(size_t)`
+ * bytes. Return the number of bytes written.
+ */
+MG_INTERNAL size_t mg_mqtt_encode_header(uint8_t *buf, uint8_t cmd,
+                                         uint8_t flags, size_t len) {
   uint8_t *vlen = &buf[1];
 
-  assert(nc->send_mbuf.len >= len);
-
-  buf[0] = header;
+  buf[0] = cmd << 4 | (uint8_t) flags;
 
   /* mqtt variable length encoding */
   do {
@@ -8450,7 +10543,18 @@ static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
     vlen++;
   } while (len > 0);
 
-  mbuf_insert(&nc->send_mbuf, off, buf, vlen - buf);
+  return vlen - buf;
+}
+
+static void mg_mqtt_prepend_header(struct mg_connection *nc, uint8_t cmd,
+                                   uint8_t flags, size_t len) {
+  size_t off = nc->send_mbuf.len - len;
+  uint8_t buf[1 + sizeof(size_t)];
+
+  assert(nc->send_mbuf.len >= len);
+
+  mbuf_insert(&nc->send_mbuf, off, buf,
+              mg_mqtt_encode_header(buf, cmd, flags, len));
 }
 
 void mg_mqtt_publish(struct mg_connection *nc, const char *topic,
@@ -8505,6 +10609,21 @@ int mg_mqtt_next_subscribe_topic(struct mg_mqtt_message *msg,
   return pos + 2 + topic->len + 1;
 }
 
+int mg_mqtt_next_unsubscribe_topic(struct mg_mqtt_message *msg,
+                                   struct mg_str *topic, int pos) {
+  unsigned char *buf = (unsigned char *) msg->payload.p + pos;
+  if ((size_t) pos + 2 > msg->payload.len) {
+    return -1;
+  }
+
+  topic->len = buf[0] << 8 | buf[1];
+  topic->p = (char *) buf + 2;
+  if ((size_t) pos + 2 + topic->len > msg->payload.len) {
+    return -1;
+  }
+  return pos + 2 + topic->len;
+}
+
 void mg_mqtt_unsubscribe(struct mg_connection *nc, char **topics,
                          size_t topics_len, uint16_t message_id) {
   size_t old_len = nc->send_mbuf.len;
@@ -8536,68 +10655,702 @@ void mg_mqtt_connack(struct mg_connection *nc, uint8_t return_code) {
  * Helper function.
  */
 static void mg_send_mqtt_short_command(struct mg_connection *nc, uint8_t cmd,
-                                       uint16_t message_id) {
+                                       uint8_t flags, uint16_t message_id) {
+  uint16_t message_id_net = htons(message_id);
+  mg_send(nc, &message_id_net, 2);
+  mg_mqtt_prepend_header(nc, cmd, flags, 2);
+}
+
+void mg_mqtt_puback(struct mg_connection *nc, uint16_t message_id) {
+  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBACK, 0, message_id);
+}
+
+void mg_mqtt_pubrec(struct mg_connection *nc, uint16_t message_id) {
+  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBREC, 0, message_id);
+}
+
+void mg_mqtt_pubrel(struct mg_connection *nc, uint16_t message_id) {
+  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBREL, MG_MQTT_QOS(1),
+                             message_id);
+}
+
+void mg_mqtt_pubcomp(struct mg_connection *nc, uint16_t message_id) {
+  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBCOMP, 0, message_id);
+}
+
+void mg_mqtt_suback(struct mg_connection *nc, uint8_t *qoss, size_t qoss_len,
+                    uint16_t message_id) {
+  size_t i;
   uint16_t message_id_net = htons(message_id);
   mg_send(nc, &message_id_net, 2);
-  mg_mqtt_prepend_header(nc, cmd, MG_MQTT_QOS(1), 2);
+  for (i = 0; i < qoss_len; i++) {
+    mg_send(nc, &qoss[i], 1);
+  }
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_SUBACK, 0, 2 + qoss_len);
+}
+
+void mg_mqtt_unsuback(struct mg_connection *nc, uint16_t message_id) {
+  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_UNSUBACK, 0, message_id);
+}
+
+void mg_mqtt_ping(struct mg_connection *nc) {
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_PINGREQ, 0, 0);
+}
+
+void mg_mqtt_pong(struct mg_connection *nc) {
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_PINGRESP, 0, 0);
+}
+
+void mg_mqtt_disconnect(struct mg_connection *nc) {
+  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_DISCONNECT, 0, 0);
+}
+
+struct mg_mqtt_inflight_msg {
+  struct mg_mqtt_inflight_msg *next;
+  double sent_time;
+  size_t len; /* Size of the serialized PUBLISH in `frame` */
+  uint16_t message_id;
+  uint8_t qos;
+  uint8_t state;
+  char *frame;
+};
+
+#define MG_MQTT_MSG_QUEUED 0
+#define MG_MQTT_MSG_SENT 1     /* Waiting for PUBACK or PUBREC */
+#define MG_MQTT_MSG_RELEASED 2 /* PUBREL sent, waiting for PUBCOMP */
+
+void mg_mqtt_inflight_init(struct mg_mqtt_inflight *w, size_t max_inflight,
+                           size_t max_bytes) {
+  memset(w, 0, sizeof(*w));
+  w->max_inflight = max_inflight > 0 ? max_inflight : MG_MQTT_MAX_INFLIGHT;
+  w->max_bytes = max_bytes > 0 ? max_bytes : MG_MQTT_MAX_INFLIGHT_BYTES;
+  w->next_message_id = 1;
+}
+
+void mg_mqtt_inflight_free(struct mg_mqtt_inflight *w) {
+  struct mg_mqtt_inflight_msg *m, *next;
+  for (m = w->head; m != NULL; m = next) {
+    next = m->next;
+    MG_FREE(m);
+  }
+  if (w->nc != NULL && w->nc->proto_data == w) w->nc->proto_data = NULL;
+  MG_FREE(w->incoming);
+  mg_mqtt_inflight_init(w, w->max_inflight, w->max_bytes);
+}
+
+static void mg_mqtt_inflight_send(struct mg_mqtt_inflight *w,
+                                  struct mg_mqtt_inflight_msg *m, int dup) {
+  if (m->state == MG_MQTT_MSG_RELEASED) {
+    mg_mqtt_pubrel(w->nc, m->message_id);
+  } else {
+    if (dup) m->frame[0] |= MG_MQTT_DUP;
+    mg_send(w->nc, m->frame, m->len);
+  }
+  m->sent_time = mg_time();
+}
+
+/*
+ * Send queued messages while the window has room. Messages are sent in
+ * order, so the ones waiting for acknowledgements always precede the queued
+ * ones.
+ */
+static void mg_mqtt_inflight_pump(struct mg_mqtt_inflight *w) {
+  struct mg_mqtt_inflight_msg *m;
+  if (!w->ready) return;
+  for (m = w->head; m != NULL && w->num_sent < w->max_inflight; m = m->next) {
+    if (m->state != MG_MQTT_MSG_QUEUED) continue;
+    m->state = MG_MQTT_MSG_SENT;
+    w->num_sent++;
+    mg_mqtt_inflight_send(w, m, 0);
+  }
+}
+
+/* Session (re)established: resend unacknowledged messages, then the queue. */
+static void mg_mqtt_inflight_resume(struct mg_mqtt_inflight *w) {
+  struct mg_mqtt_inflight_msg *m;
+  w->ready = 1;
+  for (m = w->head; m != NULL && m->state != MG_MQTT_MSG_QUEUED; m = m->next) {
+    mg_mqtt_inflight_send(w, m, 1);
+  }
+  mg_mqtt_inflight_pump(w);
+}
+
+static void mg_mqtt_inflight_poll(struct mg_mqtt_inflight *w) {
+  struct mg_mqtt_inflight_msg *m;
+  double now;
+  if (!w->ready || w->num_sent == 0) return;
+  now = mg_time();
+  for (m = w->head; m != NULL && m->state != MG_MQTT_MSG_QUEUED; m = m->next) {
+    if (now - m->sent_time >= MG_MQTT_RETRY_INTERVAL) {
+      mg_mqtt_inflight_send(w, m, 1);
+    }
+  }
+}
+
+void mg_mqtt_set_inflight(struct mg_connection *nc,
+                          struct mg_mqtt_inflight *w) {
+  if (w->nc != NULL && w->nc->proto_data == w) w->nc->proto_data = NULL;
+  nc->proto_data = w;
+  nc->proto_data_destructor = NULL;
+  w->nc = nc;
+  w->ready = 0;
+  /* Server side sessions are established by the time they get state */
+  if (nc->listener != NULL) mg_mqtt_inflight_resume(w);
+}
+
+static uint16_t mg_mqtt_inflight_next_id(struct mg_mqtt_inflight *w) {
+  struct mg_mqtt_inflight_msg *m;
+  uint16_t id;
+  do {
+    id = w->next_message_id++;
+    if (w->next_message_id == 0) w->next_message_id = 1;
+    for (m = w->head; m != NULL && m->message_id != id; m = m->next) {
+    }
+  } while (m != NULL);
+  return id;
+}
+
+int mg_mqtt_inflight_publish(struct mg_mqtt_inflight *w, const char *topic,
+                             int flags, const void *data, size_t len) {
+  struct mg_mqtt_inflight_msg *m;
+  size_t topic_len = strlen(topic), rem_len = 2 + topic_len + 2 + len, hlen;
+  uint8_t header[1 + sizeof(size_t)];
+  char *p;
+
+  if (MG_MQTT_GET_QOS(flags) == 0) {
+    if (w->nc == NULL || !w->ready) return -1;
+    mg_mqtt_publish(w->nc, topic, 0, flags, data, len);
+    return 0;
+  }
+
+  hlen = mg_mqtt_encode_header(header, MG_MQTT_CMD_PUBLISH, flags, rem_len);
+  if (w->num_bytes + hlen + rem_len > w->max_bytes ||
+      (m = (struct mg_mqtt_inflight_msg *) MG_MALLOC(
+           sizeof(*m) + hlen + rem_len)) == NULL) {
+    return -1;
+  }
+
+  m->next = NULL;
+  m->sent_time = 0;
+  m->len = hlen + rem_len;
+  m->message_id = mg_mqtt_inflight_next_id(w);
+  m->qos = MG_MQTT_GET_QOS(flags);
+  m->state = MG_MQTT_MSG_QUEUED;
+  m->frame = p = (char *) (m + 1);
+
+  memcpy(p, header, hlen);
+  p += hlen;
+  *p++ = (char) (topic_len >> 8);
+  *p++ = (char) (topic_len & 0xff);
+  memcpy(p, topic, topic_len);
+  p += topic_len;
+  *p++ = (char) (m->message_id >> 8);
+  *p++ = (char) (m->message_id & 0xff);
+  memcpy(p, data, len);
+
+  if (w->tail != NULL) {
+    w->tail->next = m;
+  } else {
+    w->head = m;
+  }
+  w->tail = m;
+  w->num_bytes += m->len;
+
+  mg_mqtt_inflight_pump(w);
+
+  return m->message_id;
+}
+
+/* Find a sent message; `*prev` is set to its list predecessor. */
+static struct mg_mqtt_inflight_msg *mg_mqtt_inflight_find(
+    struct mg_mqtt_inflight *w, uint16_t message_id,
+    struct mg_mqtt_inflight_msg **prev) {
+  struct mg_mqtt_inflight_msg *m;
+  *prev = NULL;
+  for (m = w->head; m != NULL && m->state != MG_MQTT_MSG_QUEUED; m = m->next) {
+    if (m->message_id == message_id) return m;
+    *prev = m;
+  }
+  return NULL;
+}
+
+static void mg_mqtt_inflight_ack(struct mg_mqtt_inflight *w,
+                                 uint16_t message_id, int state) {
+  struct mg_mqtt_inflight_msg *prev;
+  struct mg_mqtt_inflight_msg *m = mg_mqtt_inflight_find(w, message_id, &prev);
+
+  /* PUBACK only completes QoS 1 messages */
+  if (m == NULL || m->state != state ||
+      (state == MG_MQTT_MSG_SENT && m->qos != 1)) {
+    return;
+  }
+
+  if (prev != NULL) {
+    prev->next = m->next;
+  } else {
+    w->head = m->next;
+  }
+  if (w->tail == m) w->tail = prev;
+  w->num_sent--;
+  w->num_bytes -= m->len;
+  MG_FREE(m);
+
+  mg_mqtt_inflight_pump(w);
+}
+
+/* Remember or forget an incoming QoS 2 message. Return 1 if it was known. */
+static int mg_mqtt_inflight_incoming(struct mg_mqtt_inflight *w,
+                                     uint16_t message_id, int add) {
+  size_t i;
+  uint16_t *ids;
+
+  for (i = 0; i < w->num_incoming; i++) {
+    if (w->incoming[i] != message_id) continue;
+    if (!add) w->incoming[i] = w->incoming[--w->num_incoming];
+    return 1;
+  }
+
+  if (!add) return 0;
+  /* Bounded by the window size: forget the oldest if the peer floods us */
+  if (w->num_incoming >= w->max_inflight && w->num_incoming > 0) {
+    memmove(w->incoming, w->incoming + 1,
+            (--w->num_incoming) * sizeof(*w->incoming));
+  }
+  ids = (uint16_t *) MG_REALLOC(w->incoming,
+                                (w->num_incoming + 1) * sizeof(*ids));
+  if (ids == NULL) return 0;
+  w->incoming = ids;
+  w->incoming[w->num_incoming++] = message_id;
+
+  return 0;
+}
+
+/*
+ * Drive the QoS state machine with a received message. Return 0 if the
+ * message is a duplicate that must not reach the user handler.
+ */
+static int mg_mqtt_inflight_handle(struct mg_mqtt_inflight *w,
+                                   struct mg_mqtt_message *mm) {
+  struct mg_mqtt_inflight_msg *m, *prev;
+
+  if (w->nc == NULL) return 1;
+
+  switch (mm->cmd) {
+    case MG_MQTT_CMD_CONNACK:
+      if (mm->connack_ret_code == MG_EV_MQTT_CONNACK_ACCEPTED) {
+        mg_mqtt_inflight_resume(w);
+      }
+      break;
+    case MG_MQTT_CMD_PUBLISH:
+      if (mm->qos == 1) {
+        mg_mqtt_puback(w->nc, mm->message_id);
+      } else if (mm->qos == 2) {
+        int dup = mg_mqtt_inflight_incoming(w, mm->message_id, 1);
+        mg_mqtt_pubrec(w->nc, mm->message_id);
+        if (dup) return 0;
+      }
+      break;
+    case MG_MQTT_CMD_PUBREL:
+      mg_mqtt_inflight_incoming(w, mm->message_id, 0);
+      mg_mqtt_pubcomp(w->nc, mm->message_id);
+      break;
+    case MG_MQTT_CMD_PUBACK:
+      mg_mqtt_inflight_ack(w, mm->message_id, MG_MQTT_MSG_SENT);
+      break;
+    case MG_MQTT_CMD_PUBREC:
+      m = mg_mqtt_inflight_find(w, mm->message_id, &prev);
+      if (m != NULL && m->qos == 2) {
+        m->state = MG_MQTT_MSG_RELEASED;
+        mg_mqtt_inflight_send(w, m, 0);
+      }
+      break;
+    case MG_MQTT_CMD_PUBCOMP:
+      mg_mqtt_inflight_ack(w, mm->message_id, MG_MQTT_MSG_RELEASED);
+      break;
+  }
+
+  return 1;
+}
+
+#endif /* MG_DISABLE_MQTT */
+#ifdef MG_MODULE_LINES
+#line 1 "./src/mqtt-broker.c"
+#endif
+/*
+ * Copyright (c) 2014 Cesanta Software Limited
+ * All rights reserved
+ */
+
+/* Amalgamated: #include "mongoose/src/internal.h" */
+/* Amalgamated: #include "mongoose/src/mqtt-broker.h" */
+
+#ifdef MG_ENABLE_MQTT_BROKER
+
+/* Subscription of a session to the topic filter of a tree node. */
+struct mg_mqtt_subscriber {
+  struct mg_mqtt_subscriber *next;
+  struct mg_mqtt_session *s;
+  uint8_t qos;
+};
+
+/*
+ * Topic tree node, one per topic level. Literal children are kept sorted
+ * for binary search, `+` and `#` children have their own slots. Routing a
+ * topic thus costs one lookup per level plus the matching subscribers.
+ */
+struct mg_mqtt_topic_node {
+  struct mg_mqtt_topic_node *parent;
+  struct mg_mqtt_topic_node **children;
+  size_t num_children;
+  struct mg_mqtt_topic_node *plus, *hash;
+  struct mg_mqtt_subscriber *subscribers;
+  char *retained; /* Serialized PUBLISH with the retain flag set */
+  size_t retained_len;
+  char *level;
+  size_t level_len;
+};
+
+/* PUBLISH frame serialized once and shared by all matching sessions. */
+struct mg_mqtt_frame {
+  int refcnt;
+  size_t len;
+  char *buf;
+};
+
+/* Message being routed to subscribers. */
+struct mg_mqtt_delivery {
+  struct mg_mqtt_frame *frame; /* QoS 0 frame */
+  struct mg_mqtt_message *msg;
+  unsigned long seq;
+};
+
+/*
+ * Return the length of the topic level starting at `p`. `*next` is set to
+ * the start of the following level, or NULL if this one is the last.
+ */
+static size_t mg_mqtt_next_level(const char *p, const char *end,
+                                 const char **next) {
+  const char *q = (const char *) memchr(p, '/', end - p);
+  if (q == NULL) {
+    *next = NULL;
+    return end - p;
+  }
+  *next = q + 1;
+  return q - p;
+}
+
+static int mg_mqtt_is_wildcard(const char *level, size_t len) {
+  return len == 1 && (level[0] == '+' || level[0] == '#');
+}
+
+static struct mg_mqtt_topic_node *mg_mqtt_find_child(
+    struct mg_mqtt_topic_node *n, const char *level, size_t len,
+    size_t *pos) {
+  size_t lo = 0, hi = n->num_children;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    struct mg_mqtt_topic_node *c = n->children[mid];
+    int cmp = memcmp(c->level, level, c->level_len < len ? c->level_len : len);
+    if (cmp == 0) cmp = (c->level_len > len) - (c->level_len < len);
+    if (cmp == 0) {
+      if (pos != NULL) *pos = mid;
+      return c;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (pos != NULL) *pos = lo;
+  return NULL;
+}
+
+static struct mg_mqtt_topic_node *mg_mqtt_new_node(
+    struct mg_mqtt_topic_node *parent, const char *level, size_t len) {
+  struct mg_mqtt_topic_node *n =
+      (struct mg_mqtt_topic_node *) MG_CALLOC(1, sizeof(*n) + len + 1);
+  if (n == NULL) return NULL;
+  n->parent = parent;
+  n->level = (char *) (n + 1);
+  memcpy(n->level, level, len);
+  n->level_len = len;
+  return n;
+}
+
+static struct mg_mqtt_topic_node *mg_mqtt_get_child(
+    struct mg_mqtt_topic_node *n, const char *level, size_t len, int create) {
+  struct mg_mqtt_topic_node *c, **children;
+  size_t pos;
+
+  if (mg_mqtt_is_wildcard(level, len)) {
+    struct mg_mqtt_topic_node **slot = level[0] == '+' ? &n->plus : &n->hash;
+    if (*slot == NULL && create) *slot = mg_mqtt_new_node(n, level, len);
+    return *slot;
+  }
+
+  if ((c = mg_mqtt_find_child(n, level, len, &pos)) != NULL || !create) {
+    return c;
+  }
+
+  children = (struct mg_mqtt_topic_node **) MG_REALLOC(
+      n->children, (n->num_children + 1) * sizeof(*children));
+  if (children == NULL) return NULL;
+  n->children = children;
+  if ((c = mg_mqtt_new_node(n, level, len)) == NULL) return NULL;
+  memmove(&children[pos + 1], &children[pos],
+          (n->num_children - pos) * sizeof(*children));
+  children[pos] = c;
+  n->num_children++;
+
+  return c;
+}
+
+/* Find the node for a topic or a filter, creating missing levels. */
+static struct mg_mqtt_topic_node *mg_mqtt_find_node(struct mg_mqtt_broker *brk,
+                                                    const char *topic,
+                                                    size_t len, int create) {
+  struct mg_mqtt_topic_node *n = brk->topics;
+  const char *p = topic, *end = topic + len, *next;
+
+  if (n == NULL) {
+    if (!create || (n = mg_mqtt_new_node(NULL, "", 0)) == NULL) return NULL;
+    brk->topics = n;
+  }
+
+  while (n != NULL && p != NULL) {
+    n = mg_mqtt_get_child(n, p, mg_mqtt_next_level(p, end, &next), create);
+    p = next;
+  }
+
+  return n;
+}
+
+/* Release nodes left without subscribers, retained messages and children. */
+static void mg_mqtt_prune_node(struct mg_mqtt_topic_node *n) {
+  while (n->parent != NULL && n->subscribers == NULL && n->retained == NULL &&
+         n->num_children == 0 && n->plus == NULL && n->hash == NULL) {
+    struct mg_mqtt_topic_node *parent = n->parent;
+    size_t pos;
+
+    if (parent->plus == n) {
+      parent->plus = NULL;
+    } else if (parent->hash == n) {
+      parent->hash = NULL;
+    } else if (mg_mqtt_find_child(parent, n->level, n->level_len, &pos) ==
+               n) {
+      memmove(&parent->children[pos], &parent->children[pos + 1],
+              (parent->num_children - pos - 1) * sizeof(n));
+      if (--parent->num_children == 0) {
+        MG_FREE(parent->children);
+        parent->children = NULL;
+      }
+    }
+
+    MG_FREE(n->children);
+    MG_FREE(n);
+    n = parent;
+  }
+}
+
+static void mg_mqtt_free_node(struct mg_mqtt_topic_node *n) {
+  struct mg_mqtt_subscriber *sub, *next;
+  size_t i;
+
+  for (i = 0; i < n->num_children; i++) {
+    mg_mqtt_free_node(n->children[i]);
+  }
+  if (n->plus != NULL) mg_mqtt_free_node(n->plus);
+  if (n->hash != NULL) mg_mqtt_free_node(n->hash);
+  for (sub = n->subscribers; sub != NULL; sub = next) {
+    next = sub->next;
+    MG_FREE(sub);
+  }
+  MG_FREE(n->retained);
+  MG_FREE(n->children);
+  MG_FREE(n);
+}
+
+/*
+ * Check a topic filter: wildcards must take a whole level and `#` may only
+ * be the last level.
+ */
+static int mg_mqtt_is_valid_filter(const char *f, size_t len) {
+  size_t i;
+  if (len == 0) return 0;
+  for (i = 0; i < len; i++) {
+    if (f[i] != '+' && f[i] != '#') continue;
+    if (i > 0 && f[i - 1] != '/') return 0;
+    if (i + 1 < len && (f[i] == '#' || f[i + 1] != '/')) return 0;
+  }
+  return 1;
+}
+
+static int mg_mqtt_is_valid_topic(const char *t, size_t len) {
+  return len > 0 && memchr(t, '+', len) == NULL && memchr(t, '#', len) == NULL;
+}
+
+static struct mg_mqtt_subscriber *mg_mqtt_find_subscriber(
+    struct mg_mqtt_topic_node *n, struct mg_mqtt_session *s) {
+  struct mg_mqtt_subscriber *sub;
+  for (sub = n != NULL ? n->subscribers : NULL; sub != NULL; sub = sub->next) {
+    if (sub->s == s) break;
+  }
+  return sub;
+}
+
+static int mg_mqtt_add_subscriber(struct mg_mqtt_session *s,
+                                  const char *filter, size_t len,
+                                  uint8_t qos) {
+  struct mg_mqtt_topic_node *n = mg_mqtt_find_node(s->brk, filter, len, 1);
+  struct mg_mqtt_subscriber *sub;
+
+  if (n == NULL) return 0;
+  if ((sub = (struct mg_mqtt_subscriber *) MG_MALLOC(sizeof(*sub))) == NULL) {
+    mg_mqtt_prune_node(n);
+    return 0;
+  }
+  sub->s = s;
+  sub->qos = qos;
+  sub->next = n->subscribers;
+  n->subscribers = sub;
+
+  return 1;
+}
+
+static void mg_mqtt_remove_subscriber(struct mg_mqtt_session *s,
+                                      const char *filter, size_t len) {
+  struct mg_mqtt_topic_node *n = mg_mqtt_find_node(s->brk, filter, len, 0);
+  struct mg_mqtt_subscriber **p, *sub;
+
+  if (n == NULL) return;
+  for (p = &n->subscribers; (sub = *p) != NULL; p = &sub->next) {
+    if (sub->s == s) {
+      *p = sub->next;
+      MG_FREE(sub);
+      break;
+    }
+  }
+  mg_mqtt_prune_node(n);
 }
 
-void mg_mqtt_puback(struct mg_connection *nc, uint16_t message_id) {
-  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBACK, message_id);
+static void mg_mqtt_frame_release(void *buf, void *cb_data) {
+  struct mg_mqtt_frame *f = (struct mg_mqtt_frame *) cb_data;
+  (void) buf;
+  if (--f->refcnt == 0) MG_FREE(f);
+}
+
+static void mg_mqtt_deliver(struct mg_mqtt_subscriber *sub,
+                            struct mg_mqtt_delivery *d) {
+  struct mg_mqtt_frame *f = d->frame;
+  for (; sub != NULL; sub = sub->next) {
+    struct mg_mqtt_session *s = sub->s;
+    int qos = d->msg->qos < sub->qos ? d->msg->qos : sub->qos;
+    /* Overlapping subscriptions get a single copy */
+    if (s->last_delivery == d->seq) continue;
+    s->last_delivery = d->seq;
+    if (qos > 0) {
+      /* Has its own message id, so it can't share the frame */
+      if (mg_mqtt_inflight_publish(&s->inflight, d->msg->topic,
+                                   MG_MQTT_QOS(qos), d->msg->payload.p,
+                                   d->msg->payload.len) < 0) {
+        /* See struct mg_mqtt_broker */
+        DBG(("%p dropping QoS %d message, queue full", s->nc, qos));
+        s->brk->num_dropped++;
+      }
+    } else if (f->len >= MG_MQTT_SHARED_FRAME_SIZE) {
+      f->refcnt++;
+      mg_send_buf(s->nc, f->buf, f->len, mg_mqtt_frame_release, f);
+    } else {
+      mg_send(s->nc, f->buf, f->len);
+    }
+  }
 }
 
-void mg_mqtt_pubrec(struct mg_connection *nc, uint16_t message_id) {
-  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBREC, message_id);
-}
+static void mg_mqtt_route(struct mg_mqtt_topic_node *n, const char *p,
+                          const char *end, struct mg_mqtt_delivery *d) {
+  struct mg_mqtt_topic_node *c;
+  const char *next;
+  size_t len;
 
-void mg_mqtt_pubrel(struct mg_connection *nc, uint16_t message_id) {
-  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBREL, message_id);
+  if (p == NULL) {
+    /* `a/#` matches `a` too */
+    mg_mqtt_deliver(n->subscribers, d);
+    if (n->hash != NULL) mg_mqtt_deliver(n->hash->subscribers, d);
+    return;
+  }
+
+  len = mg_mqtt_next_level(p, end, &next);
+  /* Wildcards at the first level don't match `$` topics */
+  if (n->parent != NULL || len == 0 || p[0] != '$') {
+    if (n->hash != NULL) mg_mqtt_deliver(n->hash->subscribers, d);
+    if (n->plus != NULL) mg_mqtt_route(n->plus, next, end, d);
+  }
+  if ((c = mg_mqtt_find_child(n, p, len, NULL)) != NULL) {
+    mg_mqtt_route(c, next, end, d);
+  }
 }
 
-void mg_mqtt_pubcomp(struct mg_connection *nc, uint16_t message_id) {
-  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_PUBCOMP, message_id);
+static int mg_mqtt_is_sys_level(const struct mg_mqtt_topic_node *n) {
+  return n->parent->parent == NULL && n->level_len > 0 && n->level[0] == '$';
 }
 
-void mg_mqtt_suback(struct mg_connection *nc, uint8_t *qoss, size_t qoss_len,
-                    uint16_t message_id) {
+static void mg_mqtt_send_retained_tree(struct mg_connection *nc,
+                                       struct mg_mqtt_topic_node *n) {
   size_t i;
-  uint16_t message_id_net = htons(message_id);
-  mg_send(nc, &message_id_net, 2);
-  for (i = 0; i < qoss_len; i++) {
-    mg_send(nc, &qoss[i], 1);
+  if (n->retained != NULL) mg_send(nc, n->retained, n->retained_len);
+  for (i = 0; i < n->num_children; i++) {
+    if (mg_mqtt_is_sys_level(n->children[i])) continue;
+    mg_mqtt_send_retained_tree(nc, n->children[i]);
   }
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_SUBACK, MG_MQTT_QOS(1), 2 + qoss_len);
-}
-
-void mg_mqtt_unsuback(struct mg_connection *nc, uint16_t message_id) {
-  mg_send_mqtt_short_command(nc, MG_MQTT_CMD_UNSUBACK, message_id);
 }
 
-void mg_mqtt_ping(struct mg_connection *nc) {
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_PINGREQ, 0, 0);
-}
+/* Send retained messages matching the filter starting at level `p`. */
+static void mg_mqtt_send_retained(struct mg_connection *nc,
+                                  struct mg_mqtt_topic_node *n, const char *p,
+                                  const char *end) {
+  struct mg_mqtt_topic_node *c;
+  const char *next;
+  size_t len, i;
 
-void mg_mqtt_pong(struct mg_connection *nc) {
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_PINGRESP, 0, 0);
-}
+  if (p == NULL) {
+    if (n->retained != NULL) mg_send(nc, n->retained, n->retained_len);
+    return;
+  }
 
-void mg_mqtt_disconnect(struct mg_connection *nc) {
-  mg_mqtt_prepend_header(nc, MG_MQTT_CMD_DISCONNECT, 0, 0);
+  len = mg_mqtt_next_level(p, end, &next);
+  if (len == 1 && p[0] == '#') {
+    mg_mqtt_send_retained_tree(nc, n);
+  } else if (len == 1 && p[0] == '+') {
+    for (i = 0; i < n->num_children; i++) {
+      if (mg_mqtt_is_sys_level(n->children[i])) continue;
+      mg_mqtt_send_retained(nc, n->children[i], next, end);
+    }
+  } else if ((c = mg_mqtt_find_child(n, p, len, NULL)) != NULL) {
+    mg_mqtt_send_retained(nc, c, next, end);
+  }
 }
 
-#endif /* MG_DISABLE_MQTT */
-#ifdef MG_MODULE_LINES
-#line 1 "./src/mqtt-broker.c"
-#endif
-/*
- * Copyright (c) 2014 Cesanta Software Limited
- * All rights reserved
- */
-
-/* Amalgamated: #include "mongoose/src/internal.h" */
-/* Amalgamated: #include "mongoose/src/mqtt-broker.h" */
+/* Store or, for an empty payload, clear the retained message of a topic. */
+static void mg_mqtt_retain(struct mg_mqtt_broker *brk, const char *topic,
+                           size_t topic_len, const struct mg_mqtt_frame *f,
+                           size_t payload_len) {
+  struct mg_mqtt_topic_node *n =
+      mg_mqtt_find_node(brk, topic, topic_len, payload_len > 0);
 
-#ifdef MG_ENABLE_MQTT_BROKER
+  if (n == NULL) return;
+  MG_FREE(n->retained);
+  n->retained = NULL;
+  n->retained_len = 0;
+  if (payload_len > 0 && (n->retained = (char *) MG_MALLOC(f->len)) != NULL) {
+    memcpy(n->retained, f->buf, f->len);
+    n->retained[0] |= MG_MQTT_RETAIN;
+    n->retained_len = f->len;
+  }
+  mg_mqtt_prune_node(n);
+}
 
 static void mg_mqtt_session_init(struct mg_mqtt_broker *brk,
                                  struct mg_mqtt_session *s,
@@ -8606,6 +11359,9 @@ static void mg_mqtt_session_init(struct mg_mqtt_broker *brk,
   s->subscriptions = NULL;
   s->num_subscriptions = 0;
   s->nc = nc;
+  s->last_delivery = 0;
+  mg_mqtt_inflight_init(&s->inflight, brk->max_inflight,
+                        brk->max_inflight_bytes);
 }
 
 static void mg_mqtt_add_session(struct mg_mqtt_session *s) {
@@ -8624,9 +11380,12 @@ static void mg_mqtt_remove_session(struct mg_mqtt_session *s) {
 static void mg_mqtt_destroy_session(struct mg_mqtt_session *s) {
   size_t i;
   for (i = 0; i < s->num_subscriptions; i++) {
-    MG_FREE((void *) s->subscriptions[i].topic);
+    const char *topic = s->subscriptions[i].topic;
+    mg_mqtt_remove_subscriber(s, topic, strlen(topic));
+    MG_FREE((void *) topic);
   }
   MG_FREE(s->subscriptions);
+  mg_mqtt_inflight_free(&s->inflight);
   MG_FREE(s);
 }
 
@@ -8638,6 +11397,16 @@ static void mg_mqtt_close_session(struct mg_mqtt_session *s) {
 void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data) {
   brk->sessions = NULL;
   brk->user_data = user_data;
+  brk->topics = NULL;
+  brk->num_deliveries = 0;
+  brk->max_inflight = 0;
+  brk->max_inflight_bytes = 0;
+  brk->num_dropped = 0;
+}
+
+void mg_mqtt_broker_free(struct mg_mqtt_broker *brk) {
+  if (brk->topics != NULL) mg_mqtt_free_node(brk->topics);
+  brk->topics = NULL;
 }
 
 static void mg_mqtt_broker_handle_connect(struct mg_mqtt_broker *brk,
@@ -8658,6 +11427,19 @@ static void mg_mqtt_broker_handle_connect(struct mg_mqtt_broker *brk,
   mg_mqtt_add_session(s);
 
   mg_mqtt_connack(nc, MG_EV_MQTT_CONNACK_ACCEPTED);
+  mg_mqtt_set_inflight(nc, &s->inflight);
+}
+
+static int mg_mqtt_find_subscription(struct mg_mqtt_session *s,
+                                     const struct mg_str *topic) {
+  size_t i;
+  for (i = 0; i < s->num_subscriptions; i++) {
+    const char *t = s->subscriptions[i].topic;
+    if (strncmp(t, topic->p, topic->len) == 0 && t[topic->len] == '\0') {
+      return (int) i;
+    }
+  }
+  return -1;
 }
 
 static void mg_mqtt_broker_handle_subscribe(struct mg_connection *nc,
@@ -8667,59 +11449,112 @@ static void mg_mqtt_broker_handle_subscribe(struct mg_connection *nc,
   size_t qoss_len = 0;
   struct mg_str topic;
   uint8_t qos;
-  int pos;
+  int pos, i;
   struct mg_mqtt_topic_expression *te;
 
-  for (pos = 0;
-       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;) {
+  for (pos = 0; qoss_len < sizeof(qoss) &&
+                (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) !=
+                    -1;) {
     qoss[qoss_len++] = qos;
   }
 
-  ss->subscriptions = (struct mg_mqtt_topic_expression *) realloc(
-      ss->subscriptions, sizeof(*ss->subscriptions) * qoss_len);
-  for (pos = 0;
+  te = (struct mg_mqtt_topic_expression *) MG_REALLOC(
+      ss->subscriptions,
+      sizeof(*ss->subscriptions) * (ss->num_subscriptions + qoss_len));
+  if (te == NULL && qoss_len > 0) return;
+  ss->subscriptions = te;
+
+  for (pos = 0, qoss_len = 0;
+       qoss_len < sizeof(qoss) &&
        (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;
-       ss->num_subscriptions++) {
-    te = &ss->subscriptions[ss->num_subscriptions];
-    te->topic = (char *) malloc(topic.len + 1);
-    te->qos = qos;
-    strncpy((char *) te->topic, topic.p, topic.len + 1);
+       qoss_len++) {
+    if (!mg_mqtt_is_valid_filter(topic.p, topic.len)) {
+      qoss[qoss_len] = 0x80; /* Failure */
+    } else if ((i = mg_mqtt_find_subscription(ss, &topic)) >= 0) {
+      /* Resubscribing replaces the existing subscription */
+      struct mg_mqtt_subscriber *sub = mg_mqtt_find_subscriber(
+          mg_mqtt_find_node(ss->brk, topic.p, topic.len, 0), ss);
+      ss->subscriptions[i].qos = qos;
+      if (sub != NULL) sub->qos = qos;
+    } else if (!mg_mqtt_add_subscriber(ss, topic.p, topic.len, qos)) {
+      qoss[qoss_len] = 0x80;
+    } else {
+      te = &ss->subscriptions[ss->num_subscriptions++];
+      te->topic = (char *) MG_MALLOC(topic.len + 1);
+      te->qos = qos;
+      memcpy((char *) te->topic, topic.p, topic.len);
+      ((char *) te->topic)[topic.len] = '\0';
+    }
   }
 
   mg_mqtt_suback(nc, qoss, qoss_len, msg->message_id);
+
+  for (pos = 0, qoss_len = 0;
+       qoss_len < sizeof(qoss) && ss->brk->topics != NULL &&
+       (pos = mg_mqtt_next_subscribe_topic(msg, &topic, &qos, pos)) != -1;
+       qoss_len++) {
+    if (qoss[qoss_len] == 0x80) continue;
+    mg_mqtt_send_retained(nc, ss->brk->topics, topic.p, topic.p + topic.len);
+  }
 }
 
-/*
- * Matches a topic against a topic expression
- *
- * See http://goo.gl/iWk21X
- *
- * Returns 1 if it matches; 0 otherwise.
- */
-static int mg_mqtt_match_topic_expression(const char *exp, const char *topic) {
-  /* TODO(mkm): implement real matching */
-  int len = strlen(exp);
-  if (strchr(exp, '#')) {
-    len -= 2;
+static void mg_mqtt_broker_handle_unsubscribe(struct mg_connection *nc,
+                                              struct mg_mqtt_message *msg) {
+  struct mg_mqtt_session *ss = (struct mg_mqtt_session *) nc->user_data;
+  struct mg_str topic;
+  int pos, i;
+
+  for (pos = 0;
+       (pos = mg_mqtt_next_unsubscribe_topic(msg, &topic, pos)) != -1;) {
+    if ((i = mg_mqtt_find_subscription(ss, &topic)) < 0) continue;
+    mg_mqtt_remove_subscriber(ss, topic.p, topic.len);
+    MG_FREE((void *) ss->subscriptions[i].topic);
+    ss->subscriptions[i] = ss->subscriptions[--ss->num_subscriptions];
   }
-  return strncmp(exp, topic, len) == 0;
+
+  mg_mqtt_unsuback(nc, msg->message_id);
 }
 
+/*
+ * Route a message to the sessions with a matching subscription.
+ *
+ * See http://goo.gl/iWk21X for the topic matching rules.
+ */
 static void mg_mqtt_broker_handle_publish(struct mg_mqtt_broker *brk,
                                           struct mg_mqtt_message *msg) {
-  struct mg_mqtt_session *s;
-  size_t i;
+  size_t topic_len = strlen(msg->topic);
+  size_t len = 2 + topic_len + msg->payload.len, hlen;
+  uint8_t header[1 + sizeof(size_t)];
+  struct mg_mqtt_frame *f;
+  struct mg_mqtt_delivery d;
+  char *p;
 
-  for (s = mg_mqtt_next(brk, NULL); s != NULL; s = mg_mqtt_next(brk, s)) {
-    for (i = 0; i < s->num_subscriptions; i++) {
-      if (mg_mqtt_match_topic_expression(s->subscriptions[i].topic,
-                                         msg->topic)) {
-        mg_mqtt_publish(s->nc, msg->topic, 0, 0, msg->payload.p,
-                        msg->payload.len);
-        break;
-      }
-    }
+  if (!mg_mqtt_is_valid_topic(msg->topic, topic_len)) return;
+
+  hlen = mg_mqtt_encode_header(header, MG_MQTT_CMD_PUBLISH, 0, len);
+  f = (struct mg_mqtt_frame *) MG_MALLOC(sizeof(*f) + hlen + len);
+  if (f == NULL) return;
+  f->refcnt = 1;
+  f->len = hlen + len;
+  f->buf = p = (char *) (f + 1);
+  memcpy(p, header, hlen);
+  p += hlen;
+  *p++ = (char) (topic_len >> 8);
+  *p++ = (char) (topic_len & 0xff);
+  memcpy(p, msg->topic, topic_len);
+  memcpy(p + topic_len, msg->payload.p, msg->payload.len);
+
+  if (brk->topics != NULL) {
+    d.frame = f;
+    d.msg = msg;
+    d.seq = ++brk->num_deliveries;
+    mg_mqtt_route(brk->topics, msg->topic, msg->topic + topic_len, &d);
   }
+  if (msg->retain) {
+    mg_mqtt_retain(brk, msg->topic, topic_len, f, msg->payload.len);
+  }
+
+  mg_mqtt_frame_release(f->buf, f);
 }
 
 void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
@@ -8742,6 +11577,9 @@ void mg_mqtt_broker(struct mg_connection *nc, int ev, void *data) {
     case MG_EV_MQTT_SUBSCRIBE:
       mg_mqtt_broker_handle_subscribe(nc, msg);
       break;
+    case MG_EV_MQTT_UNSUBSCRIBE:
+      mg_mqtt_broker_handle_unsubscribe(nc, msg);
+      break;
     case MG_EV_MQTT_PUBLISH:
       mg_mqtt_broker_handle_publish(brk, msg);
       break;
@@ -9214,11 +12052,17 @@ static const char *mg_default_dns_server = "udp://" MG_DEFAULT_NAMESERVER ":53";
 
 MG_INTERNAL char mg_dns_server[256];
 
+/* A lookup waiting for the reply to a query */
+struct mg_resolve_waiter {
+  struct mg_resolve_waiter *next;
+  mg_resolve_callback_t callback;
+  void *data;
+};
+
 struct mg_resolve_async_request {
   char name[1024];
   int query;
-  mg_resolve_callback_t callback;
-  void *data;
+  struct mg_resolve_waiter *waiters; /* Called back in order of arrival */
   time_t timeout;
   int max_retries;
   enum mg_resolve_err err;
@@ -9226,6 +12070,42 @@ struct mg_resolve_async_request {
   /* state */
   time_t last_time;
   int retries;
+  struct mg_connection *nc;              /* DNS connection */
+  struct mg_resolve_async_request *next; /* mg_resolve_cache::in_flight */
+};
+
+/* Cached reply, negative if `pkt` is NULL */
+struct mg_resolve_cache_entry {
+  char *name; /* NULL if the slot is free */
+  int query;
+  double expires;
+  double last_used;
+  char *pkt;
+  int pkt_len;
+};
+
+/* Cached reply waiting to be delivered from a timer */
+struct mg_resolve_delivery {
+  struct mg_resolve_delivery *next;
+  unsigned int timer_id;
+  mg_resolve_callback_t callback;
+  void *data;
+  char *pkt; /* A copy, the entry can be evicted before the timer fires */
+  int pkt_len;
+};
+
+struct mg_resolve_host {
+  char *name;
+  uint32_t addr; /* Network byte order */
+};
+
+struct mg_resolve_cache {
+  struct mg_resolve_cache_entry entries[MG_RESOLVE_CACHE_SIZE];
+  struct mg_resolve_async_request *in_flight;
+  struct mg_resolve_delivery *deliveries;
+  struct mg_resolve_host *hosts; /* /etc/hosts, parsed on first use */
+  int num_hosts;
+  int hosts_loaded;
 };
 
 /*
@@ -9302,46 +12182,358 @@ static int mg_get_ip_address_of_nameserver(char *name, size_t name_len) {
   return ret;
 }
 
-int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
+typedef int (*mg_hosts_cb_t)(void *user_data, const char *name, uint32_t addr);
+
+/*
+ * Call `cb` for every name in `/etc/hosts`, until it returns non-zero.
+ * Return the last value returned by `cb`, or -1 if the file can't be read.
+ */
+static int mg_scan_hosts_file(mg_hosts_cb_t cb, void *user_data) {
 #ifndef MG_DISABLE_FILESYSTEM
-  /* TODO(mkm) cache /etc/hosts */
   FILE *fp;
   char line[1024];
   char *p;
   char alias[256];
   unsigned int a, b, c, d;
-  int len = 0;
+  int len = 0, ret = 0;
 
   if ((fp = fopen("/etc/hosts", "r")) == NULL) {
     return -1;
   }
 
-  for (; fgets(line, sizeof(line), fp) != NULL;) {
+  while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
     if (line[0] == '#') continue;
 
-    if (sscanf(line, "%u.%u.%u.%u%n", &a, &b, &c, &d, &len) == 0) {
+    if (sscanf(line, "%u.%u.%u.%u%n", &a, &b, &c, &d, &len) != 4) {
       /* TODO(mkm): handle ipv6 */
       continue;
     }
-    for (p = line + len; sscanf(p, "%s%n", alias, &len) == 1; p += len) {
-      if (strcmp(alias, name) == 0) {
-        usa->sin.sin_addr.s_addr = htonl(a << 24 | b << 16 | c << 8 | d);
-        fclose(fp);
-        return 0;
-      }
+    for (p = line + len; ret == 0 && sscanf(p, "%255s%n", alias, &len) == 1 &&
+                         alias[0] != '#';
+         p += len) {
+      ret = cb(user_data, alias, htonl(a << 24 | b << 16 | c << 8 | d));
     }
   }
 
   fclose(fp);
+  return ret;
+#else
+  (void) cb;
+  (void) user_data;
+  return -1;
 #endif
+}
+
+struct mg_hosts_search {
+  const char *name;
+  uint32_t addr;
+};
+
+static int mg_hosts_match(void *user_data, const char *name, uint32_t addr) {
+  struct mg_hosts_search *hs = (struct mg_hosts_search *) user_data;
+  if (strcmp(name, hs->name) != 0) return 0;
+  hs->addr = addr;
+  return 1;
+}
+
+int mg_resolve_from_hosts_file(const char *name, union socket_address *usa) {
+  struct mg_hosts_search hs;
+  hs.name = name;
+  if (mg_scan_hosts_file(mg_hosts_match, &hs) <= 0) {
+    return -1;
+  }
+  usa->sin.sin_addr.s_addr = hs.addr;
+  return 0;
+}
+
+static struct mg_resolve_cache *mg_resolve_get_cache(struct mg_mgr *mgr) {
+  if (mgr->resolve_cache == NULL) {
+    mgr->resolve_cache =
+        (struct mg_resolve_cache *) MG_CALLOC(1, sizeof(*mgr->resolve_cache));
+  }
+  return mgr->resolve_cache;
+}
+
+static int mg_hosts_add(void *user_data, const char *name, uint32_t addr) {
+  struct mg_resolve_cache *c = (struct mg_resolve_cache *) user_data;
+  struct mg_resolve_host *h = (struct mg_resolve_host *) MG_REALLOC(
+      c->hosts, (c->num_hosts + 1) * sizeof(*h));
+  if (h == NULL) return 1;
+  c->hosts = h;
+  h += c->num_hosts;
+  if ((h->name = strdup(name)) == NULL) return 1;
+  h->addr = addr;
+  c->num_hosts++;
+  return 0;
+}
+
+MG_INTERNAL int mg_resolve_from_hosts(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *usa) {
+  struct mg_resolve_cache *c = mg_resolve_get_cache(mgr);
+  int i;
+
+  if (c == NULL) {
+    return mg_resolve_from_hosts_file(name, usa);
+  }
+  if (!c->hosts_loaded) {
+    mg_scan_hosts_file(mg_hosts_add, c);
+    c->hosts_loaded = 1;
+  }
+  for (i = 0; i < c->num_hosts; i++) {
+    if (strcmp(c->hosts[i].name, name) == 0) {
+      usa->sin.sin_addr.s_addr = c->hosts[i].addr;
+      return 0;
+    }
+  }
 
   return -1;
 }
 
+static void mg_resolve_entry_free(struct mg_resolve_cache_entry *e) {
+  MG_FREE(e->name);
+  MG_FREE(e->pkt);
+  memset(e, 0, sizeof(*e));
+}
+
+static struct mg_resolve_cache_entry *mg_resolve_cache_find(
+    struct mg_resolve_cache *c, const char *name, int query, double now) {
+  struct mg_resolve_cache_entry *e;
+  int i;
+
+  for (i = 0; i < MG_RESOLVE_CACHE_SIZE; i++) {
+    e = &c->entries[i];
+    if (e->name != NULL && e->query == query && mg_casecmp(e->name, name) == 0) {
+      if (e->expires <= now) {
+        mg_resolve_entry_free(e);
+        return NULL;
+      }
+      e->last_used = now;
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+/* Lower is a better victim: a free slot, then expired, then least recent */
+static int mg_resolve_entry_rank(const struct mg_resolve_cache_entry *e,
+                                 double now) {
+  return e->name == NULL ? 0 : e->expires <= now ? 1 : 2;
+}
+
+/* Cache the reply `msg`, or the fact that there is none if `msg` is NULL */
+static void mg_resolve_cache_put(struct mg_resolve_cache *c, const char *name,
+                                 int query, struct mg_dns_message *msg,
+                                 double now) {
+  struct mg_resolve_cache_entry *e, *victim = NULL;
+  unsigned int ttl = MG_RESOLVE_NEGATIVE_TTL;
+  int i, rank;
+
+  if (msg != NULL) {
+    ttl = MG_RESOLVE_MAX_TTL;
+    for (i = 0; i < msg->num_answers; i++) {
+      if ((unsigned int) msg->answers[i].ttl < ttl) {
+        ttl = (unsigned int) msg->answers[i].ttl;
+      }
+    }
+  }
+  if (ttl == 0) return;
+
+  for (i = 0; i < MG_RESOLVE_CACHE_SIZE; i++) {
+    e = &c->entries[i];
+    if (e->name != NULL && e->query == query && mg_casecmp(e->name, name) == 0) {
+      victim = e;
+      break;
+    }
+    rank = mg_resolve_entry_rank(e, now);
+    if (victim == NULL || rank < mg_resolve_entry_rank(victim, now) ||
+        (rank == 2 && rank == mg_resolve_entry_rank(victim, now) &&
+         e->last_used < victim->last_used)) {
+      victim = e;
+    }
+  }
+
+  mg_resolve_entry_free(victim);
+  victim->name = strdup(name);
+  victim->query = query;
+  victim->expires = now + ttl;
+  victim->last_used = now;
+  if (msg != NULL && (victim->pkt = (char *) MG_MALLOC(msg->pkt.len)) != NULL) {
+    memcpy(victim->pkt, msg->pkt.p, msg->pkt.len);
+    victim->pkt_len = msg->pkt.len;
+  }
+  if (victim->name == NULL || (msg != NULL && victim->pkt == NULL)) {
+    mg_resolve_entry_free(victim);
+  }
+}
+
+/* Call back with a cached reply, NULL `pkt` meaning there are no answers */
+static void mg_resolve_call(mg_resolve_callback_t cb, void *data,
+                            const char *pkt, int pkt_len) {
+  struct mg_dns_message *msg;
+
+  if (pkt == NULL) {
+    cb(NULL, data, MG_RESOLVE_NO_ANSWERS);
+    return;
+  }
+  msg = (struct mg_dns_message *) MG_MALLOC(sizeof(*msg));
+  if (msg != NULL && mg_parse_dns(pkt, pkt_len, msg) == 0) {
+    cb(msg, data, MG_RESOLVE_OK);
+  } else {
+    cb(NULL, data, MG_RESOLVE_NO_ANSWERS);
+  }
+  MG_FREE(msg);
+}
+
+static void mg_resolve_delivery_free(struct mg_resolve_cache *c,
+                                     struct mg_resolve_delivery *d) {
+  struct mg_resolve_delivery **p;
+  for (p = &c->deliveries; *p != NULL; p = &(*p)->next) {
+    if (*p == d) {
+      *p = d->next;
+      break;
+    }
+  }
+  MG_FREE(d->pkt);
+  MG_FREE(d);
+}
+
+static void mg_resolve_deliver(struct mg_mgr *mgr, void *user_data) {
+  struct mg_resolve_delivery *d = (struct mg_resolve_delivery *) user_data;
+  mg_resolve_call(d->callback, d->data, d->pkt, d->pkt_len);
+  mg_resolve_delivery_free(mgr->resolve_cache, d);
+}
+
+/* Schedule delivery of a cached reply on the next poll */
+static int mg_resolve_schedule(struct mg_mgr *mgr, struct mg_resolve_cache *c,
+                               struct mg_resolve_cache_entry *e,
+                               mg_resolve_callback_t cb, void *data) {
+  struct mg_resolve_delivery *d =
+      (struct mg_resolve_delivery *) MG_CALLOC(1, sizeof(*d));
+
+  if (d == NULL) return -1;
+  d->callback = cb;
+  d->data = data;
+  if (e->pkt != NULL) {
+    if ((d->pkt = (char *) MG_MALLOC(e->pkt_len)) == NULL) {
+      MG_FREE(d);
+      return -1;
+    }
+    memcpy(d->pkt, e->pkt, e->pkt_len);
+    d->pkt_len = e->pkt_len;
+  }
+  if ((d->timer_id = mg_add_timer(mgr, mg_time(), 0, mg_resolve_deliver, d)) ==
+      0) {
+    MG_FREE(d->pkt);
+    MG_FREE(d);
+    return -1;
+  }
+  d->next = c->deliveries;
+  c->deliveries = d;
+
+  return 0;
+}
+
+MG_INTERNAL int mg_resolve_from_cache(struct mg_mgr *mgr, const char *name,
+                                      union socket_address *usa) {
+  struct mg_resolve_cache_entry *e;
+  struct mg_dns_resource_record *rr;
+  struct mg_dns_message *msg;
+  int ret = -1;
+
+  if (mg_resolve_from_hosts(mgr, name, usa) == 0) {
+    return 0;
+  }
+  if (mgr->resolve_cache == NULL ||
+      (e = mg_resolve_cache_find(mgr->resolve_cache, name, MG_DNS_A_RECORD,
+                                 mg_time())) == NULL ||
+      e->pkt == NULL) {
+    return -1;
+  }
+
+  msg = (struct mg_dns_message *) MG_MALLOC(sizeof(*msg));
+  if (msg != NULL && mg_parse_dns(e->pkt, e->pkt_len, msg) == 0 &&
+      (rr = mg_dns_next_record(msg, MG_DNS_A_RECORD, NULL)) != NULL &&
+      mg_dns_parse_record_data(msg, rr, &usa->sin.sin_addr, 4) == 0) {
+    ret = 0;
+  }
+  MG_FREE(msg);
+
+  return ret;
+}
+
+MG_INTERNAL void mg_resolve_cache_free(struct mg_mgr *mgr) {
+  struct mg_resolve_cache *c = mgr->resolve_cache;
+  struct mg_resolve_delivery *d;
+  int i;
+
+  if (c == NULL) return;
+
+  /* Like lookups cut short by closing their DNS connection */
+  while ((d = c->deliveries) != NULL) {
+    mg_cancel_timer(mgr, d->timer_id);
+    d->callback(NULL, d->data, MG_RESOLVE_NO_ANSWERS);
+    mg_resolve_delivery_free(c, d);
+  }
+  for (i = 0; i < MG_RESOLVE_CACHE_SIZE; i++) {
+    mg_resolve_entry_free(&c->entries[i]);
+  }
+  for (i = 0; i < c->num_hosts; i++) {
+    MG_FREE(c->hosts[i].name);
+  }
+  MG_FREE(c->hosts);
+  MG_FREE(c);
+  mgr->resolve_cache = NULL;
+}
+
+/* Call back everybody waiting for `req` and free it */
+static void mg_resolve_finish(struct mg_connection *nc,
+                              struct mg_resolve_async_request *req,
+                              struct mg_dns_message *msg,
+                              enum mg_resolve_err err) {
+  struct mg_resolve_async_request **p;
+  struct mg_resolve_waiter *w;
+
+  /* Unlink first, so that callbacks can start a new lookup of this name */
+  if (nc->mgr->resolve_cache != NULL) {
+    for (p = &nc->mgr->resolve_cache->in_flight; *p != NULL; p = &(*p)->next) {
+      if (*p == req) {
+        *p = req->next;
+        break;
+      }
+    }
+  }
+  nc->user_data = NULL;
+
+  while ((w = req->waiters) != NULL) {
+    req->waiters = w->next;
+    w->callback(msg, w->data, err);
+    MG_FREE(w);
+  }
+  MG_FREE(req);
+}
+
+static int mg_resolve_add_waiter(struct mg_resolve_async_request *req,
+                                 mg_resolve_callback_t cb, void *data) {
+  struct mg_resolve_waiter **p, *w;
+
+  if ((w = (struct mg_resolve_waiter *) MG_CALLOC(1, sizeof(*w))) == NULL) {
+    return -1;
+  }
+  w->callback = cb;
+  w->data = data;
+  for (p = &req->waiters; *p != NULL; p = &(*p)->next) {
+  }
+  *p = w;
+
+  return 0;
+}
+
 static void mg_resolve_async_eh(struct mg_connection *nc, int ev, void *data) {
   time_t now = time(NULL);
   struct mg_resolve_async_request *req;
   struct mg_dns_message *msg;
+  int rcode;
 
   DBG(("ev=%d", ev));
 
@@ -9363,11 +12555,19 @@ static void mg_resolve_async_eh(struct mg_connection *nc, int ev, void *data) {
       break;
     case MG_EV_RECV:
       msg = (struct mg_dns_message *) MG_MALLOC(sizeof(*msg));
-      if (mg_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0 &&
-          msg->num_answers > 0) {
-        req->callback(msg, req->data, MG_RESOLVE_OK);
-        nc->user_data = NULL;
-        MG_FREE(req);
+      if (mg_parse_dns(nc->recv_mbuf.buf, *(int *) data, msg) == 0) {
+        /* NOERROR and NXDOMAIN are authoritative enough to be cached */
+        rcode = msg->flags & 0xf;
+        if (nc->mgr->resolve_cache != NULL &&
+            (msg->num_answers > 0 || rcode == 0 || rcode == 3)) {
+          mg_resolve_cache_put(nc->mgr->resolve_cache, req->name, req->query,
+                               msg->num_answers > 0 ? msg : NULL, mg_time());
+        }
+        if (msg->num_answers > 0) {
+          mg_resolve_finish(nc, req, msg, MG_RESOLVE_OK);
+        } else {
+          req->err = MG_RESOLVE_NO_ANSWERS;
+        }
       } else {
         req->err = MG_RESOLVE_NO_ANSWERS;
       }
@@ -9389,9 +12589,7 @@ static void mg_resolve_async_eh(struct mg_connection *nc, int ev, void *data) {
     case MG_EV_CLOSE:
       /* If we got here with request still not done, fire an error callback. */
       if (req != NULL) {
-        req->callback(NULL, req->data, req->err);
-        nc->user_data = NULL;
-        MG_FREE(req);
+        mg_resolve_finish(nc, req, NULL, req->err);
       }
       break;
   }
@@ -9407,12 +12605,33 @@ int mg_resolve_async(struct mg_mgr *mgr, const char *name, int query,
 int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
                          mg_resolve_callback_t cb, void *data,
                          struct mg_resolve_async_opts opts) {
+  struct mg_resolve_cache *c = mg_resolve_get_cache(mgr);
+  struct mg_resolve_cache_entry *e;
   struct mg_resolve_async_request *req;
   struct mg_connection *dns_nc;
   const char *nameserver = opts.nameserver_url;
 
   DBG(("%s %d %p", name, query, opts.dns_conn));
 
+  if (opts.dns_conn != NULL) {
+    *opts.dns_conn = NULL;
+  }
+
+  if (c != NULL && !opts.no_cache) {
+    if ((e = mg_resolve_cache_find(c, name, query, mg_time())) != NULL) {
+      return mg_resolve_schedule(mgr, c, e, cb, data);
+    }
+    /* Join the lookup in progress, if any */
+    for (req = c->in_flight; req != NULL; req = req->next) {
+      if (req->query == query && mg_casecmp(req->name, name) == 0) {
+        if (opts.dns_conn != NULL) {
+          *opts.dns_conn = req->nc;
+        }
+        return mg_resolve_add_waiter(req, cb, data);
+      }
+    }
+  }
+
   /* resolve with DNS */
   req = (struct mg_resolve_async_request *) MG_CALLOC(1, sizeof(*req));
   if (req == NULL) {
@@ -9421,11 +12640,13 @@ int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
 
   strncpy(req->name, name, sizeof(req->name));
   req->query = query;
-  req->callback = cb;
-  req->data = data;
   /* TODO(mkm): parse defaults out of resolve.conf */
   req->max_retries = opts.max_retries ? opts.max_retries : 2;
   req->timeout = opts.timeout ? opts.timeout : 5;
+  if (mg_resolve_add_waiter(req, cb, data) != 0) {
+    MG_FREE(req);
+    return -1;
+  }
 
   /* Lazily initialize dns server */
   if (nameserver == NULL && mg_dns_server[0] == '\0' &&
@@ -9440,10 +12661,16 @@ int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
 
   dns_nc = mg_connect(mgr, nameserver, mg_resolve_async_eh);
   if (dns_nc == NULL) {
-    free(req);
+    MG_FREE(req->waiters);
+    MG_FREE(req);
     return -1;
   }
   dns_nc->user_data = req;
+  req->nc = dns_nc;
+  if (c != NULL) {
+    req->next = c->in_flight;
+    c->in_flight = req;
+  }
   if (opts.dns_conn != NULL) {
     *opts.dns_conn = dns_nc;
   }
@@ -292,6 +292,7 @@ struct dirent *readdir(DIR *dir);
 #include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -1047,7 +1048,9 @@ struct mg_connection;
 typedef void (*mg_event_handler_t)(struct mg_connection *, int ev, void *);
 
 /* Events. Meaning of event parameter (evp) is given in the comment. */
-#define MG_EV_POLL 0    /* Sent to each connection on each mg_mgr_poll() call */
+#define MG_EV_POLL 0    /* Sent to each connection on each mg_mgr_poll() call,
+                           or at most every MG_POLL_INTERVAL_MS if that is
+                           set with MG_ENABLE_EPOLL */
 #define MG_EV_ACCEPT 1  /* New connection accepted. union socket_address * */
 #define MG_EV_CONNECT 2 /* connect() succeeded or failed. int *  */
 #define MG_EV_RECV 3    /* Data has benn received. int *num_bytes */
@@ -1055,6 +1058,12 @@ typedef void (*mg_event_handler_t)(struct mg_connection *, int ev, void *);
 #define MG_EV_CLOSE 5   /* Connection is closed. NULL */
 #define MG_EV_TIMER 6   /* now >= conn->ev_timer_time. double * */
 
+struct mg_mgr;
+struct mg_timer;
+
+/* Timer callback, see `mg_add_timer()`. */
+typedef void (*mg_timer_handler_t)(struct mg_mgr *mgr, void *user_data);
+
 /*
  * Mongoose event manager.
  */
@@ -1068,9 +1077,22 @@ struct mg_mgr {
   void *mgr_data;  /* Implementation-specific event manager's data. */
 #ifdef MG_ENABLE_JAVASCRIPT
   struct v7 *v7;
+#endif
+  struct mg_timer *timers;      /* Timer slots, see mg_add_timer() */
+  unsigned int *timer_heap;     /* Slots of active timers, soonest first */
+  unsigned int num_timer_slots; /* Size of `timers` */
+  unsigned int num_timers;      /* Number of active timers */
+  unsigned int free_timer_slot; /* First unused slot plus one, or 0 */
+#ifndef MG_DISABLE_RESOLVER
+  struct mg_resolve_cache *resolve_cache; /* See mg_resolve_async_opt() */
+#endif
+#ifdef MG_ENABLE_SSL
+  struct mg_ssl_session *ssl_sessions; /* Client SSL sessions to resume */
 #endif
 };
 
+struct mg_send_seg;
+
 /*
  * Mongoose connection.
  */
@@ -1081,12 +1103,20 @@ struct mg_connection {
 
   sock_t sock; /* Socket to the remote peer */
   int err;
-  union socket_address sa; /* Remote peer address */
-  size_t recv_mbuf_limit;  /* Max size of recv buffer */
-  struct mbuf recv_mbuf;   /* Received data */
-  struct mbuf send_mbuf;   /* Data scheduled for sending */
+  union socket_address sa;        /* Remote peer address */
+  size_t recv_mbuf_limit;         /* Max size of recv buffer */
+  struct mbuf recv_mbuf;          /* Received data */
+  struct mbuf send_mbuf;          /* Data scheduled for sending */
+  struct mg_send_seg *send_queue; /* Data to send before send_mbuf */
   SSL *ssl;
   SSL_CTX *ssl_ctx;
+#ifdef MG_ENABLE_SSL
+  char *ssl_session_key; /* Key of the session in mg_mgr::ssl_sessions */
+#ifdef SSL_KRYPTON
+  char *ssl_rx_buf; /* TLS record being read and decrypted in place */
+  int ssl_rx_len;
+#endif
+#endif
   time_t last_io_time;              /* Timestamp of the last socket IO */
   double ev_timer_time;             /* Timestamp of the future MG_EV_TIMER */
   mg_event_handler_t proto_handler; /* Protocol-specific event handler */
@@ -1104,6 +1134,10 @@ struct mg_connection {
   } priv_1;       /* Used by mg_enable_multithreading() */
   void *priv_2;   /* Used by mg_enable_multithreading() */
   void *mgr_data; /* Implementation-specific event manager's data. */
+#ifdef MG_ENABLE_EPOLL
+  struct mg_connection *next_changed, *prev_changed; /* epoll change list */
+  unsigned int ev_timer_id; /* mg_add_timer() ID for ev_timer_time */
+#endif
   unsigned long flags;
 /* Flags set by Mongoose */
 #define MG_F_LISTENING (1 << 0)          /* This connection is listening */
@@ -1280,6 +1314,14 @@ struct mg_connect_opts {
    * name verification.
    */
   const char *ssl_server_name;
+
+  /*
+   * Do not resume a previous SSL session with the same server. By default
+   * the event manager remembers the last session negotiated for each
+   * address and certificate settings, and offers it on the next connection,
+   * which saves a full handshake.
+   */
+  int ssl_no_session_reuse;
 #endif
 };
 
@@ -1357,6 +1399,11 @@ struct mg_connection *mg_connect_opt(struct mg_mgr *mgr, const char *address,
 const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
                        const char *ca_cert);
 
+/* Max number of client SSL sessions kept by the event manager */
+#ifndef MG_SSL_SESSION_CACHE_SIZE
+#define MG_SSL_SESSION_CACHE_SIZE 8
+#endif
+
 /*
  * Send data to the connection.
  *
@@ -1366,6 +1413,43 @@ const char *mg_set_ssl(struct mg_connection *nc, const char *cert,
  */
 void mg_send(struct mg_connection *, const void *buf, int len);
 
+/* Callback that releases a buffer passed to `mg_send_buf()`. */
+typedef void (*mg_send_free_cb_t)(void *buf, void *cb_data);
+
+/*
+ * Send data to the connection without copying it.
+ *
+ * `buf` must stay valid until it has been sent. After that, or when the
+ * connection is closed, `free_cb(buf, cb_data)` is called, unless `free_cb`
+ * is NULL. Data sent earlier with `mg_send()` goes out first. UDP connections
+ * copy the data and release `buf` right away.
+ */
+void mg_send_buf(struct mg_connection *nc, const void *buf, size_t len,
+                 mg_send_free_cb_t free_cb, void *cb_data);
+
+#ifndef MG_DISABLE_FILESYSTEM
+/*
+ * Send `len` bytes of file `fp` starting at `offset`.
+ *
+ * The data is read from the file when the socket is ready, using `sendfile()`
+ * where available, so the file must not be modified until it has been sent.
+ * If `close_fp` is non-zero, `fp` is closed once sent or when the connection
+ * is closed. Without the socket interface, the data is read right away and
+ * copied like `mg_send()` does.
+ */
+void mg_send_file_range(struct mg_connection *nc, FILE *fp, int64_t offset,
+                        size_t len, int close_fp);
+#endif
+
+/*
+ * Return the number of bytes that have been sent to the connection but not
+ * written to the socket yet.
+ *
+ * Unsent data may be kept outside `send_mbuf`, e.g. after `mg_send_buf()` or
+ * a partial write, so `send_mbuf.len` alone can be 0 while this is not.
+ */
+size_t mg_send_queue_len(const struct mg_connection *nc);
+
 /* Enables format string warnings for mg_printf */
 #if defined(__GNUC__)
 __attribute__((format(printf, 2, 3)))
@@ -1434,6 +1518,31 @@ int mg_check_ip_acl(const char *acl, uint32_t remote_ip);
  */
 void mg_enable_multithreading(struct mg_connection *nc);
 
+/* Optional parameters to `mg_enable_multithreading_opt()` */
+struct mg_multithreading_opts {
+  int num_workers; /* Number of worker threads, 0 for thread per connection */
+};
+
+/*
+ * Enable multi-threaded handling for the given listening connection `nc`,
+ * using a fixed pool of `opts.num_workers` threads.
+ *
+ * Each worker runs its own event manager. An accepted socket is handed over
+ * to the worker that currently serves the fewest connections, and from then
+ * on it is polled, read and written by that worker only: no per-connection
+ * threads are created and no data is copied between threads. Event handler
+ * is called in the worker thread, starting with `MG_EV_ACCEPT`, so blocking
+ * in it stalls all other connections of that worker.
+ *
+ * Workers exit when the listener is closed and their last connection is
+ * gone. SSL connections are handed over after the handshake, which requires
+ * a thread-safe SSL library.
+ *
+ * With `opts.num_workers == 0`, behaves as `mg_enable_multithreading()`.
+ */
+void mg_enable_multithreading_opt(struct mg_connection *nc,
+                                  struct mg_multithreading_opts opts);
+
 #ifdef MG_ENABLE_JAVASCRIPT
 /*
  * Enable server-side JavaScript scripting.
@@ -1471,6 +1580,27 @@ enum v7_err mg_enable_javascript(struct mg_mgr *m, struct v7 *v7,
  */
 double mg_set_timer(struct mg_connection *c, double timestamp);
 
+/*
+ * Schedule `handler(mgr, user_data)` to be called by `mg_mgr_poll()` at
+ * `timestamp`, which is the same kind of time as in `mg_set_timer()`, and
+ * then every `interval` seconds if `interval` is positive.
+ *
+ * Unlike `mg_set_timer()`, this timer doesn't need a connection. Timers are
+ * kept in a heap, so adding and cancelling them takes O(log n) time.
+ *
+ * Return the timer ID, which is never 0, or 0 if out of memory.
+ */
+unsigned int mg_add_timer(struct mg_mgr *mgr, double timestamp,
+                          double interval, mg_timer_handler_t handler,
+                          void *user_data);
+
+/*
+ * Cancel timer `id` returned by `mg_add_timer()`.
+ * Return its `user_data`, or NULL if there is no such timer, e.g. because it
+ * has fired already and wasn't repeating.
+ */
+void *mg_cancel_timer(struct mg_mgr *mgr, unsigned int id);
+
 /*
  * A sub-second precision version of time().
  */
@@ -1545,6 +1675,12 @@ void mg_if_poll(struct mg_connection *nc, time_t now);
 /* Deliver a TIMER event to the connection. */
 void mg_if_timer(struct mg_connection *c, double now);
 
+/* Run expired `mg_add_timer()` timers. */
+void mg_mgr_run_timers(struct mg_mgr *mgr, double now);
+
+/* Return when the next `mg_add_timer()` timer expires, or 0 if none. */
+double mg_mgr_next_timer(struct mg_mgr *mgr);
+
 /* Perform interface-related connection initialization. Return 1 on success. */
 int mg_if_create_conn(struct mg_connection *nc);
 
@@ -1862,6 +1998,9 @@ extern "C" {
 #define MG_MAX_HTTP_HEADERS 20
 #endif
 
+/* Number of well-known headers that are looked up without scanning */
+#define MG_HTTP_NUM_INDEXED_HEADERS 18
+
 #ifndef MG_MAX_HTTP_REQUEST_SIZE
 #define MG_MAX_HTTP_REQUEST_SIZE 1024
 #endif
@@ -1882,6 +2021,32 @@ extern "C" {
 #define MG_WEBSOCKET_PING_INTERVAL_SECONDS 5
 #endif
 
+/*
+ * Largest reassembled WebSocket message, in bytes. Peers sending more get
+ * closed with status 1009. 0 means no limit.
+ */
+#ifndef MG_MAX_WEBSOCKET_MESSAGE_SIZE
+#define MG_MAX_WEBSOCKET_MESSAGE_SIZE 0
+#endif
+
+/*
+ * With MG_ENABLE_WS_DEFLATE, WebSocket clients offer and servers accept
+ * RFC 7692 permessage-deflate. common/miniz.c must be linked in.
+ *
+ * MG_WS_DEFLATE_WINDOW_BITS is the largest peer compression window we
+ * inflate with; smaller windows need less memory. Outgoing messages shorter
+ * than MG_WS_DEFLATE_MIN_SIZE are sent uncompressed. Defining
+ * MG_WS_DEFLATE_NO_CONTEXT_TAKEOVER resets both contexts after every
+ * message, which frees compressor and decompressor memory between messages.
+ */
+#ifndef MG_WS_DEFLATE_WINDOW_BITS
+#define MG_WS_DEFLATE_WINDOW_BITS 15
+#endif
+
+#ifndef MG_WS_DEFLATE_MIN_SIZE
+#define MG_WS_DEFLATE_MIN_SIZE 64
+#endif
+
 #ifndef MG_CGI_ENVIRONMENT_SIZE
 #define MG_CGI_ENVIRONMENT_SIZE 8192
 #endif
@@ -1921,6 +2086,14 @@ struct http_message {
   struct mg_str header_names[MG_MAX_HTTP_HEADERS];
   struct mg_str header_values[MG_MAX_HTTP_HEADERS];
 
+  /*
+   * Where well-known headers like Content-Length or Host are: index in
+   * `header_names` plus one, or 0 if absent. Set up by the parser and used
+   * by `mg_get_http_header()` if `header_index_valid` is non-zero.
+   */
+  unsigned short header_index[MG_HTTP_NUM_INDEXED_HEADERS];
+  int header_index_valid;
+
   /* Message body */
   struct mg_str body; /* Zero-length for requests with no body */
 };
@@ -1990,7 +2163,9 @@ struct mg_http_multipart_part {
  * - MG_EV_WEBSOCKET_HANDSHAKE_DONE: server has completed Websocket handshake.
  *   `ev_data` is `NULL`.
  * - MG_EV_WEBSOCKET_FRAME: new websocket frame has arrived. `ev_data` is
- *   `struct websocket_message *`
+ *   `struct websocket_message *`. Unless `MG_F_WEBSOCKET_NO_DEFRAG` is set,
+ *   fragmented messages are delivered once, reassembled, with the FIN flag
+ *   and the opcode of the first fragment.
  * - MG_EV_HTTP_PART_BEGIN: new part of multipart message is started,
  *   extra parameters are passed in mg_http_multipart_part
  * - MG_EV_HTTP_PART_DATA: new portion of data from multiparted message
@@ -2212,6 +2387,9 @@ int mg_parse_http(const char *s, int n, struct http_message *hm, int is_req);
  * If header is not found, NULL is returned. Example:
  *
  *     struct mg_str *host_hdr = mg_get_http_header(hm, "Host");
+ *
+ * Well-known headers, like the ones Mongoose itself looks at, are found
+ * without scanning the whole header list.
  */
 struct mg_str *mg_get_http_header(struct http_message *hm, const char *name);
 
@@ -2713,6 +2891,7 @@ struct mg_mqtt_message {
   uint8_t connack_ret_code; /* connack */
   uint16_t message_id;      /* puback */
   char *topic;
+  int retain; /* publish */
 };
 
 struct mg_mqtt_topic_expression {
@@ -2720,6 +2899,29 @@ struct mg_mqtt_topic_expression {
   uint8_t qos;
 };
 
+/* Outgoing message tracked by `struct mg_mqtt_inflight`. */
+struct mg_mqtt_inflight_msg;
+
+/*
+ * QoS 1/2 delivery state: outgoing messages waiting to be sent or
+ * acknowledged, and incoming QoS 2 messages waiting for PUBREL.
+ *
+ * Owned by the caller, so that it can outlive a connection and be attached
+ * to the next one with `mg_mqtt_set_inflight()`.
+ */
+struct mg_mqtt_inflight {
+  struct mg_connection *nc;                 /* Attached connection */
+  struct mg_mqtt_inflight_msg *head, *tail; /* Outgoing, oldest first */
+  size_t num_sent;                          /* Sent but not acknowledged */
+  size_t num_bytes;                         /* Memory held by messages */
+  size_t max_inflight;                      /* Window size */
+  size_t max_bytes;                         /* Memory limit */
+  uint16_t next_message_id;
+  uint16_t *incoming; /* Ids of received QoS 2 messages */
+  size_t num_incoming;
+  int ready; /* Session established, messages can be sent */
+};
+
 struct mg_send_mqtt_handshake_opts {
   unsigned char flags; /* connection flags */
   uint16_t keep_alive;
@@ -2764,11 +2966,22 @@ struct mg_send_mqtt_handshake_opts {
 
 /* Message flags */
 #define MG_MQTT_RETAIN 0x1
-#define MG_MQTT_DUP 0x4
+#define MG_MQTT_DUP 0x8
 #define MG_MQTT_QOS(qos) ((qos) << 1)
 #define MG_MQTT_GET_QOS(flags) (((flags) &0x6) >> 1)
 #define MG_MQTT_SET_QOS(flags, qos) (flags) = ((flags) & ~0x6) | ((qos) << 1)
 
+/* Default QoS 1/2 window size, memory limit and retransmit interval */
+#ifndef MG_MQTT_MAX_INFLIGHT
+#define MG_MQTT_MAX_INFLIGHT 16
+#endif
+#ifndef MG_MQTT_MAX_INFLIGHT_BYTES
+#define MG_MQTT_MAX_INFLIGHT_BYTES 8192
+#endif
+#ifndef MG_MQTT_RETRY_INTERVAL
+#define MG_MQTT_RETRY_INTERVAL 20 /* seconds */
+#endif
+
 /* Connection flags */
 #define MG_MQTT_CLEAN_SESSION 0x02
 #define MG_MQTT_HAS_WILL 0x04
@@ -2871,6 +3084,49 @@ void mg_mqtt_pong(struct mg_connection *nc);
 int mg_mqtt_next_subscribe_topic(struct mg_mqtt_message *msg,
                                  struct mg_str *topic, uint8_t *qos, int pos);
 
+/*
+ * Extract the next topic from an UNSUBSCRIBE command payload.
+ *
+ * Topic name will point to a string in the payload buffer.
+ * Return the pos of the next topic or -1 when the list
+ * of topics is exhausted.
+ */
+int mg_mqtt_next_unsubscribe_topic(struct mg_mqtt_message *msg,
+                                   struct mg_str *topic, int pos);
+
+/*
+ * Initialize QoS 1/2 delivery state. Zero `max_inflight` or `max_bytes`
+ * select `MG_MQTT_MAX_INFLIGHT` and `MG_MQTT_MAX_INFLIGHT_BYTES`.
+ */
+void mg_mqtt_inflight_init(struct mg_mqtt_inflight *w, size_t max_inflight,
+                           size_t max_bytes);
+
+/* Free all messages held by the delivery state and detach it. */
+void mg_mqtt_inflight_free(struct mg_mqtt_inflight *w);
+
+/*
+ * Attach delivery state to an MQTT connection.
+ *
+ * The protocol handler then acknowledges incoming QoS 1/2 publishes,
+ * suppresses duplicate QoS 2 deliveries, completes the outgoing handshakes
+ * and retransmits unacknowledged messages every `MG_MQTT_RETRY_INTERVAL`
+ * seconds. On the client side, messages left from a previous connection
+ * are resent once CONNACK arrives.
+ */
+void mg_mqtt_set_inflight(struct mg_connection *nc,
+                          struct mg_mqtt_inflight *w);
+
+/*
+ * Publish a message with delivery tracking.
+ *
+ * Up to `max_inflight` messages are sent without waiting for
+ * acknowledgements, the rest are queued. Return the message id,
+ * 0 for a QoS 0 message, or -1 if the message can't be sent or queued
+ * because of the memory limit or, for QoS 0, no established session.
+ */
+int mg_mqtt_inflight_publish(struct mg_mqtt_inflight *w, const char *topic,
+                             int flags, const void *data, size_t len);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -2909,7 +3165,16 @@ extern "C" {
 
 #define MG_MQTT_MAX_SESSION_SUBSCRIPTIONS 512;
 
+/*
+ * Outgoing PUBLISH frames at least this large are shared between all
+ * matching sessions instead of being copied into each send buffer.
+ */
+#ifndef MG_MQTT_SHARED_FRAME_SIZE
+#define MG_MQTT_SHARED_FRAME_SIZE 1024
+#endif
+
 struct mg_mqtt_broker;
+struct mg_mqtt_topic_node;
 
 /* MQTT session (Broker side). */
 struct mg_mqtt_session {
@@ -2918,18 +3183,41 @@ struct mg_mqtt_session {
   struct mg_connection *nc;            /* Connection with the client */
   size_t num_subscriptions;            /* Size of `subscriptions` array */
   struct mg_mqtt_topic_expression *subscriptions;
-  void *user_data; /* User data */
+  void *user_data;             /* User data */
+  unsigned long last_delivery; /* Last publish routed to this session */
+  struct mg_mqtt_inflight inflight; /* QoS 1/2 delivery state */
 };
 
-/* MQTT broker. */
+/*
+ * MQTT broker.
+ *
+ * QoS 1/2 messages routed to a subscriber are queued in its session's
+ * `inflight` state until acknowledged. A session holds at most
+ * `max_inflight_bytes` of them: when a message doesn't fit, it's dropped
+ * for that subscriber and counted in `num_dropped`, while the publisher is
+ * acknowledged as usual. Zero limits select `MG_MQTT_MAX_INFLIGHT` and
+ * `MG_MQTT_MAX_INFLIGHT_BYTES`; they apply to sessions created after they
+ * are set.
+ */
 struct mg_mqtt_broker {
   struct mg_mqtt_session *sessions; /* Session list */
   void *user_data;                  /* User data */
+  struct mg_mqtt_topic_node *topics; /* Subscriptions and retained messages */
+  unsigned long num_deliveries;      /* Publish counter */
+  size_t max_inflight;               /* Per-session QoS 1/2 window */
+  size_t max_inflight_bytes;         /* Per-session QoS 1/2 memory limit */
+  unsigned long num_dropped;         /* QoS 1/2 messages that didn't fit */
 };
 
-/* Initialize a MQTT broker. */
+/* Initialize a MQTT broker with default limits. */
 void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data);
 
+/*
+ * Free retained messages and the topic tree held by the broker.
+ * Sessions are owned by their connections and must be closed first.
+ */
+void mg_mqtt_broker_free(struct mg_mqtt_broker *brk);
+
 /*
  * Process a MQTT broker message.
  *
@@ -2954,6 +3242,10 @@ void mg_mqtt_broker_init(struct mg_mqtt_broker *brk, void *user_data);
  *
  * Since only the MG_EV_ACCEPT message is processed by the listening socket,
  * for most events the `user_data` will thus point to a `mg_mqtt_session`.
+ *
+ * Subscriptions support the `+` and `#` wildcards. Messages published
+ * with the `MG_MQTT_RETAIN` flag are kept per topic and sent to new
+ * matching subscribers; a retained publish with an empty payload clears it.
  */
 void mg_mqtt_broker(struct mg_connection *brk, int ev, void *data);
 
@@ -3249,6 +3541,21 @@ enum mg_resolve_err {
 typedef void (*mg_resolve_callback_t)(struct mg_dns_message *dns_message,
                                       void *user_data, enum mg_resolve_err);
 
+/* Max number of answers kept in the per-manager resolver cache */
+#ifndef MG_RESOLVE_CACHE_SIZE
+#define MG_RESOLVE_CACHE_SIZE 32
+#endif
+
+/* How long to remember that a name has no records, in seconds */
+#ifndef MG_RESOLVE_NEGATIVE_TTL
+#define MG_RESOLVE_NEGATIVE_TTL 30
+#endif
+
+/* Upper bound for the record TTL, in seconds */
+#ifndef MG_RESOLVE_MAX_TTL
+#define MG_RESOLVE_MAX_TTL 3600
+#endif
+
 /* Options for `mg_resolve_async_opt`. */
 struct mg_resolve_async_opts {
   const char *nameserver_url;
@@ -3256,6 +3563,7 @@ struct mg_resolve_async_opts {
   int timeout;        /* in seconds; defaults to 5 if zero */
   int accept_literal; /* pseudo-resolve literal ipv4 and ipv6 addrs */
   int only_literal;   /* only resolves literal addrs; sync cb invocation */
+  int no_cache;       /* always send a query, don't use cached answers */
   struct mg_connection **dns_conn; /* return DNS connection */
 };
 
@@ -3283,6 +3591,15 @@ int mg_resolve_async(struct mg_mgr *mgr, const char *name, int query,
  *   NULL);
  * mg_dns_parse_record_data(msg, rr, &ina, sizeof(ina));
  * ----
+ *
+ * Answers are cached in the event manager, up to `MG_RESOLVE_CACHE_SIZE`
+ * entries, for as long as the smallest TTL of their records, capped by
+ * `MG_RESOLVE_MAX_TTL`. Replies without answers are cached for
+ * `MG_RESOLVE_NEGATIVE_TTL` seconds. A cached answer is delivered on the
+ * next `mg_mgr_poll()` iteration, and `*opts.dns_conn` is set to NULL.
+ * Lookups of a name and query type that is already being resolved don't
+ * send another query: they share the DNS connection of the first lookup and
+ * get called back with the same reply.
  */
 int mg_resolve_async_opt(struct mg_mgr *mgr, const char *name, int query,
                          mg_resolve_callback_t cb, void *data,
@@ -55,6 +55,7 @@ struct v7 *init_v7(void *stack_base) {
   opts.object_arena_size = 164;
   opts.function_arena_size = 26;
   opts.property_arena_size = 400;
+  opts.gc_time_budget_us = 0;
   opts.c_stack_base = stack_base;
 
   return v7_create_opt(opts);
@@ -73,6 +73,7 @@ void init_v7(void *stack_base) {
   opts.function_arena_size = 26;
   opts.property_arena_size = 400;
 #endif
+  opts.gc_time_budget_us = 0;
   opts.c_stack_base = stack_base;
   v7 = v7_create_opt(opts);
 
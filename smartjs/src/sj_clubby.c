@@ -738,6 +738,18 @@ error:
  */
 int c_snprintf(char *buf, size_t buf_size, const char *fmt, ...);
 
+/* Parses JSON straight out of the frame, no NUL-terminated copy needed */
+static enum v7_err clubby_parse_json(const char *ptr, size_t len,
+                                     v7_val_t *res) {
+  struct v7_json_parser *jp = v7_json_parser_create(s_v7);
+  enum v7_err rcode = v7_json_parser_feed(jp, ptr, len);
+  if (rcode == V7_OK) {
+    rcode = v7_json_parser_finish(jp, res);
+  }
+  v7_json_parser_destroy(jp);
+  return rcode;
+}
+
 static void clubby_resp_cb(struct clubby_event *evt, void *user_data) {
   v7_val_t *cbp = (v7_val_t *) user_data;
   v7_val_t cb_param;
@@ -755,18 +767,14 @@ static void clubby_resp_cb(struct clubby_event *evt, void *user_data) {
      */
     const char reply_fmt[] = "{\"id\":%" INT64_FMT
                              ",\"status\":1,"
-                             "resp: \"Deadline exceeded\"}";
+                             "\"resp\": \"Deadline exceeded\"}";
     char reply[sizeof(reply_fmt) + 17];
     c_snprintf(reply, sizeof(reply), reply_fmt, evt->response.id);
 
     res = v7_parse_json(s_v7, reply, &cb_param);
   } else {
-    /* v7_parse_json wants null terminated string */
-    char *obj_str = calloc(1, evt->response.resp_body->len + 1);
-    memcpy(obj_str, evt->response.resp_body->ptr, evt->response.resp_body->len);
-
-    res = v7_parse_json(s_v7, obj_str, &cb_param);
-    free(obj_str);
+    res = clubby_parse_json(evt->response.resp_body->ptr,
+                            evt->response.resp_body->len, &cb_param);
   }
 
   if (res != V7_OK) {
@@ -825,13 +833,9 @@ static void clubby_req_cb(struct clubby_event *evt, void *user_data) {
 
   struct json_token *obj_tok = evt->request.cmd_body;
 
-  /* v7_parse_json wants null terminated string */
-  char *obj_str = calloc(1, obj_tok->len + 1);
-  memcpy(obj_str, obj_tok->ptr, obj_tok->len);
-
   v7_val_t clubby_param;
-  enum v7_err res = v7_parse_json(s_v7, obj_str, &clubby_param);
-  free(obj_str);
+  enum v7_err res =
+      clubby_parse_json(obj_tok->ptr, obj_tok->len, &clubby_param);
 
   if (res != V7_OK) {
     /*
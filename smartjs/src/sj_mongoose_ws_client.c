@@ -66,7 +66,7 @@ static void ws_ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
       free(ud);
       break;
     case MG_EV_SEND:
-      invoke_cb(ud, "onsend", v7_mk_number(nc->send_mbuf.len));
+      invoke_cb(ud, "onsend", v7_mk_number(mg_send_queue_len(nc)));
       break;
   }
 }
@@ -249,7 +249,7 @@ SJ_PRIVATE enum v7_err WebSocket_send(struct v7 *v7, v7_val_t *res) {
 
   /* notify that the buffer size changed */
   ud = (struct user_data *) nc->user_data;
-  invoke_cb(ud, "onsend", v7_mk_number(nc->send_mbuf.len));
+  invoke_cb(ud, "onsend", v7_mk_number(mg_send_queue_len(nc)));
 
 clean:
   return rcode;
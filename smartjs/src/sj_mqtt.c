@@ -13,19 +13,72 @@
 #include "smartjs/src/sj_v7_ext.h"
 #include "smartjs/src/sj_mongoose.h"
 #include "smartjs/src/sj_common.h"
+#include "smartjs/src/sj_timers.h"
 
 #define SJ_MQTT_CONNECT_CB "_cocb"
 #define SJ_MQTT_MESSAGE_CB "_mecb"
 #define SJ_MQTT_ERROR_CB "_ercb"
 #define SJ_MQTT_CLOSE_CB "_clcb"
 
+/*
+ * State of a client, lives as long as the JS client object is connected or
+ * reconnecting: QoS 1/2 messages which weren't acknowledged before the
+ * connection got closed are resent on the next one.
+ */
 struct user_data {
   struct v7 *v7;
   uint32_t msgid; /* next message id */
   v7_val_t client;
   char *client_id;
+  char *url; /* host:port */
+  int use_ssl;
+  int reconnect_period; /* ms, 0 to not reconnect */
+  int ended;            /* `end()` was called */
+  sj_timer_id reconnect_timer;
+  struct mg_connection *nc;         /* NULL while disconnected */
+  struct mg_mqtt_inflight inflight; /* QoS 1/2 publishes */
 };
 
+static void mqtt_ev_handler(struct mg_connection *nc, int ev, void *ev_data);
+
+static int mqtt_connect_nc(struct user_data *ud) {
+  struct mg_connection *nc = mg_connect(&sj_mgr, ud->url, mqtt_ev_handler);
+  if (nc == NULL) return 0;
+#ifdef MG_ENABLE_SSL
+  if (ud->use_ssl) mg_set_ssl(nc, NULL, NULL);
+#endif
+  mg_set_protocol_mqtt(nc);
+  nc->user_data = ud;
+  mg_mqtt_set_inflight(nc, &ud->inflight);
+  ud->nc = nc;
+  return 1;
+}
+
+static void mqtt_free(struct user_data *ud) {
+  struct v7 *v7 = ud->v7;
+  v7_def(v7, ud->client, "_ud", ~0, _V7_DESC_HIDDEN(1), v7_mk_undefined());
+  v7_disown(v7, &ud->client);
+  mg_mqtt_inflight_free(&ud->inflight);
+  free(ud->client_id);
+  free(ud->url);
+  free(ud);
+}
+
+static void mqtt_reconnect_cb(void *arg) {
+  struct user_data *ud = (struct user_data *) arg;
+  ud->reconnect_timer = SJ_INVALID_TIMER_ID;
+  if (!mqtt_connect_nc(ud)) {
+    ud->reconnect_timer =
+        sj_set_c_timer(ud->reconnect_period, 0, mqtt_reconnect_cb, ud);
+  }
+}
+
+/* Returns the state of the client `this`, or NULL if it has ended */
+static struct user_data *mqtt_get_ud(struct v7 *v7) {
+  return (struct user_data *) v7_to_foreign(
+      v7_get(v7, v7_get_this(v7), "_ud", ~0));
+}
+
 static void mqtt_ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
   struct mg_mqtt_message *msg = (struct mg_mqtt_message *) ev_data;
   struct user_data *ud = (struct user_data *) nc->user_data;
@@ -73,17 +126,21 @@ static void mqtt_ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
       break;
     case MG_EV_CLOSE:
       /*
-       * Invoke close cb and then destroys all mg state.
+       * Invoke close cb, then either schedule a reconnect, which picks up
+       * unacknowledged messages, or destroy all mg state.
        */
+      ud->nc = NULL;
       cb = v7_get(v7, ud->client, SJ_MQTT_CLOSE_CB, ~0);
       if (!v7_is_undefined(cb)) {
         sj_invoke_cb0(v7, cb);
       }
 
-      v7_def(v7, ud->client, "_nc", ~0, _V7_DESC_HIDDEN(1), v7_mk_undefined());
-      v7_disown(v7, &ud->client);
-      free(ud->client_id);
-      free(ud);
+      if (ud->ended || ud->reconnect_period == 0) {
+        mqtt_free(ud);
+      } else {
+        ud->reconnect_timer =
+            sj_set_c_timer(ud->reconnect_period, 0, mqtt_reconnect_cb, ud);
+      }
       break;
   }
 }
@@ -99,6 +156,9 @@ static void mqtt_ev_handler(struct mg_connection *nc, int ev, void *ev_data) {
  *
  * - clientId: string; mqtt client id. defaults to
  *             Math.random().toString(16).substr(2, 10)
+ * - reconnectPeriod: number; milliseconds between reconnection attempts
+ *             after the connection is closed. Defaults to 0, which
+ *             doesn't reconnect.
  *
  * Example:
  *
@@ -125,12 +185,11 @@ enum v7_err sj_mqtt_connect(struct v7 *v7, v7_val_t *res) {
   size_t len;
   struct mg_str host, scheme;
   unsigned int port;
-  struct mg_connection *nc;
   struct user_data *ud;
   char *url_with_port = NULL;
   int use_ssl = 0;
   v7_val_t urlv = v7_arg(v7, 0), opts = v7_arg(v7, 1);
-  v7_val_t client_id;
+  v7_val_t client_id, reconnect_period;
   v7_val_t proto =
       v7_get(v7, v7_get(v7, v7_get_global(v7), "MQTT", ~0), "proto", ~0);
 
@@ -139,6 +198,15 @@ enum v7_err sj_mqtt_connect(struct v7 *v7, v7_val_t *res) {
     goto clean;
   }
 
+  /* Running JS may move strings, so `url` is fetched afterwards */
+  client_id = v7_get(v7, opts, "clientId", ~0);
+  if (v7_is_undefined(client_id)) {
+    rcode = v7_exec(v7, "Math.random().toString(16).substr(2,8)", &client_id);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+  }
+
   url = v7_get_string_data(v7, &urlv, &len);
 
   if (mg_parse_uri(mg_mk_str(url), &scheme, NULL, &host, &port, NULL, NULL,
@@ -150,19 +218,22 @@ enum v7_err sj_mqtt_connect(struct v7 *v7, v7_val_t *res) {
   if (mg_vcmp(&scheme, "mqtt") == 0) {
     url += sizeof("mqtt://") - 1;
   } else if (mg_vcmp(&scheme, "mqtts") == 0) {
+#ifdef MG_ENABLE_SSL
     url += sizeof("mqtts://") - 1;
     use_ssl = 1;
+#else
+    rcode = v7_throwf(v7, "Error", "SSL not enabled");
+    goto clean;
+#endif
   } else {
     rcode = v7_throwf(v7, "Error", "unsupported protocol");
     goto clean;
   }
 
-  client_id = v7_get(v7, opts, "clientId", ~0);
-  if (v7_is_undefined(client_id)) {
-    rcode = v7_exec(v7, "Math.random().toString(16).substr(2,8)", &client_id);
-    if (rcode != V7_OK) {
-      goto clean;
-    }
+  reconnect_period = v7_get(v7, opts, "reconnectPeriod", ~0);
+  if (!v7_is_undefined(reconnect_period) && !v7_is_number(reconnect_period)) {
+    rcode = v7_throwf(v7, "TypeError", "invalid reconnectPeriod");
+    goto clean;
   }
 
   if (port == 0) {
@@ -171,34 +242,31 @@ enum v7_err sj_mqtt_connect(struct v7 *v7, v7_val_t *res) {
     (void) ret;
   }
 
-  nc =
-      mg_connect(&sj_mgr, url_with_port ? url_with_port : url, mqtt_ev_handler);
-  if (nc == NULL) {
+  ud = calloc(1, sizeof(*ud));
+  ud->v7 = v7;
+  ud->client_id = strdup(v7_to_cstring(v7, &client_id));
+  ud->url = strdup(url_with_port ? url_with_port : url);
+  ud->use_ssl = use_ssl;
+  ud->reconnect_period =
+      v7_is_undefined(reconnect_period) ? 0 : v7_to_number(reconnect_period);
+  mg_mqtt_inflight_init(&ud->inflight, 0, 0);
+
+  if (!mqtt_connect_nc(ud)) {
+    mg_mqtt_inflight_free(&ud->inflight);
+    free(ud->client_id);
+    free(ud->url);
+    free(ud);
     rcode = v7_throwf(v7, "Error", "cannot create connection");
     goto clean;
   }
 
-  if (use_ssl) {
-#ifdef MG_ENABLE_SSL
-    mg_set_ssl(nc, NULL, NULL);
-#else
-    rcode = v7_throwf(v7, "Error", "SSL not enabled");
-    goto clean;
-#endif
-  }
-  mg_set_protocol_mqtt(nc);
-
   *res = v7_mk_object(v7);
   v7_set_proto(v7, *res, proto);
 
-  ud = calloc(1, sizeof(*ud));
-  ud->v7 = v7;
   ud->client = *res;
-  ud->client_id = strdup(v7_to_cstring(v7, &client_id));
-  nc->user_data = ud;
   v7_own(v7, &ud->client);
 
-  v7_def(v7, *res, "_nc", ~0, _V7_DESC_HIDDEN(1), v7_mk_foreign(nc));
+  v7_def(v7, *res, "_ud", ~0, _V7_DESC_HIDDEN(1), v7_mk_foreign(ud));
 
 clean:
   free(url_with_port);
@@ -206,24 +274,43 @@ clean:
   return rcode;
 }
 
+/* Parse the `qos` property of an options object, 0 if missing. */
+static int sj_mqtt_get_qos(struct v7 *v7, v7_val_t opts, int *qos) {
+  v7_val_t qosv = v7_get(v7, opts, "qos", ~0);
+  if (v7_is_undefined(qosv)) {
+    *qos = 0;
+    return 1;
+  }
+  if (!v7_is_number(qosv)) return 0;
+  *qos = v7_to_number(qosv);
+  return *qos >= 0 && *qos <= 2;
+}
+
 /*
  * Publishes a message to a topic.
  *
  * Args:
  * - `topic`: topic, string.
  * - `message`: message, string.
+ * - `opts`: optional object with properties:
+ *   - `qos`: 0 (default), 1 or 2.
+ *   - `retain`: boolean, ask the broker to retain the message.
  *
- * Only QOS 0 is implemented at the moment.
+ * QoS 1 and 2 messages are pipelined: up to `MG_MQTT_MAX_INFLIGHT` of them
+ * await acknowledgement at a time, the rest are queued and retransmitted
+ * until acknowledged, on the next connection if the current one is closed
+ * and `reconnectPeriod` is set. They can be published while reconnecting
+ * too. Returns false if the queue is full.
  */
 enum v7_err MQTT_publish(struct v7 *v7, v7_val_t *res) {
   enum v7_err rcode = V7_OK;
   struct user_data *ud;
-  struct mg_connection *nc;
   const char *topic;
   const char *message;
   size_t message_len;
-  v7_val_t topicv = v7_arg(v7, 0), messagev = v7_arg(v7, 1);
-  (void) res;
+  int qos, flags;
+  v7_val_t topicv = v7_arg(v7, 0), messagev = v7_arg(v7, 1),
+           opts = v7_arg(v7, 2);
 
   topic = v7_to_cstring(v7, &topicv);
   if (topic == NULL || strlen(topic) == 0) {
@@ -237,14 +324,28 @@ enum v7_err MQTT_publish(struct v7 *v7, v7_val_t *res) {
   }
   message = v7_get_string_data(v7, &messagev, &message_len);
 
-  nc = v7_to_foreign(v7_get(v7, v7_get_this(v7), "_nc", ~0));
-  if (nc == NULL) {
+  if (!sj_mqtt_get_qos(v7, opts, &qos)) {
+    rcode = v7_throwf(v7, "TypeError", "invalid qos");
+    goto clean;
+  }
+  flags = MG_MQTT_QOS(qos);
+  if (v7_is_truthy(v7, v7_get(v7, opts, "retain", ~0))) {
+    flags |= MG_MQTT_RETAIN;
+  }
+
+  ud = mqtt_get_ud(v7);
+  if (ud == NULL || (qos == 0 && ud->nc == NULL)) {
     rcode = v7_throwf(v7, "Error", "invalid connection");
     goto clean;
   }
-  ud = (struct user_data *) nc->user_data;
 
-  mg_mqtt_publish(nc, topic, ud->msgid++, MG_MQTT_QOS(0), message, message_len);
+  if (qos == 0) {
+    mg_mqtt_publish(ud->nc, topic, ud->msgid++, flags, message, message_len);
+    *res = v7_mk_boolean(1);
+  } else {
+    *res = v7_mk_boolean(mg_mqtt_inflight_publish(&ud->inflight, topic, flags,
+                                                  message, message_len) > 0);
+  }
 
 clean:
   return rcode;
@@ -252,21 +353,23 @@ clean:
 
 /*
  * Subscribes a mqtt client to a topic.
+ *
+ * An optional second argument is an object with a `qos` property:
+ * 0 (default), 1 or 2.
  */
 enum v7_err MQTT_subscribe(struct v7 *v7, v7_val_t *res) {
   enum v7_err rcode = V7_OK;
   struct user_data *ud;
-  struct mg_connection *nc;
   struct mg_mqtt_topic_expression expr;
-  v7_val_t topicv = v7_arg(v7, 0);
+  v7_val_t topicv = v7_arg(v7, 0), opts = v7_arg(v7, 1);
   const char *topic;
+  int qos;
 
-  nc = v7_to_foreign(v7_get(v7, v7_get_this(v7), "_nc", ~0));
-  if (nc == NULL) {
-    rcode = v7_throwf(v7, "Error", "unsupported protocol");
+  ud = mqtt_get_ud(v7);
+  if (ud == NULL || ud->nc == NULL) {
+    rcode = v7_throwf(v7, "Error", "invalid connection");
     goto clean;
   }
-  ud = (struct user_data *) nc->user_data;
 
   topic = v7_to_cstring(v7, &topicv);
   if (topic == NULL || strlen(topic) == 0) {
@@ -274,9 +377,14 @@ enum v7_err MQTT_subscribe(struct v7 *v7, v7_val_t *res) {
     goto clean;
   }
 
+  if (!sj_mqtt_get_qos(v7, opts, &qos)) {
+    rcode = v7_throwf(v7, "TypeError", "invalid qos");
+    goto clean;
+  }
+
   expr.topic = topic;
-  expr.qos = 0;
-  mg_mqtt_subscribe(nc, &expr, 1, ud->msgid++);
+  expr.qos = qos;
+  mg_mqtt_subscribe(ud->nc, &expr, 1, ud->msgid++);
 
   *res = v7_mk_boolean(1);
 clean:
@@ -289,7 +397,9 @@ clean:
  *
  * - `connect`: invoked on sucessfull connection (mqtt connack message)
  * - `error`: invoked on connection error
- * - `close`: invoked when the connection gets closed
+ * - `close`: invoked when the connection gets closed. Unless `end()` was
+ *            called or `reconnectPeriod` is not set, the client then
+ *            reconnects
  * - `message`: invoked when a new message is received. The callback
  *              receives (topic, message) arguments, both strings
  */
@@ -320,6 +430,28 @@ clean:
   return rcode;
 }
 
+/*
+ * Closes the connection after sending what's buffered, and stops
+ * reconnecting. Messages which weren't acknowledged are dropped.
+ */
+enum v7_err MQTT_end(struct v7 *v7, v7_val_t *res) {
+  struct user_data *ud = mqtt_get_ud(v7);
+
+  if (ud != NULL && !ud->ended) {
+    ud->ended = 1;
+    if (ud->nc != NULL) {
+      ud->nc->flags |= MG_F_SEND_AND_CLOSE;
+    } else {
+      /* waiting for a reconnect */
+      sj_clear_timer(ud->reconnect_timer);
+      mqtt_free(ud);
+    }
+  }
+
+  (void) res;
+  return V7_OK;
+}
+
 void sj_mqtt_api_setup(struct v7 *v7) {
   v7_val_t mqtt_proto = v7_mk_object(v7);
   v7_val_t mqtt_connect =
@@ -336,6 +468,7 @@ void sj_mqtt_api_setup(struct v7 *v7) {
   v7_set_method(v7, mqtt_proto, "publish", MQTT_publish);
   v7_set_method(v7, mqtt_proto, "subscribe", MQTT_subscribe);
   v7_set_method(v7, mqtt_proto, "on", MQTT_on);
+  v7_set_method(v7, mqtt_proto, "end", MQTT_end);
   v7_set(v7, v7_get_global(v7), "MQTT", ~0, mqtt);
 
   v7_disown(v7, &mqtt);
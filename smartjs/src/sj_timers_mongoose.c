@@ -4,81 +4,57 @@
 #include <smartjs/src/sj_mongoose.h>
 #include <smartjs/src/sj_v7_ext.h>
 
-static sj_timer_id s_next_timer_id = 0;
-
 struct timer_info {
-  sj_timer_id id;
-  int interval_ms;
+  int repeat;
   timer_callback cb;
   void *arg;
   struct v7 *v7;
   v7_val_t js_cb;
 };
 
-static void sj_timer_handler(struct mg_connection *c, int ev, void *p) {
-  struct timer_info *ti = (struct timer_info *) c->user_data;
-  (void) p;
-  if (ti == NULL) return;
-  switch (ev) {
-    case MG_EV_TIMER: {
-      if (c->flags & MG_F_CLOSE_IMMEDIATELY) break;
-      if (ti->v7 != NULL) sj_invoke_cb0(ti->v7, ti->js_cb);
-      if (ti->cb != NULL) ti->cb(ti->arg);
-      if (ti->interval_ms > 0) {
-        c->ev_timer_time = mg_time() + ti->interval_ms / 1000.0;
-        LOG(LL_INFO, ("next timer at %d", (int) (c->ev_timer_time * 1000)));
-      } else {
-        c->flags |= MG_F_CLOSE_IMMEDIATELY;
-      }
-      break;
-    }
-    case MG_EV_CLOSE: {
-      if (ti->v7 != NULL) v7_disown(ti->v7, &ti->js_cb);
-      free(ti);
-      c->user_data = NULL;
-      break;
-    }
-  }
+static void sj_timer_info_free(struct timer_info *ti) {
+  if (ti->v7 != NULL) v7_disown(ti->v7, &ti->js_cb);
+  free(ti);
 }
 
-static struct mg_connection *sj_find_timer(sj_timer_id id) {
-  struct mg_connection *c;
-  for (c = mg_next(&sj_mgr, NULL); c != NULL; c = mg_next(&sj_mgr, c)) {
-    if (c->handler == sj_timer_handler) {
-      struct timer_info *ti = (struct timer_info *) c->user_data;
-      if (ti != NULL && ti->id == id) return c;
-    }
+static void sj_timer_handler(struct mg_mgr *mgr, void *user_data) {
+  struct timer_info *ti = (struct timer_info *) user_data;
+  /* A repeating timer can be cleared by its own callback, read ti first */
+  int repeat = ti->repeat;
+  (void) mgr;
+  if (ti->v7 != NULL) {
+    sj_invoke_cb0(ti->v7, ti->js_cb);
+  } else if (ti->cb != NULL) {
+    ti->cb(ti->arg);
   }
-  return NULL;
+  /* One-shot timers are gone from mongoose by now */
+  if (!repeat) sj_timer_info_free(ti);
 }
 
-sj_timer_id sj_set_timer(struct timer_info *ti, int msecs, int repeat) {
-  struct mg_connection *c;
-  struct mg_add_sock_opts opts;
-  do {
-    ti->id = s_next_timer_id++;
-  } while (ti->id == SJ_INVALID_TIMER_ID || sj_find_timer(ti->id) != NULL);
-  ti->interval_ms = (repeat ? msecs : -1);
-  memset(&opts, 0, sizeof(opts));
-  opts.user_data = ti;
-  c = mg_add_sock_opt(&sj_mgr, INVALID_SOCKET, sj_timer_handler, opts);
-  if (c == NULL) {
+static sj_timer_id sj_set_timer(struct timer_info *ti, int msecs, int repeat) {
+  sj_timer_id id;
+  ti->repeat = repeat;
+  id = mg_add_timer(&sj_mgr, mg_time() + msecs / 1000.0,
+                    repeat ? msecs / 1000.0 : 0, sj_timer_handler, ti);
+  if (id == SJ_INVALID_TIMER_ID) {
     free(ti);
-    return 0;
+    return SJ_INVALID_TIMER_ID;
   }
-  c->ev_timer_time = mg_time() + (msecs / 1000.0);
   mongoose_schedule_poll();
-  return 1;
+  return id;
 }
 
 sj_timer_id sj_set_js_timer(int msecs, int repeat, struct v7 *v7, v7_val_t cb) {
   struct timer_info *ti = (struct timer_info *) calloc(1, sizeof(*ti));
+  sj_timer_id id;
   if (ti == NULL) return SJ_INVALID_TIMER_ID;
   ti->v7 = v7;
   ti->js_cb = cb;
-  if (!sj_set_timer(ti, msecs, repeat)) return SJ_INVALID_TIMER_ID;
+  if ((id = sj_set_timer(ti, msecs, repeat)) == SJ_INVALID_TIMER_ID) {
+    return SJ_INVALID_TIMER_ID;
+  }
   v7_own(v7, &ti->js_cb);
-  return ti->id;
+  return id;
 }
 
 sj_timer_id sj_set_c_timer(int msecs, int repeat, timer_callback cb,
@@ -87,12 +63,10 @@ sj_timer_id sj_set_c_timer(int msecs, int repeat, timer_callback cb,
   if (ti == NULL) return SJ_INVALID_TIMER_ID;
   ti->cb = cb;
   ti->arg = arg;
-  if (!sj_set_timer(ti, msecs, repeat)) return SJ_INVALID_TIMER_ID;
-  return ti->id;
+  return sj_set_timer(ti, msecs, repeat);
 }
 
 void sj_clear_timer(sj_timer_id id) {
-  struct mg_connection *c = sj_find_timer(id);
-  if (c == NULL) return;
-  c->flags |= MG_F_CLOSE_IMMEDIATELY;
+  struct timer_info *ti = (struct timer_info *) mg_cancel_timer(&sj_mgr, id);
+  if (ti != NULL) sj_timer_info_free(ti);
 }
@@ -519,7 +519,7 @@ static void mg_ev_handler(struct mg_connection *c, int ev, void *ev_data) {
       }
       trigger_event(ud->v7, get_cb_info_holder(ud->v7, ud->sock_obj), s_ev_sent,
                     v7_mk_undefined(), v7_mk_undefined());
-      if (c->send_mbuf.len == 0) {
+      if (mg_send_queue_len(c) == 0) {
         trigger_event(ud->v7, get_cb_info_holder(ud->v7, ud->sock_obj),
                       s_ev_drain, v7_mk_undefined(), v7_mk_undefined());
       }
@@ -0,0 +1,147 @@
+# Standalone tests and benchmarks. They include the sources they test and
+# don't need the unit_test harness, so they have a makefile of their own:
+#
+#   make -f bench.mk        builds them
+#   make -f bench.mk test   builds and runs the tests
+#   make -f bench.mk bench  builds and runs the benchmarks, generating the
+#                           certificates they need first
+#   make -f bench.mk run    both
+
+TESTS = resolv_cache_test v7_test v7_test_switch http_fuzz_test
+BENCHES = ws_mask_bench ws_deflate_bench mt_conn_bench kr_resume_bench \
+          kr_ca_bench kr_ca_bench_on_demand kr_suite_bench kr_aes_bench \
+          kr_aes_bench_generic kr_record_bench kr_record_bench_copied \
+          mqtt_broker_bench v7_bcode_bench v7_bcode_bench_switch mkcaindex
+
+all: $(TESTS) $(BENCHES)
+
+run: test bench
+
+test: $(TESTS)
+	./resolv_cache_test
+	./v7_test
+	./v7_test_switch
+	./http_fuzz_test
+
+bench: $(BENCHES) kr_resume_bench.pem kr_ca_bench.d/bundle.idx
+	./ws_mask_bench
+	./ws_deflate_bench
+	./mt_conn_bench
+	./kr_resume_bench kr_resume_bench.pem
+	./kr_ca_bench kr_ca_bench.d/sv.pem kr_ca_bench.d/bundle.pem \
+	  kr_ca_bench.d/bundle.idx
+	./kr_ca_bench_on_demand kr_ca_bench.d/sv.pem kr_ca_bench.d/bundle.pem \
+	  kr_ca_bench.d/bundle.idx
+	./kr_suite_bench kr_resume_bench.pem
+	./kr_aes_bench
+	./kr_aes_bench_generic
+	./kr_record_bench kr_resume_bench.pem
+	./kr_record_bench_copied kr_resume_bench.pem
+	./mqtt_broker_bench
+	./v7_bcode_bench
+	./v7_bcode_bench_switch
+
+clean:
+	rm -rf $(TESTS) $(BENCHES) kr_resume_bench.pem kr_ca_bench.d
+
+.PHONY: all run test bench clean
+
+resolv_cache_test: resolv_cache_test.c ../../mongoose/mongoose.c
+	$(CC) -g -W -Wall -I../../mongoose -I../.. $(CFLAGS_EXTRA) -o $@ $< \
+	  ../../common/test_util.c
+
+v7_test: v7_test.c ../../v7/v7.c
+	$(CC) -g -W -Wall -fsanitize=address -I../../v7 -I../.. $(CFLAGS_EXTRA) \
+	  -o $@ $< ../../common/test_util.c ../../common/cs_time.c -lm
+
+v7_test_switch: v7_test.c ../../v7/v7.c
+	$(CC) -g -W -Wall -fsanitize=address -DV7_DISABLE_COMPUTED_GOTO \
+	  -DV7_DISABLE_SUPERINSTRUCTIONS -I../../v7 -I../.. $(CFLAGS_EXTRA) \
+	  -o $@ $< ../../common/test_util.c ../../common/cs_time.c -lm
+
+http_fuzz_test: http_fuzz_test.c ../../mongoose/mongoose.c
+	$(CC) -g -W -Wall -fsanitize=address -I../../mongoose -I../.. \
+	  $(CFLAGS_EXTRA) -o $@ $< ../../common/test_util.c
+
+ws_mask_bench: ws_mask_bench.c ../../mongoose/mongoose.c
+	$(CC) -O2 -W -Wall -I../../mongoose $(CFLAGS_EXTRA) -o $@ $<
+
+ws_deflate_bench: ws_deflate_bench.c ../../mongoose/mongoose.c
+	$(CC) -O2 -W -Wall -I../../mongoose -I../.. $(CFLAGS_EXTRA) -o $@ $< \
+	  ../../common/miniz.c
+
+mt_conn_bench: mt_conn_bench.c ../../mongoose/mongoose.c
+	$(CC) -O2 -W -Wall -DMG_ENABLE_THREADS -DMG_ENABLE_EPOLL -I../../mongoose \
+	  $(CFLAGS_EXTRA) -o $@ $< -lpthread
+
+kr_resume_bench: kr_resume_bench.c ../../mongoose/mongoose.c \
+                 ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -DMG_ENABLE_SSL -DSSL_KRYPTON -DMG_DISABLE_PFS \
+	  -DMG_ENABLE_THREADS -I../../krypton -I../../mongoose $(CFLAGS_EXTRA) \
+	  -o $@ $< ../../krypton/krypton.c -lpthread
+
+kr_ca_bench: kr_ca_bench.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -I../../krypton $(CFLAGS_EXTRA) -o $@ $< -lpthread
+
+kr_ca_bench_on_demand: kr_ca_bench.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -DKR_NO_LOAD_CA_STORE -I../../krypton $(CFLAGS_EXTRA) \
+	  -o $@ $< -lpthread
+
+mkcaindex: ../../tools/mkcaindex.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -I../../krypton $(CFLAGS_EXTRA) -o $@ $<
+
+kr_suite_bench: kr_suite_bench.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -I../../krypton $(CFLAGS_EXTRA) -o $@ $< -lpthread
+
+kr_aes_bench: kr_aes_bench.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -I../../krypton $(CFLAGS_EXTRA) -o $@ $<
+
+kr_aes_bench_generic: kr_aes_bench.c ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -DKR_NO_AESNI -I../../krypton $(CFLAGS_EXTRA) -o $@ $<
+
+kr_record_bench: kr_record_bench.c ../../mongoose/mongoose.c \
+                 ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -DMG_ENABLE_SSL -DSSL_KRYPTON -DMG_DISABLE_PFS \
+	  -DMG_ENABLE_THREADS -I../../krypton -I../../mongoose $(CFLAGS_EXTRA) \
+	  -o $@ $< ../../krypton/krypton.c -lpthread
+
+kr_record_bench_copied: kr_record_bench.c ../../mongoose/mongoose.c \
+                        ../../krypton/krypton.c
+	$(CC) -O2 -W -Wall -DMG_ENABLE_SSL -DSSL_KRYPTON -DMG_DISABLE_PFS \
+	  -DMG_ENABLE_THREADS -DMG_DISABLE_SSL_IN_PLACE -I../../krypton \
+	  -I../../mongoose $(CFLAGS_EXTRA) -o $@ $< ../../krypton/krypton.c \
+	  -lpthread
+
+mqtt_broker_bench: mqtt_broker_bench.c ../../mongoose/mongoose.c
+	$(CC) -O2 -W -Wall -DMG_ENABLE_MQTT_BROKER -DMG_ENABLE_THREADS \
+	  -DMG_ENABLE_EPOLL -I../../mongoose $(CFLAGS_EXTRA) -o $@ $< -lpthread
+
+v7_bcode_bench: v7_bcode_bench.c ../../v7/v7.c
+	$(CC) -O2 -W -Wall -I../../v7 -I../.. $(CFLAGS_EXTRA) -o $@ $< \
+	  ../../common/cs_time.c -lm
+
+v7_bcode_bench_switch: v7_bcode_bench.c ../../v7/v7.c
+	$(CC) -O2 -W -Wall -DV7_DISABLE_COMPUTED_GOTO \
+	  -DV7_DISABLE_SUPERINSTRUCTIONS -I../../v7 -I../.. $(CFLAGS_EXTRA) \
+	  -o $@ $< ../../common/cs_time.c -lm
+
+# Benchmark data
+
+kr_resume_bench.pem:
+	openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost \
+	  -keyout $@ -out $@
+
+# 150 roots, the server certificate is issued by the last one
+kr_ca_bench.d/bundle.pem:
+	mkdir -p kr_ca_bench.d
+	cd kr_ca_bench.d && for i in $$(seq 1 150); do \
+	  openssl req -x509 -newkey rsa:1024 -nodes -days 30 \
+	    -subj "/O=Bench/CN=Root $$i" -keyout k$$i.pem -out c$$i.pem; \
+	  cat c$$i.pem >> bundle.pem; done
+	cd kr_ca_bench.d && openssl req -new -newkey rsa:2048 -nodes \
+	  -subj /CN=localhost -keyout sv.key -out sv.csr && \
+	  openssl x509 -req -in sv.csr -CA c150.pem -CAkey k150.pem \
+	    -set_serial 1 -days 30 -out sv.crt && cat sv.crt sv.key > sv.pem
+
+kr_ca_bench.d/bundle.idx: kr_ca_bench.d/bundle.pem mkcaindex
+	./mkcaindex $< $@
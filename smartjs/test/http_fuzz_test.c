@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * HTTP parser tests: randomly generated requests are pipelined to a server
+ * and sent in random fragments, the server regenerates each request from
+ * its sequence number and checks what the parser made of it. Run with
+ * "throughput" as the filter to only measure request rates.
+ * Includes mongoose.c directly, build with -fsanitize=address.
+ */
+
+#include "mongoose.c"
+#include "common/test_util.h"
+
+#define HTTP_ADDR "127.0.0.1:17755"
+#define MAX_HEADERS 11 /* X-Seq and a subset of gen_request() names */
+#define MAX_BODY 2000
+
+struct fuzz_request {
+  char text[MG_MAX_HTTP_REQUEST_SIZE + MAX_BODY];
+  int len;
+  int num_headers;
+  char names[MAX_HEADERS][30];
+  char values[MAX_HEADERS][30];
+  int body_len;
+};
+
+struct fuzz_stats {
+  int num_requests; /* Requests parsed by the server */
+  int num_errors;   /* Requests that did not match */
+  int verify;       /* Regenerate and compare each request */
+};
+
+static struct fuzz_stats s_stats;
+
+static unsigned fuzz_rand(unsigned *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7fff;
+}
+
+/* Request `seq` is always the same, whoever generates it */
+static void gen_request(int seq, struct fuzz_request *r) {
+  static const char *names[] = {
+      "Content-Type", "User-Agent", "Accept", "Accept-Encoding", "Cookie",
+      "Authorization", "Referer", "If-None-Match", "X-Forwarded-For",
+      "X-Custom"};
+  unsigned seed = (unsigned) seq, mask = 0;
+  int is_post = fuzz_rand(&seed) % 2, n;
+  size_t i, j;
+
+  memset(r, 0, sizeof(*r));
+  n = snprintf(r->text, sizeof(r->text), "%s /r/%d?q=%d HTTP/1.1\r\n",
+               is_post ? "POST" : "GET", seq, seq);
+  snprintf(r->names[0], sizeof(r->names[0]), "X-Seq");
+  snprintf(r->values[0], sizeof(r->values[0]), "%d", seq);
+  r->num_headers = 1;
+
+  /* A random subset of headers, names in random case */
+  mask = fuzz_rand(&seed) | fuzz_rand(&seed) << 15;
+  for (i = 0; i < ARRAY_SIZE(names); i++) {
+    if (!(mask & (1u << i))) continue;
+    for (j = 0; j < strlen(names[i]); j++) {
+      r->names[r->num_headers][j] =
+          fuzz_rand(&seed) % 4 ? names[i][j] : (char) tolower(names[i][j]);
+    }
+    snprintf(r->values[r->num_headers], sizeof(r->values[0]), "v%u",
+             fuzz_rand(&seed));
+    r->num_headers++;
+  }
+  for (i = 0; i < (size_t) r->num_headers; i++) {
+    n += snprintf(r->text + n, sizeof(r->text) - n, "%s:%s%s\r\n",
+                  r->names[i], fuzz_rand(&seed) % 2 ? " " : "", r->values[i]);
+  }
+
+  /* POST without Content-Length would take the rest of the connection */
+  r->body_len = fuzz_rand(&seed) % 3 ? 0 : (int) (fuzz_rand(&seed) % MAX_BODY);
+  if (r->body_len > 0 || is_post) {
+    n += snprintf(r->text + n, sizeof(r->text) - n, "Content-Length: %d\r\n",
+                  r->body_len);
+  }
+  n += snprintf(r->text + n, sizeof(r->text) - n, "\r\n");
+  for (i = 0; i < (size_t) r->body_len; i++) {
+    r->text[n++] = 'a' + fuzz_rand(&seed) % 26;
+  }
+  r->len = n;
+}
+
+/* Header lookup by scanning all names, to check the index against */
+static struct mg_str *find_header(struct http_message *hm, const char *name) {
+  int i;
+  for (i = 0; i < MG_MAX_HTTP_HEADERS && hm->header_names[i].len > 0; i++) {
+    if (mg_vcasecmp(&hm->header_names[i], name) == 0) {
+      return &hm->header_values[i];
+    }
+  }
+  return NULL;
+}
+
+static int check_request(struct http_message *hm) {
+  struct fuzz_request r;
+  struct mg_str *s;
+  char uri[20];
+  int i;
+
+  if ((s = find_header(hm, "X-Seq")) == NULL) return 0;
+  gen_request(atoi(s->p), &r);
+  snprintf(uri, sizeof(uri), "/r/%d", atoi(s->p));
+
+  if (hm->message.len != (size_t) r.len ||
+      memcmp(hm->message.p, r.text, r.len) != 0 ||
+      mg_vcmp(&hm->uri, uri) != 0 || hm->body.len != (size_t) r.body_len ||
+      memcmp(hm->body.p, r.text + r.len - r.body_len, r.body_len) != 0) {
+    return 0;
+  }
+  for (i = 0; i < r.num_headers; i++) {
+    if ((s = mg_get_http_header(hm, r.names[i])) == NULL ||
+        s != find_header(hm, r.names[i]) || mg_vcmp(s, r.values[i]) != 0) {
+      return 0;
+    }
+  }
+  return mg_get_http_header(hm, "Host") == NULL &&
+         mg_get_http_header(hm, "Upgrade") == NULL;
+}
+
+static void server_handler(struct mg_connection *nc, int ev, void *p) {
+  if (ev == MG_EV_HTTP_REQUEST) {
+    s_stats.num_requests++;
+    if (s_stats.verify && !check_request((struct http_message *) p)) {
+      s_stats.num_errors++;
+    }
+    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+  }
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == MG_EV_RECV) {
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+/*
+ * Pipelines requests `first`..`first + num - 1` on one connection,
+ * writing at most `max_frag` bytes per poll. Returns the time it took.
+ */
+static double send_requests(int first, int num, int max_frag,
+                            unsigned *seed) {
+  struct fuzz_request r;
+  struct mbuf buf;
+  struct mg_mgr mgr;
+  struct mg_connection *lc, *nc;
+  size_t off = 0, n;
+  double start, deadline;
+  int i;
+
+  mbuf_init(&buf, 0);
+  for (i = 0; i < num; i++) {
+    gen_request(first + i, &r);
+    mbuf_append(&buf, r.text, r.len);
+  }
+
+  mg_mgr_init(&mgr, NULL);
+  lc = mg_bind(&mgr, HTTP_ADDR, server_handler);
+  mg_set_protocol_http_websocket(lc);
+  nc = mg_connect(&mgr, HTTP_ADDR, client_handler);
+  s_stats.num_requests = s_stats.num_errors = 0;
+
+  start = cs_time();
+  deadline = start + 30;
+  while (off < buf.len && cs_time() < deadline) {
+    if (nc->send_mbuf.len == 0) {
+      n = max_frag > 0 ? 1 + fuzz_rand(seed) % max_frag : buf.len;
+      if (n > buf.len - off) n = buf.len - off;
+      mg_send(nc, buf.buf + off, n);
+      off += n;
+    }
+    mg_mgr_poll(&mgr, 0);
+  }
+  while (s_stats.num_requests < num && cs_time() < deadline) {
+    mg_mgr_poll(&mgr, 1);
+  }
+
+  start = cs_time() - start;
+  mg_mgr_free(&mgr);
+  mbuf_free(&buf);
+  return start;
+}
+
+static const char *test_http_fuzz(void) {
+  static const int frags[] = {1, 7, 64, 1500, 5000, 0};
+  unsigned seed = 1;
+  size_t i;
+
+  s_stats.verify = 1;
+  for (i = 0; i < ARRAY_SIZE(frags); i++) {
+    send_requests((int) i * 1000, frags[i] == 1 ? 100 : 1000, frags[i], &seed);
+    ASSERT_EQ(s_stats.num_errors, 0);
+    ASSERT_EQ(s_stats.num_requests, frags[i] == 1 ? 100 : 1000);
+  }
+
+  return NULL;
+}
+
+static const char *test_http_throughput(void) {
+  static const int frags[] = {16, 512, 0};
+  unsigned seed = 1;
+  double t;
+  size_t i;
+
+  s_stats.verify = 0;
+  printf("%-10s %12s\n", "fragment", "req/s");
+  for (i = 0; i < ARRAY_SIZE(frags); i++) {
+    t = send_requests(0, 20000, frags[i], &seed);
+    ASSERT_EQ(s_stats.num_requests, 20000);
+    printf("%-10d %12.0f\n", frags[i], 20000 / t);
+  }
+
+  return NULL;
+}
+
+static const char *run_tests(const char *filter, double *total_elapsed) {
+  RUN_TEST(test_http_fuzz);
+  RUN_TEST(test_http_throughput);
+  return NULL;
+}
+
+int __cdecl main(int argc, char *argv[]) {
+  const char *fail_msg;
+  const char *filter = argc > 1 ? argv[1] : "";
+  double total_elapsed = 0.0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  fail_msg = run_tests(filter, &total_elapsed);
+  printf("%s, run %d in %.3lfs\n", fail_msg ? "FAIL" : "PASS", num_tests,
+         total_elapsed);
+  return fail_msg == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * AES throughput benchmark: encrypts and decrypts TLS record sized buffers
+ * with each key size and mode Krypton has and reports MB/s. Includes
+ * krypton.c directly, build with and without KR_NO_AESNI to compare the
+ * table driven code with AES-NI on x86-64.
+ */
+
+#include "krypton.c"
+
+#include <sys/time.h>
+
+#define RECORD_LEN 16384
+#define TOTAL_BYTES (64 * 1024 * 1024)
+
+enum mode { BLOCK_ENC, BLOCK_DEC, CBC_ENC, CBC_DEC, GCM_ENC, GCM_DEC };
+
+static uint8_t s_buf[RECORD_LEN];
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void aes256_setup_enc(void *ctx, const uint8_t *key) {
+  kr_aes_set_key((kr_aes_ctx *) ctx, key, AES_MODE_256);
+}
+
+static void aes256_setup_dec(void *ctx, const uint8_t *key) {
+  kr_aes_set_key((kr_aes_ctx *) ctx, key, AES_MODE_256);
+  kr_aes_convert_key((kr_aes_ctx *) ctx);
+}
+
+static const kr_cipher_info s_aes256_cs_info = {
+    AES_BLOCK_SIZE, AES256_KEY_SIZE, 16, kr_aes_new_ctx, aes256_setup_enc,
+    aes256_setup_dec, kr_aes_encrypt, kr_aes_decrypt, kr_aes_free_ctx};
+
+static void run(const kr_cipher_info *ci, enum mode mode) {
+  static const char *names[] = {"block enc", "block dec", "cbc enc",
+                                "cbc dec",   "gcm enc",   "gcm dec"};
+  uint8_t key[MAX_KEY_SIZE], iv[16], tag[GCM_TAG_SIZE];
+  void *ctx = ci->new_ctx();
+  size_t done;
+  double t;
+
+  memset(key, 0x2b, sizeof(key));
+  memset(iv, 0x7e, sizeof(iv));
+  if (mode == BLOCK_DEC || mode == CBC_DEC) {
+    ci->setup_dec(ctx, key);
+  } else {
+    ci->setup_enc(ctx, key);
+  }
+
+  t = now();
+  for (done = 0; done < TOTAL_BYTES; done += RECORD_LEN) {
+    switch (mode) {
+      case BLOCK_ENC:
+        ci->encrypt(ctx, s_buf, RECORD_LEN, s_buf);
+        break;
+      case BLOCK_DEC:
+        ci->decrypt(ctx, s_buf, RECORD_LEN, s_buf);
+        break;
+      case CBC_ENC:
+        kr_cbc_encrypt(ci, ctx, s_buf, RECORD_LEN, iv, s_buf);
+        break;
+      case CBC_DEC:
+        kr_cbc_decrypt(ci, ctx, s_buf, RECORD_LEN, iv, s_buf);
+        break;
+      case GCM_ENC:
+        kr_gcm_encrypt(ctx, iv, iv, 13, s_buf, RECORD_LEN, s_buf, tag);
+        break;
+      case GCM_DEC:
+        kr_gcm_decrypt(ctx, iv, iv, 13, s_buf, RECORD_LEN, s_buf, tag);
+        break;
+    }
+  }
+  t = now() - t;
+  ci->free_ctx(ctx);
+
+  printf("aes-%-4d %-10s %10.1f\n", ci->key_len * 8, names[mode],
+         TOTAL_BYTES / t / (1024 * 1024));
+}
+
+int main(void) {
+  int m;
+
+#ifdef KR_AESNI
+  printf("aes-ni: %s\n", kr_cpu_has_aesni() ? "yes" : "not supported");
+#else
+  printf("aes-ni: disabled\n");
+#endif
+  printf("%-8s %-10s %10s\n", "cipher", "mode", "MB/s");
+  for (m = BLOCK_ENC; m <= CBC_DEC; m++) run(kr_aes128_cs_info(), m);
+  for (m = BLOCK_ENC; m <= CBC_DEC; m++) run(&s_aes256_cs_info, m);
+  run(kr_aes128_gcm_cs_info(), GCM_ENC);
+  run(kr_aes128_gcm_cs_info(), GCM_DEC);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Trust store benchmark: verifies a server certificate issued by the last
+ * root of a large CA bundle, given either as PEM or as an index made by
+ * tools/mkcaindex, and reports the time to load the store, to verify the
+ * certificate and to complete a handshake. Includes krypton.c directly,
+ * build with and without KR_NO_LOAD_CA_STORE to compare both stores.
+ */
+
+#include "krypton.c"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define VERIFY_ROUNDS 200
+#define HANDSHAKES 20
+
+static const char *s_server_pem;
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *server_thread(void *param) {
+  int fd = *(int *) param;
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL *ssl;
+
+  if (!SSL_CTX_use_certificate_chain_file(ctx, s_server_pem) ||
+      !SSL_CTX_use_PrivateKey_file(ctx, s_server_pem, SSL_FILETYPE_PEM)) {
+    fprintf(stderr, "%s: cannot load server certificate\n", s_server_pem);
+    exit(EXIT_FAILURE);
+  }
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  SSL_accept(ssl);
+  SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  close(fd);
+  return NULL;
+}
+
+static double handshake(SSL_CTX *ctx) {
+  pthread_t thread;
+  int fds[2], ok;
+  double t;
+  SSL *ssl;
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  pthread_create(&thread, NULL, server_thread, &fds[1]);
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fds[0]);
+  t = now();
+  ok = SSL_connect(ssl) == 1;
+  t = now() - t;
+  SSL_free(ssl);
+  close(fds[0]);
+  pthread_join(thread, NULL);
+  if (!ok) {
+    fprintf(stderr, "handshake failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return t;
+}
+
+static void run(const char *ca_file) {
+  double t_load, t_verify, t_handshake = 0;
+  SSL_CTX *ctx;
+  X509 *cert;
+  PEM *pem;
+  int i;
+
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_kr_set_verify_name(ctx, "localhost");
+  t_load = now();
+  if (!SSL_CTX_load_verify_locations(ctx, ca_file, NULL)) {
+    fprintf(stderr, "%s: cannot load CA store\n", ca_file);
+    exit(EXIT_FAILURE);
+  }
+  t_load = now() - t_load;
+
+  pem = pem_load_types(s_server_pem, PEM_SIG_CERT);
+  if (pem == NULL || pem->num_obj == 0 ||
+      (cert = X509_new(pem->obj->der, pem->obj->der_len)) == NULL) {
+    fprintf(stderr, "%s: no certificate\n", s_server_pem);
+    exit(EXIT_FAILURE);
+  }
+  t_verify = now();
+  for (i = 0; i < VERIFY_ROUNDS; i++) {
+    if (!X509_verify(ctx, cert)) {
+      fprintf(stderr, "verification failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  t_verify = now() - t_verify;
+  X509_free(cert);
+  pem_free(pem);
+
+  for (i = 0; i < HANDSHAKES; i++) t_handshake += handshake(ctx);
+  SSL_CTX_free(ctx);
+
+#ifdef KR_NO_LOAD_CA_STORE
+  printf("%-10s", "on demand");
+#else
+  printf("%-10s", "in memory");
+#endif
+  printf(" %-24s %10.2f %10.1f %12.2f\n", ca_file, t_load * 1e3,
+         t_verify * 1e6 / VERIFY_ROUNDS, t_handshake * 1e3 / HANDSHAKES);
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s server.pem ca_bundle...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  s_server_pem = argv[1];
+
+  printf("%-10s %-24s %10s %10s %12s\n", "store", "file", "load ms",
+         "verify us", "handshake ms");
+  for (i = 2; i < argc; i++) run(argv[i]);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * TLS record benchmark: a client echoes a stream of small mg_send() calls,
+ * with the odd mg_send_buf(), through a local Krypton server, checks what
+ * comes back and reports MB/s and the peak heap use, with at most
+ * MAX_IN_FLIGHT bytes on their way. Includes mongoose.c
+ * directly, build with MG_ENABLE_SSL, SSL_KRYPTON and MG_ENABLE_THREADS,
+ * and with MG_DISABLE_SSL_IN_PLACE to compare with copying records.
+ */
+
+#include "mongoose.c"
+
+#include <malloc.h>
+
+#define BENCH_PORT "127.0.0.1:17703"
+#define BULK_BYTES (64 * 1024 * 1024)
+#define CHUNK 1400
+#define MAX_IN_FLIGHT (64 * 1024)
+
+static const char *s_cert = "kr_resume_bench.pem";
+static volatile int s_server_stop;
+static volatile int s_server_ready;
+
+/* Data at stream offset i is s_pattern[i % 251] */
+static char s_pattern[CHUNK + 251];
+
+struct client_state {
+  size_t queued;
+  size_t received;
+  size_t peak_heap;
+  int bad;
+  int done;
+};
+
+static void echo_handler(struct mg_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static void *server_thread(void *param) {
+  struct mg_bind_opts opts;
+  struct mg_mgr mgr;
+  const char *err = NULL;
+
+  (void) param;
+  mg_mgr_init(&mgr, NULL);
+  memset(&opts, 0, sizeof(opts));
+  opts.ssl_cert = s_cert;
+  opts.error_string = &err;
+  if (mg_bind_opt(&mgr, BENCH_PORT, echo_handler, opts) == NULL) {
+    fprintf(stderr, "cannot bind to %s: %s\n", BENCH_PORT, err);
+    exit(EXIT_FAILURE);
+  }
+
+  s_server_ready = 1;
+  while (!s_server_stop) {
+    mg_mgr_poll(&mgr, 100);
+  }
+  mg_mgr_free(&mgr);
+  s_server_ready = 0;
+
+  return NULL;
+}
+
+/* Keeps some data queued, as many small writes */
+static void fill(struct mg_connection *nc, struct client_state *st) {
+  while (st->queued < BULK_BYTES && st->queued - st->received < MAX_IN_FLIGHT) {
+    const char *data = s_pattern + st->queued % 251;
+    size_t len = BULK_BYTES - st->queued < CHUNK ? BULK_BYTES - st->queued
+                                                 : CHUNK;
+    if (st->queued / CHUNK % 64 == 63) {
+      mg_send_buf(nc, data, len, NULL, NULL);
+    } else {
+      mg_send(nc, data, len);
+    }
+    st->queued += len;
+  }
+}
+
+static size_t heap_in_use(void) {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *p) {
+  struct client_state *st = (struct client_state *) nc->mgr->user_data;
+  struct mbuf *io = &nc->recv_mbuf;
+  size_t i;
+
+  switch (ev) {
+    case MG_EV_CONNECT:
+      if (*(int *) p != 0) {
+        fprintf(stderr, "connect failed: %d\n", *(int *) p);
+        exit(EXIT_FAILURE);
+      }
+      fill(nc, st);
+      break;
+    case MG_EV_RECV:
+      for (i = 0; i < io->len; i += CHUNK) {
+        size_t len = io->len - i < CHUNK ? io->len - i : CHUNK;
+        if (memcmp(io->buf + i, s_pattern + (st->received + i) % 251, len)) {
+          st->bad++;
+        }
+      }
+      st->received += io->len;
+      mbuf_remove(io, io->len);
+      if (st->received >= BULK_BYTES) {
+        nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      }
+      fill(nc, st);
+      break;
+    case MG_EV_CLOSE:
+      st->done = 1;
+      break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct mg_connect_opts opts;
+  struct client_state st;
+  struct mg_mgr mgr;
+  double t_start, t_end;
+  size_t i, base;
+
+  if (argc > 1) s_cert = argv[1];
+  for (i = 0; i < sizeof(s_pattern); i++) s_pattern[i] = (char) (i % 251);
+
+  mg_start_thread(server_thread, NULL);
+  while (!s_server_ready) usleep(1000);
+  base = heap_in_use();
+
+  memset(&st, 0, sizeof(st));
+  mg_mgr_init(&mgr, &st);
+  memset(&opts, 0, sizeof(opts));
+  opts.ssl_cert = ""; /* Turns on SSL without a client certificate */
+  if (mg_connect_opt(&mgr, BENCH_PORT, client_handler, opts) == NULL) {
+    fprintf(stderr, "cannot connect to %s\n", BENCH_PORT);
+    exit(EXIT_FAILURE);
+  }
+
+  t_start = cs_time();
+  while (!st.done) {
+    size_t heap = heap_in_use();
+    if (heap > st.peak_heap) st.peak_heap = heap;
+    mg_mgr_poll(&mgr, 100);
+  }
+  t_end = cs_time();
+  mg_mgr_free(&mgr);
+
+  s_server_stop = 1;
+  while (s_server_ready) usleep(1000);
+
+  printf("%-10s %10s %14s\n", "records", "MB/s", "peak heap KB");
+  printf("%-10s %10.1f %14.1f\n",
+#ifdef MG_SSL_IN_PLACE
+         "in place",
+#else
+         "copied",
+#endif
+         BULK_BYTES / (t_end - t_start) / (1024 * 1024),
+         (st.peak_heap - base) / 1024.0);
+  if (st.received != BULK_BYTES || st.bad != 0) {
+    fprintf(stderr, "echo failed: received %d, %d bad chunks\n",
+            (int) st.received, st.bad);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
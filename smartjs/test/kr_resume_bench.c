@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * SSL handshake rate benchmark: makes sequential client connections to a
+ * local Krypton server and measures handshakes per second with full
+ * handshakes, with sessions resumed from the server's session cache and
+ * with sessions resumed from tickets. Includes mongoose.c directly, build
+ * with MG_ENABLE_SSL, SSL_KRYPTON and MG_ENABLE_THREADS.
+ */
+
+#include "mongoose.c"
+
+#define BENCH_PORT "127.0.0.1:17702"
+#define CONNS_PER_RUN 200
+
+enum mode { FULL, SESSION_ID, TICKET };
+
+static const char *s_cert = "kr_resume_bench.pem";
+static volatile int s_server_stop;
+static volatile int s_server_ready;
+
+struct client_stats {
+  int done;
+  int resumed;
+};
+
+static void echo_handler(struct mg_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static void *server_thread(void *param) {
+  enum mode mode = *(enum mode *) param;
+  struct mg_bind_opts opts;
+  struct mg_connection *lc;
+  struct mg_mgr mgr;
+  const char *err = NULL;
+
+  mg_mgr_init(&mgr, NULL);
+  memset(&opts, 0, sizeof(opts));
+  opts.ssl_cert = s_cert;
+  opts.error_string = &err;
+  lc = mg_bind_opt(&mgr, BENCH_PORT, echo_handler, opts);
+  if (lc == NULL) {
+    fprintf(stderr, "cannot bind to %s: %s\n", BENCH_PORT, err);
+    exit(EXIT_FAILURE);
+  }
+  if (mode == SESSION_ID) SSL_CTX_set_options(lc->ssl_ctx, SSL_OP_NO_TICKET);
+
+  s_server_ready = 1;
+  while (!s_server_stop) {
+    mg_mgr_poll(&mgr, 100);
+  }
+  mg_mgr_free(&mgr);
+  s_server_ready = 0;
+
+  return NULL;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *p) {
+  struct client_stats *st = (struct client_stats *) nc->mgr->user_data;
+
+  if (ev == MG_EV_CONNECT) {
+    if (*(int *) p != 0) {
+      fprintf(stderr, "connect failed: %d\n", *(int *) p);
+      exit(EXIT_FAILURE);
+    }
+    if (SSL_session_reused(nc->ssl)) st->resumed++;
+    mg_send(nc, "ping", 4);
+  } else if (ev == MG_EV_RECV && nc->recv_mbuf.len >= 4) {
+    st->done++;
+    nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+  }
+}
+
+static void run(enum mode mode) {
+  static const char *names[] = {"full", "session_id", "ticket"};
+  struct mg_connect_opts opts;
+  struct client_stats st;
+  struct mg_mgr mgr;
+  double t_start, t_end;
+  int i;
+
+  s_server_stop = 0;
+  mg_start_thread(server_thread, &mode);
+  while (!s_server_ready) usleep(1000);
+
+  memset(&st, 0, sizeof(st));
+  mg_mgr_init(&mgr, &st);
+  memset(&opts, 0, sizeof(opts));
+  opts.ssl_cert = ""; /* Turns on SSL without a client certificate */
+  opts.ssl_no_session_reuse = (mode == FULL);
+
+  t_start = cs_time();
+  for (i = 0; i < CONNS_PER_RUN; i++) {
+    if (mg_connect_opt(&mgr, BENCH_PORT, client_handler, opts) == NULL) {
+      fprintf(stderr, "cannot connect to %s\n", BENCH_PORT);
+      exit(EXIT_FAILURE);
+    }
+    while (st.done <= i) mg_mgr_poll(&mgr, 100);
+  }
+  t_end = cs_time();
+  mg_mgr_free(&mgr);
+
+  s_server_stop = 1;
+  while (s_server_ready) usleep(1000);
+
+  printf("%-12s %8d %8d %12.1f\n", names[mode], CONNS_PER_RUN, st.resumed,
+         CONNS_PER_RUN / (t_end - t_start));
+  if (mode != FULL && st.resumed != CONNS_PER_RUN - 1) {
+    fprintf(stderr, "expected all but the first session to be resumed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) s_cert = argv[1];
+
+  printf("%-12s %8s %8s %12s\n", "mode", "conns", "resumed", "handshake/s");
+  run(FULL);
+  run(SESSION_ID);
+  run(TICKET);
+
+  return EXIT_SUCCESS;
+}
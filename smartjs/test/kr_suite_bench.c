@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Cipher suite benchmark: for each suite Krypton offers, measures full
+ * handshakes per second and bulk transfer rate between a client and a
+ * server thread over a socket pair. Includes krypton.c directly.
+ */
+
+#include "krypton.c"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define HANDSHAKES 50
+#define BULK_BYTES (64 * 1024 * 1024)
+#define CHUNK 16384
+
+static const char *s_suites[] = {"ECDHE-RSA-AES128-GCM-SHA256",
+                                 "AES128-GCM-SHA256", "AES128-SHA256",
+                                 "AES128-SHA", "RC4-SHA"};
+static SSL_CTX *s_server_ctx;
+
+struct conn {
+  int fd;
+  size_t received;
+};
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *server_thread(void *param) {
+  struct conn *c = (struct conn *) param;
+  SSL *ssl = SSL_new(s_server_ctx);
+  char buf[CHUNK];
+  int n;
+
+  SSL_set_fd(ssl, c->fd);
+  if (SSL_accept(ssl) == 1) {
+    while ((n = SSL_read(ssl, buf, sizeof(buf))) > 0) c->received += n;
+    SSL_shutdown(ssl);
+  }
+  SSL_free(ssl);
+  close(c->fd);
+  return NULL;
+}
+
+/* Returns the time taken by the handshake and the transfer of len bytes */
+static void run_conn(SSL_CTX *ctx, size_t len, double *t_hs, double *t_xfer) {
+  static char buf[CHUNK];
+  pthread_t thread;
+  struct conn c;
+  int fds[2], ok;
+  size_t sent = 0;
+  double t;
+  SSL *ssl;
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  memset(&c, 0, sizeof(c));
+  c.fd = fds[1];
+  pthread_create(&thread, NULL, server_thread, &c);
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fds[0]);
+
+  t = now();
+  ok = SSL_connect(ssl) == 1;
+  *t_hs = now() - t;
+
+  t = now();
+  while (ok && sent < len) {
+    int n = SSL_write(ssl, buf, sizeof(buf));
+    if (n <= 0) ok = 0;
+    sent += n;
+  }
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  shutdown(fds[0], SHUT_WR);
+  pthread_join(thread, NULL);
+  *t_xfer = now() - t;
+  close(fds[0]);
+
+  if (!ok || c.received != sent) {
+    fprintf(stderr, "connection failed: sent %d, received %d\n", (int) sent,
+            (int) c.received);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void run(const char *suite) {
+  double t_hs, t_xfer, total = 0;
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+  int i;
+
+  if (!SSL_CTX_set_cipher_list(ctx, suite)) {
+    fprintf(stderr, "%s: not supported\n", suite);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < HANDSHAKES; i++) {
+    run_conn(ctx, 0, &t_hs, &t_xfer);
+    total += t_hs;
+  }
+  run_conn(ctx, BULK_BYTES, &t_hs, &t_xfer);
+  SSL_CTX_free(ctx);
+
+  printf("%-28s %12.1f %10.1f\n", suite, HANDSHAKES / total,
+         BULK_BYTES / t_xfer / (1024 * 1024));
+}
+
+int main(int argc, char *argv[]) {
+  const char *pem = argc > 1 ? argv[1] : "kr_resume_bench.pem";
+  size_t i;
+
+  s_server_ctx = SSL_CTX_new(SSLv23_server_method());
+  SSL_CTX_set_session_cache_mode(s_server_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_options(s_server_ctx, SSL_OP_NO_TICKET);
+  if (!SSL_CTX_use_certificate_chain_file(s_server_ctx, pem) ||
+      !SSL_CTX_use_PrivateKey_file(s_server_ctx, pem, SSL_FILETYPE_PEM)) {
+    fprintf(stderr, "%s: cannot load server certificate\n", pem);
+    return EXIT_FAILURE;
+  }
+
+  printf("%-28s %12s %10s\n", "suite", "handshake/s", "MB/s");
+  for (i = 0; i < sizeof(s_suites) / sizeof(s_suites[0]); i++) {
+    run(s_suites[i]);
+  }
+  SSL_CTX_free(s_server_ctx);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * MQTT broker routing benchmark: runs a broker in a separate thread,
+ * connects a growing number of subscribers and measures the publish and
+ * delivery rate when each message goes to one subscriber and when it goes
+ * to all of them, with payloads below and above MG_MQTT_SHARED_FRAME_SIZE.
+ * Includes mongoose.c directly, build with MG_ENABLE_MQTT_BROKER.
+ */
+
+#include "mongoose.c"
+
+#define BENCH_PORT "127.0.0.1:17702"
+#define DELIVERIES_PER_RUN 200000
+#define WINDOW 64 /* Publishes in flight */
+
+static volatile int s_server_stop;
+static volatile int s_server_ready;
+
+struct bench_stats {
+  int connected;  /* Sessions with CONNACK and SUBACK received */
+  int received;   /* PUBLISH frames delivered to subscribers */
+  char topic[50]; /* Topic of the current run */
+};
+
+/* Small frames are pipelined, don't let Nagle wait for delayed ACKs */
+static void set_nodelay(struct mg_connection *nc) {
+  int on = 1;
+  setsockopt(nc->sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+}
+
+static void *server_thread(void *param) {
+  struct mg_mqtt_broker brk;
+  struct mg_connection *lc;
+  struct mg_mgr mgr;
+
+  (void) param;
+  mg_mgr_init(&mgr, NULL);
+  mg_mqtt_broker_init(&brk, NULL);
+  lc = mg_bind(&mgr, BENCH_PORT, mg_mqtt_broker);
+  if (lc == NULL) {
+    fprintf(stderr, "cannot bind to %s\n", BENCH_PORT);
+    exit(EXIT_FAILURE);
+  }
+  lc->user_data = &brk;
+  set_nodelay(lc); /* Inherited by accepted sockets */
+
+  s_server_ready = 1;
+  while (!s_server_stop) {
+    mg_mgr_poll(&mgr, 100);
+  }
+  mg_mgr_free(&mgr);
+  mg_mqtt_broker_free(&brk);
+  s_server_ready = 0;
+
+  return NULL;
+}
+
+/*
+ * Subscriber `i` listens on "bench/<i>" and on "bench/all";
+ * the publisher has a negative index.
+ */
+static void client_handler(struct mg_connection *nc, int ev, void *p) {
+  struct bench_stats *st = (struct bench_stats *) nc->mgr->user_data;
+  int idx = (int) (intptr_t) nc->user_data;
+  char id[20], topic[20];
+
+  switch (ev) {
+    case MG_EV_CONNECT:
+      if (*(int *) p != 0) {
+        fprintf(stderr, "connect failed: %d\n", *(int *) p);
+        exit(EXIT_FAILURE);
+      }
+      set_nodelay(nc);
+      snprintf(id, sizeof(id), "bench%d", idx);
+      mg_send_mqtt_handshake(nc, id);
+      break;
+    case MG_EV_MQTT_CONNACK:
+      if (idx < 0) {
+        st->connected++;
+      } else {
+        struct mg_mqtt_topic_expression topics[2];
+        snprintf(topic, sizeof(topic), "bench/%d", idx);
+        topics[0].topic = topic;
+        topics[0].qos = 0;
+        topics[1].topic = "bench/all";
+        topics[1].qos = 0;
+        mg_mqtt_subscribe(nc, topics, ARRAY_SIZE(topics), 1);
+      }
+      break;
+    case MG_EV_MQTT_SUBACK:
+      st->connected++;
+      break;
+    case MG_EV_MQTT_PUBLISH:
+      st->received++;
+      break;
+  }
+}
+
+static struct mg_connection *connect_client(struct mg_mgr *mgr, int idx) {
+  struct mg_connection *nc = mg_connect(mgr, BENCH_PORT, client_handler);
+  if (nc == NULL) {
+    fprintf(stderr, "cannot connect to %s\n", BENCH_PORT);
+    exit(EXIT_FAILURE);
+  }
+  mg_set_protocol_mqtt(nc);
+  nc->user_data = (void *) (intptr_t) idx;
+  return nc;
+}
+
+/* Publishes until DELIVERIES_PER_RUN messages reach subscribers */
+static void run(struct mg_mgr *mgr, struct mg_connection *pub, int num_subs,
+                int fanout, size_t payload_size) {
+  struct bench_stats *st = (struct bench_stats *) mgr->user_data;
+  int num_pubs = DELIVERIES_PER_RUN / (fanout ? num_subs : 1);
+  int target = num_pubs * (fanout ? num_subs : 1), sent = 0;
+  char *payload = (char *) calloc(1, payload_size);
+  double t_start, t_end;
+
+  st->received = 0;
+  t_start = cs_time();
+  while (st->received < target) {
+    /* Keep at most WINDOW publishes in flight */
+    while (sent < num_pubs &&
+           sent - st->received / (fanout ? num_subs : 1) < WINDOW) {
+      if (fanout) {
+        snprintf(st->topic, sizeof(st->topic), "bench/all");
+      } else {
+        snprintf(st->topic, sizeof(st->topic), "bench/%d", sent % num_subs);
+      }
+      mg_mqtt_publish(pub, st->topic, 0, MG_MQTT_QOS(0), payload,
+                      payload_size);
+      sent++;
+    }
+    mg_mgr_poll(mgr, 100);
+  }
+  t_end = cs_time();
+  free(payload);
+
+  printf("%-8s %8d %8d %12.0f %12.0f\n", fanout ? "fanout" : "unicast",
+         num_subs, (int) payload_size, num_pubs / (t_end - t_start),
+         target / (t_end - t_start));
+}
+
+int main(void) {
+  static const int subs[] = {1, 10, 100, 500};
+  static const size_t sizes[] = {64, MG_MQTT_SHARED_FRAME_SIZE * 2};
+  struct bench_stats st;
+  struct mg_connection *pub;
+  struct mg_mgr mgr;
+  size_t i, j;
+  int k;
+
+  mg_start_thread(server_thread, NULL);
+  while (!s_server_ready) usleep(1000);
+
+  printf("%-8s %8s %8s %12s %12s\n", "mode", "subs", "payload", "pub/s",
+         "deliver/s");
+  for (i = 0; i < ARRAY_SIZE(subs); i++) {
+    memset(&st, 0, sizeof(st));
+    mg_mgr_init(&mgr, &st);
+    for (k = 0; k < subs[i]; k++) connect_client(&mgr, k);
+    pub = connect_client(&mgr, -1);
+    while (st.connected < subs[i] + 1) mg_mgr_poll(&mgr, 100);
+
+    for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+      run(&mgr, pub, subs[i], 0, sizes[j]);
+      run(&mgr, pub, subs[i], 1, sizes[j]);
+    }
+    mg_mgr_free(&mgr);
+  }
+
+  s_server_stop = 1;
+  while (s_server_ready) usleep(1000);
+
+  return EXIT_SUCCESS;
+}
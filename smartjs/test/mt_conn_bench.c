@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Connection scaling benchmark for multi-threaded listeners: runs an echo
+ * server with a thread per connection and with worker pools of various
+ * sizes, and measures request rate for a growing number of concurrent
+ * clients. Includes mongoose.c directly, build with MG_ENABLE_THREADS.
+ */
+
+#include "mongoose.c"
+
+#define BENCH_PORT "127.0.0.1:17701"
+#define MSG_SIZE 64
+#define MSGS_PER_RUN 100000
+
+static volatile int s_server_stop;
+static volatile int s_server_ready;
+
+struct client_stats {
+  int connected;
+  int done;
+  int remaining; /* Messages still to send */
+};
+
+static void echo_handler(struct mg_connection *nc, int ev, void *p) {
+  (void) p;
+  if (ev == MG_EV_RECV) {
+    mg_send(nc, nc->recv_mbuf.buf, nc->recv_mbuf.len);
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+  }
+}
+
+static void *server_thread(void *param) {
+  int num_workers = *(int *) param;
+  struct mg_multithreading_opts opts;
+  struct mg_connection *lc;
+  struct mg_mgr mgr;
+
+  mg_mgr_init(&mgr, NULL);
+  lc = mg_bind(&mgr, BENCH_PORT, echo_handler);
+  if (lc == NULL) {
+    fprintf(stderr, "cannot bind to %s\n", BENCH_PORT);
+    exit(EXIT_FAILURE);
+  }
+  memset(&opts, 0, sizeof(opts));
+  opts.num_workers = num_workers;
+  mg_enable_multithreading_opt(lc, opts);
+
+  s_server_ready = 1;
+  while (!s_server_stop) {
+    mg_mgr_poll(&mgr, 100);
+  }
+  mg_mgr_free(&mgr);
+  s_server_ready = 0;
+
+  return NULL;
+}
+
+static void client_handler(struct mg_connection *nc, int ev, void *p) {
+  struct client_stats *st = (struct client_stats *) nc->mgr->user_data;
+  static const char msg[MSG_SIZE] = "ping";
+
+  if (ev == MG_EV_CONNECT) {
+    if (*(int *) p != 0) {
+      fprintf(stderr, "connect failed: %d\n", *(int *) p);
+      exit(EXIT_FAILURE);
+    }
+    st->connected++;
+    st->remaining--;
+    mg_send(nc, msg, sizeof(msg));
+  } else if (ev == MG_EV_RECV && nc->recv_mbuf.len >= sizeof(msg)) {
+    mbuf_remove(&nc->recv_mbuf, sizeof(msg));
+    st->done++;
+    if (st->remaining > 0) {
+      st->remaining--;
+      mg_send(nc, msg, sizeof(msg));
+    }
+  }
+}
+
+/* Number of threads in this process, or -1 if unknown */
+static int count_threads(void) {
+  FILE *fp = fopen("/proc/self/status", "r");
+  char line[100];
+  int n = -1;
+
+  if (fp == NULL) return -1;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "Threads: %d", &n) == 1) break;
+  }
+  fclose(fp);
+  return n;
+}
+
+static void run(int num_workers, int num_conns) {
+  struct client_stats st;
+  struct mg_mgr mgr;
+  double t_start, t_connected, t_end;
+  int i, threads;
+
+  s_server_stop = 0;
+  mg_start_thread(server_thread, &num_workers);
+  while (!s_server_ready) usleep(1000);
+
+  memset(&st, 0, sizeof(st));
+  st.remaining = MSGS_PER_RUN;
+  mg_mgr_init(&mgr, &st);
+
+  t_start = cs_time();
+  for (i = 0; i < num_conns; i++) {
+    if (mg_connect(&mgr, BENCH_PORT, client_handler) == NULL) {
+      fprintf(stderr, "cannot connect to %s\n", BENCH_PORT);
+      exit(EXIT_FAILURE);
+    }
+  }
+  while (st.connected < num_conns) mg_mgr_poll(&mgr, 100);
+  t_connected = cs_time();
+  while (st.done < MSGS_PER_RUN) mg_mgr_poll(&mgr, 100);
+  t_end = cs_time();
+  threads = count_threads();
+  mg_mgr_free(&mgr);
+
+  s_server_stop = 1;
+  while (s_server_ready) usleep(1000);
+  /* Give threads serving closed connections time to exit */
+  usleep(200000);
+
+  printf("%-8s %8d %8d %12.1f %12.0f\n",
+         num_workers > 0 ? "pool" : "per-conn", num_workers, threads,
+         (t_connected - t_start) * 1e3, MSGS_PER_RUN / (t_end - t_connected));
+}
+
+int main(void) {
+  static const int workers[] = {0, 1, 2, 4, 8};
+  static const int conns[] = {16, 128, 512};
+  size_t i, j;
+
+  printf("%-8s %8s %8s %12s %12s\n", "mode", "workers", "threads",
+         "connect ms", "req/s");
+  for (j = 0; j < ARRAY_SIZE(conns); j++) {
+    printf("-- %d connections\n", conns[j]);
+    for (i = 0; i < ARRAY_SIZE(workers); i++) {
+      run(workers[i], conns[j]);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
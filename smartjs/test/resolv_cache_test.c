@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Resolver cache tests. Lookups go to a DNS server on localhost built with
+ * mg_dns_send_reply(), which counts the queries it gets.
+ * Includes mongoose.c directly to get at the internal resolver API.
+ */
+
+#define MG_ENABLE_DNS_SERVER
+#include "mongoose.c"
+#include "common/test_util.h"
+
+#define DNS_ADDR "udp://127.0.0.1:17753"
+#define TEST_TTL 1
+
+static int s_num_queries;
+
+struct lookup {
+  int done;
+  enum mg_resolve_err err;
+  struct in_addr addr;
+};
+
+static void dns_server_handler(struct mg_connection *nc, int ev, void *p) {
+  struct mg_dns_message *msg = (struct mg_dns_message *) p;
+  struct mg_dns_resource_record *rr;
+  struct mg_dns_reply reply;
+  char name[256];
+  uint32_t addr = htonl(0x0a000001); /* 10.0.0.1 */
+  int i;
+
+  if (ev != MG_DNS_MESSAGE) return;
+
+  s_num_queries++;
+  reply = mg_dns_create_reply(&nc->send_mbuf, msg);
+  for (i = 0; i < msg->num_questions; i++) {
+    rr = &msg->questions[i];
+    mg_dns_uncompress_name(msg, &rr->name, name, sizeof(name));
+    if (rr->rtype == MG_DNS_A_RECORD && strcmp(name, "a.test") == 0) {
+      mg_dns_reply_record(&reply, rr, NULL, rr->rtype, TEST_TTL, &addr, 4);
+    }
+  }
+  mg_dns_send_reply(nc, &reply);
+}
+
+static void lookup_cb(struct mg_dns_message *msg, void *data,
+                      enum mg_resolve_err err) {
+  struct lookup *l = (struct lookup *) data;
+  struct mg_dns_resource_record *rr;
+
+  l->done++;
+  l->err = err;
+  if (msg != NULL &&
+      (rr = mg_dns_next_record(msg, MG_DNS_A_RECORD, NULL)) != NULL) {
+    mg_dns_parse_record_data(msg, rr, &l->addr, sizeof(l->addr));
+  }
+}
+
+static int lookup(struct mg_mgr *mgr, const char *name, struct lookup *l,
+                  int no_cache) {
+  struct mg_resolve_async_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  memset(l, 0, sizeof(*l));
+  opts.nameserver_url = DNS_ADDR;
+  opts.timeout = 1;
+  opts.no_cache = no_cache;
+  return mg_resolve_async_opt(mgr, name, MG_DNS_A_RECORD, lookup_cb, l, opts);
+}
+
+static void poll_until(struct mg_mgr *mgr, int *done) {
+  double deadline = mg_time() + 5;
+  while (!*done && mg_time() < deadline) mg_mgr_poll(mgr, 10);
+}
+
+static const char *test_resolve_cache(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  struct lookup l1, l2, l3;
+
+  mg_mgr_init(&mgr, NULL);
+  ASSERT((nc = mg_bind(&mgr, DNS_ADDR, dns_server_handler)) != NULL);
+  mg_set_protocol_dns(nc);
+
+  /* Concurrent lookups of the same name share one query */
+  s_num_queries = 0;
+  ASSERT_EQ(lookup(&mgr, "a.test", &l1, 0), 0);
+  ASSERT_EQ(lookup(&mgr, "A.TEST", &l2, 0), 0);
+  poll_until(&mgr, &l2.done);
+  ASSERT_EQ(l1.done, 1);
+  ASSERT_EQ(l2.done, 1);
+  ASSERT_EQ(l1.err, MG_RESOLVE_OK);
+  ASSERT_EQ(l2.err, MG_RESOLVE_OK);
+  ASSERT_EQ(ntohl(l2.addr.s_addr), 0x0a000001);
+  ASSERT_EQ(s_num_queries, 1);
+
+  /* Cached answer is delivered on the next poll, without a query */
+  ASSERT_EQ(lookup(&mgr, "a.test", &l3, 0), 0);
+  ASSERT_EQ(l3.done, 0);
+  mg_mgr_poll(&mgr, 0);
+  ASSERT_EQ(l3.done, 1);
+  ASSERT_EQ(l3.err, MG_RESOLVE_OK);
+  ASSERT_EQ(ntohl(l3.addr.s_addr), 0x0a000001);
+  ASSERT_EQ(s_num_queries, 1);
+
+  /* Bypassing the cache */
+  ASSERT_EQ(lookup(&mgr, "a.test", &l3, 1), 0);
+  poll_until(&mgr, &l3.done);
+  ASSERT_EQ(l3.err, MG_RESOLVE_OK);
+  ASSERT_EQ(s_num_queries, 2);
+
+  /* Negative caching */
+  ASSERT_EQ(lookup(&mgr, "nx.test", &l1, 0), 0);
+  poll_until(&mgr, &l1.done);
+  ASSERT_EQ(l1.err, MG_RESOLVE_NO_ANSWERS);
+  ASSERT_EQ(s_num_queries, 3);
+  ASSERT_EQ(lookup(&mgr, "nx.test", &l2, 0), 0);
+  poll_until(&mgr, &l2.done);
+  ASSERT_EQ(l2.err, MG_RESOLVE_NO_ANSWERS);
+  ASSERT_EQ(s_num_queries, 3);
+
+  /* Record TTL is respected */
+  while (mgr.resolve_cache->entries[0].expires > mg_time()) {
+    mg_mgr_poll(&mgr, 100);
+  }
+  ASSERT_EQ(lookup(&mgr, "a.test", &l1, 0), 0);
+  poll_until(&mgr, &l1.done);
+  ASSERT_EQ(l1.err, MG_RESOLVE_OK);
+  ASSERT_EQ(s_num_queries, 4);
+
+  /* Pending deliveries are not lost when the manager goes away */
+  ASSERT_EQ(lookup(&mgr, "a.test", &l1, 0), 0);
+  mg_mgr_free(&mgr);
+  ASSERT_EQ(l1.done, 1);
+
+  return NULL;
+}
+
+static const char *test_resolve_cache_eviction(void) {
+  struct mg_mgr mgr;
+  struct mg_connection *nc;
+  struct lookup l;
+  char name[20];
+  int i;
+
+  mg_mgr_init(&mgr, NULL);
+  ASSERT((nc = mg_bind(&mgr, DNS_ADDR, dns_server_handler)) != NULL);
+  mg_set_protocol_dns(nc);
+
+  /* Fill the cache with negative entries, then some */
+  s_num_queries = 0;
+  ASSERT_EQ(lookup(&mgr, "a.test", &l, 0), 0);
+  poll_until(&mgr, &l.done);
+  for (i = 0; i < MG_RESOLVE_CACHE_SIZE + 4; i++) {
+    snprintf(name, sizeof(name), "n%d.test", i);
+    ASSERT_EQ(lookup(&mgr, name, &l, 0), 0);
+    poll_until(&mgr, &l.done);
+  }
+  ASSERT_EQ(s_num_queries, MG_RESOLVE_CACHE_SIZE + 5);
+
+  /* The least recently used entries are gone, the recent ones stay */
+  ASSERT_EQ(lookup(&mgr, "a.test", &l, 0), 0);
+  poll_until(&mgr, &l.done);
+  ASSERT_EQ(s_num_queries, MG_RESOLVE_CACHE_SIZE + 6);
+  snprintf(name, sizeof(name), "n%d.test", MG_RESOLVE_CACHE_SIZE + 3);
+  ASSERT_EQ(lookup(&mgr, name, &l, 0), 0);
+  poll_until(&mgr, &l.done);
+  ASSERT_EQ(s_num_queries, MG_RESOLVE_CACHE_SIZE + 6);
+
+  mg_mgr_free(&mgr);
+  return NULL;
+}
+
+static const char *test_resolve_hosts(void) {
+  struct mg_mgr mgr;
+  union socket_address sa1, sa2;
+
+  mg_mgr_init(&mgr, NULL);
+  memset(&sa1, 0, sizeof(sa1));
+  memset(&sa2, 0, sizeof(sa2));
+  if (mg_resolve_from_hosts_file("localhost", &sa1) == 0) {
+    ASSERT_EQ(mg_resolve_from_hosts(&mgr, "localhost", &sa2), 0);
+    ASSERT_EQ(sa1.sin.sin_addr.s_addr, sa2.sin.sin_addr.s_addr);
+    ASSERT(mgr.resolve_cache->hosts_loaded);
+    ASSERT(mgr.resolve_cache->num_hosts > 0);
+    ASSERT(mg_bind(&mgr, "localhost:17754", dns_server_handler) != NULL);
+  }
+  ASSERT_EQ(mg_resolve_from_hosts(&mgr, "no-such-host.test", &sa2), -1);
+  mg_mgr_free(&mgr);
+
+  return NULL;
+}
+
+static const char *run_tests(const char *filter, double *total_elapsed) {
+  RUN_TEST(test_resolve_cache);
+  RUN_TEST(test_resolve_cache_eviction);
+  RUN_TEST(test_resolve_hosts);
+  return NULL;
+}
+
+int __cdecl main(int argc, char *argv[]) {
+  const char *fail_msg;
+  const char *filter = argc > 1 ? argv[1] : "";
+  double total_elapsed = 0.0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  fail_msg = run_tests(filter, &total_elapsed);
+  printf("%s, run %d in %.3lfs\n", fail_msg ? "FAIL" : "PASS", num_tests,
+         total_elapsed);
+  return fail_msg == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
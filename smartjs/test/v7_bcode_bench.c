@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Bytecode dispatch benchmark: times loops dominated by one opcode pattern
+ * each, so that builds with and without computed-goto dispatch and
+ * superinstructions can be compared pattern by pattern.
+ * Includes v7.c directly, build with V7_DISABLE_COMPUTED_GOTO and
+ * V7_DISABLE_SUPERINSTRUCTIONS for the plain switch loop.
+ */
+
+#include "v7.c"
+#include "common/cs_time.h"
+
+#define ITERATIONS 1000000
+#define RUNS 3
+
+struct pattern {
+  const char *name;
+  const char *js; /* Sets up `f(n)`, which runs the pattern `n` times */
+};
+
+static const struct pattern s_patterns[] = {
+    {"loop", "function f(n) { for (var i = 0; i < n; i++) {} }"},
+    {"get_var.get",
+     "var o = {a: 1, b: 2}, s;"
+     "function f(n) { for (var i = 0; i < n; i++) s = o.b; }"},
+    {"get_local.get",
+     "function f(n) { var o = {a: 1, b: 2}, s;"
+     "  for (var i = 0; i < n; i++) s = o.b; }"},
+    {"get.get",
+     "var o = {p: {a: 1}}, s;"
+     "function f(n) { for (var i = 0; i < n; i++) s = o.p.a; }"},
+    {"and_or",
+     "var t = 1, z = 0, s;"
+     "function f(n) { for (var i = 0; i < n; i++) s = (t && z) || t; }"},
+    {"cmp.jmp",
+     "function f(n) { var s = 0;"
+     "  for (var i = 0; i < n; i++) { if (i > 5) s++; if (i <= 2) s--; } }"},
+    {"eq.jmp",
+     "function f(n) { var s = 0;"
+     "  for (var i = 0; i < n; i++) { if (i === 7) s++; if (s !== 1) s++; } }"},
+    {"arith",
+     "function f(n) { var s = 0;"
+     "  for (var i = 0; i < n; i++) s = (s + i * 3) % 1000; }"},
+};
+
+/* Best of RUNS, in nanoseconds per iteration */
+static double run(struct v7 *v7, const struct pattern *p) {
+  char js[50];
+  double best = 0, t;
+  v7_val_t res;
+  int i;
+
+  if (v7_exec(v7, p->js, &res) != V7_OK) {
+    v7_print_error(stderr, v7, p->js, res);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(js, sizeof(js), "f(%d)", ITERATIONS);
+  for (i = 0; i < RUNS; i++) {
+    t = cs_time();
+    if (v7_exec(v7, js, &res) != V7_OK) {
+      v7_print_error(stderr, v7, js, res);
+      exit(EXIT_FAILURE);
+    }
+    t = cs_time() - t;
+    if (i == 0 || t < best) best = t;
+  }
+
+  return best * 1e9 / ITERATIONS;
+}
+
+int main(void) {
+  struct v7 *v7 = v7_create();
+  size_t i;
+
+  printf("%-16s %10s\n", "pattern", "ns/iter");
+  for (i = 0; i < ARRAY_SIZE(s_patterns); i++) {
+    printf("%-16s %10.1f\n", s_patterns[i].name, run(v7, &s_patterns[i]));
+  }
+  v7_destroy(v7);
+
+  return EXIT_SUCCESS;
+}
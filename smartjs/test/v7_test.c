@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * V7 regression tests: each case runs a script and checks the printed
+ * result. Includes v7.c directly, build with -fsanitize=address to catch
+ * memory errors as well.
+ */
+
+#include "v7.c"
+#include "common/test_util.h"
+
+/* Runs `js` and checks that the result, converted to JSON, is `expected` */
+static const char *check_js(struct v7 *v7, const char *js,
+                            const char *expected, int line) {
+  char buf[200], *p;
+  v7_val_t res;
+
+  if (v7_exec(v7, js, &res) != V7_OK) {
+    v7_print_error(stderr, v7, js, res);
+    FAIL("v7_exec", line);
+  }
+  p = v7_to_json(v7, res, buf, sizeof(buf));
+  if (strcmp(p, expected) != 0) {
+    printf("%s != %s\n", p, expected);
+    if (p != buf) free(p);
+    FAIL(js, line);
+  }
+  if (p != buf) free(p);
+  return NULL;
+}
+
+#define ASSERT_JS(v7, js, expected)                                   \
+  do {                                                                \
+    const char *msg = check_js(v7, js, expected, __LINE__);           \
+    num_tests++;                                                      \
+    if (msg != NULL) return msg;                                      \
+  } while (0)
+
+static const char *test_json_parse(void) {
+  struct v7 *v7 = v7_create();
+
+  ASSERT_JS(v7, "JSON.parse('[1, \"a\", {\"b\": null}]')[2].b", "null");
+  ASSERT_JS(v7, "JSON.parse('\"\\\\u0041\\\\/\"')", "\"A/\"");
+
+  /* Strings created while parsing move the text of the JS string */
+  ASSERT_JS(v7,
+            "var a = [];"
+            "for (var i = 0; i < 2000; i++) {"
+            "  a.push({id: i, name: 'name number ' + i, tag: 't' + i});"
+            "}"
+            "var b = JSON.parse(JSON.stringify(a)), ok = b.length == 2000;"
+            "for (var i = 0; i < 2000; i++) {"
+            "  ok = ok && b[i].id == i && b[i].name == 'name number ' + i &&"
+            "       b[i].tag == 't' + i;"
+            "}"
+            "ok",
+            "true");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_dense_array(void) {
+  struct v7 *v7 = v7_create();
+
+  ASSERT_JS(v7,
+            "var a = [];"
+            "for (var i = 0; i < 20000; i++) a.push(i);"
+            "var s = 0; while (a.length) s += a.shift();"
+            "for (var i = 0; i < 20000; i++) a.unshift(i);"
+            "while (a.length) s += a.pop();"
+            "s",
+            "399980000");
+  ASSERT_JS(v7, "var b = [1, 2, 3, 4, 5]; [b.splice(1, 2, 'x', 'y'), b]",
+            "[[2,3],[1,\"x\",\"y\",4,5]]");
+  ASSERT_JS(v7, "var c = [1, 2, 3]; delete c[1]; [c.length, 1 in c, c[2]]",
+            "[3,false,3]");
+  ASSERT_JS(v7, "delete c[2]; c.length", "1");
+  ASSERT_JS(v7, "var k = []; for (var i in [5, 6, 7]) k.push(i); k",
+            "[\"0\",\"1\",\"2\"]");
+
+  /* Large gaps and element attributes make the array ordinary */
+  ASSERT_JS(v7, "var d = [1]; d[100000] = 2; [d.length, d[0], d[100000]]",
+            "[100001,1,2]");
+  ASSERT_JS(v7,
+            "var e = [1, 2];"
+            "Object.defineProperty(e, '0', {value: 9, writable: false});"
+            "e[0] = 5; e.push(3); [e[0], e.length, Object.keys(e).length]",
+            "[9,3,2]");
+
+  /* The C API lists the elements, then the other properties */
+  {
+    v7_val_t a, name, val;
+    v7_prop_attr_t attrs;
+    void *h = NULL;
+    char names[50] = "";
+    double sum = 0;
+    ASSERT_EQ(v7_exec(v7, "var f = [1, , 3]; f.x = 4; f", &a), V7_OK);
+    while ((h = v7_next_prop(h, a, &name, &val, &attrs)) != NULL) {
+      if (attrs & _V7_PROPERTY_HIDDEN) continue;
+      strcat(names, v7_to_cstring(v7, &name));
+      sum += v7_to_number(val);
+    }
+    ASSERT_STREQ(names, "02x");
+    ASSERT_EQ(sum, 8);
+  }
+
+  /* ToPrimitive goes through toString, not the backing store */
+  ASSERT_JS(v7, "['' + [1, 2], [] + [], 1 + [2], +[5], [1] == 1]",
+            "[\"1,2\",\"\",\"12\",5,true]");
+  ASSERT_JS(v7, "[[1, [2, 3]] + '', [] == '', +[], [7].valueOf()[0]]",
+            "[\"1,2,3\",true,0,7]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_array_like(void) {
+  struct v7 *v7 = v7_create();
+
+  ASSERT_JS(v7, "var cat = function(a, b) { return a + b; };"
+            "Array.prototype.reduce.call('abc', cat, '>')",
+            "\">abc\"");
+  ASSERT_JS(v7, "Array.prototype.reduce.call({length: 3, 0: 1, 2: 5}, cat)",
+            "6");
+  ASSERT_JS(v7,
+            "(function() {"
+            "  return Array.prototype.reduce.call(arguments, cat, 1);"
+            "})(2, 3)",
+            "6");
+  ASSERT_JS(v7, "[, 1, , 2].reduce(cat, 10)", "13");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_function_bind(void) {
+  struct v7 *v7 = v7_create();
+
+  ASSERT_JS(v7,
+            "function P(x, y) { this.x = x; this.y = y; }"
+            "P.prototype.sum = function() { return this.x + this.y; };"
+            "var t = {}; P.bind(t, 1)(2); [t.x, t.y]",
+            "[1,2]");
+
+  /* Bound functions construct their target, ignoring the bound `this` */
+  ASSERT_JS(v7, "var o = new (P.bind(t, 1))(2); [o.x, o.y, o.sum(), t.x]",
+            "[1,2,3,1]");
+  ASSERT_JS(v7,
+            "var B = P.bind(null, 1); [new B(2) instanceof P, o instanceof B]",
+            "[true,true]");
+  ASSERT_JS(v7,
+            "var o2 = new (B.bind(null, 5))(); [o2.x, o2.y, o2 instanceof P]",
+            "[1,5,true]");
+  ASSERT_JS(v7, "function R() { return {r: 1}; } (new (R.bind(null))()).r",
+            "1");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_inline_cache(void) {
+  struct v7 *v7 = v7_create();
+
+  /* Cached lookups see prototype changes and own properties shadowing them */
+  ASSERT_JS(v7,
+            "function P() {} P.prototype.x = 1;"
+            "var o = new P(), r = [];"
+            "function gx(o) { return o.x; }"
+            "for (var i = 0; i < 3; i++) r.push(gx(o));"
+            "P.prototype.x = 2; r.push(gx(o));"
+            "o.x = 3; r.push(gx(o));"
+            "delete o.x; r.push(gx(o)); r",
+            "[1,1,1,2,3,2]");
+  ASSERT_JS(v7,
+            "var A = {v: 'a'}, C = Object.create(A), d = Object.create(C);"
+            "function gv(o) { return o.v; }"
+            "var r = [gv(d), gv(d)];"
+            "C.v = 'c'; r.push(gv(d));"
+            "delete C.v; r.push(gv(d));"
+            "A.v = 'b'; r.push(gv(d)); r",
+            "[\"a\",\"a\",\"c\",\"a\",\"b\"]");
+
+  /* One site, objects of different shapes */
+  ASSERT_JS(v7,
+            "function gy(o) { return o.y; }"
+            "[gy({x: 1, y: 2}), gy({y: 3, x: 4}), gy({y: 5}),"
+            " gy({x: 6}) === undefined, gy({x: 7, y: 8})]",
+            "[2,3,5,true,8]");
+  ASSERT_JS(v7,
+            "function F() { this.a = 1; this.b = 2; }"
+            "function ga(o) { return o.a + o.b; }"
+            "var f1 = new F(), f2 = new F(), r = [ga(f1), ga(f2)];"
+            "f2.b = 'x'; delete f1.a; f1.a = 10;"
+            "r.push(ga(f1), ga(f2)); r",
+            "[3,3,12,\"1x\"]");
+
+  /* Objects with many properties, and deletes, leave the shape tree */
+  ASSERT_JS(v7,
+            "var m = {};"
+            "for (var i = 0; i < 100; i++) m['p' + i] = i;"
+            "function gm(o) { return o.p50; }"
+            "var r = [gm(m), gm(m)];"
+            "delete m.p50; r.push(gm(m) === undefined);"
+            "m.p50 = 'x'; r.push(gm(m), m.p99, Object.keys(m).length); r",
+            "[50,50,true,\"x\",99,100]");
+
+  /* Cached stores */
+  ASSERT_JS(v7,
+            "function sv(o, v) { o.w = v; return o.w; }"
+            "var W = {}, w = Object.create(W);"
+            "[sv(w, 1), sv(w, 2), sv(Object.create(W), 3), W.w === undefined]",
+            "[1,2,3,true]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_scope_slots(void) {
+  struct v7 *v7 = v7_create();
+
+  /* eval() reads, writes and declares variables of the calling function */
+  ASSERT_JS(v7,
+            "var x = 'g'; function f() { eval('var x = \\'l\\''); return x; }"
+            "[f(), x]",
+            "[\"l\",\"g\"]");
+  ASSERT_JS(v7,
+            "function h(a) {"
+            "  var b = 2; eval('a = a + b; b = 10'); return [a, b];"
+            "} h(1)",
+            "[3,10]");
+  ASSERT_JS(v7,
+            "function de(a) { var b = 1; eval('var c = a + b'); return c; }"
+            "de(5)",
+            "6");
+  ASSERT_JS(v7,
+            "function ev2() {"
+            "  var k = 1; return eval('k + 1') + eval('typeof q');"
+            "} ev2()",
+            "\"2undefined\"");
+  ASSERT_JS(v7,
+            "var gl = 1; function ge() { return eval('gl') + (0, eval)('gl'); }"
+            "ge()",
+            "2");
+
+  /* `with` isn't supported: rejecting it leaves the caller's slots alone */
+  ASSERT_JS(v7,
+            "function wf() {"
+            "  var a = 1, r = 'ok';"
+            "  try { eval('with ({a: 2}) { a = 3; }'); }"
+            "  catch (e) { r = 'no'; }"
+            "  return [a, r];"
+            "} wf()",
+            "[1,\"no\"]");
+
+  /* Closures, hoisting, catch scopes */
+  ASSERT_JS(v7,
+            "function mk() {"
+            "  var fs = [], r = [];"
+            "  for (var i = 0; i < 3; i++) fs.push(function() { return i; });"
+            "  for (var j = 0; j < fs.length; j++) r.push(fs[j]());"
+            "  return r;"
+            "} mk()",
+            "[3,3,3]");
+  ASSERT_JS(v7,
+            "function c() { var n = 0; function inc() { n++; } inc(); inc();"
+            "  return n; }"
+            "function outer() { var v = 1;"
+            "  function mid() { function inner() { return v; } v = 2;"
+            "    return inner(); }"
+            "  return mid(); }"
+            "[c(), outer()]",
+            "[2,2]");
+  ASSERT_JS(v7,
+            "function sh2() { return typeof late; var late = 1; }"
+            "function sh3(a, a) { return a; }"
+            "function fd() { return g(); function g() { return 'h'; } }"
+            "[sh2(), sh3(1, 2), fd()]",
+            "[\"undefined\",2,\"h\"]");
+  ASSERT_JS(v7,
+            "function cat(e) { var e2 = 'outer';"
+            "  try { throw 'thrown'; } catch (e2) { e = e2; } return [e, e2]; }"
+            "cat(0)",
+            "[\"thrown\",\"outer\"]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_call_args(void) {
+  struct v7 *v7 = v7_create();
+
+  /* v7 doesn't alias `arguments` to named parameters */
+  ASSERT_JS(v7,
+            "function al(a) { arguments[0] = 9; return a; }"
+            "function al2(a) { a = 7; return arguments[0]; }"
+            "[al(1), al2(1)]",
+            "[1,1]");
+
+  /* Missing, extra and defaulted arguments */
+  ASSERT_JS(v7,
+            "function m(a, b, c) { return [a, b, c, arguments.length]; }"
+            "function ex(a) { return arguments[3]; }"
+            "[m(1), m(1, 2, 3, 4), ex(1, 2, 3, 'x')]",
+            "[[1,null,null,1],[1,2,3,4],\"x\"]");
+  ASSERT_JS(v7,
+            "function nm(x) { x = x || 'd'; return x; }"
+            "function sh(a) { var a = 2; return arguments[0]; }"
+            "[nm(), nm(0), nm('v'), sh(3)]",
+            "[\"d\",\"d\",\"v\",3]");
+
+  /* call/apply with many arguments and recursion */
+  ASSERT_JS(v7,
+            "function sum() { var s = 0;"
+            "  for (var i = 0; i < arguments.length; i++) s += arguments[i];"
+            "  return s; }"
+            "var big = []; for (var i = 0; i < 100; i++) big.push(i);"
+            "[sum.apply(null, big), sum.call(null, 1, 2, 3, 4, 5, 6, 7, 8, 9),"
+            " sum()]",
+            "[4950,45,0]");
+  ASSERT_JS(v7,
+            "function fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }"
+            "function deep(n) { return n == 0 ? 0 : 1 + deep(n - 1); }"
+            "function rc(n, acc) {"
+            "  return n == 0 ? acc : rc(n - 1, acc + arguments.length); }"
+            "[fib(15), deep(200), rc(10, 0)]",
+            "[610,200,20]");
+
+  /* Arguments and parameters outlive the call that created them */
+  ASSERT_JS(v7,
+            "function keep() { return arguments; }"
+            "function cl(a) { return function() { a++; return a; }; }"
+            "var ka = keep(1, 'b'), inc = cl(5); inc();"
+            "[ka.length, ka[0], ka[1], inc()]",
+            "[2,1,\"b\",7]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_ropes(void) {
+  struct v7 *v7 = v7_create();
+
+  /* Appending and prepending in a loop builds ropes; reads flatten them */
+  ASSERT_JS(v7,
+            "var s = ''; for (var i = 0; i < 300; i++) s += 'ab' + (i % 10);"
+            "[s.length, s.charAt(0), s.charAt(4), s.charAt(899),"
+            " s.charCodeAt(5), s[7]]",
+            "[900,\"a\",\"b\",\"9\",49,\"b\"]");
+  ASSERT_JS(v7,
+            "var t = ''; for (var i = 0; i < 300; i++) t = (i % 10) + t;"
+            "[t.length, t.indexOf('98765'), t.lastIndexOf('0123'),"
+            " t.indexOf('x'), t.slice(-4), t.substr(10, 5)]",
+            "[300,0,-1,-1,\"3210\",\"98765\"]");
+  ASSERT_JS(v7,
+            "var p = 'x'; for (var i = 0; i < 12; i++) p = p + p;"
+            "var q = p + 'y';"
+            "[p.length, q.charAt(4096), q.indexOf('y'),"
+            " p.substring(4090).length]",
+            "[4096,\"y\",4096,6]");
+
+  /* Ropes of different shapes compare by content */
+  ASSERT_JS(v7,
+            "var a = '', b = '', c = '';"
+            "for (var i = 0; i < 200; i++) { a += 'xy'; c = 'xy' + c; }"
+            "for (var i = 0; i < 100; i++) b = b + 'xyxy';"
+            "[a == b, a === c, b == c, a < a + 'z', (a + 'a') < (b + 'b'),"
+            " a > c, a + 'q' != c + 'r']",
+            "[true,true,true,true,true,false,true]");
+  ASSERT_JS(v7,
+            "var sw = '', sw2 = '';"
+            "for (var i = 0; i < 30; i++) { sw += 'abc'; sw2 = 'abc' + sw2; }"
+            "var r; switch (sw) { case 'abc': r = 'short'; break;"
+            "  case sw2: r = 'hit'; break; default: r = 'miss'; } r",
+            "\"hit\"");
+
+  /* Ropes as property names and as arguments to natives */
+  ASSERT_JS(v7,
+            "var k = '', k2 = '', o = {};"
+            "for (var i = 0; i < 40; i++) {"
+            "  k += 'key' + i; k2 = k2 + ('key' + i);"
+            "}"
+            "o[k] = 1; [o[k2], k2 in o, Object.keys(o)[0] === k]",
+            "[1,true,true]");
+  ASSERT_JS(v7,
+            "var u = '';"
+            "for (var i = 0; i < 100; i++) {"
+            "  u += String.fromCharCode(65 + i % 26);"
+            "}"
+            "[u.toLowerCase().slice(0, 3), u.split('Z').length,"
+            " JSON.stringify(u).length, u.replace(/A/g, '').length]",
+            "[\"abc\",4,102,96]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_gc_nursery(void) {
+  struct v7_create_opts opts;
+  struct v7 *v7;
+
+  /* Like `v7 -vg 1`: tiny arenas and a minor pass every few allocations */
+  memset(&opts, 0, sizeof(opts));
+  opts.object_arena_size = 16;
+  opts.property_arena_size = 16;
+  opts.gc_time_budget_us = 1;
+  v7 = v7_create_opt(opts);
+
+  /* Old objects, dense arrays, scopes and prototypes pointing to young ones */
+  ASSERT_JS(v7,
+            "var old = {kids: {}}, arr = [], junk;"
+            "for (var i = 0; i < 3000; i++) {"
+            "  old.kids['k' + (i % 50)] = {v: i, s: 'str' + i};"
+            "  arr[i % 100] = {v: i};"
+            "  junk = {a: [i], b: 'x' + i};"
+            "}"
+            "function kids_ok() { var ok = true;"
+            "  for (var i = 0; i < 50; i++) { var k = old.kids['k' + i];"
+            "    ok = ok && k.v % 50 == i && k.s == 'str' + k.v; }"
+            "  for (var i = 0; i < 100; i++) ok = ok && arr[i].v == 2900 + i;"
+            "  return ok; }"
+            "kids_ok()",
+            "true");
+  ASSERT_JS(v7,
+            "function counter() { var st = {n: 0};"
+            "  return function() { st = {n: st.n + 1, pad: [1, 2]};"
+            "    return st.n; }; }"
+            "var cnt = counter(), last;"
+            "for (var i = 0; i < 2000; i++) { last = cnt(); junk = {x: i}; }"
+            "function P() {} var inst;"
+            "for (var i = 0; i < 2000; i++) {"
+            "  P.prototype = {tag: 'p' + i}; inst = new P();"
+            "  junk = [i, {i: i}];"
+            "}"
+            "[last, inst.tag]",
+            "[2000,\"p1999\"]");
+  ASSERT_JS(v7,
+            "var q = [];"
+            "for (var i = 0; i < 2000; i++) {"
+            "  q.push({i: i}); if (q.length > 30) q.shift(); junk = 'g' + i;"
+            "}"
+            "var ch = null;"
+            "for (var i = 0; i < 1500; i++) ch = {next: ch, i: i};"
+            "var n = 0, sum = 0; for (var c = ch; c; c = c.next) {"
+            "  n++; sum += c.i; }"
+            "[q.length, q[0].i, q[29].i, n, sum]",
+            "[30,1970,1999,1500,1124250]");
+
+  /* Everything is still reachable after a full pass */
+  v7_gc(v7, 1);
+  ASSERT_JS(v7,
+            "[kids_ok(), cnt(), inst.tag, q[29].i, ch.next.i, old.kids.k7.s]",
+            "[true,2001,\"p1999\",1999,1498,\"str2957\"]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *test_atoms(void) {
+  struct v7 *v7 = v7_create();
+
+  /* Names built at runtime find properties keyed by literal atoms */
+  ASSERT_JS(v7,
+            "var arr = [1, 2, 3], L = 'le' + 'ngth';"
+            "[arr[L], 'abc'[L], arr['len' + 'gth'] === arr.length]",
+            "[3,3,true]");
+  ASSERT_JS(v7,
+            "var o = {}; o['na' + 'me'] = 'v';"
+            "var nm = ['n', 'a', 'm', 'e'].join('');"
+            "[o.name, o[nm], nm in o, o.hasOwnProperty('nam' + 'e'),"
+            " 'na' + 'me' === 'name']",
+            "[\"v\",\"v\",true,true,true]");
+  ASSERT_JS(v7,
+            "var p = 'pro' + 'totype'; function F() {}"
+            "F[p].m = function() { return 'm'; };"
+            "var o4 = {toString: 1}, t = 'to' + 'String';"
+            "[new F().m(), F.prototype === F[p], o4.hasOwnProperty(t),"
+            " typeof Object.prototype[t], delete o4[t],"
+            " o4.hasOwnProperty('toString')]",
+            "[\"m\",true,true,\"function\",true,false]");
+  ASSERT_JS(v7,
+            "var s = 'x'.concat('y', 'z'), sub = 'wxyzw'.substr(1, 3);"
+            "var o6 = {xyz: 1}, n = 12, o5 = {};"
+            "o5[n] = 'a'; o5['1' + '3'] = 'b';"
+            "[o6[s], o6[sub], s === sub, o6['XYZ'.toLowerCase()],"
+            " o5['12'], o5[13]]",
+            "[1,1,true,1,\"a\",\"b\"]");
+
+  /* Keys from JSON.parse, Object.keys and switch on built strings */
+  ASSERT_JS(v7,
+            "var j = JSON.parse('{\"alpha\": 1, \"be\\\\u0074a\": 2}');"
+            "[j.alpha, j.beta, j['al' + 'pha'], 'beta' in j]",
+            "[1,2,1,true]");
+  ASSERT_JS(v7,
+            "var o3 = {}; o3['a' + 'b'] = 1; o3.cd = 2;"
+            "var ks = Object.keys(o3).sort();"
+            "[ks[0] === 'ab', ks[1] == 'c' + 'd', ks.indexOf('a' + 'b'),"
+            " o3[ks[0]] + o3[ks[1]]]",
+            "[true,true,0,3]");
+  ASSERT_JS(v7,
+            "var key = String.fromCharCode(120, 121), r;"
+            "switch (key) { case 'xy': r = 'atom'; break; default: r = 'no'; }"
+            "[r, {xy: 5}[key], key == 'xy']",
+            "[\"atom\",5,true]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+/*
+ * The peephole optimizer fuses frequent sequences into superinstructions;
+ * `make -f bench.mk test` also runs these cases on a build without them.
+ */
+static const char *test_superinstructions(void) {
+  struct v7 *v7 = v7_create();
+
+  /* GET_VAR; PUSH_LIT; GET, GET_LOCAL; PUSH_LIT; GET, PUSH_LIT; GET */
+  ASSERT_JS(v7,
+            "var o = {a: {b: 1}}; function P() {} P.prototype.q = 'proto';"
+            "var p = new P();"
+            "function gl() { var loc = {c: 2};"
+            "  return [o.a.b, loc.c, p.q, o.zz, loc.c.toFixed(1),"
+            "          'str'.length, (5).constructor === Number]; }"
+            "gl()",
+            "[1,2,\"proto\",null,\"2.0\",3,true]");
+  ASSERT_JS(v7,
+            "var u, r = [];"
+            "try { u.x; } catch (e) { r.push(e instanceof TypeError); }"
+            "function lu() { var n = null;"
+            "  try { return n.y; } catch (e) { return 'caught'; } }"
+            "r.push(lu()); r",
+            "[true,\"caught\"]");
+
+  /* DUP; JMP_FALSE and DUP; JMP_TRUE of && and || */
+  ASSERT_JS(v7,
+            "var r = [], vals = [0, 1, '', 'a', null, undefined, NaN, {}, -0];"
+            "for (var i = 0; i < vals.length; i++) {"
+            "  var v = vals[i]; r.push((v && 'T') || 'F'); r.push(v || 'D');"
+            "} r",
+            "[\"F\",\"D\",\"T\",1,\"F\",\"D\",\"T\",\"a\","
+            "\"F\",\"D\",\"F\",\"D\",\"F\",\"D\",\"T\",{},"
+            "\"F\",\"D\"]");
+  ASSERT_JS(v7,
+            "var a = 'x', b;"
+            "[a && b || 'dflt', (b || a) && 'both', 0 || null || '' || 'last',"
+            " 1 && 2 && 0 && 3]",
+            "[\"dflt\",\"both\",\"last\",0]");
+
+  /* Comparisons followed by a conditional jump, numbers or not */
+  ASSERT_JS(v7,
+            "var r = [], xs = [1, 2, NaN, undefined, '3', null, -0, 0];"
+            "for (var i = 0; i < xs.length; i++) { var x = xs[i];"
+            "  if (x < 2) r.push('lt'); else r.push('nlt');"
+            "  if (x >= 2) r.push('ge'); else r.push('nge'); } r",
+            "[\"lt\",\"nge\",\"nlt\",\"ge\",\"nlt\",\"nge\","
+            "\"nlt\",\"nge\",\"nlt\",\"ge\",\"lt\",\"nge\","
+            "\"lt\",\"nge\",\"lt\",\"nge\"]");
+  ASSERT_JS(v7,
+            "var s = 0, c = 0;"
+            "for (var i = 0; i < 10; i++) { if (i % 2 === 0 || i > 7) s += i; }"
+            "for (var j = 10; j >= 0; j--) c += j <= 3 ? 1 : 0;"
+            "[s, c, 10 < 9, 'b' > 'a', [2] > 1]",
+            "[29,4,false,true,true]");
+  ASSERT_JS(v7,
+            "var r = [], n = NaN, o = {};"
+            "if (n === n) r.push('eq'); else r.push('ne');"
+            "if (n !== n) r.push('ne2');"
+            "if ('ab' === 'a' + 'b') r.push('s');"
+            "if (null === undefined) r.push('bad');"
+            "if (1 === '1') r.push('bad2');"
+            "if (o === o) r.push('o'); if ({} !== {}) r.push('o2'); r",
+            "[\"ne\",\"ne2\",\"s\",\"o\",\"o2\"]");
+  ASSERT_JS(v7,
+            "var s = 'abc', k = NaN, kk;"
+            "switch (s) { case 'ab' + 'c': s = 1; break; default: s = 2; }"
+            "switch (k) { case NaN: kk = 'nan'; break; default: kk = 'def'; }"
+            "[s, kk]",
+            "[1,\"def\"]");
+
+  /* A jump landing between the comparison and its conditional jump */
+  ASSERT_JS(v7,
+            "function t(x, a, b) { if (x ? a : a < b) return 'y'; return 'n'; }"
+            "function t2(x, a) { while (x ? a-- : a > 0 && a--); return a; }"
+            "[t(1, 0, 5), t(1, 1, 0), t(0, 1, 5), t(0, 5, 1), t2(1, 3),"
+            " t2(0, 3)]",
+            "[\"n\",\"y\",\"y\",\"n\",-1,0]");
+
+  v7_destroy(v7);
+  return NULL;
+}
+
+static const char *run_tests(const char *filter, double *total_elapsed) {
+  RUN_TEST(test_json_parse);
+  RUN_TEST(test_dense_array);
+  RUN_TEST(test_array_like);
+  RUN_TEST(test_function_bind);
+  RUN_TEST(test_inline_cache);
+  RUN_TEST(test_scope_slots);
+  RUN_TEST(test_call_args);
+  RUN_TEST(test_ropes);
+  RUN_TEST(test_gc_nursery);
+  RUN_TEST(test_atoms);
+  RUN_TEST(test_superinstructions);
+  return NULL;
+}
+
+int __cdecl main(int argc, char *argv[]) {
+  const char *fail_msg;
+  const char *filter = argc > 1 ? argv[1] : "";
+  double total_elapsed = 0.0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  fail_msg = run_tests(filter, &total_elapsed);
+  printf("%s, run %d in %.3lfs\n", fail_msg ? "FAIL" : "PASS", num_tests,
+         total_elapsed);
+  return fail_msg == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
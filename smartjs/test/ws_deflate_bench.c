@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * permessage-deflate benchmark: replays captured clubby frames, one per
+ * line, through the WebSocket compressor and decompressor and reports
+ * compression ratio and CPU cost, with and without context takeover.
+ * Includes mongoose.c directly to get at the static deflate code.
+ */
+
+#define MG_ENABLE_WS_DEFLATE
+#include "mongoose.c"
+
+#define ROUNDS 50
+
+struct capture {
+  char *buf;
+  struct mg_str msgs[1024];
+  int num_msgs;
+};
+
+static int load_capture(const char *path, struct capture *c) {
+  FILE *fp = fopen(path, "rb");
+  long size;
+  char *p, *end, *eol;
+
+  if (fp == NULL) return 0;
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  c->buf = (char *) malloc(size);
+  if (c->buf == NULL || fread(c->buf, 1, size, fp) != (size_t) size) {
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+
+  c->num_msgs = 0;
+  for (p = c->buf, end = p + size; p < end; p = eol + 1) {
+    if ((eol = (char *) memchr(p, '\n', end - p)) == NULL) eol = end;
+    if (eol > p && c->num_msgs < (int) ARRAY_SIZE(c->msgs)) {
+      c->msgs[c->num_msgs].p = p;
+      c->msgs[c->num_msgs].len = eol - p;
+      c->num_msgs++;
+    }
+  }
+
+  return c->num_msgs > 0;
+}
+
+static void setup(struct mg_connection *nc, int no_takeover) {
+  struct mg_ws_deflate *d;
+  memset(nc, 0, sizeof(*nc));
+  d = &mg_http_get_proto_data(nc)->ws.deflate;
+  d->enabled = d->tx_ok = 1;
+  d->rx_bits = 15;
+  d->rx_no_takeover = d->tx_no_takeover = no_takeover;
+}
+
+static int run(const struct capture *c, int no_takeover) {
+  struct mg_connection tx, rx;
+  struct mbuf out, in;
+  size_t raw = 0, compressed = 0;
+  double t_deflate = 0, t_inflate = 0, t;
+  int i, round, ok = 1;
+
+  mbuf_init(&out, 0);
+  mbuf_init(&in, 0);
+
+  /* Every round replays the capture over a fresh connection */
+  for (round = 0; round < ROUNDS && ok; round++) {
+    setup(&tx, no_takeover);
+    setup(&rx, no_takeover);
+    for (i = 0; i < c->num_msgs; i++) {
+      struct websocket_message wsm;
+
+      out.len = in.len = 0;
+      t = cs_time();
+      if (!mg_ws_deflate_frame(&tx, WEBSOCKET_OP_TEXT, &c->msgs[i], 1, &out)) {
+        /* Too short to be compressed */
+        mbuf_append(&out, c->msgs[i].p, c->msgs[i].len);
+        wsm.flags = 0x80 | WEBSOCKET_OP_TEXT;
+      } else {
+        wsm.flags = 0xc0 | WEBSOCKET_OP_TEXT;
+      }
+      t_deflate += cs_time() - t;
+
+      wsm.data = (unsigned char *) out.buf;
+      wsm.size = out.len;
+      t = cs_time();
+      ok = mg_ws_inflate_frame(&rx, &wsm, &in) == 0;
+      t_inflate += cs_time() - t;
+
+      if (!ok || wsm.size != c->msgs[i].len ||
+          memcmp(wsm.data, c->msgs[i].p, wsm.size) != 0) {
+        printf("round trip failed on message %d\n", i);
+        ok = 0;
+        break;
+      }
+      raw += c->msgs[i].len;
+      compressed += out.len;
+    }
+    mg_http_conn_destructor(tx.proto_data);
+    mg_http_conn_destructor(rx.proto_data);
+  }
+
+  printf("%-16s %8.1f%% %10.1f %10.1f %10.1f %10.1f\n",
+         no_takeover ? "no_takeover" : "context_takeover",
+         100.0 * compressed / raw, t_deflate * 1e6 / (ROUNDS * c->num_msgs),
+         raw / t_deflate / 1e6, t_inflate * 1e6 / (ROUNDS * c->num_msgs),
+         raw / t_inflate / 1e6);
+
+  mbuf_free(&out);
+  mbuf_free(&in);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : "data/clubby_traffic.json";
+  static struct capture c;
+  size_t i, total = 0;
+  int ok;
+
+  if (!load_capture(path, &c)) {
+    fprintf(stderr, "cannot load %s\n", path);
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < (size_t) c.num_msgs; i++) total += c.msgs[i].len;
+  printf("%s: %d messages, %d bytes\n", path, c.num_msgs, (int) total);
+
+  printf("%-16s %9s %10s %10s %10s %10s\n", "mode", "size", "defl us",
+         "defl MB/s", "infl us", "infl MB/s");
+  ok = run(&c, 0) && run(&c, 1);
+
+  free(c.buf);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
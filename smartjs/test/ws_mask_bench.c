@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014-2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * WebSocket masking micro-benchmark: compares mg_ws_mask() against the
+ * byte-at-a-time loop for frame sizes from 16 bytes to 1 megabyte.
+ * Includes mongoose.c directly to get at the static masking kernel.
+ */
+
+#include "mongoose.c"
+
+#define MAX_FRAME_SIZE (1024 * 1024)
+#define BYTES_PER_RUN (64 * 1024 * 1024)
+
+static void mask_bytewise(unsigned char *data, size_t len,
+                          const unsigned char *key, size_t off) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    data[i] ^= key[(off + i) % 4];
+  }
+}
+
+static int check(unsigned char *a, unsigned char *b, const unsigned char *key) {
+  size_t len, off, shift;
+  for (len = 0; len < 100; len++) {
+    for (off = 0; off < 4; off++) {
+      for (shift = 0; shift < 8; shift++) {
+        memset(a + shift, 0x5a, len);
+        memset(b + shift, 0x5a, len);
+        mg_ws_mask(a + shift, len, key, off);
+        mask_bytewise(b + shift, len, key, off);
+        if (memcmp(a + shift, b + shift, len) != 0) {
+          printf("mismatch: len %d, off %d, shift %d\n", (int) len, (int) off,
+                 (int) shift);
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  static const unsigned char key[4] = {0x12, 0x34, 0x56, 0x78};
+  unsigned char *buf = (unsigned char *) malloc(MAX_FRAME_SIZE + 16);
+  unsigned char *ref = (unsigned char *) malloc(MAX_FRAME_SIZE + 16);
+  size_t size, n, runs;
+  double t1, t2;
+
+  if (buf == NULL || ref == NULL || !check(buf, ref, key)) return EXIT_FAILURE;
+  memset(buf, 0, MAX_FRAME_SIZE + 16);
+
+  printf("%10s %12s %12s %8s\n", "size", "bytes MB/s", "words MB/s", "ratio");
+  for (size = 16; size <= MAX_FRAME_SIZE; size *= 4) {
+    runs = BYTES_PER_RUN / size;
+
+    t1 = cs_time();
+    for (n = 0; n < runs; n++) mask_bytewise(buf, size, key, 0);
+    t1 = cs_time() - t1;
+
+    t2 = cs_time();
+    for (n = 0; n < runs; n++) mg_ws_mask(buf, size, key, 0);
+    t2 = cs_time() - t2;
+
+    printf("%10d %12.1f %12.1f %8.2f\n", (int) size,
+           BYTES_PER_RUN / t1 / 1e6, BYTES_PER_RUN / t2 / 1e6, t1 / t2);
+  }
+
+  free(buf);
+  free(ref);
+  return EXIT_SUCCESS;
+}
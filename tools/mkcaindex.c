@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Builds a Krypton trust anchor index from a PEM CA bundle, see
+ * ca_index.c in krypton.c for the format. The index can be passed to
+ * SSL_CTX_load_verify_locations() instead of the bundle.
+ *
+ *   cc -I../krypton -o mkcaindex mkcaindex.c
+ *   ./mkcaindex ca.pem ca.idx
+ */
+
+#include "krypton.c"
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t num_buckets = 1, num_certs = 0, off, i, j, *hashes, *start;
+  uint8_t *table, *e;
+  size_t table_len;
+  DER **certs;
+  PEM *p;
+  FILE *f;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s ca.pem ca.idx\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  p = pem_load_types(argv[1], PEM_SIG_CERT);
+  if (p == NULL || p->num_obj == 0) {
+    fprintf(stderr, "%s: no certificates\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  /* Hash the subjects, skipping what Krypton cannot parse */
+  hashes = calloc(p->num_obj, sizeof(*hashes));
+  certs = calloc(p->num_obj, sizeof(*certs));
+  for (i = 0; i < p->num_obj; i++) {
+    X509 *cert = X509_new(p->obj[i].der, p->obj[i].der_len);
+    if (cert == NULL) {
+      fprintf(stderr, "%s: skipping certificate %u\n", argv[1], i);
+      continue;
+    }
+    hashes[num_certs] = kr_ca_index_hash(cert->subject.ptr, cert->subject.len);
+    certs[num_certs++] = &p->obj[i];
+    X509_free(cert);
+  }
+  while (num_buckets < num_certs) num_buckets <<= 1;
+
+  /* Count entries per bucket, then turn counts into start indices */
+  start = calloc(num_buckets + 1, sizeof(*start));
+  for (i = 0; i < num_certs; i++) start[(hashes[i] & (num_buckets - 1)) + 1]++;
+  for (i = 0; i < num_buckets; i++) start[i + 1] += start[i];
+
+  table_len = 4 * (num_buckets + 1) + 12 * num_certs;
+  table = calloc(1, KR_CA_INDEX_HDR_LEN + table_len);
+  memcpy(table, "KRCA", 4);
+  put32(table + 4, num_buckets);
+  put32(table + 8, num_certs);
+  for (i = 0; i <= num_buckets; i++) {
+    put32(table + KR_CA_INDEX_HDR_LEN + 4 * i, start[i]);
+  }
+
+  /* Fill the buckets, keeping the order of the bundle within each */
+  off = KR_CA_INDEX_HDR_LEN + table_len;
+  e = table + KR_CA_INDEX_HDR_LEN + 4 * (num_buckets + 1);
+  for (i = 0; i < num_certs; i++) {
+    j = start[hashes[i] & (num_buckets - 1)]++;
+    put32(e + 12 * j, hashes[i]);
+    put32(e + 12 * j + 4, off);
+    put32(e + 12 * j + 8, certs[i]->der_len);
+    off += certs[i]->der_len;
+  }
+
+  f = fopen(argv[2], "wb");
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  fwrite(table, 1, KR_CA_INDEX_HDR_LEN + table_len, f);
+  for (i = 0; i < num_certs; i++) {
+    fwrite(certs[i]->der, 1, certs[i]->der_len, f);
+  }
+  if (fclose(f) != 0) {
+    fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  printf("%s: %u certificates, %u buckets, %u bytes\n", argv[2], num_certs,
+         num_buckets, off);
+  free(table);
+  free(start);
+  free(certs);
+  free(hashes);
+  pem_free(p);
+  return EXIT_SUCCESS;
+}
@@ -1931,6 +1931,14 @@ struct v7_create_opts {
   size_t object_arena_size;
   size_t function_arena_size;
   size_t property_arena_size;
+  /*
+   * Target pause of a minor GC pass, in microseconds. Minor passes only
+   * collect objects allocated since the previous pass; when this is non-zero,
+   * they are performed every N allocations, N being adjusted to keep the
+   * pause within the target. 0 means that GC runs only when the heap is
+   * exhausted.
+   */
+  unsigned long gc_time_budget_us;
 #ifdef V7_STACK_SIZE
   void *c_stack_base;
 #endif
@@ -2124,6 +2132,18 @@ V7_PRIVATE void init_error(struct v7 *v7);
 
 typedef void (*gc_cell_destructor_t)(struct v7 *v7, void *);
 
+/*
+ * Number of allocations between minor GC passes when
+ * `v7_create_opts::gc_time_budget_us` is set, initially and at least.
+ */
+#ifndef V7_GC_NURSERY_SIZE
+#define V7_GC_NURSERY_SIZE 1000
+#endif
+
+#ifndef V7_GC_MIN_NURSERY_SIZE
+#define V7_GC_MIN_NURSERY_SIZE 50
+#endif
+
 struct gc_block {
   struct gc_block *next;
   struct gc_cell *base;
@@ -2135,6 +2155,7 @@ struct gc_arena {
   size_t size_increment;
   struct gc_cell *free; /* head of free list */
   size_t cell_size;
+  struct mbuf young; /* cells allocated since the last GC, see `gc_minor()` */
 
 #if V7_ENABLE__Memory__stats
   unsigned long allocations; /* cumulative counter of allocations */
@@ -2585,6 +2606,10 @@ typedef unsigned char entity_id_part_t;
  *
  * Tag (1,0) however cannot hold a zero payload otherwise it's interpreted as an
  * INFINITY; for simplicity we're just not going to use that combination.
+ *
+ * Tags with the sign bit cleared are positive NaNs, which are never produced
+ * by `v7_mk_number()` (it stores every NaN as `V7_TAG_NAN`), so they are free
+ * for use as well.
  */
 #define MAKE_TAG(s, t) \
   ((uint64_t)(s) << 63 | (uint64_t) 0x7ff0 << 48 | (uint64_t)(t) << 48)
@@ -2604,6 +2629,8 @@ typedef unsigned char entity_id_part_t;
 #define V7_TAG_STRING_D MAKE_TAG(1, 0x3)  /* Dictionary string  */
 #define V7_TAG_REGEXP MAKE_TAG(1, 0x2)    /* Regex */
 #define V7_TAG_NOVALUE MAKE_TAG(1, 0x1)   /* Sentinel for no value */
+#define V7_TAG_STRING_R MAKE_TAG(0, 0xF)  /* Rope string */
+#define V7_TAG_STRING_A MAKE_TAG(0, 0xE)  /* Atom (interned string) */
 #define V7_TAG_MASK MAKE_TAG(1, 0xF)
 
 #define V7_NULL V7_TAG_FOREIGN
@@ -2617,6 +2644,8 @@ typedef unsigned char v7_obj_attr_t;
 #define V7_OBJ_DENSE_ARRAY (1 << 1)    /* TODO(mkm): store in some tag */
 #define V7_OBJ_FUNCTION (1 << 2)       /* function object */
 #define V7_OBJ_OFF_HEAP (1 << 3)       /* object not managed by V7 HEAP */
+#define V7_OBJ_OLD (1 << 4)            /* object survived a GC */
+#define V7_OBJ_REMEMBERED (1 << 5)     /* object is in `v7->remembered` */
 
 /*
  * JavaScript value is either a primitive, or an object.
@@ -2654,6 +2683,7 @@ enum v7_type {
 struct v7_call_frame {
   struct v7_call_frame *prev;
   size_t stack_size;
+  size_t locals_base;
   struct bcode *bcode;
   char *bcode_ops;
   struct {
@@ -2673,6 +2703,7 @@ struct v7_vals {
   val_t global_object;
   val_t this_object; /* this object for current call */
   val_t arguments;   /* arguments of current call */
+  val_t callee;      /* function object of current C function call */
 
   val_t object_prototype;
   val_t array_prototype;
@@ -2736,6 +2767,20 @@ struct v7 {
 
   struct mbuf stack; /* value stack for bcode interpreter */
 
+  /*
+   * Index (in `val_t` units) of the first frame slot of the current function
+   * in `stack`. Valid only while running a function whose bcode has
+   * `uses_slots` set.
+   */
+  size_t locals_base;
+
+  /*
+   * Arguments of the current cfunction call: unless `vals.arguments` holds an
+   * array, these are `argc` values on `stack` starting at index `args_base`.
+   */
+  size_t args_base;
+  unsigned long argc;
+
   struct mbuf owned_strings;   /* Sequence of (varint len, char data[]) */
   struct mbuf foreign_strings; /* Sequence of (varint len, char *data) */
 
@@ -2745,6 +2790,18 @@ struct v7 {
   struct gc_arena generic_object_arena;
   struct gc_arena function_arena;
   struct gc_arena property_arena;
+  struct gc_arena rope_arena;
+  size_t rope_flat_size; /* Bytes allocated by rope flattening since last GC */
+
+  /*
+   * Generational GC state, see `gc_minor()`.
+   */
+  struct mbuf remembered;     /* Old objects written to since the last GC */
+  size_t gc_young_cnt;        /* Cells allocated since the last GC */
+  size_t gc_nursery_size;     /* Max `gc_young_cnt` before a minor GC, or 0 */
+  size_t gc_promoted_cnt;     /* Cells promoted since the last major GC */
+  size_t gc_old_cnt;          /* Cells alive after the last major GC */
+  unsigned long gc_time_budget_us; /* See `struct v7_create_opts` */
 #if V7_ENABLE__Memory__stats
   size_t function_arena_ast_size;
   size_t bcode_ops_size;
@@ -2785,6 +2842,17 @@ struct v7 {
   /* singleton, pointer because of amalgamation */
   struct v7_property *cur_dense_prop;
 
+  /* Root of the shape transition tree, see `struct v7_shape` */
+  struct v7_shape *root_shape;
+  size_t shapes_cnt;
+  /* Generation of inline caches, see `struct v7_prop_ic` */
+  uint32_t ic_epoch;
+
+  /* Hash table of interned strings, see `struct v7_atom` */
+  struct v7_atom **atoms;
+  size_t atoms_size; /* Number of buckets, power of two */
+  size_t atoms_cnt;
+
   volatile int interrupt;
 #ifdef V7_STACK_SIZE
   void *sp_limit;
@@ -2847,6 +2915,8 @@ struct v7 {
   unsigned int is_constructor : 1;
   /* while true, GC is inhibited */
   unsigned int inhibit_gc : 1;
+  /* true while a minor GC is marking, see `gc_minor()` */
+  unsigned int is_minor_gc : 1;
   /* true if `thrown_error` is valid */
   unsigned int is_thrown : 1;
   /* true if `returned_value` is valid */
@@ -2913,6 +2983,72 @@ struct v7_generic_object {
    */
   struct v7_object base;
   struct v7_object *prototype;
+  /*
+   * Hidden class of the object, see `struct v7_shape`. `NULL` means that the
+   * object is in "dictionary mode": its property list is the only source of
+   * truth, and inline caches don't apply to it.
+   */
+  struct v7_shape *shape;
+  /*
+   * Properties of a shaped object in insertion order: `slots[i]` is the one
+   * added at depth `i` of the shape, so that inline caches reach it without
+   * walking the list. Grows in powers of two; `NULL` in dictionary mode.
+   */
+  struct v7_property **slots;
+};
+
+#ifndef V7_MAX_SHAPES
+#define V7_MAX_SHAPES 512
+#endif
+
+#ifndef V7_SHAPE_MAX_PROPS
+#define V7_SHAPE_MAX_PROPS 32
+#endif
+
+/*
+ * Shape (aka hidden class) describes the layout of the property list of a
+ * generic object: the names of its properties, in insertion order.
+ *
+ * Shapes form a transition tree rooted at `v7->root_shape`: adding a property
+ * named `foo` to an object with shape `S` moves the object to the child of
+ * `S` named `foo`, so objects built the same way share the same shape.
+ * The property added at depth `i` is `slots[i]` of the object.
+ *
+ * Deleting a property (or any other direct manipulation of the property
+ * list) moves the object to dictionary mode. So does growing past
+ * `V7_SHAPE_MAX_PROPS` properties, or running out of `V7_MAX_SHAPES`.
+ *
+ * Shapes are owned by `struct v7` and are never freed before `v7_destroy()`.
+ */
+struct v7_shape {
+  struct v7_shape *parent;
+  struct v7_shape *children; /* First child transition */
+  struct v7_shape *next;     /* Next sibling transition */
+  uint16_t count;            /* Number of properties */
+  uint16_t name_len;
+  char name[1]; /* Name of the last added property, `name_len` bytes */
+};
+
+/*
+ * Inline cache entry of a single `OP_GET` / `OP_SET` instruction.
+ *
+ * For `OP_GET`, `holder` is `NULL` if the property was found in the object
+ * itself, or the shape of its prototype otherwise. For `OP_SET`, `holder` is
+ * `NULL` if an existing own property was assigned, or the shape to transition
+ * to if a new property was added.
+ *
+ * `name` isn't a GC root. Owned strings get a new value on each GC run, and
+ * ropes and atoms might be freed and reused, so if `name` is an owned string,
+ * a rope or an atom, the entry is valid only while `epoch` matches
+ * `v7->ic_epoch` (which is bumped by GC). Other kinds of strings are stable.
+ */
+struct v7_prop_ic {
+  uint32_t key; /* Offset of the instruction + 1, 0 for unused entry */
+  uint32_t epoch;
+  val_t name;
+  struct v7_shape *shape;
+  struct v7_shape *holder;
+  uint16_t pos; /* Slot of the property in the holder */
 };
 
 /*
@@ -3149,6 +3285,9 @@ int v7_is_string(v7_val_t v);
  * Short JS strings are embedded inside the `v7_val_t` value itself. This is why
  * a pointer to a `v7_val_t` is required. It also means that the string data
  * will become invalid once that `v7_val_t` value goes out of scope.
+ *
+ * Long strings built by concatenation are kept as ropes and get flattened by
+ * the first call to `v7_get_string_data()`.
  */
 const char *v7_get_string_data(struct v7 *v7, v7_val_t *v, size_t *len);
 
@@ -3192,10 +3331,108 @@ const char *v7_to_cstring(struct v7 *v7, v7_val_t *v);
  */
 #define _V7_STRING_BUF_RESERVE 500
 
+/*
+ * Concatenations yielding strings shorter than this are performed eagerly,
+ * longer ones produce a rope.
+ */
+#ifndef V7_ROPE_MIN_LEN
+#define V7_ROPE_MIN_LEN 64
+#endif
+
+/*
+ * Max nesting of ropes along right children. Ropes are traversed iteratively
+ * along left children and recursively along right ones, so this bounds the
+ * C stack usage of flattening and GC marking.
+ */
+#ifndef V7_ROPE_MAX_DEPTH
+#define V7_ROPE_MAX_DEPTH 32
+#endif
+
+/* Initial number of buckets in the atom table, must be a power of two */
+#ifndef V7_ATOMS_INITIAL_SIZE
+#define V7_ATOMS_INITIAL_SIZE 64
+#endif
+
+/*
+ * Max number of rope nodes a rope can reference before it gets flattened.
+ * Keeps the number of small strings kept alive by ropes, and thus the cost
+ * of GC, under control.
+ */
+#ifndef V7_ROPE_MAX_NODES
+#define V7_ROPE_MAX_NODES 256
+#endif
+
+/*
+ * Rope string: the deferred concatenation of `left` and `right` strings,
+ * either of which can be a rope itself.
+ *
+ * A rope is flattened the first time its contents are needed (e.g. by
+ * `v7_get_string_data()`): the result is cached in `flat`, and `left` and
+ * `right` are released.
+ *
+ * NOTE: `flat` must be the first field: GC uses the first word of the cell
+ * as a mark word.
+ */
+struct v7_rope {
+  char *flat; /* NUL-terminated contents, or NULL if not flattened yet */
+  val_t left;
+  val_t right;
+  size_t len;
+  uint16_t nodes;      /* Number of referenced ropes, 0 if flattened */
+  unsigned char depth; /* Nesting along right children, 0 if flattened */
+  unsigned char old;   /* True if the rope survived a GC */
+};
+
+/*
+ * Atom: an interned string (`V7_TAG_STRING_A`).
+ *
+ * Property names and identifier literals are interned in a per-instance hash
+ * table, so that equal names share the same `val_t` and property lookup can
+ * compare names by value instead of by contents. Atoms are malloc-ed outside
+ * of `owned_strings` and are reclaimed by a major GC once nothing refers to
+ * them.
+ */
+struct v7_atom {
+  struct v7_atom *next; /* Next atom in the same bucket */
+  uint32_t hash;
+  unsigned char marked;
+  size_t len;
+  char s[1]; /* NUL-terminated contents */
+};
+
 #if defined(__cplusplus)
 extern "C" {
 #endif /* __cplusplus */
 
+V7_PRIVATE int is_rope(val_t v);
+V7_PRIVATE struct v7_rope *to_rope(val_t v);
+V7_PRIVATE void rope_destructor(struct v7 *v7, void *ptr);
+
+V7_PRIVATE int is_atom(val_t v);
+V7_PRIVATE struct v7_atom *to_atom(val_t v);
+
+/*
+ * Returns the canonical value of the string `p`, `len` if it exists: an
+ * inlined string, an atom or a dictionary string. Returns `V7_UNDEFINED`
+ * if the string was never interned.
+ */
+V7_PRIVATE val_t v7_find_atom(struct v7 *v7, const char *p, size_t len);
+
+/*
+ * Returns the canonical value of the string `p`, `len`, interning it if
+ * needed.
+ */
+V7_PRIVATE val_t v7_mk_atom(struct v7 *v7, const char *p, size_t len);
+
+/*
+ * Interns an owned or rope string `v`; other strings are returned as is.
+ */
+V7_PRIVATE val_t v7_intern_string(struct v7 *v7, val_t v);
+
+/* Frees atoms not marked by the last GC and clears the marks */
+V7_PRIVATE void atoms_sweep(struct v7 *v7);
+V7_PRIVATE void atoms_destroy(struct v7 *v7);
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err v7_char_code_at(struct v7 *v7, v7_val_t s, v7_val_t at,
                                        double *res);
@@ -3428,6 +3665,17 @@ V7_PRIVATE struct v7_property *v7_get_own_property2(struct v7 *v7, val_t obj,
                                                     size_t len,
                                                     v7_prop_attr_t attrs);
 
+/*
+ * Like `v7_get_own_property2()`, but takes in addition the canonical value of
+ * the name, as returned by `v7_find_atom()`, so that it's computed just once
+ * when looking up the same name in several objects.
+ */
+V7_PRIVATE struct v7_property *v7_get_own_property_key(struct v7 *v7,
+                                                       val_t obj, val_t key,
+                                                       const char *name,
+                                                       size_t len,
+                                                       v7_prop_attr_t attrs);
+
 V7_PRIVATE struct v7_property *v7_get_own_property(struct v7 *v7, val_t obj,
                                                    const char *name,
                                                    size_t len);
@@ -3456,6 +3704,46 @@ V7_PRIVATE enum v7_err v7_get_throwing_v(struct v7 *v7, v7_val_t obj,
 
 V7_PRIVATE void v7_destroy_property(struct v7_property **p);
 
+/*
+ * Creates the root of the shape tree, see `struct v7_shape`. If it fails,
+ * all objects will just be created in dictionary mode.
+ */
+V7_PRIVATE void shapes_init(struct v7 *v7);
+
+/* Frees the whole shape tree */
+V7_PRIVATE void shapes_destroy(struct v7 *v7);
+
+/*
+ * Moves the object to dictionary mode. Must be called before manipulating
+ * object's property list directly, i.e. not via `def_property()` and friends.
+ */
+V7_PRIVATE void obj_drop_shape(struct v7_object *obj);
+
+/*
+ * Moves a shaped object to the child `shape` of its shape, the one which
+ * adds the property `p` just prepended to its list. `shape` may be `NULL`:
+ * then the object goes to dictionary mode.
+ */
+V7_PRIVATE void obj_set_shape(struct v7_generic_object *o,
+                              struct v7_shape *shape, struct v7_property *p);
+
+/*
+ * Like `v7_get_throwing_v()`, but uses (and fills) the given inline cache
+ * entry. `ic` may be `NULL`.
+ */
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err v7_get_throwing_ic(struct v7 *v7, struct v7_prop_ic *ic,
+                                          v7_val_t obj, v7_val_t name,
+                                          v7_val_t *res);
+
+/*
+ * Like `set_property_v()` with a string `name`, but uses (and fills) the given
+ * inline cache entry. `ic` may be `NULL`.
+ */
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err set_property_ic(struct v7 *v7, struct v7_prop_ic *ic,
+                                       val_t obj, val_t name, val_t val);
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err v7_invoke_setter(struct v7 *v7, struct v7_property *prop,
                                         val_t obj, val_t val);
@@ -3535,6 +3823,13 @@ V7_PRIVATE val_t obj_prototype_v(struct v7 *v7, val_t obj);
 
 V7_PRIVATE int is_prototype_of(struct v7 *v7, val_t o, val_t p);
 
+/*
+ * Returns the `prototype` property of the constructor `func`. For functions
+ * created by `bind()` it's the one of the target function: they are
+ * constructed and checked by `instanceof` as the target (ES5 15.3.4.5).
+ */
+V7_PRIVATE val_t ctor_prototype(struct v7 *v7, val_t func);
+
 #endif /* CS_V7_SRC_OBJECT_H_ */
 #ifdef V7_MODULE_LINES
 #line 1 "./v7/src/exec_public.h"
@@ -3597,6 +3892,32 @@ enum v7_err v7_parse_json(struct v7 *v7, const char *str, v7_val_t *res);
 WARN_UNUSED_RESULT
 enum v7_err v7_parse_json_file(struct v7 *v7, const char *path, v7_val_t *res);
 
+/*
+ * Incremental JSON parser, for JSON text which arrives in chunks, e.g. from
+ * the network. Chunks are fed to `v7_json_parser_feed()` as they come, and
+ * the value is built while parsing, so the text never has to be kept as a
+ * whole. When the text is over, `v7_json_parser_finish()` yields the value.
+ *
+ * Both functions return `V7_SYNTAX_ERROR` (and throw `SyntaxError`) if the
+ * text is not a valid JSON. The parser must be freed with
+ * `v7_json_parser_destroy()`.
+ *
+ * Chunks must not point into the data of a JS string: it may move while the
+ * parser creates values.
+ */
+struct v7_json_parser;
+
+struct v7_json_parser *v7_json_parser_create(struct v7 *v7);
+
+WARN_UNUSED_RESULT
+enum v7_err v7_json_parser_feed(struct v7_json_parser *jp, const char *buf,
+                                size_t len);
+
+WARN_UNUSED_RESULT
+enum v7_err v7_json_parser_finish(struct v7_json_parser *jp, v7_val_t *res);
+
+void v7_json_parser_destroy(struct v7_json_parser *jp);
+
 /*
  * Compile JavaScript code `js_code` into the byte code and write generated
  * byte code into opened file stream `fp`. If `generate_binary_output` is 0,
@@ -3739,10 +4060,59 @@ void v7_array_del(struct v7 *v7, v7_val_t arr, unsigned long index);
 extern "C" {
 #endif /* __cplusplus */
 
+/*
+ * Backing store of a dense array, kept in its hidden property. Elements removed
+ * from the front by `shift()` are not moved right away: the first `head`
+ * slots of `vals` are dead, and are reclaimed once they outnumber the live
+ * ones, or reused by `unshift()`.
+ */
+struct v7_dense_array {
+  struct mbuf vals;
+  size_t head;
+  struct v7 *v7; /* To make element names in `v7_next_prop()` */
+};
+
+#define DENSE_ARRAY_VALS(da) ((val_t *) (da)->vals.buf + (da)->head)
+#define DENSE_ARRAY_LEN(da) ((da)->vals.len / sizeof(val_t) - (da)->head)
+
+/*
+ * The largest index which can be set in a dense array of length `len`: the
+ * ones beyond would leave too many missing elements, so the array is made
+ * ordinary first
+ */
+#define DENSE_ARRAY_MAX_INDEX(len) (2 * (len) + 64)
+
 V7_PRIVATE v7_val_t v7_mk_dense_array(struct v7 *v7);
 V7_PRIVATE val_t
 v7_array_get2(struct v7 *v7, v7_val_t arr, unsigned long index, int *has);
 
+/*
+ * Returns backing store of a dense array, or NULL if the array has no
+ * elements yet
+ */
+V7_PRIVATE struct v7_dense_array *v7_to_dense_array(struct v7 *v7,
+                                                    v7_val_t arr);
+
+/* Removes `n` leading elements from the backing store of a dense array */
+V7_PRIVATE void dense_array_shift(struct v7_dense_array *da, size_t n);
+
+/* Makes room for `n` leading elements in the backing store of a dense array */
+V7_PRIVATE void dense_array_unshift(struct v7_dense_array *da, size_t n);
+
+/*
+ * Returns 1 and stores the index in `res` if `name` is an array index: a
+ * decimal number less than 2^32 - 1 without leading zeros. Returns 0
+ * otherwise.
+ */
+V7_PRIVATE int cstr_to_array_index(const char *name, size_t len,
+                                   unsigned long *res);
+
+/*
+ * Turns a dense array into an ordinary one, moving its elements to the
+ * property list. Does nothing for other objects.
+ */
+V7_PRIVATE void dense_array_to_sparse(struct v7 *v7, v7_val_t arr);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -4718,7 +5088,7 @@ V7_PRIVATE void release_ast(struct v7 *, struct ast *);
 #ifndef CS_V7_SRC_BCODE_H_
 #define CS_V7_SRC_BCODE_H_
 
-#define BIN_BCODE_SIGNATURE "V\007BCODE:"
+#define BIN_BCODE_SIGNATURE "V\011BCODE:"
 
 #if !defined(V7_NAMES_CNT_WIDTH)
 #define V7_NAMES_CNT_WIDTH 10
@@ -4988,6 +5358,23 @@ enum opcode {
    */
   OP_SAFE_GET_VAR,
 
+  /*
+   * Takes a varint argument -- index of the frame slot of a function local
+   * (see `bcode::uses_slots`), and pushes the value of that slot onto the
+   * stack.
+   *
+   * `( -- a )`
+   */
+  OP_GET_LOCAL,
+  /*
+   * Takes 1 value from the stack and a varint argument -- index of the frame
+   * slot of a function local. Stores the value in the slot and pushes it back
+   * to the stack.
+   *
+   * `( a -- a )`
+   */
+  OP_SET_LOCAL,
+
   /*
    * ==== Jumps
    *
@@ -5235,6 +5622,54 @@ enum opcode {
    */
   OP_EXIT_CATCH,
 
+  /*
+   * ==== Superinstructions
+   *
+   * The compiler emits these in place of the first opcode of a frequent
+   * sequence of instructions (see `bcode_op()`). The rest of the sequence is
+   * left intact: a superinstruction performs the whole sequence at once and
+   * skips it, while a jump into the middle of the sequence still executes
+   * the original instructions.
+   */
+
+  /*
+   * Replaces `PUSH_LIT` in `PUSH_LIT name; GET`.
+   *
+   * `( a -- a.name )`
+   */
+  OP_GET_PROP,
+  /*
+   * Replaces `GET_VAR` in `GET_VAR var; PUSH_LIT name; GET`.
+   *
+   * `( -- var.name )`
+   */
+  OP_GET_VAR_PROP,
+  /*
+   * Replaces `GET_LOCAL` in `GET_LOCAL slot; PUSH_LIT name; GET`.
+   *
+   * `( -- slot.name )`
+   */
+  OP_GET_LOCAL_PROP,
+  /*
+   * Replaces `DUP` in `DUP; JMP_FALSE` and `DUP; JMP_TRUE`: performs the jump
+   * without popping the value.
+   *
+   * `( a -- a )`
+   */
+  OP_DUP_JMP,
+  /*
+   * Replaces a comparison followed by `JMP_FALSE` or `JMP_TRUE`: the result of
+   * the comparison isn't pushed onto the stack.
+   *
+   * `( a b -- )`
+   */
+  OP_LT_JMP,
+  OP_LE_JMP,
+  OP_GT_JMP,
+  OP_GE_JMP,
+  OP_EQ_EQ_JMP,
+  OP_NE_NE_JMP,
+
   OP_MAX,
 };
 
@@ -5266,6 +5701,13 @@ struct bcode {
   /* Literal table */
   struct v7_vec lit;
 
+  /*
+   * Inline caches of `OP_GET` / `OP_SET` instructions, allocated lazily on
+   * the first property access; direct-mapped by the instruction offset,
+   * `(1 << ic_bits)` entries.
+   */
+  struct v7_prop_ic *ic;
+
   /* Reference count */
   uint8_t refcnt;
 
@@ -5286,6 +5728,20 @@ struct bcode {
   unsigned int ops_in_rom : 1;
   /* Set for deserialized bcode. Used for metrics only */
   unsigned int deserialized : 1;
+  /* Log2 of the number of entries in `ic` */
+  unsigned int ic_bits : 3;
+  /*
+   * If set, the function keeps its names in stack slots instead of a scope
+   * object: slot `i` holds the value of the name `i`, and the slot
+   * `names_cnt` holds the `arguments` array. Set by the compiler for
+   * functions which have neither nested functions nor `eval` or `with`.
+   */
+  unsigned int uses_slots : 1;
+  /*
+   * If set, the function might refer to its `arguments` object, so it has to
+   * be created on each call.
+   */
+  unsigned int uses_arguments : 1;
 };
 
 /*
@@ -5298,8 +5754,17 @@ struct bcode_builder {
 
   struct mbuf ops; /* names + instruction opcode */
   struct mbuf lit; /* literal table */
+
+  /*
+   * Offsets of the last and the last-but-one emitted opcodes, or
+   * `BCODE_NO_OP`. Used to emit superinstructions, see `bcode_op()`.
+   */
+  bcode_off_t last_op;
+  bcode_off_t prev_op;
 };
 
+#define BCODE_NO_OP ((bcode_off_t) ~0)
+
 enum bcode_ser_lit_tag {
   BCODE_SER_NUMBER,
   BCODE_SER_STRING,
@@ -5317,6 +5782,12 @@ V7_PRIVATE void bcode_free(struct v7 *v7, struct bcode *bcode);
 V7_PRIVATE void release_bcode(struct v7 *v7, struct bcode *bcode);
 V7_PRIVATE void retain_bcode(struct v7 *v7, struct bcode *bcode);
 
+/*
+ * Returns inline cache entry for the instruction at `op` (which should point
+ * into `bcode->ops`), or `NULL` if the bcode can't have inline caches.
+ */
+V7_PRIVATE struct v7_prop_ic *bcode_get_ic(struct bcode *bcode, const char *op);
+
 #ifndef V7_NO_FS
 /*
  * Serialize a bcode structure.
@@ -5612,15 +6083,22 @@ extern "C" {
 V7_PRIVATE struct v7_generic_object *new_generic_object(struct v7 *);
 V7_PRIVATE struct v7_property *new_property(struct v7 *);
 V7_PRIVATE struct v7_js_function *new_function(struct v7 *);
+V7_PRIVATE struct v7_rope *new_rope(struct v7 *);
 
 V7_PRIVATE void gc_mark(struct v7 *, val_t);
 
 V7_PRIVATE void gc_arena_init(struct gc_arena *, size_t, size_t, size_t,
                               const char *);
 V7_PRIVATE void gc_arena_destroy(struct v7 *, struct gc_arena *a);
-V7_PRIVATE void gc_sweep(struct v7 *, struct gc_arena *, size_t);
+V7_PRIVATE size_t gc_sweep(struct v7 *, struct gc_arena *, size_t);
 V7_PRIVATE void *gc_alloc_cell(struct v7 *, struct gc_arena *);
 
+/*
+ * Has to be called after a value is stored into the given object (its
+ * property, its prototype, etc), see `gc_minor()`.
+ */
+V7_PRIVATE void gc_write_barrier(struct v7 *, struct v7_object *);
+
 V7_PRIVATE struct gc_tmp_frame new_tmp_frame(struct v7 *);
 V7_PRIVATE void tmp_frame_cleanup(struct gc_tmp_frame *);
 V7_PRIVATE void tmp_stack_push(struct gc_tmp_frame *, val_t *);
@@ -5674,6 +6152,12 @@ extern "C" {
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err eval_bcode(struct v7 *v7, struct bcode *bcode);
 
+/*
+ * Creates a dense array of `cnt` values of the data stack, starting at the
+ * index `idx` (counting from the bottom of the stack).
+ */
+V7_PRIVATE v7_val_t stack_to_array(struct v7 *v7, size_t idx, size_t cnt);
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err b_apply(struct v7 *v7, v7_val_t func, v7_val_t this_obj,
                                v7_val_t args, uint8_t is_constructor,
@@ -5895,6 +6379,13 @@ WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err std_eval(struct v7 *v7, v7_val_t arg, v7_val_t this_obj,
                                 int is_json, v7_val_t *res);
 
+/*
+ * Parses JSON text `buf` of `len` bytes into `res`, see `v7_json_parser`.
+ */
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err json_parse(struct v7 *v7, const char *buf, size_t len,
+                                  v7_val_t *res);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -11992,6 +12483,8 @@ static const char *op_names[] = {
   "SET_VAR",
   "GET_VAR",
   "SAFE_GET_VAR",
+  "GET_LOCAL",
+  "SET_LOCAL",
   "JMP",
   "JMP_TRUE",
   "JMP_FALSE",
@@ -12017,6 +12510,16 @@ static const char *op_names[] = {
   "CONTINUE",
   "ENTER_CATCH",
   "EXIT_CATCH",
+  "GET_PROP",
+  "GET_VAR_PROP",
+  "GET_LOCAL_PROP",
+  "DUP_JMP",
+  "LT_JMP",
+  "LE_JMP",
+  "GT_JMP",
+  "GE_JMP",
+  "EQ_EQ_JMP",
+  "NE_NE_JMP",
 };
 /* clang-format on */
 
@@ -12051,6 +12554,7 @@ V7_PRIVATE void bcode_builder_init(struct v7 *v7,
   memset(bbuilder, 0x00, sizeof(*bbuilder));
   bbuilder->v7 = v7;
   bbuilder->bcode = bcode;
+  bbuilder->last_op = bbuilder->prev_op = BCODE_NO_OP;
 
   mbuf_init(&bbuilder->ops, 0);
   mbuf_init(&bbuilder->lit, 0);
@@ -12085,12 +12589,19 @@ V7_PRIVATE void dump_op(struct v7 *v7, FILE *f, struct bcode *bcode,
     case OP_PUSH_LIT:
     case OP_SAFE_GET_VAR:
     case OP_GET_VAR:
-    case OP_SET_VAR: {
+    case OP_SET_VAR:
+    case OP_GET_PROP:
+    case OP_GET_VAR_PROP: {
       size_t idx = bcode_get_varint(&p);
       fprintf(f, "(%lu): ", (unsigned long) idx);
       v7_fprint(f, v7, ((val_t *) bcode->lit.p)[idx]);
       break;
     }
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL_PROP:
+      fprintf(f, "(%lu)", (unsigned long) bcode_get_varint(&p));
+      break;
     case OP_CALL:
     case OP_NEW:
       p++;
@@ -12158,6 +12669,10 @@ V7_PRIVATE void bcode_free(struct v7 *v7, struct bcode *bcode) {
   free(bcode->lit.p);
   memset(&bcode->lit, 0x00, sizeof(bcode->lit));
 
+  free(bcode->ic);
+  bcode->ic = NULL;
+  bcode->ic_bits = 0;
+
   bcode->refcnt = 0;
 }
 
@@ -12181,7 +12696,100 @@ V7_PRIVATE void release_bcode(struct v7 *v7, struct bcode *b) {
   }
 }
 
+V7_PRIVATE struct v7_prop_ic *bcode_get_ic(struct bcode *bcode,
+                                           const char *op) {
+  uint32_t key = (uint32_t)(op - bcode->ops.p) + 1;
+  struct v7_prop_ic *ic;
+
+  if (bcode->frozen) {
+    return NULL;
+  }
+
+  if (bcode->ic == NULL) {
+    /* Roughly one entry per 32 bytes of code, between 2 and 32 entries */
+    size_t bits = 1;
+    while (bits < 5 && ((size_t) 32 << bits) < bcode->ops.len) {
+      bits++;
+    }
+    bcode->ic = (struct v7_prop_ic *) calloc(1 << bits, sizeof(*bcode->ic));
+    if (bcode->ic == NULL) {
+      return NULL;
+    }
+    bcode->ic_bits = bits;
+  }
+
+  ic = &bcode->ic[key & ((1 << bcode->ic_bits) - 1)];
+  if (ic->key != key) {
+    memset(ic, 0x00, sizeof(*ic));
+    ic->key = key;
+  }
+  return ic;
+}
+
+#ifndef V7_DISABLE_SUPERINSTRUCTIONS
+/*
+ * Peephole optimizer: if `op` completes one of the frequent sequences of
+ * instructions, replaces the opcode of the first instruction of the sequence
+ * with the corresponding superinstruction (see `enum opcode`).
+ */
+static void bcode_fuse(struct bcode_builder *bbuilder, uint8_t op) {
+  uint8_t *last, *prev = NULL;
+
+  if (bbuilder->last_op == BCODE_NO_OP) {
+    return;
+  }
+  last = (uint8_t *) bbuilder->ops.buf + bbuilder->last_op;
+  if (bbuilder->prev_op != BCODE_NO_OP) {
+    prev = (uint8_t *) bbuilder->ops.buf + bbuilder->prev_op;
+  }
+
+  switch (op) {
+    case OP_GET:
+      if (*last == OP_PUSH_LIT) {
+        *last = OP_GET_PROP;
+        if (prev != NULL && *prev == OP_GET_VAR) {
+          *prev = OP_GET_VAR_PROP;
+        } else if (prev != NULL && *prev == OP_GET_LOCAL) {
+          *prev = OP_GET_LOCAL_PROP;
+        }
+      }
+      break;
+    case OP_JMP_FALSE:
+    case OP_JMP_TRUE:
+      switch (*last) {
+        case OP_DUP:
+          *last = OP_DUP_JMP;
+          break;
+        case OP_LT:
+          *last = OP_LT_JMP;
+          break;
+        case OP_LE:
+          *last = OP_LE_JMP;
+          break;
+        case OP_GT:
+          *last = OP_GT_JMP;
+          break;
+        case OP_GE:
+          *last = OP_GE_JMP;
+          break;
+        case OP_EQ_EQ:
+          *last = OP_EQ_EQ_JMP;
+          break;
+        case OP_NE_NE:
+          *last = OP_NE_NE_JMP;
+          break;
+      }
+      break;
+  }
+}
+#endif
+
 V7_PRIVATE void bcode_op(struct bcode_builder *bbuilder, uint8_t op) {
+#ifndef V7_DISABLE_SUPERINSTRUCTIONS
+  bcode_fuse(bbuilder, op);
+#endif
+  bbuilder->prev_op = bbuilder->last_op;
+  bbuilder->last_op = bbuilder->ops.len;
   bcode_ops_append(bbuilder, &op, 1);
 }
 
@@ -12279,9 +12887,10 @@ bcode_decode_lit(struct v7 *v7, struct bcode *bcode, char **ops) {
     case BCODE_INLINE_STRING_TYPE_TAG: {
       val_t res;
       size_t len = bcode_get_varint(ops);
-      res = v7_mk_string(
-          v7, (const char *) *ops + 1 /*skip BCODE_INLINE_STRING_TYPE_TAG*/,
-          len, !bcode->ops_in_rom);
+      const char *p = (const char *) *ops + 1 /*skip the type tag*/;
+      /* Strings in ROM are used as is, others are interned */
+      res = bcode->ops_in_rom ? v7_mk_string(v7, p, len, 0)
+                              : v7_mk_atom(v7, p, len);
       *ops += len + 1;
       return res;
       break;
@@ -12430,6 +13039,18 @@ V7_PRIVATE enum v7_err bcode_add_name(struct bcode_builder *bbuilder,
   /* reserve space in `ops` buffer */
   mbuf_insert(&bbuilder->ops, ops_index, NULL, llen + len + 1 /*null-term*/);
 
+  /* keep track of the last emitted opcodes, see `bcode_op()` */
+  if (ops_index == bbuilder->ops.len - (llen + len + 1)) {
+    bbuilder->last_op = bbuilder->prev_op = BCODE_NO_OP;
+  } else {
+    if (bbuilder->last_op != BCODE_NO_OP && bbuilder->last_op >= ops_index) {
+      bbuilder->last_op += llen + len + 1;
+    }
+    if (bbuilder->prev_op != BCODE_NO_OP && bbuilder->prev_op >= ops_index) {
+      bbuilder->prev_op += llen + len + 1;
+    }
+  }
+
   {
     char *ops = bbuilder->ops.buf + ops_index;
 
@@ -12612,6 +13233,12 @@ static void bcode_serialize_func(struct v7 *v7, struct bcode *bcode,
   /* names_cnt */
   bcode_serialize_varint(bcode->names_cnt, out);
 
+  /* uses_slots */
+  bcode_serialize_varint(bcode->uses_slots, out);
+
+  /* uses_arguments */
+  bcode_serialize_varint(bcode->uses_arguments, out);
+
   /*
    * bcode:
    * <varint> // opcodes length
@@ -12700,6 +13327,12 @@ static const char *bcode_deserialize_func(struct v7 *v7, struct bcode *bcode,
   /* get number of names */
   bcode->names_cnt = bcode_deserialize_varint(&data);
 
+  /* get the frame slots flag */
+  bcode->uses_slots = bcode_deserialize_varint(&data);
+
+  /* get the `arguments` flag */
+  bcode->uses_arguments = bcode_deserialize_varint(&data);
+
   /* get opcode size */
   size = bcode_deserialize_varint(&data);
 
@@ -12839,6 +13472,36 @@ V7_STATIC_ASSERT((sizeof(bcode_off_t) * 8) == LBLOCK_OFFSET_WIDTH,
 #define TOS() stack_tos(&v7->stack)
 #define SP() stack_sp(&v7->stack)
 
+/*
+ * Direct-threaded dispatch: if the compiler supports computed goto, handlers
+ * of the most frequent instructions end with `NEXT_OP`, which jumps straight
+ * to the handler of the next instruction instead of going back through the
+ * main loop and the `switch`. Otherwise `NEXT_OP` is just
+ * `break`, and the `switch` is used for all instructions.
+ */
+#if defined(__GNUC__) && !defined(V7_BCODE_TRACE) && \
+    !defined(V7_DISABLE_COMPUTED_GOTO)
+#define V7_COMPUTED_GOTO
+#endif
+
+#ifdef V7_COMPUTED_GOTO
+#define CASE(op) \
+  case op:       \
+  lbl_##op
+#define NEXT_OP                            \
+  do {                                     \
+    r.ops++;                               \
+    if (r.ops < r.end && !v7->need_gc) {   \
+      op = (enum opcode) * r.ops;          \
+      goto *dispatch_table[op];            \
+    }                                      \
+    goto restart;                          \
+  } while (0)
+#else
+#define CASE(op) case op
+#define NEXT_OP break
+#endif
+
 /*
  * Local-to-function block types that we might want to consider when unwinding
  * stack for whatever reason. see `unwind_local_blocks_stack()`.
@@ -12895,12 +13558,38 @@ V7_PRIVATE int stack_sp(struct mbuf *s) {
 }
 
 /*
- * Delete a property with name `name`, `len` from an object `obj`. If the
- * object does not contain own property with the given `name`, moves to `obj`'s
- * prototype, and so on.
- *
- * If the property is eventually found, it is deleted, and `0` is returned.
- * Otherwise, `-1` is returned.
+ * Returns a pointer to the `idx`-th value of the stack, counting from the
+ * bottom. The pointer is invalidated by the next `stack_push()`.
+ */
+static val_t *stack_ptr(struct mbuf *s, size_t idx) {
+  assert(idx * sizeof(val_t) < s->len);
+  return (val_t *) s->buf + idx;
+}
+
+V7_PRIVATE val_t stack_to_array(struct v7 *v7, size_t idx, size_t cnt) {
+  val_t arr = v7_mk_dense_array(v7);
+  size_t i;
+  for (i = 0; i < cnt; i++) {
+    v7_array_push(v7, arr, *stack_ptr(&v7->stack, idx + i));
+  }
+  return arr;
+}
+
+/*
+ * Returns a pointer to the frame slot `idx` of the current function, see
+ * `bcode::uses_slots`. The pointer is invalidated by the next `PUSH()`.
+ */
+static val_t *bcode_local(struct v7 *v7, size_t idx) {
+  return stack_ptr(&v7->stack, v7->locals_base + idx);
+}
+
+/*
+ * Delete a property with name `name`, `len` from an object `obj`. If the
+ * object does not contain own property with the given `name`, moves to `obj`'s
+ * prototype, and so on.
+ *
+ * If the property is eventually found, it is deleted, and `0` is returned.
+ * Otherwise, `-1` is returned.
  *
  * If `len` is -1/MAXUINT/~0, then `name` must be 0-terminated.
  *
@@ -13041,6 +13730,22 @@ static bcode_off_t bcode_get_target(char **ops) {
   return target;
 }
 
+/*
+ * Finishes a fused `<cond>; JMP_TRUE` or `<cond>; JMP_FALSE` pair. `*ops`
+ * points at the last byte of the first instruction; on return it points at
+ * the last byte of the jump, or right before its target if the jump is taken.
+ */
+static void bcode_fused_jmp(struct bcode *bcode, char **ops, int cond) {
+  bcode_off_t target;
+  int jmp_if;
+  (*ops)++;
+  jmp_if = (enum opcode) **ops == OP_JMP_TRUE;
+  target = bcode_get_target(ops);
+  if (!!cond == jmp_if) {
+    *ops = bcode->ops.p + target - 1;
+  }
+}
+
 struct bcode_registers {
   struct bcode *bcode;
   char *ops;
@@ -13122,6 +13827,9 @@ static struct v7_call_frame *bcode_create_call_frame(
 
     /* is constructor */
     call_frame->is_constructor = v7->is_constructor;
+
+    /* frame slots of the caller */
+    call_frame->locals_base = v7->locals_base;
   } else {
     /*
      * No bcode registers is provided: assume it's not going to change, and
@@ -13140,6 +13848,9 @@ static struct v7_call_frame *bcode_create_call_frame(
  * TODO(mkm): put this state on a return stack
  *
  * Caller of bcode_perform_call is responsible for owning `call_frame`
+ *
+ * If `scope_frame` is `undefined`, the function keeps its names in frame
+ * slots (see `bcode::uses_slots`) and runs directly in the function's scope.
  */
 static enum v7_err bcode_perform_call(struct v7 *v7, v7_val_t scope_frame,
                                       struct v7_js_function *func,
@@ -13155,9 +13866,13 @@ static enum v7_err bcode_perform_call(struct v7 *v7, v7_val_t scope_frame,
   v7->vals.this_object = this_object;
   v7->is_constructor = is_constructor;
 
-  /* new scope_frame will inherit from the function's scope */
-  obj_prototype_set(v7, v7_to_object(scope_frame), &func->scope->base);
-  v7->vals.scope = scope_frame;
+  if (v7_is_undefined(scope_frame)) {
+    v7->vals.scope = v7_object_to_value(&func->scope->base);
+  } else {
+    /* new scope_frame will inherit from the function's scope */
+    obj_prototype_set(v7, v7_to_object(scope_frame), &func->scope->base);
+    v7->vals.scope = scope_frame;
+  }
   v7->call_stack = call_frame;
   bcode_restore_registers(v7, func->bcode, r);
 
@@ -13204,6 +13919,9 @@ static uint8_t unwind_stack_1level(struct v7 *v7, struct bcode_registers *r) {
 
     /* restore `is_constructor` */
     v7->is_constructor = v7->call_stack->is_constructor;
+
+    /* restore frame slots of the caller */
+    v7->locals_base = v7->call_stack->locals_base;
   }
 
   /* adjust data stack length (restore saved) */
@@ -13572,6 +14290,7 @@ static val_t bcode_instantiate_function(struct v7 *v7, val_t func) {
      */
     res = func;
     f->scope = v7_to_generic_object(v7->vals.scope);
+    gc_write_barrier(v7, &f->base);
   }
 
   return res;
@@ -13580,27 +14299,41 @@ static val_t bcode_instantiate_function(struct v7 *v7, val_t func) {
 /**
  * Call C function `func` with given `this_object` and array of arguments
  * `args`. `func` should be a C function pointer, not C function object.
+ *
+ * If `args` is `undefined`, the arguments are `argc` values on the data stack
+ * starting at index `args_base`; they are not copied anywhere unless the
+ * function asks for the whole `arguments` array.
  */
 static enum v7_err call_cfunction(struct v7 *v7, val_t func, val_t this_object,
-                                  val_t args, uint8_t is_constructor,
+                                  val_t args, size_t args_base,
+                                  unsigned long argc, uint8_t is_constructor,
                                   val_t *res) {
   enum v7_err rcode = V7_OK;
   uint8_t saved_inhibit_gc = v7->inhibit_gc;
+  uint8_t saved_is_constructor = v7->is_constructor;
   val_t saved_this = v7->vals.this_object;
   val_t saved_arguments = v7->vals.arguments;
+  val_t saved_callee = v7->vals.callee;
+  size_t saved_args_base = v7->args_base;
+  unsigned long saved_argc = v7->argc;
   struct gc_tmp_frame tf = new_tmp_frame(v7);
 
   *res = v7_mk_undefined();
 
   tmp_stack_push(&tf, &saved_this);
   tmp_stack_push(&tf, &saved_arguments);
+  tmp_stack_push(&tf, &saved_callee);
 
   /*
-   * prepare cfunction environment: `this`, `arguments`.
+   * prepare cfunction environment: `this`, `arguments`, callee.
    */
   v7->vals.this_object = this_object;
   v7->inhibit_gc = 1;
   v7->vals.arguments = args;
+  v7->vals.callee = func;
+  v7->args_base = args_base;
+  v7->argc = argc;
+  v7->is_constructor = is_constructor;
 
   /* call C function */
   rcode = to_cfunction(v7, func)(v7, res);
@@ -13616,7 +14349,11 @@ static enum v7_err call_cfunction(struct v7 *v7, val_t func, val_t this_object,
 clean:
   v7->vals.this_object = saved_this;
   v7->vals.arguments = saved_arguments;
+  v7->vals.callee = saved_callee;
+  v7->args_base = saved_args_base;
+  v7->argc = saved_argc;
   v7->inhibit_gc = saved_inhibit_gc;
+  v7->is_constructor = saved_is_constructor;
 
   tmp_frame_cleanup(&tf);
   return rcode;
@@ -13733,6 +14470,98 @@ V7_PRIVATE enum v7_err eval_bcode(struct v7 *v7, struct bcode *bcode) {
         v3 = v7_mk_undefined(), v4 = v7_mk_undefined(),
         scope_frame = v7_mk_undefined();
   struct gc_tmp_frame tf = new_tmp_frame(v7);
+  enum opcode op;
+
+#ifdef V7_COMPUTED_GOTO
+  /* clang-format off */
+  static const void *const dispatch_table[OP_MAX] = {
+      &&lbl_OP_DROP,
+      &&lbl_OP_DUP,
+      &&lbl_OP_2DUP,
+      &&lbl_OP_SWAP,
+      &&lbl_OP_STASH,
+      &&lbl_OP_UNSTASH,
+      &&lbl_OP_SWAP_DROP,
+      &&lbl_OP_PUSH_UNDEFINED,
+      &&lbl_OP_PUSH_NULL,
+      &&lbl_OP_PUSH_THIS,
+      &&lbl_OP_PUSH_TRUE,
+      &&lbl_OP_PUSH_FALSE,
+      &&lbl_OP_PUSH_ZERO,
+      &&lbl_OP_PUSH_ONE,
+      &&lbl_OP_PUSH_LIT,
+      &&lbl_OP_NOT,
+      &&lbl_OP_LOGICAL_NOT,
+      &&lbl_OP_NEG,
+      &&lbl_OP_POS,
+      &&lbl_OP_ADD,
+      &&lbl_OP_SUB,
+      &&lbl_OP_REM,
+      &&lbl_OP_MUL,
+      &&lbl_OP_DIV,
+      &&lbl_OP_LSHIFT,
+      &&lbl_OP_RSHIFT,
+      &&lbl_OP_URSHIFT,
+      &&lbl_OP_OR,
+      &&lbl_OP_XOR,
+      &&lbl_OP_AND,
+      &&lbl_OP_EQ_EQ,
+      &&lbl_OP_EQ,
+      &&lbl_OP_NE,
+      &&lbl_OP_NE_NE,
+      &&lbl_OP_LT,
+      &&lbl_OP_LE,
+      &&lbl_OP_GT,
+      &&lbl_OP_GE,
+      &&lbl_OP_INSTANCEOF,
+      &&lbl_OP_TYPEOF,
+      &&lbl_OP_IN,
+      &&lbl_OP_GET,
+      &&lbl_OP_SET,
+      &&lbl_OP_SET_VAR,
+      &&lbl_OP_GET_VAR,
+      &&lbl_OP_SAFE_GET_VAR,
+      &&lbl_OP_GET_LOCAL,
+      &&lbl_OP_SET_LOCAL,
+      &&lbl_OP_JMP,
+      &&lbl_OP_JMP_TRUE,
+      &&lbl_OP_JMP_FALSE,
+      &&lbl_OP_JMP_TRUE_DROP,
+      &&lbl_OP_JMP_IF_CONTINUE,
+      &&lbl_OP_CREATE_OBJ,
+      &&lbl_OP_CREATE_ARR,
+      &&lbl_OP_NEXT_PROP,
+      &&lbl_OP_FUNC_LIT,
+      &&lbl_OP_CALL,
+      &&lbl_OP_NEW,
+      &&lbl_OP_RET,
+      &&lbl_OP_DELETE,
+      &&lbl_OP_DELETE_VAR,
+      &&lbl_OP_TRY_PUSH_CATCH,
+      &&lbl_OP_TRY_PUSH_FINALLY,
+      &&lbl_OP_TRY_PUSH_LOOP,
+      &&lbl_OP_TRY_PUSH_SWITCH,
+      &&lbl_OP_TRY_POP,
+      &&lbl_OP_AFTER_FINALLY,
+      &&lbl_OP_THROW,
+      &&lbl_OP_BREAK,
+      &&lbl_OP_CONTINUE,
+      &&lbl_OP_ENTER_CATCH,
+      &&lbl_OP_EXIT_CATCH,
+      &&lbl_OP_GET_PROP,
+      &&lbl_OP_GET_VAR_PROP,
+      &&lbl_OP_GET_LOCAL_PROP,
+      &&lbl_OP_DUP_JMP,
+      &&lbl_OP_LT_JMP,
+      &&lbl_OP_LE_JMP,
+      &&lbl_OP_GT_JMP,
+      &&lbl_OP_GE_JMP,
+      &&lbl_OP_EQ_EQ_JMP,
+      &&lbl_OP_NE_NE_JMP,
+  };
+  /* clang-format on */
+  assert(dispatch_table[OP_MAX - 1] != NULL);
+#endif
 
   bcode_restore_registers(v7, bcode, &r);
 
@@ -13760,7 +14589,7 @@ V7_PRIVATE enum v7_err eval_bcode(struct v7 *v7, struct bcode *bcode) {
 
 restart:
   while (r.ops < r.end && rcode == V7_OK) {
-    enum opcode op = (enum opcode) * r.ops;
+    op = (enum opcode) * r.ops;
 
     if (v7->need_gc) {
       maybe_gc(v7);
@@ -13776,96 +14605,97 @@ restart:
     }
 #endif
 
+  op_switch:
     switch (op) {
-      case OP_DROP:
+      CASE(OP_DROP):
         POP();
-        break;
-      case OP_DUP:
+        NEXT_OP;
+      CASE(OP_DUP):
         v1 = POP();
         PUSH(v1);
         PUSH(v1);
-        break;
-      case OP_2DUP:
+        NEXT_OP;
+      CASE(OP_2DUP):
         v2 = POP();
         v1 = POP();
         PUSH(v1);
         PUSH(v2);
         PUSH(v1);
         PUSH(v2);
-        break;
-      case OP_SWAP:
+        NEXT_OP;
+      CASE(OP_SWAP):
         v1 = POP();
         v2 = POP();
         PUSH(v1);
         PUSH(v2);
-        break;
-      case OP_STASH:
+        NEXT_OP;
+      CASE(OP_STASH):
         assert(!v7->is_stashed);
         v7->vals.stash = TOS();
         v7->is_stashed = 1;
-        break;
-      case OP_UNSTASH:
+        NEXT_OP;
+      CASE(OP_UNSTASH):
         assert(v7->is_stashed);
         POP();
         PUSH(v7->vals.stash);
         v7->vals.stash = v7_mk_undefined();
         v7->is_stashed = 0;
-        break;
+        NEXT_OP;
 
-      case OP_SWAP_DROP:
+      CASE(OP_SWAP_DROP):
         v1 = POP();
         POP();
         PUSH(v1);
-        break;
+        NEXT_OP;
 
-      case OP_PUSH_UNDEFINED:
+      CASE(OP_PUSH_UNDEFINED):
         PUSH(v7_mk_undefined());
-        break;
-      case OP_PUSH_NULL:
+        NEXT_OP;
+      CASE(OP_PUSH_NULL):
         PUSH(v7_mk_null());
-        break;
-      case OP_PUSH_THIS:
+        NEXT_OP;
+      CASE(OP_PUSH_THIS):
         PUSH(v7_get_this(v7));
-        break;
-      case OP_PUSH_TRUE:
+        NEXT_OP;
+      CASE(OP_PUSH_TRUE):
         PUSH(v7_mk_boolean(1));
-        break;
-      case OP_PUSH_FALSE:
+        NEXT_OP;
+      CASE(OP_PUSH_FALSE):
         PUSH(v7_mk_boolean(0));
-        break;
-      case OP_PUSH_ZERO:
+        NEXT_OP;
+      CASE(OP_PUSH_ZERO):
         PUSH(v7_mk_number(0));
-        break;
-      case OP_PUSH_ONE:
+        NEXT_OP;
+      CASE(OP_PUSH_ONE):
         PUSH(v7_mk_number(1));
-        break;
-      case OP_PUSH_LIT: {
+        NEXT_OP;
+      CASE(OP_PUSH_LIT): {
         PUSH(bcode_decode_lit(v7, r.bcode, &r.ops));
-        break;
+        NEXT_OP;
       }
-      case OP_LOGICAL_NOT:
+      CASE(OP_LOGICAL_NOT):
         v1 = POP();
         PUSH(v7_mk_boolean(!v7_is_truthy(v7, v1)));
-        break;
-      case OP_NOT: {
+        NEXT_OP;
+      CASE(OP_NOT): {
         v1 = POP();
         BTRY(to_number_v(v7, v1, &v1));
         PUSH(v7_mk_number(~(int32_t) v7_to_number(v1)));
         break;
       }
-      case OP_NEG: {
+      CASE(OP_NEG): {
         v1 = POP();
         BTRY(to_number_v(v7, v1, &v1));
         PUSH(v7_mk_number(-v7_to_number(v1)));
         break;
       }
-      case OP_POS: {
+      CASE(OP_POS): {
         v1 = POP();
         BTRY(to_number_v(v7, v1, &v1));
         PUSH(v1);
         break;
       }
-      case OP_ADD: {
+      CASE(OP_ADD): {
         v2 = POP();
         v1 = POP();
 
@@ -13893,18 +14723,18 @@ restart:
           PUSH(v7_mk_number(
               b_num_bin_op(op, v7_to_number(v1), v7_to_number(v2))));
         }
-        break;
+        NEXT_OP;
       }
-      case OP_SUB:
-      case OP_REM:
-      case OP_MUL:
-      case OP_DIV:
-      case OP_LSHIFT:
-      case OP_RSHIFT:
-      case OP_URSHIFT:
-      case OP_OR:
-      case OP_XOR:
-      case OP_AND: {
+      CASE(OP_SUB):
+      CASE(OP_REM):
+      CASE(OP_MUL):
+      CASE(OP_DIV):
+      CASE(OP_LSHIFT):
+      CASE(OP_RSHIFT):
+      CASE(OP_URSHIFT):
+      CASE(OP_OR):
+      CASE(OP_XOR):
+      CASE(OP_AND): {
         v2 = POP();
         v1 = POP();
 
@@ -13913,9 +14743,9 @@ restart:
 
         PUSH(
             v7_mk_number(b_num_bin_op(op, v7_to_number(v1), v7_to_number(v2))));
-        break;
+        NEXT_OP;
       }
-      case OP_EQ_EQ: {
+      CASE(OP_EQ_EQ): {
         v2 = POP();
         v1 = POP();
         if (v7_is_string(v1) && v7_is_string(v2)) {
@@ -13926,9 +14756,9 @@ restart:
           res = v7_mk_boolean(v1 == v2);
         }
         PUSH(res);
-        break;
+        NEXT_OP;
       }
-      case OP_NE_NE: {
+      CASE(OP_NE_NE): {
         v2 = POP();
         v1 = POP();
         if (v7_is_string(v1) && v7_is_string(v2)) {
@@ -13939,10 +14769,10 @@ restart:
           res = v7_mk_boolean(v1 != v2);
         }
         PUSH(res);
-        break;
+        NEXT_OP;
       }
-      case OP_EQ:
-      case OP_NE: {
+      CASE(OP_EQ):
+      CASE(OP_NE): {
         v2 = POP();
         v1 = POP();
         /*
@@ -13990,10 +14820,10 @@ restart:
         PUSH(res);
         break;
       }
-      case OP_LT:
-      case OP_LE:
-      case OP_GT:
-      case OP_GE: {
+      CASE(OP_LT):
+      CASE(OP_LE):
+      CASE(OP_GT):
+      CASE(OP_GE): {
         v2 = POP();
         v1 = POP();
         BTRY(to_primitive(v7, v1, V7_TO_PRIMITIVE_HINT_NUMBER, &v1));
@@ -14028,9 +14858,9 @@ restart:
               b_bool_bin_op(op, v7_to_number(v1), v7_to_number(v2)));
         }
         PUSH(res);
-        break;
+        NEXT_OP;
       }
-      case OP_INSTANCEOF: {
+      CASE(OP_INSTANCEOF): {
         v2 = POP();
         v1 = POP();
         if (!v7_is_callable(v7, v2)) {
@@ -14039,11 +14869,11 @@ restart:
           goto op_done;
         } else {
           PUSH(v7_mk_boolean(
-              is_prototype_of(v7, v1, v7_get(v7, v2, "prototype", 9))));
+              is_prototype_of(v7, v1, ctor_prototype(v7, v2))));
         }
         break;
       }
-      case OP_TYPEOF:
+      CASE(OP_TYPEOF):
         v1 = POP();
         switch (val_type(v7, v1)) {
           case V7_TYPE_NUMBER:
@@ -14069,7 +14899,7 @@ restart:
         }
         PUSH(res);
         break;
-      case OP_IN: {
+      CASE(OP_IN): {
         struct v7_property *prop = NULL;
         v2 = POP();
         v1 = POP();
@@ -14077,13 +14907,14 @@ restart:
         prop = v7_get_property(v7, v2, buf, -1);
         PUSH(v7_mk_boolean(prop != NULL));
       } break;
-      case OP_GET:
+      CASE(OP_GET):
         v2 = POP();
         v1 = POP();
-        BTRY(v7_get_throwing_v(v7, v1, v2, &v3));
+        BTRY(v7_get_throwing_ic(v7, bcode_get_ic(r.bcode, r.ops), v1, v2,
+                                &v3));
         PUSH(v3);
-        break;
-      case OP_SET: {
+        NEXT_OP;
+      CASE(OP_SET): {
         v3 = POP();
         v2 = POP();
         v1 = POP();
@@ -14092,13 +14923,13 @@ restart:
         BTRY(to_string(v7, v2, &v2, NULL, 0, NULL));
 
         /* set value */
-        BTRY(set_property_v(v7, v1, v2, v3, NULL));
+        BTRY(set_property_ic(v7, bcode_get_ic(r.bcode, r.ops), v1, v2, v3));
 
         PUSH(v3);
-        break;
+        NEXT_OP;
       }
-      case OP_GET_VAR:
-      case OP_SAFE_GET_VAR: {
+      CASE(OP_GET_VAR):
+      CASE(OP_SAFE_GET_VAR): {
         struct v7_property *p = NULL;
         assert(r.ops < r.end - 1);
         v1 = bcode_decode_lit(v7, r.bcode, &r.ops);
@@ -14116,16 +14947,25 @@ restart:
           BTRY(v7_property_value(v7, v7->vals.scope, p, &v2));
           PUSH(v2);
         }
-        break;
+        NEXT_OP;
       }
-      case OP_SET_VAR: {
-        struct v7_property *prop;
+      CASE(OP_SET_VAR): {
+        struct v7_property *prop = NULL;
+        size_t name_len;
+        val_t key;
         v3 = POP();
         v2 = bcode_decode_lit(v7, r.bcode, &r.ops);
         v1 = v7->vals.scope;
 
-        BTRY(to_string(v7, v2, NULL, buf, sizeof(buf), NULL));
-        prop = v7_get_property(v7, v1, buf, strlen(buf));
+        BTRY(to_string(v7, v2, NULL, buf, sizeof(buf), &name_len));
+        /* Like `v7_get_property()`, but the holder is needed for GC */
+        key = v7_find_atom(v7, buf, name_len);
+        for (; v1 != V7_NULL; v1 = obj_prototype_v(v7, v1)) {
+          if ((prop = v7_get_own_property_key(v7, v1, key, buf, name_len, 0)) !=
+              NULL) {
+            break;
+          }
+        }
         if (prop != NULL) {
           /* Property already exists: update its value */
           /*
@@ -14140,6 +14980,7 @@ restart:
            */
           if (!(prop->attributes & V7_PROPERTY_NON_WRITABLE)) {
             prop->value = v3;
+            gc_write_barrier(v7, v7_to_object(v1));
           }
         } else if (!r.bcode->strict_mode) {
           /*
@@ -14157,30 +14998,37 @@ restart:
           break;
         }
         PUSH(v3);
-        break;
+        NEXT_OP;
       }
-      case OP_JMP: {
+      CASE(OP_GET_LOCAL):
+        v1 = *bcode_local(v7, bcode_get_varint(&r.ops));
+        PUSH(v1);
+        NEXT_OP;
+      CASE(OP_SET_LOCAL):
+        *bcode_local(v7, bcode_get_varint(&r.ops)) = TOS();
+        NEXT_OP;
+      CASE(OP_JMP): {
         bcode_off_t target = bcode_get_target(&r.ops);
         r.ops = r.bcode->ops.p + target - 1;
-        break;
+        NEXT_OP;
       }
-      case OP_JMP_FALSE: {
+      CASE(OP_JMP_FALSE): {
         bcode_off_t target = bcode_get_target(&r.ops);
         v1 = POP();
         if (!v7_is_truthy(v7, v1)) {
           r.ops = r.bcode->ops.p + target - 1;
         }
-        break;
+        NEXT_OP;
       }
-      case OP_JMP_TRUE: {
+      CASE(OP_JMP_TRUE): {
         bcode_off_t target = bcode_get_target(&r.ops);
         v1 = POP();
         if (v7_is_truthy(v7, v1)) {
           r.ops = r.bcode->ops.p + target - 1;
         }
-        break;
+        NEXT_OP;
       }
-      case OP_JMP_TRUE_DROP: {
+      CASE(OP_JMP_TRUE_DROP): {
         bcode_off_t target = bcode_get_target(&r.ops);
         v1 = POP();
         if (v7_is_truthy(v7, v1)) {
@@ -14189,9 +15037,9 @@ restart:
           POP();
           PUSH(v1);
         }
-        break;
+        NEXT_OP;
       }
-      case OP_JMP_IF_CONTINUE: {
+      CASE(OP_JMP_IF_CONTINUE): {
         bcode_off_t target = bcode_get_target(&r.ops);
         if (v7->is_continuing) {
           r.ops = r.bcode->ops.p + target - 1;
@@ -14199,13 +15047,13 @@ restart:
         v7->is_continuing = 0;
         break;
       }
-      case OP_CREATE_OBJ:
+      CASE(OP_CREATE_OBJ):
         PUSH(v7_mk_object(v7));
-        break;
-      case OP_CREATE_ARR:
-        PUSH(v7_mk_array(v7));
-        break;
-      case OP_NEXT_PROP: {
+        NEXT_OP;
+      CASE(OP_CREATE_ARR):
+        PUSH(v7_mk_dense_array(v7));
+        NEXT_OP;
+      CASE(OP_NEXT_PROP): {
         void *h = NULL;
         v1 = POP(); /* handle */
         v2 = POP(); /* object */
@@ -14240,14 +15088,14 @@ restart:
         }
         break;
       }
-      case OP_FUNC_LIT: {
+      CASE(OP_FUNC_LIT): {
         v1 = POP();
         v2 = bcode_instantiate_function(v7, v1);
         PUSH(v2);
         break;
       }
-      case OP_CALL:
-      case OP_NEW: {
+      CASE(OP_CALL):
+      CASE(OP_NEW): {
         /* Naive implementation pending stack frame redesign */
         int args = (int) *(++r.ops);
         uint8_t is_constructor = (op == OP_NEW);
@@ -14257,15 +15105,21 @@ restart:
           goto op_done;
           break;
         } else {
-          v2 = v7_mk_dense_array(v7);
-          while (args > 0) {
-            BTRY(v7_array_set_throwing(v7, v2, --args, POP(), NULL));
-          }
-          /* pop function to call */
-          v1 = POP();
+          /*
+           * Arguments are not popped: they stay on the data stack and are
+           * accessed in place, `base` is the index of `this`:
+           * `( this func arg1 ... argN )`
+           */
+          size_t base = SP() - args - 2;
 
-          /* pop `this` */
-          v3 = POP();
+          /* function to call */
+          v1 = *stack_ptr(&v7->stack, base + 1);
+
+          /* `this` */
+          v3 = *stack_ptr(&v7->stack, base);
+
+          /* the `arguments` array, created only if needed */
+          v2 = v7_mk_undefined();
 
           /*
            * adjust `this` if the function is called with the constructor
@@ -14281,7 +15135,7 @@ restart:
              * get "prototype" property from the constructor function,
              * and make sure it's an object
              */
-            v4 = v7_get(v7, v1 /*func*/, "prototype", 9);
+            v4 = ctor_prototype(v7, v1 /*func*/);
             if (!v7_is_object(v4)) {
               /* TODO(dfrank): box primitive value */
               BTRY(v7_throwf(
@@ -14331,10 +15185,12 @@ restart:
               v3 = v7->vals.global_object;
             }
 
-            BTRY(call_cfunction(v7, v1 /*func*/, v3 /*this*/, v2 /*args*/,
-                                is_constructor, &v4));
+            BTRY(call_cfunction(v7, v1 /*func*/, v3 /*this*/,
+                                v7_mk_undefined() /*args are on the stack*/,
+                                base + 2, args, is_constructor, &v4));
 
-            /* push value returned from C function to bcode stack */
+            /* drop the call, push value returned from C function instead */
+            v7->stack.len = base * sizeof(val_t);
             PUSH(v4);
 
           } else {
@@ -14351,6 +15207,45 @@ restart:
               v3 = v7->vals.global_object;
             }
 
+            if (func->bcode->uses_arguments) {
+              v2 = stack_to_array(v7, base + 2, args);
+            }
+
+            if (func->bcode->uses_slots) {
+              /*
+               * No scope object is needed: skip the names and transfer
+               * control to the function. The function and its arguments are
+               * already on the stack, right where the first frame slots go.
+               */
+              int i;
+              int loc_cnt = func->bcode->names_cnt - func->bcode->args_cnt -
+                            1 /*func name*/;
+              ops = bcode_end_names(func->bcode->ops.p,
+                                    func->bcode->names_cnt);
+              V7_TRY(bcode_perform_call(v7, v7_mk_undefined(), func, &r,
+                                        v3 /*this*/, ops, is_constructor));
+
+              /* returning from the frame drops the whole call */
+              v7->call_stack->stack_size = base * sizeof(val_t);
+              v7->locals_base = base + 1;
+
+              /* drop extra arguments, and fill in the missing ones */
+              if (args > func->bcode->args_cnt) {
+                v7->stack.len =
+                    (v7->locals_base + 1 + func->bcode->args_cnt) *
+                    sizeof(val_t);
+              }
+              for (i = args; i < func->bcode->args_cnt; ++i) {
+                PUSH(v7_mk_undefined());
+              }
+              for (i = 0; i < loc_cnt; ++i) {
+                PUSH(v7_mk_undefined());
+              }
+              /* `arguments` */
+              PUSH(v2);
+              break;
+            }
+
             scope_frame = v7_mk_object(v7);
 
             /*
@@ -14378,9 +15273,12 @@ restart:
               int arg_num;
               for (arg_num = 0; arg_num < func->bcode->args_cnt; ++arg_num) {
                 ops = bcode_next_name_v(v7, func->bcode, ops, &v4);
-                BTRY(def_property_v(
-                    v7, scope_frame, v4, V7_DESC_CONFIGURABLE(0),
-                    v7_array_get(v7, v2, arg_num), 0 /*not assign*/, NULL));
+                res = arg_num < args
+                          ? *stack_ptr(&v7->stack, base + 2 + arg_num)
+                          : v7_mk_undefined();
+                BTRY(def_property_v(v7, scope_frame, v4,
+                                    V7_DESC_CONFIGURABLE(0), res,
+                                    0 /*not assign*/, NULL));
               }
             }
 
@@ -14396,8 +15294,10 @@ restart:
              *
              * should yield 2. Currently, it yields 1.
              */
-            v7_def(v7, scope_frame, "arguments", 9, V7_DESC_CONFIGURABLE(0),
-                   v2);
+            if (func->bcode->uses_arguments) {
+              v7_def(v7, scope_frame, "arguments", 9, V7_DESC_CONFIGURABLE(0),
+                     v2);
+            }
 
             /* populate local variables */
             {
@@ -14412,7 +15312,8 @@ restart:
               }
             }
 
-            /* transfer control to the function */
+            /* drop the call, and transfer control to the function */
+            v7->stack.len = base * sizeof(val_t);
             V7_TRY(bcode_perform_call(v7, scope_frame, func, &r, v3 /*this*/,
                                       ops, is_constructor));
 
@@ -14421,12 +15322,12 @@ restart:
         }
         break;
       }
-      case OP_RET:
+      CASE(OP_RET):
         bcode_adjust_retval(v7, 1 /*explicit return*/);
         V7_TRY(bcode_perform_return(v7, &r, 1 /*take value from stack*/));
         break;
-      case OP_DELETE:
-      case OP_DELETE_VAR: {
+      CASE(OP_DELETE):
+      CASE(OP_DELETE_VAR): {
         size_t name_len;
         struct v7_property *prop;
 
@@ -14492,16 +15393,16 @@ restart:
         PUSH(res);
         break;
       }
-      case OP_TRY_PUSH_CATCH:
-      case OP_TRY_PUSH_FINALLY:
-      case OP_TRY_PUSH_LOOP:
-      case OP_TRY_PUSH_SWITCH:
+      CASE(OP_TRY_PUSH_CATCH):
+      CASE(OP_TRY_PUSH_FINALLY):
+      CASE(OP_TRY_PUSH_LOOP):
+      CASE(OP_TRY_PUSH_SWITCH):
         eval_try_push(v7, op, &r);
         break;
-      case OP_TRY_POP:
+      CASE(OP_TRY_POP):
         V7_TRY(eval_try_pop(v7));
         break;
-      case OP_AFTER_FINALLY:
+      CASE(OP_AFTER_FINALLY):
         /*
          * exited from `finally` block: if some value is currently being
          * returned, continue returning it.
@@ -14522,18 +15423,18 @@ restart:
           bcode_perform_break(v7, &r);
         }
         break;
-      case OP_THROW:
+      CASE(OP_THROW):
         V7_TRY(bcode_perform_throw(v7, &r, 1 /*take thrown value*/));
         goto op_done;
         break;
-      case OP_BREAK:
+      CASE(OP_BREAK):
         bcode_perform_break(v7, &r);
         break;
-      case OP_CONTINUE:
+      CASE(OP_CONTINUE):
         v7->is_continuing = 1;
         bcode_perform_break(v7, &r);
         break;
-      case OP_ENTER_CATCH: {
+      CASE(OP_ENTER_CATCH): {
         /* pop thrown value from stack */
         v1 = POP();
         /* get the name of the thrown value */
@@ -14550,7 +15451,7 @@ restart:
         bcode_private_frame_push(v7, scope_frame);
         break;
       }
-      case OP_EXIT_CATCH: {
+      CASE(OP_EXIT_CATCH): {
         uint8_t is_func_frame = 0;
         /* unwind 1 frame */
         is_func_frame = unwind_stack_1level(v7, &r);
@@ -14561,6 +15462,72 @@ restart:
 #endif
         break;
       }
+
+      /*
+       * Superinstructions. Each one replaces the first opcode of a sequence
+       * emitted by the compiler and consumes the rest of it, so the operands
+       * and inline cache slots of the original instructions are reused as is.
+       */
+      CASE(OP_GET_PROP):
+        v1 = POP();
+      get_prop:
+        v2 = bcode_decode_lit(v7, r.bcode, &r.ops);
+        r.ops++; /* `GET`, the inline cache is keyed by its offset */
+        BTRY(v7_get_throwing_ic(v7, bcode_get_ic(r.bcode, r.ops), v1, v2,
+                                &v3));
+        PUSH(v3);
+        NEXT_OP;
+      CASE(OP_GET_VAR_PROP): {
+        struct v7_property *p = NULL;
+        v2 = bcode_decode_lit(v7, r.bcode, &r.ops);
+        BTRY(v7_get_property_v(v7, v7->vals.scope, v2, &p));
+        if (p == NULL) {
+          /* variable does not exist: Reference Error */
+          V7_TRY(bcode_throw_reference_error(v7, &r, v2));
+          goto op_done;
+        }
+        BTRY(v7_property_value(v7, v7->vals.scope, p, &v1));
+        r.ops++; /* `PUSH_LIT` */
+        goto get_prop;
+      }
+      CASE(OP_GET_LOCAL_PROP):
+        v1 = *bcode_local(v7, bcode_get_varint(&r.ops));
+        r.ops++; /* `PUSH_LIT` */
+        goto get_prop;
+      CASE(OP_DUP_JMP):
+        bcode_fused_jmp(r.bcode, &r.ops, v7_is_truthy(v7, TOS()));
+        NEXT_OP;
+      CASE(OP_LT_JMP):
+      CASE(OP_LE_JMP):
+      CASE(OP_GT_JMP):
+      CASE(OP_GE_JMP): {
+        enum opcode cmp_op = (enum opcode)(OP_LT + (op - OP_LT_JMP));
+        v2 = POP();
+        v1 = POP();
+        if (!v7_is_number(v1) || !v7_is_number(v2)) {
+          /* run the plain comparison, the jump follows as usual */
+          PUSH(v1);
+          PUSH(v2);
+          op = cmp_op;
+          goto op_switch;
+        }
+        bcode_fused_jmp(r.bcode, &r.ops, b_bool_bin_op(cmp_op, v7_to_number(v1),
+                                                       v7_to_number(v2)));
+        NEXT_OP;
+      }
+      CASE(OP_EQ_EQ_JMP):
+      CASE(OP_NE_NE_JMP): {
+        int eq;
+        v2 = POP();
+        v1 = POP();
+        if (v7_is_string(v1) && v7_is_string(v2)) {
+          eq = s_cmp(v7, v1, v2) == 0;
+        } else {
+          eq = v1 == v2 && v1 != V7_TAG_NAN;
+        }
+        bcode_fused_jmp(r.bcode, &r.ops, (op == OP_EQ_EQ_JMP) == eq);
+        NEXT_OP;
+      }
       default:
         BTRY(v7_throwf(v7, INTERNAL_ERROR, "Unknown opcode: %d", (int) op));
         goto op_done;
@@ -14817,7 +15784,8 @@ V7_PRIVATE enum v7_err b_exec(struct v7 *v7, const char *src, size_t src_len,
     bcode_builder_finalize(&bbuilder);
   } else if (is_cfunction_lite(func) || is_cfunction_obj(v7, func)) {
     /* call cfunction */
-    V7_TRY(call_cfunction(v7, func, this_object, args, 0 /* not a ctor */, &r));
+    V7_TRY(call_cfunction(v7, func, this_object, args, 0, 0, is_constructor,
+                          &r));
     goto clean;
   } else {
     /* value is not a function */
@@ -14982,7 +15950,7 @@ struct v7 *v7_head = NULL;
 static void generic_object_destructor(struct v7 *v7, void *ptr) {
   struct v7_generic_object *o = (struct v7_generic_object *) ptr;
   struct v7_property *p;
-  struct mbuf *abuf;
+  struct v7_dense_array *da;
 
   p = v7_get_own_property2(v7, v7_object_to_value(&o->base), "", 0,
                            _V7_PROPERTY_HIDDEN);
@@ -14998,12 +15966,14 @@ static void generic_object_destructor(struct v7 *v7, void *ptr) {
 
   if (o->base.attributes & V7_OBJ_DENSE_ARRAY) {
     if (p != NULL &&
-        ((abuf = (struct mbuf *) v7_to_foreign(p->value)) != NULL)) {
-      mbuf_free(abuf);
-      free(abuf);
+        ((da = (struct v7_dense_array *) v7_to_foreign(p->value)) != NULL)) {
+      mbuf_free(&da->vals);
+      free(da);
     }
   }
 
+  free(o->slots);
+
 #if defined(V7_ENABLE_ENTITY_IDS)
   o->base.entity_id_base = V7_ENTITY_ID_PART_NONE;
   o->base.entity_id_spec = V7_ENTITY_ID_PART_NONE;
@@ -15081,6 +16051,7 @@ struct v7 *v7_create_opt(struct v7_create_opts opts) {
 
     v7->cur_dense_prop =
         (struct v7_property *) calloc(1, sizeof(struct v7_property));
+    shapes_init(v7);
     gc_arena_init(&v7->generic_object_arena, sizeof(struct v7_generic_object),
                   opts.object_arena_size, 10, "object");
     v7->generic_object_arena.destructor = generic_object_destructor;
@@ -15092,6 +16063,12 @@ struct v7 *v7_create_opt(struct v7_create_opts opts) {
 #if defined(V7_ENABLE_ENTITY_IDS)
     v7->property_arena.destructor = property_destructor;
 #endif
+    gc_arena_init(&v7->rope_arena, sizeof(struct v7_rope), 20, 10, "rope");
+    v7->rope_arena.destructor = rope_destructor;
+    v7->gc_time_budget_us = opts.gc_time_budget_us;
+    if (opts.gc_time_budget_us > 0) {
+      v7->gc_nursery_size = V7_GC_NURSERY_SIZE;
+    }
 
     /*
      * The compacting GC exploits the null terminator of the previous
@@ -15150,6 +16127,7 @@ void v7_destroy(struct v7 *v7) {
   gc_arena_destroy(v7, &v7->generic_object_arena);
   gc_arena_destroy(v7, &v7->function_arena);
   gc_arena_destroy(v7, &v7->property_arena);
+  gc_arena_destroy(v7, &v7->rope_arena);
 
   mbuf_free(&v7->owned_strings);
   mbuf_free(&v7->owned_values);
@@ -15157,6 +16135,7 @@ void v7_destroy(struct v7 *v7) {
   mbuf_free(&v7->json_visited_stack);
   mbuf_free(&v7->tmp_stack);
   mbuf_free(&v7->act_bcodes);
+  mbuf_free(&v7->remembered);
   mbuf_free(&v7->stack);
 
 #if defined(V7_CYG_PROFILE_ON)
@@ -15174,6 +16153,8 @@ void v7_destroy(struct v7 *v7) {
 
   free(v7->call_stack);
 
+  shapes_destroy(v7);
+  atoms_destroy(v7);
   free(v7->cur_dense_prop);
   free(v7);
 }
@@ -15183,15 +16164,26 @@ v7_val_t v7_get_this(struct v7 *v7) {
 }
 
 v7_val_t v7_get_arguments(struct v7 *v7) {
+  if (v7_is_undefined(v7->vals.arguments)) {
+    /* arguments are passed on the data stack: materialize them */
+    v7->vals.arguments = stack_to_array(v7, v7->args_base, v7->argc);
+  }
   return v7->vals.arguments;
 }
 
 v7_val_t v7_arg(struct v7 *v7, unsigned long n) {
-  return v7_array_get(v7, v7->vals.arguments, n);
+  if (!v7_is_undefined(v7->vals.arguments)) {
+    return v7_array_get(v7, v7->vals.arguments, n);
+  }
+  return n < v7->argc ? ((val_t *) v7->stack.buf)[v7->args_base + n]
+                      : v7_mk_undefined();
 }
 
 unsigned long v7_argc(struct v7 *v7) {
-  return v7_array_length(v7, v7->vals.arguments);
+  if (!v7_is_undefined(v7->vals.arguments)) {
+    return v7_array_length(v7, v7->vals.arguments);
+  }
+  return v7->argc;
 }
 
 void v7_own(struct v7 *v7, v7_val_t *v) {
@@ -15580,8 +16572,7 @@ enum v7_err v7_exec(struct v7 *v7, const char *src, val_t *res) {
 }
 
 enum v7_err v7_parse_json(struct v7 *v7, const char *str, val_t *res) {
-  return b_exec(v7, str, 0, v7_mk_undefined(), v7_mk_undefined(),
-                v7_mk_undefined(), 1, 0, 0, res);
+  return json_parse(v7, str, strlen(str), res);
 }
 
 #ifndef V7_NO_FS
@@ -15623,8 +16614,15 @@ static enum v7_err exec_file(struct v7 *v7, const char *path, val_t *res,
 #else
     int fr = 0;
 #endif
-    rcode = b_exec(v7, p, file_size, v7_mk_undefined(), v7_mk_undefined(),
-                   v7_mk_undefined(), is_json, fr, 0, res);
+    if (is_json) {
+      rcode = json_parse(v7, p, file_size, res);
+      if (fr) {
+        free(p);
+      }
+    } else {
+      rcode = b_exec(v7, p, file_size, v7_mk_undefined(), v7_mk_undefined(),
+                     v7_mk_undefined(), 0, fr, 0, res);
+    }
     if (rcode != V7_OK) {
       goto clean;
     }
@@ -15793,6 +16791,8 @@ V7_PRIVATE enum v7_type val_type(struct v7 *v7, val_t v) {
     case V7_TAG_STRING_F >> 48:
     case V7_TAG_STRING_D >> 48:
     case V7_TAG_STRING_5 >> 48:
+    case V7_TAG_STRING_R >> 48:
+    case V7_TAG_STRING_A >> 48:
       return V7_TYPE_STRING;
     case V7_TAG_BOOLEAN >> 48:
       return V7_TYPE_BOOLEAN;
@@ -16146,11 +17146,131 @@ V7_PRIVATE int s_cmp(struct v7 *v7, val_t a, val_t b) {
   }
 }
 
+V7_PRIVATE int is_rope(val_t v) {
+  return (v & V7_TAG_MASK) == V7_TAG_STRING_R;
+}
+
+V7_PRIVATE struct v7_rope *to_rope(val_t v) {
+  return (struct v7_rope *) v7_to_pointer(v);
+}
+
+V7_PRIVATE void rope_destructor(struct v7 *v7, void *ptr) {
+  struct v7_rope *r = (struct v7_rope *) ptr;
+  (void) v7;
+  free(r->flat);
+}
+
+static size_t s_len(struct v7 *v7, val_t v) {
+  size_t len;
+  if (is_rope(v)) {
+    return to_rope(v)->len;
+  }
+  v7_get_string_data(v7, &v, &len);
+  return len;
+}
+
+static unsigned char rope_depth(val_t v) {
+  return is_rope(v) ? to_rope(v)->depth : 0;
+}
+
+static size_t rope_nodes(val_t v) {
+  return is_rope(v) ? to_rope(v)->nodes : 0;
+}
+
+/*
+ * Copies contents of the string `v` to the buffer which ends at `end`.
+ * Walks down the left children iteratively, so that ropes built by appending
+ * in a loop don't eat up the C stack.
+ */
+static void rope_copy(struct v7 *v7, val_t v, char *end) {
+  const char *p;
+  size_t len;
+
+  while (is_rope(v)) {
+    struct v7_rope *r = to_rope(v);
+    if (r->flat != NULL) {
+      memcpy(end - r->len, r->flat, r->len);
+      return;
+    }
+    rope_copy(v7, r->right, end);
+    end -= s_len(v7, r->right);
+    v = r->left;
+  }
+
+  p = v7_get_string_data(v7, &v, &len);
+  memcpy(end - len, p, len);
+}
+
+static const char *rope_flatten(struct v7 *v7, struct v7_rope *r) {
+  if (r->flat == NULL) {
+    char *flat = (char *) malloc(r->len + 1);
+    if (flat == NULL) abort();
+    rope_copy(v7, r->left, flat + r->len - s_len(v7, r->right));
+    rope_copy(v7, r->right, flat + r->len);
+    flat[r->len] = '\0';
+
+    r->flat = flat;
+    r->left = r->right = V7_UNDEFINED;
+    r->nodes = r->depth = 0;
+
+    /* flattened ropes are garbage collected along with strings */
+    v7->rope_flat_size += r->len;
+    if (v7->rope_flat_size > v7->owned_strings.size) {
+      v7->need_gc = 1;
+    }
+  }
+  return r->flat;
+}
+
+static val_t s_concat_rope(struct v7 *v7, val_t a, val_t b, size_t len) {
+  struct gc_tmp_frame tf = new_tmp_frame(v7);
+  struct v7_rope *r;
+
+  if (rope_depth(b) >= V7_ROPE_MAX_DEPTH) {
+    rope_flatten(v7, to_rope(b));
+  }
+
+  /* allocation might trigger GC, which relocates owned strings */
+  tmp_stack_push(&tf, &a);
+  tmp_stack_push(&tf, &b);
+  r = new_rope(v7);
+  tmp_frame_cleanup(&tf);
+
+  r->left = a;
+  r->right = b;
+  r->len = len;
+  r->depth = rope_depth(b) + 1;
+  if (r->depth < rope_depth(a)) {
+    r->depth = rope_depth(a);
+  }
+  if (rope_nodes(a) + rope_nodes(b) + 1 > V7_ROPE_MAX_NODES) {
+    rope_flatten(v7, r);
+  } else {
+    r->nodes = rope_nodes(a) + rope_nodes(b) + 1;
+  }
+
+  return pointer_to_value(r) | V7_TAG_STRING_R;
+}
+
 V7_PRIVATE val_t s_concat(struct v7 *v7, val_t a, val_t b) {
   size_t a_len, b_len, res_len;
   const char *a_ptr, *b_ptr, *res_ptr;
   val_t res;
 
+  /*
+   * Long strings are concatenated lazily, so that building a string by
+   * appending to it in a loop doesn't copy it over and over again.
+   */
+  a_len = s_len(v7, a);
+  b_len = s_len(v7, b);
+  if (a_len == 0) {
+    return b;
+  } else if (b_len == 0) {
+    return a;
+  } else if (a_len + b_len >= V7_ROPE_MIN_LEN) {
+    return s_concat_rope(v7, a, b, a_len + b_len);
+  }
+
   /* Find out lengths of both srtings */
   a_ptr = v7_get_string_data(v7, &a, &a_len);
   b_ptr = v7_get_string_data(v7, &b, &b_len);
@@ -16170,6 +17290,145 @@ V7_PRIVATE val_t s_concat(struct v7 *v7, val_t a, val_t b) {
   return res;
 }
 
+V7_PRIVATE int is_atom(val_t v) {
+  return (v & V7_TAG_MASK) == V7_TAG_STRING_A;
+}
+
+V7_PRIVATE struct v7_atom *to_atom(val_t v) {
+  return (struct v7_atom *) v7_to_pointer(v);
+}
+
+/* FNV-1a */
+static uint32_t atom_hash(const char *p, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) p[i]) * 16777619U;
+  }
+  return h;
+}
+
+static struct v7_atom *atom_lookup(struct v7 *v7, const char *p, size_t len,
+                                   uint32_t hash) {
+  struct v7_atom *a;
+  if (v7->atoms == NULL) return NULL;
+  for (a = v7->atoms[hash & (v7->atoms_size - 1)]; a != NULL; a = a->next) {
+    if (a->hash == hash && a->len == len && memcmp(a->s, p, len) == 0) {
+      return a;
+    }
+  }
+  return NULL;
+}
+
+static int atoms_grow(struct v7 *v7) {
+  size_t i, size = v7->atoms_size == 0 ? V7_ATOMS_INITIAL_SIZE
+                                       : v7->atoms_size * 2;
+  struct v7_atom **buckets =
+      (struct v7_atom **) calloc(size, sizeof(*buckets));
+  if (buckets == NULL) return 0;
+
+  for (i = 0; i < v7->atoms_size; i++) {
+    struct v7_atom *a, *next;
+    for (a = v7->atoms[i]; a != NULL; a = next) {
+      next = a->next;
+      a->next = buckets[a->hash & (size - 1)];
+      buckets[a->hash & (size - 1)] = a;
+    }
+  }
+  free(v7->atoms);
+  v7->atoms = buckets;
+  v7->atoms_size = size;
+  return 1;
+}
+
+V7_PRIVATE val_t v7_find_atom(struct v7 *v7, const char *p, size_t len) {
+  struct v7_atom *a;
+  int dict_index;
+
+  if (len <= 5) {
+    return v7_mk_string(v7, p, len, 1);
+  } else if ((a = atom_lookup(v7, p, len, atom_hash(p, len))) != NULL) {
+    return pointer_to_value(a) | V7_TAG_STRING_A;
+  } else if ((dict_index = v_find_string_in_dictionary(p, len)) >= 0) {
+    val_t v = 0;
+    GET_VAL_NAN_PAYLOAD(v)[0] = dict_index;
+    return v | V7_TAG_STRING_D;
+  }
+  return V7_UNDEFINED;
+}
+
+V7_PRIVATE val_t v7_mk_atom(struct v7 *v7, const char *p, size_t len) {
+  uint32_t hash;
+  struct v7_atom *a;
+  val_t res;
+
+  if (len == ~((size_t) 0)) len = strlen(p);
+  if ((res = v7_find_atom(v7, p, len)) != V7_UNDEFINED) {
+    return res;
+  }
+
+  if (v7->atoms_cnt >= v7->atoms_size && !atoms_grow(v7) &&
+      v7->atoms == NULL) {
+    return v7_mk_string(v7, p, len, 1);
+  }
+  a = (struct v7_atom *) malloc(sizeof(*a) + len);
+  if (a == NULL) {
+    return v7_mk_string(v7, p, len, 1);
+  }
+  hash = atom_hash(p, len);
+  a->hash = hash;
+  a->marked = 0;
+  a->len = len;
+  memcpy(a->s, p, len);
+  a->s[len] = '\0';
+  a->next = v7->atoms[hash & (v7->atoms_size - 1)];
+  v7->atoms[hash & (v7->atoms_size - 1)] = a;
+  v7->atoms_cnt++;
+
+  return pointer_to_value(a) | V7_TAG_STRING_A;
+}
+
+V7_PRIVATE val_t v7_intern_string(struct v7 *v7, val_t v) {
+  uint64_t tag = v & V7_TAG_MASK;
+  if (tag == V7_TAG_STRING_O || tag == V7_TAG_STRING_R) {
+    size_t len;
+    const char *p = v7_get_string_data(v7, &v, &len);
+    return v7_mk_atom(v7, p, len);
+  }
+  return v;
+}
+
+V7_PRIVATE void atoms_sweep(struct v7 *v7) {
+  size_t i;
+  for (i = 0; i < v7->atoms_size; i++) {
+    struct v7_atom **pa = &v7->atoms[i], *a;
+    while ((a = *pa) != NULL) {
+      if (a->marked) {
+        a->marked = 0;
+        pa = &a->next;
+      } else {
+        *pa = a->next;
+        free(a);
+        v7->atoms_cnt--;
+      }
+    }
+  }
+}
+
+V7_PRIVATE void atoms_destroy(struct v7 *v7) {
+  size_t i;
+  for (i = 0; i < v7->atoms_size; i++) {
+    struct v7_atom *a, *next;
+    for (a = v7->atoms[i]; a != NULL; a = next) {
+      next = a->next;
+      free(a);
+    }
+  }
+  free(v7->atoms);
+  v7->atoms = NULL;
+  v7->atoms_size = v7->atoms_cnt = 0;
+}
+
 V7_PRIVATE unsigned long cstr_to_ulong(const char *s, size_t len, int *ok) {
   char *e;
   unsigned long res = strtoul(s, &e, 10);
@@ -16311,7 +17570,8 @@ v7_val_t v7_mk_string(struct v7 *v7, const char *p, size_t len, int copy) {
 int v7_is_string(val_t v) {
   uint64_t t = v & V7_TAG_MASK;
   return t == V7_TAG_STRING_I || t == V7_TAG_STRING_F || t == V7_TAG_STRING_O ||
-         t == V7_TAG_STRING_5 || t == V7_TAG_STRING_D;
+         t == V7_TAG_STRING_5 || t == V7_TAG_STRING_D || t == V7_TAG_STRING_R ||
+         t == V7_TAG_STRING_A;
 }
 
 /* Get a pointer to string and string length. */
@@ -16372,6 +17632,14 @@ const char *v7_get_string_data(struct v7 *v7, val_t *v, size_t *sizep) {
       *sizep = decode_varint((uint8_t *) s, &llen);
       memcpy(&p, s + llen, sizeof(p));
     }
+  } else if (tag == V7_TAG_STRING_R) {
+    struct v7_rope *r = to_rope(*v);
+    *sizep = r->len;
+    p = rope_flatten(v7, r);
+  } else if (tag == V7_TAG_STRING_A) {
+    struct v7_atom *a = to_atom(*v);
+    *sizep = a->len;
+    p = a->s;
   } else {
     assert(0);
   }
@@ -16431,21 +17699,18 @@ int v7_is_array(struct v7 *v7, val_t v) {
 }
 
 /*
- * Dense arrays are backed by mbuf. Currently the array can only grow by
- * appending (i.e. setting an element whose index == array.length)
+ * Dense arrays are backed by mbuf. Elements live in the mbuf only, other
+ * properties live in the property list as usual. Missing elements are kept as
+ * `V7_TAG_NOVALUE`, so that they are not listed by the key iteration.
  *
- * TODO(mkm): automatically promote dense arrays to normal objects
- *            when they are used as sparse arrays or to store arbitrary keys
- *            (perhaps a hybrid approach)
- * TODO(mkm): small sparsness doesn't have to promote the array,
- *            we can just fill empty slots with a tag. In JS missing array
- *            indices are subtly different from indices with an undefined value
- *            (key iteration).
- * TODO(mkm): change the interpreter so it can set elements in dense arrays
+ * A dense array is turned into an ordinary one (see `dense_array_to_sparse()`)
+ * when an element is given attributes, or set beyond `DENSE_ARRAY_MAX_INDEX()`.
+ *
+ * Defining `V7_DISABLE_DENSE_ARRAYS` makes all arrays ordinary.
  */
 V7_PRIVATE val_t v7_mk_dense_array(struct v7 *v7) {
   val_t a = v7_mk_array(v7);
-#ifdef V7_ENABLE_DENSE_ARRAYS
+#ifndef V7_DISABLE_DENSE_ARRAYS
   v7_own(v7, &a);
   v7_def(v7, a, "", 0, _V7_DESC_HIDDEN(1), V7_NULL);
 
@@ -16461,6 +17726,44 @@ V7_PRIVATE val_t v7_mk_dense_array(struct v7 *v7) {
   return a;
 }
 
+V7_PRIVATE struct v7_dense_array *v7_to_dense_array(struct v7 *v7, val_t arr) {
+  struct v7_property *p =
+      v7_get_own_property2(v7, arr, "", 0, _V7_PROPERTY_HIDDEN);
+  return p == NULL ? NULL : (struct v7_dense_array *) v7_to_foreign(p->value);
+}
+
+V7_PRIVATE void dense_array_shift(struct v7_dense_array *da, size_t n) {
+  size_t len = DENSE_ARRAY_LEN(da);
+  if (n >= len) {
+    da->vals.len = 0;
+    da->head = 0;
+    return;
+  }
+  da->head += n;
+  len -= n;
+  /*
+   * Compact only when dead slots outnumber live ones twice, so that the room
+   * left by a recent `unshift()` survives a following `shift()`. A compaction
+   * moves `len` elements after at least `len` shifts, so `shift()` takes
+   * amortized constant time.
+   */
+  if (da->head > 2 * len + 16) {
+    memmove(da->vals.buf, DENSE_ARRAY_VALS(da), len * sizeof(val_t));
+    da->vals.len = len * sizeof(val_t);
+    da->head = 0;
+  }
+}
+
+V7_PRIVATE void dense_array_unshift(struct v7_dense_array *da, size_t n) {
+  if (da->head < n) {
+    /* grow the front by the array size too, like `mbuf_append()` grows back */
+    size_t gap = n - da->head + DENSE_ARRAY_LEN(da);
+    mbuf_insert(&da->vals, 0, NULL, gap * sizeof(val_t));
+    da->head += gap;
+  }
+  da->head -= n;
+}
+
 /* TODO_V7_ERR */
 val_t v7_array_get(struct v7 *v7, val_t arr, unsigned long index) {
   return v7_array_get2(v7, arr, index, NULL);
@@ -16476,23 +17779,16 @@ val_t v7_array_get2(struct v7 *v7, val_t arr, unsigned long index, int *has) {
   }
   if (v7_is_object(arr)) {
     if (v7_to_object(arr)->attributes & V7_OBJ_DENSE_ARRAY) {
-      struct v7_property *p =
-          v7_get_own_property2(v7, arr, "", 0, _V7_PROPERTY_HIDDEN);
-      struct mbuf *abuf = NULL;
-      unsigned long len;
-      if (p != NULL) {
-        abuf = (struct mbuf *) v7_to_foreign(p->value);
-      }
-      if (abuf == NULL) {
+      struct v7_dense_array *da = v7_to_dense_array(v7, arr);
+      if (da == NULL) {
         res = v7_mk_undefined();
         goto clean;
       }
-      len = abuf->len / sizeof(val_t);
-      if (index >= len) {
+      if (index >= DENSE_ARRAY_LEN(da)) {
         res = v7_mk_undefined();
         goto clean;
       } else {
-        memcpy(&res, abuf->buf + index * sizeof(val_t), sizeof(val_t));
+        res = DENSE_ARRAY_VALS(da)[index];
         if (has != NULL && res != V7_TAG_NOVALUE) *has = 1;
         if (res == V7_TAG_NOVALUE) {
           res = v7_mk_undefined();
@@ -16518,103 +17814,67 @@ clean:
   return res;
 }
 
-#if V7_ENABLE_DENSE_ARRAYS
+V7_PRIVATE int cstr_to_array_index(const char *name, size_t len,
+                                   unsigned long *res) {
+  uint64_t n = 0;
+  size_t i;
 
-/* Create V7 strings for integers such as array indices */
-static val_t ulong_to_str(struct v7 *v7, unsigned long n) {
-  char buf[100];
-  int len;
-  len = c_snprintf(buf, sizeof(buf), "%lu", n);
-  return v7_mk_string(v7, buf, len, 1);
+  if (len == 0 || len > 10 || (name[0] == '0' && len > 1)) return 0;
+  for (i = 0; i < len; i++) {
+    if (name[i] < '0' || name[i] > '9') return 0;
+    n = n * 10 + (name[i] - '0');
+  }
+  if (n >= 0xffffffff) return 0;
+  *res = (unsigned long) n;
+  return 1;
 }
 
-/*
- * Pack 15-bit length and 15 bit index, leaving 2 bits for tag. the LSB has to
- * be set to distinguish it from a prop pointer.
- * In alternative we just fetch the length from obj at each call to v7_next_prop
- * and just stuff the index here (e.g. on 8/16-bit platforms).
- * TODO(mkm): conditional for 16-bit platforms
- */
-#define PACK_ITER(len, idx) \
-  ((struct v7_property *) ((len) << 17 | (idx) << 1 | 1))
+V7_PRIVATE void dense_array_to_sparse(struct v7 *v7, val_t arr) {
+  struct v7_object *o = v7_to_object(arr);
+  struct v7_property *p, **pp;
+  struct v7_dense_array *da;
+  size_t i;
 
-#define UNPACK_ITER_LEN(p) (((uintptr_t) p) >> 17)
-#define UNPACK_ITER_IDX(p) ((((uintptr_t) p) >> 1) & 0x7FFF)
-#define IS_PACKED_ITER(p) ((uintptr_t) p & 1)
+  if (!(o->attributes & V7_OBJ_DENSE_ARRAY)) return;
+  p = v7_get_own_property2(v7, arr, "", 0, _V7_PROPERTY_HIDDEN);
+  da = (p == NULL) ? NULL : (struct v7_dense_array *) v7_to_foreign(p->value);
 
-void *v7_next_prop(struct v7 *v7, val_t obj, void *h, val_t *name, val_t *val,
-                   v7_prop_attr_t *attrs) {
-  struct v7_property *p = (struct v7_property *) h;
+  /*
+   * The array stays dense until all the elements are in the property list,
+   * so that GC, which may run on each allocation, still sees all of them.
+   * Elements go in the same order as if they were appended one by one.
+   */
+  v7_own(v7, &arr);
+  obj_drop_shape(o);
+  for (i = 0; da != NULL && i < DENSE_ARRAY_LEN(da); i++) {
+    struct v7_property *prop;
+    char buf[20];
+    int n;
 
-  if (v7_to_object(obj)->attributes & V7_OBJ_DENSE_ARRAY) {
-    /* This is a dense array. Find backing mbuf and fetch values from there */
-    struct v7_property *hp =
-        v7_get_own_property2(v7, obj, "", 0, _V7_PROPERTY_HIDDEN);
-    struct mbuf *abuf = NULL;
-    unsigned long len, idx;
-    if (hp != NULL) {
-      abuf = (struct mbuf *) v7_to_foreign(hp->value);
-    }
-    if (abuf == NULL) return NULL;
-    len = abuf->len / sizeof(val_t);
-    if (len == 0) return NULL;
-    idx = (p == NULL) ? 0 : UNPACK_ITER_IDX(p) + 1;
-    p = (idx == len) ? v7_to_object(obj)->properties : PACK_ITER(len, idx);
-    if (val != NULL) *val = ((val_t *) abuf->buf)[idx];
-    if (attrs != NULL) *attrs = 0;
-    if (name != NULL) {
-      char buf[20];
-      int n = v_sprintf_s(buf, sizeof(buf), "%lu", index);
-      *name = v7_mk_string(v7, buf, n, 1);
-    }
-  } else {
-    /* Ordinary object */
-    p = (p == NULL) ? v7_to_object(obj)->properties : p->next;
-    if (p != NULL) {
-      if (name != NULL) *name = p->name;
-      if (val != NULL) *val = p->value;
-      if (attrs != NULL) *attrs = p->attributes;
-    }
+    if (DENSE_ARRAY_VALS(da)[i] == V7_TAG_NOVALUE) continue;
+    prop = v7_mk_property(v7);
+    prop->value = DENSE_ARRAY_VALS(da)[i];
+    prop->next = o->properties;
+    o->properties = prop;
+    n = v_sprintf_s(buf, sizeof(buf), "%lu", (unsigned long) i);
+    prop->name = v7_mk_atom(v7, buf, n);
   }
+  gc_write_barrier(v7, o);
 
-  return p;
-}
-
-V7_PRIVATE val_t
-v7_iter_get_value(struct v7 *v7, val_t obj, struct v7_property *p) {
-  return IS_PACKED_ITER(p) ? v7_array_get(v7, obj, UNPACK_ITER_IDX(p))
-                           : p->value;
-}
-
-V7_PRIVATE val_t v7_iter_get_name(struct v7 *v7, struct v7_property *p) {
-  return IS_PACKED_ITER(p) ? ulong_to_str(v7, UNPACK_ITER_IDX(p)) : p->name;
-}
-
-V7_PRIVATE uint8_t v7_iter_get_attrs(struct v7_property *p) {
-  return IS_PACKED_ITER(p) ? 0 : p->attributes;
-}
-
-/* return array index as number or undefined. works with iterators */
-V7_PRIVATE enum v7_err v7_iter_get_index(struct v7 *v7, struct v7_property *p,
-                                         val_t *res) {
-  enum v7_err rcode = V7_OK;
-  int ok;
-  unsigned long res;
-  if (IS_PACKED_ITER(p)) {
-    *res = v7_mk_number(UNPACK_ITER_IDX(p));
-    goto clean;
+  for (pp = &o->properties; p != NULL && *pp != NULL; pp = &pp[0]->next) {
+    if (*pp == p) {
+      *pp = p->next;
+      v7_destroy_property(&p);
+      break;
+    }
   }
-  V7_TRY(str_to_ulong(v7, p->name, &ok, &res));
-  if (!ok || res >= UINT32_MAX) {
-    goto clean;
+  if (da != NULL) {
+    mbuf_free(&da->vals);
+    free(da);
   }
-  *res = v7_mk_number(res);
-  goto clean;
-
-clean:
-  return rcode;
+  o->attributes &= ~V7_OBJ_DENSE_ARRAY;
+  v7_disown(v7, &arr);
 }
-#endif
 
 /* TODO_V7_ERR */
 unsigned long v7_array_length(struct v7 *v7, val_t v) {
@@ -16627,24 +17887,11 @@ unsigned long v7_array_length(struct v7 *v7, val_t v) {
     goto clean;
   }
 
-#if V7_ENABLE_DENSE_ARRAYS
   if (v7_to_object(v)->attributes & V7_OBJ_DENSE_ARRAY) {
-    struct v7_property *p =
-        v7_get_own_property2(v7, v, "", 0, _V7_PROPERTY_HIDDEN);
-    struct mbuf *abuf;
-    if (p == NULL) {
-      len = 0;
-      goto clean;
-    }
-    abuf = (struct mbuf *) v7_to_foreign(p->value);
-    if (abuf == NULL) {
-      len = 0;
-      goto clean;
-    }
-    len = abuf->len / sizeof(val_t);
+    struct v7_dense_array *da = v7_to_dense_array(v7, v);
+    len = (da == NULL) ? 0 : DENSE_ARRAY_LEN(da);
     goto clean;
   }
-#endif
 
   for (p = v7_to_object(v)->properties; p != NULL; p = p->next) {
     int ok = 0;
@@ -16686,15 +17933,23 @@ enum v7_err v7_array_set_throwing(struct v7 *v7, val_t arr, unsigned long index,
   int ires = -1;
 
   if (v7_is_object(arr)) {
-    if (v7_to_object(arr)->attributes & V7_OBJ_DENSE_ARRAY) {
+    struct v7_object *o = v7_to_object(arr);
+    if ((o->attributes & V7_OBJ_DENSE_ARRAY) &&
+        index > DENSE_ARRAY_MAX_INDEX(v7_array_length(v7, arr))) {
+      dense_array_to_sparse(v7, arr);
+    }
+    if (o->attributes & V7_OBJ_DENSE_ARRAY) {
       struct v7_property *p =
           v7_get_own_property2(v7, arr, "", 0, _V7_PROPERTY_HIDDEN);
-      struct mbuf *abuf;
+      struct v7_dense_array *da;
       unsigned long len;
       assert(p != NULL);
-      abuf = (struct mbuf *) v7_to_foreign(p->value);
+      da = (struct v7_dense_array *) v7_to_foreign(p->value);
+      len = (da == NULL) ? 0 : DENSE_ARRAY_LEN(da);
 
-      if (v7_to_object(arr)->attributes & V7_OBJ_NOT_EXTENSIBLE) {
+      /* only the existing elements can be set in a non-extensible array */
+      if ((o->attributes & V7_OBJ_NOT_EXTENSIBLE) &&
+          (index >= len || DENSE_ARRAY_VALS(da)[index] == V7_TAG_NOVALUE)) {
         if (v7->strict_mode) {
           rcode = v7_throwf(v7, TYPE_ERROR, "Object is not extensible");
           goto clean;
@@ -16703,27 +17958,29 @@ enum v7_err v7_array_set_throwing(struct v7 *v7, val_t arr, unsigned long index,
         goto clean;
       }
 
-      if (abuf == NULL) {
-        abuf = (struct mbuf *) malloc(sizeof(*abuf));
-        mbuf_init(abuf, sizeof(val_t) * (index + 1));
-        p->value = v7_mk_foreign(abuf);
+      if (da == NULL) {
+        da = (struct v7_dense_array *) malloc(sizeof(*da));
+        mbuf_init(&da->vals, sizeof(val_t) * (index + 1));
+        da->head = 0;
+        da->v7 = v7;
+        p->value = v7_mk_foreign(da);
       }
-      len = abuf->len / sizeof(val_t);
-      /* TODO(mkm): possibly promote to sparse array */
       if (index > len) {
         unsigned long i;
         val_t s = V7_TAG_NOVALUE;
         for (i = len; i < index; i++) {
-          mbuf_append(abuf, (char *) &s, sizeof(val_t));
+          mbuf_append(&da->vals, (char *) &s, sizeof(val_t));
         }
         len = index;
       }
 
       if (index == len) {
-        mbuf_append(abuf, (char *) &v, sizeof(val_t));
+        mbuf_append(&da->vals, (char *) &v, sizeof(val_t));
       } else {
-        memcpy(abuf->buf + index * sizeof(val_t), &v, sizeof(val_t));
+        DENSE_ARRAY_VALS(da)[index] = v;
       }
+      gc_write_barrier(v7, o);
+      ires = 0;
     } else {
       char buf[20];
       int n = v_sprintf_s(buf, sizeof(buf), "%lu", index);
@@ -16796,6 +18053,8 @@ V7_PRIVATE val_t mk_object(struct v7 *v7, val_t prototype) {
   o->base.entity_id_spec = V7_ENTITY_ID_PART_GEN_OBJ;
 #endif
   o->base.properties = NULL;
+  o->shape = v7->root_shape;
+  o->slots = NULL;
   obj_prototype_set(v7, &o->base, v7_to_object(prototype));
   return v7_object_to_value(&o->base);
 }
@@ -16874,19 +18133,159 @@ V7_PRIVATE struct v7_property *v7_mk_property(struct v7 *v7) {
   return p;
 }
 
-V7_PRIVATE struct v7_property *v7_get_own_property2(struct v7 *v7, val_t obj,
-                                                    const char *name,
-                                                    size_t len,
-                                                    v7_prop_attr_t attrs) {
+/* Shapes {{{ */
+
+V7_PRIVATE void shapes_init(struct v7 *v7) {
+  v7->root_shape = (struct v7_shape *) calloc(1, sizeof(*v7->root_shape));
+  v7->shapes_cnt = (v7->root_shape != NULL) ? 1 : 0;
+}
+
+static void shape_free(struct v7_shape *shape) {
+  struct v7_shape *child, *next;
+  for (child = shape->children; child != NULL; child = next) {
+    next = child->next;
+    shape_free(child);
+  }
+  free(shape);
+}
+
+V7_PRIVATE void shapes_destroy(struct v7 *v7) {
+  if (v7->root_shape != NULL) {
+    shape_free(v7->root_shape);
+  }
+  v7->root_shape = NULL;
+  v7->shapes_cnt = 0;
+}
+
+V7_PRIVATE void obj_drop_shape(struct v7_object *obj) {
+  if (!(obj->attributes & V7_OBJ_FUNCTION)) {
+    struct v7_generic_object *o = (struct v7_generic_object *) obj;
+    free(o->slots);
+    o->slots = NULL;
+    o->shape = NULL;
+  }
+}
+
+V7_PRIVATE void obj_set_shape(struct v7_generic_object *o,
+                              struct v7_shape *shape, struct v7_property *p) {
+  size_t n;
+
+  if (shape == NULL) {
+    obj_drop_shape(&o->base);
+    return;
+  }
+
+  /* `n` is the slot of `p`, grow the slots when it's a power of two */
+  n = shape->count - 1;
+  if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {
+    struct v7_property **slots = (struct v7_property **) realloc(
+        o->slots, (n == 0 ? 4 : 2 * n) * sizeof(*slots));
+    if (slots == NULL) {
+      obj_drop_shape(&o->base);
+      return;
+    }
+    o->slots = slots;
+  }
+  o->slots[n] = p;
+  o->shape = shape;
+}
+
+/*
+ * Returns the shape which results from adding a property `name` to an object
+ * with the given shape, creating it if needed. Returns `NULL` if the object
+ * should go to dictionary mode instead.
+ */
+static struct v7_shape *shape_add_prop(struct v7 *v7, struct v7_shape *shape,
+                                       const char *name, size_t len) {
+  struct v7_shape *s;
+
+  /*
+   * Array indices would create a new shape for each element, so objects
+   * indexed by numbers go straight to dictionary mode.
+   */
+  if (shape->count >= V7_SHAPE_MAX_PROPS || len > 0xffff ||
+      (len > 0 && isdigit((unsigned char) name[0]))) {
+    return NULL;
+  }
+
+  for (s = shape->children; s != NULL; s = s->next) {
+    if (s->name_len == len && memcmp(s->name, name, len) == 0) {
+      return s;
+    }
+  }
+
+  if (v7->shapes_cnt >= V7_MAX_SHAPES ||
+      (s = (struct v7_shape *) calloc(1, sizeof(*s) + len)) == NULL) {
+    return NULL;
+  }
+  s->parent = shape;
+  s->count = shape->count + 1;
+  s->name_len = len;
+  memcpy(s->name, name, len);
+  s->next = shape->children;
+  shape->children = s;
+  v7->shapes_cnt++;
+
+  return s;
+}
+
+/*
+ * Returns the prototype of the object if it's a generic object which is not
+ * in dictionary mode, or `NULL`
+ */
+static struct v7_generic_object *obj_shaped_prototype(
+    struct v7_generic_object *o) {
+  struct v7_object *proto = o->prototype;
+  if (proto == NULL || (proto->attributes & V7_OBJ_FUNCTION) ||
+      ((struct v7_generic_object *) proto)->shape == NULL) {
+    return NULL;
+  }
+  return (struct v7_generic_object *) proto;
+}
+
+static int ic_name_valid(struct v7 *v7, struct v7_prop_ic *ic, val_t name) {
+  return ic->name == name && (((name & V7_TAG_MASK) != V7_TAG_STRING_O &&
+                               !is_rope(name) && !is_atom(name)) ||
+                              ic->epoch == v7->ic_epoch);
+}
+
+static struct v7_property *obj_prop_at(struct v7_generic_object *o,
+                                       size_t pos) {
+  return o->slots[pos];
+}
+
+static size_t obj_prop_pos(struct v7_generic_object *o,
+                           struct v7_property *prop) {
+  size_t pos = 0;
+  while (o->slots[pos] != prop) {
+    pos++;
+  }
+  return pos;
+}
+
+/* }}} Shapes */
+
+/*
+ * Returns true if the name is the canonical value of its contents, see
+ * `v7_find_atom()`. Other names (foreign and owned strings, ropes) can only
+ * be compared by contents.
+ */
+static int is_canonical_name(val_t v) {
+  uint64_t t = v & V7_TAG_MASK;
+  return t == V7_TAG_STRING_I || t == V7_TAG_STRING_5 ||
+         t == V7_TAG_STRING_D || t == V7_TAG_STRING_A;
+}
+
+V7_PRIVATE struct v7_property *v7_get_own_property_key(struct v7 *v7,
+                                                       val_t obj, val_t key,
+                                                       const char *name,
+                                                       size_t len,
+                                                       v7_prop_attr_t attrs) {
   struct v7_property *p;
   struct v7_object *o;
-  val_t ss;
   if (!v7_is_object(obj)) {
     return NULL;
   }
-  if (len == (size_t) ~0) {
-    len = strlen(name);
-  }
 
   o = v7_to_object(obj);
   /*
@@ -16895,39 +18294,32 @@ V7_PRIVATE struct v7_property *v7_get_own_property2(struct v7 *v7, val_t obj,
    * a zero length string anyway, so this will change.
    */
   if (o->attributes & V7_OBJ_DENSE_ARRAY && len > 0) {
-    int ok, has;
-    unsigned long i = cstr_to_ulong(name, len, &ok);
-    if (ok) {
+    int has;
+    unsigned long i;
+    if (cstr_to_array_index(name, len, &i)) {
       v7->cur_dense_prop->value = v7_array_get2(v7, obj, i, &has);
       return has ? v7->cur_dense_prop : NULL;
     }
   }
 
-  if (len <= 5) {
-    ss = v7_mk_string(v7, name, len, 1);
-    for (p = o->properties; p != NULL; p = p->next) {
+  for (p = o->properties; p != NULL; p = p->next) {
 #if defined(V7_ENABLE_ENTITY_IDS)
-      if (p->entity_id != V7_ENTITY_ID_PROP) {
-        fprintf(stderr, "not a prop!=0x%x\n", p->entity_id);
-        abort();
-      }
+    if (p->entity_id != V7_ENTITY_ID_PROP) {
+      fprintf(stderr, "not a prop!=0x%x\n", p->entity_id);
+      abort();
+    }
 #endif
-      if (p->name == ss && (attrs == 0 || (p->attributes & attrs))) {
-        return p;
-      }
+    if (attrs != 0 && !(p->attributes & attrs)) {
+      continue;
     }
-  } else {
-    for (p = o->properties; p != NULL; p = p->next) {
+    if (p->name == key) {
+      return p;
+    }
+    /* Names up to 5 bytes are always inlined, hence canonical */
+    if (len > 5 && !is_canonical_name(p->name)) {
       size_t n;
       const char *s = v7_get_string_data(v7, &p->name, &n);
-#if defined(V7_ENABLE_ENTITY_IDS)
-      if (p->entity_id != V7_ENTITY_ID_PROP) {
-        fprintf(stderr, "not a prop!=0x%x\n", p->entity_id);
-        abort();
-      }
-#endif
-      if (n == len && strncmp(s, name, len) == 0 &&
-          (attrs == 0 || (p->attributes & attrs))) {
+      if (n == len && memcmp(s, name, len) == 0) {
         return p;
       }
     }
@@ -16935,26 +18327,52 @@ V7_PRIVATE struct v7_property *v7_get_own_property2(struct v7 *v7, val_t obj,
   return NULL;
 }
 
+V7_PRIVATE struct v7_property *v7_get_own_property2(struct v7 *v7, val_t obj,
+                                                    const char *name,
+                                                    size_t len,
+                                                    v7_prop_attr_t attrs) {
+  if (!v7_is_object(obj)) {
+    return NULL;
+  }
+  if (len == (size_t) ~0) {
+    len = strlen(name);
+  }
+  return v7_get_own_property_key(v7, obj, v7_find_atom(v7, name, len), name,
+                                 len, attrs);
+}
+
 V7_PRIVATE struct v7_property *v7_get_own_property(struct v7 *v7, val_t obj,
                                                    const char *name,
                                                    size_t len) {
   return v7_get_own_property2(v7, obj, name, len, 0);
 }
 
-V7_PRIVATE struct v7_property *v7_get_property(struct v7 *v7, val_t obj,
-                                               const char *name, size_t len) {
+static struct v7_property *get_property_key(struct v7 *v7, val_t obj,
+                                            val_t key, const char *name,
+                                            size_t len) {
   if (!v7_is_object(obj)) {
     return NULL;
   }
   for (; obj != V7_NULL; obj = obj_prototype_v(v7, obj)) {
     struct v7_property *prop;
-    if ((prop = v7_get_own_property(v7, obj, name, len)) != NULL) {
+    if ((prop = v7_get_own_property_key(v7, obj, key, name, len, 0)) != NULL) {
       return prop;
     }
   }
   return NULL;
 }
 
+V7_PRIVATE struct v7_property *v7_get_property(struct v7 *v7, val_t obj,
+                                               const char *name, size_t len) {
+  if (!v7_is_object(obj)) {
+    return NULL;
+  }
+  if (len == (size_t) ~0) {
+    len = strlen(name);
+  }
+  return get_property_key(v7, obj, v7_find_atom(v7, name, len), name, len);
+}
+
 V7_PRIVATE enum v7_err v7_get_property_v(struct v7 *v7, val_t obj,
                                          v7_val_t name,
                                          struct v7_property **res) {
@@ -16966,6 +18384,11 @@ V7_PRIVATE enum v7_err v7_get_property_v(struct v7 *v7, val_t obj,
 
   if (v7_is_string(name)) {
     s = v7_get_string_data(v7, &name, &name_len);
+    if (is_canonical_name(name)) {
+      /* E.g. an identifier literal: no need to look it up in the atoms */
+      *res = get_property_key(v7, obj, name, s, name_len);
+      goto clean;
+    }
   } else {
     char *stmp;
     V7_TRY(v7_stringify_throwing(v7, name, buf, sizeof(buf),
@@ -17084,6 +18507,58 @@ clean:
   return rcode;
 }
 
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err v7_get_throwing_ic(struct v7 *v7, struct v7_prop_ic *ic,
+                                          v7_val_t obj, v7_val_t name,
+                                          v7_val_t *res) {
+  struct v7_generic_object *o, *holder;
+  struct v7_property *p;
+  const char *s;
+  size_t len;
+
+  if (ic == NULL || !v7_is_generic_object(obj) || !v7_is_string(name) ||
+      (o = v7_to_generic_object(obj))->shape == NULL) {
+    return v7_get_throwing_v(v7, obj, name, res);
+  }
+
+  if (ic->shape == o->shape && ic_name_valid(v7, ic, name)) {
+    /*
+     * Own shape of the object is the same: the property is either at the
+     * cached position, or (if `holder` is set) the object doesn't have it and
+     * we should check the prototype.
+     */
+    holder = (ic->holder == NULL) ? o : obj_shaped_prototype(o);
+    if (holder != NULL && (ic->holder == NULL || holder->shape == ic->holder)) {
+      return v7_property_value(v7, obj, obj_prop_at(holder, ic->pos), res);
+    }
+  }
+
+  /* Cache miss: look up the object itself and its immediate prototype */
+  s = v7_get_string_data(v7, &name, &len);
+  if (len > 0 && isdigit((unsigned char) s[0])) {
+    return v7_get_throwing_v(v7, obj, name, res);
+  }
+
+  holder = o;
+  p = v7_get_own_property(v7, obj, s, len);
+  if (p == NULL) {
+    holder = obj_shaped_prototype(o);
+    if (holder == NULL ||
+        (p = v7_get_own_property(v7, v7_object_to_value(&holder->base), s,
+                                 len)) == NULL) {
+      return v7_get_throwing_v(v7, obj, name, res);
+    }
+  }
+
+  ic->name = name;
+  ic->epoch = v7->ic_epoch;
+  ic->shape = o->shape;
+  ic->holder = (holder == o) ? NULL : holder->shape;
+  ic->pos = obj_prop_pos(holder, p);
+
+  return v7_property_value(v7, obj, p, res);
+}
+
 V7_PRIVATE void v7_destroy_property(struct v7_property **p) {
   *p = NULL;
 }
@@ -17193,6 +18668,80 @@ V7_PRIVATE enum v7_err set_property_v(struct v7 *v7, val_t obj, val_t name,
   return def_property_v(v7, obj, name, 0, val, 1 /*as_assign*/, res);
 }
 
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err set_property_ic(struct v7 *v7, struct v7_prop_ic *ic,
+                                       val_t obj, val_t name, val_t val) {
+  enum v7_err rcode = V7_OK;
+  struct v7_generic_object *o;
+  struct v7_shape *shape;
+  struct v7_property *p = NULL;
+  uint32_t epoch = v7->ic_epoch;
+
+  if (ic == NULL || !v7_is_generic_object(obj) ||
+      (o = v7_to_generic_object(obj))->shape == NULL) {
+    return set_property_v(v7, obj, name, val, NULL);
+  }
+
+  if (ic->shape == o->shape && ic_name_valid(v7, ic, name)) {
+    if (ic->holder == NULL) {
+      /* Assignment to an existing own property */
+      p = obj_prop_at(o, ic->pos);
+      if (!(p->attributes & (V7_PROPERTY_NON_WRITABLE | V7_PROPERTY_GETTER |
+                             V7_PROPERTY_SETTER))) {
+        p->value = val;
+        gc_write_barrier(v7, &o->base);
+        return V7_OK;
+      }
+    } else if (!(o->base.attributes & V7_OBJ_NOT_EXTENSIBLE)) {
+      /* Adding a new property: replay the cached shape transition */
+      shape = ic->holder;
+      v7_own(v7, &name);
+      v7_own(v7, &val);
+      p = v7_mk_property(v7);
+      v7_disown(v7, &val);
+      v7_disown(v7, &name);
+      if (p != NULL) {
+        p->name = v7_intern_string(v7, name);
+        p->value = val;
+        p->attributes = V7_DEFAULT_PROPERTY_ATTRS;
+        p->next = o->base.properties;
+        o->base.properties = p;
+        obj_set_shape(o, shape, p);
+        gc_write_barrier(v7, &o->base);
+        return V7_OK;
+      }
+    }
+  }
+
+  /* Cache miss: do a regular assignment and see what happened */
+  shape = o->shape;
+  V7_TRY(set_property_v(v7, obj, name, val, &p));
+
+  /* Array indices don't live in the property list of dense arrays */
+  if (p != NULL && o->shape != NULL && v7->ic_epoch == epoch &&
+      !(o->base.attributes & V7_OBJ_DENSE_ARRAY)) {
+    if (o->shape == shape) {
+      if (!(p->attributes & (V7_PROPERTY_NON_WRITABLE | V7_PROPERTY_GETTER |
+                             V7_PROPERTY_SETTER))) {
+        ic->name = name;
+        ic->epoch = epoch;
+        ic->shape = shape;
+        ic->holder = NULL;
+        ic->pos = obj_prop_pos(o, p);
+      }
+    } else if (o->shape->parent == shape && p->attributes == 0) {
+      ic->name = name;
+      ic->epoch = epoch;
+      ic->shape = shape;
+      ic->holder = o->shape;
+      ic->pos = 0;
+    }
+  }
+
+clean:
+  return rcode;
+}
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err set_property(struct v7 *v7, val_t obj, const char *name,
                                     size_t len, v7_val_t val,
@@ -17218,6 +18767,26 @@ V7_PRIVATE enum v7_err def_property_v(struct v7 *v7, val_t obj, val_t name,
     goto clean;
   }
 
+  if (v7_to_object(obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    unsigned long i;
+    if (cstr_to_array_index(n, len, &i)) {
+      /* elements of dense arrays can only be plain data properties */
+      if (as_assign && attrs_desc == 0 &&
+          i <= DENSE_ARRAY_MAX_INDEX(v7_array_length(v7, obj))) {
+        int ires = -1;
+        V7_TRY(v7_array_set_throwing(v7, obj, i, val, &ires));
+        prop = NULL;
+        if (ires == 0) {
+          prop = v7->cur_dense_prop;
+          prop->value = val;
+        }
+        goto clean;
+      }
+      dense_array_to_sparse(v7, obj);
+      n = v7_get_string_data(v7, &name, &len);
+    }
+  }
+
   prop = v7_get_own_property(v7, obj, n, len);
   if (prop == NULL) {
     /*
@@ -17243,12 +18812,22 @@ V7_PRIVATE enum v7_err def_property_v(struct v7 *v7, val_t obj, val_t name,
       prop = NULL; /* LCOV_EXCL_LINE */
       goto clean;
     }
-    prop->name = name;
+    prop->name = name = v7_intern_string(v7, name);
     prop->value = val;
     prop->attributes = apply_attrs_desc(attrs_desc, V7_DEFAULT_PROPERTY_ATTRS);
 
     prop->next = v7_to_object(obj)->properties;
     v7_to_object(obj)->properties = prop;
+    gc_write_barrier(v7, v7_to_object(obj));
+
+    if (v7_is_generic_object(obj)) {
+      struct v7_generic_object *o = v7_to_generic_object(obj);
+      if (o->shape != NULL) {
+        /* `name` might have been moved by GC during `v7_mk_property()` */
+        n = v7_get_string_data(v7, &name, &len);
+        obj_set_shape(o, shape_add_prop(v7, o->shape, n, len), prop);
+      }
+    }
     goto clean;
   } else {
     /* Property already exists */
@@ -17316,6 +18895,7 @@ V7_PRIVATE enum v7_err def_property_v(struct v7 *v7, val_t obj, val_t name,
     /* Set value and apply attrs delta */
     if (!(attrs_desc & V7_DESC_PRESERVE_VALUE)) {
       prop->value = val;
+      gc_write_barrier(v7, v7_to_object(obj));
     }
     prop->attributes = apply_attrs_desc(attrs_desc, prop->attributes);
   }
@@ -17348,7 +18928,7 @@ V7_PRIVATE enum v7_err def_property(struct v7 *v7, val_t obj, const char *name,
     len = strlen(name);
   }
 
-  name_val = v7_mk_string(v7, name, len, 1);
+  name_val = v7_mk_atom(v7, name, len);
   V7_TRY(def_property_v(v7, obj, name_val, attrs_desc, val, as_assign, res));
 
 clean:
@@ -17388,6 +18968,26 @@ int v7_del(struct v7 *v7, val_t obj, const char *name, size_t len) {
   if (len == (size_t) ~0) {
     len = strlen(name);
   }
+  if (v7_to_object(obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    /*
+     * Deleted elements are left as holes. Like with ordinary arrays, whose
+     * length is the largest index plus one, trailing holes are dropped.
+     */
+    struct v7_dense_array *da = v7_to_dense_array(v7, obj);
+    unsigned long i;
+    if (cstr_to_array_index(name, len, &i)) {
+      if (da == NULL || i >= DENSE_ARRAY_LEN(da) ||
+          DENSE_ARRAY_VALS(da)[i] == V7_TAG_NOVALUE) {
+        return -1;
+      }
+      DENSE_ARRAY_VALS(da)[i] = V7_TAG_NOVALUE;
+      while (DENSE_ARRAY_LEN(da) > 0 &&
+             DENSE_ARRAY_VALS(da)[DENSE_ARRAY_LEN(da) - 1] == V7_TAG_NOVALUE) {
+        da->vals.len -= sizeof(val_t);
+      }
+      return 0;
+    }
+  }
   for (prev = NULL, prop = v7_to_object(obj)->properties; prop != NULL;
        prev = prop, prop = prop->next) {
     size_t n;
@@ -17399,6 +18999,7 @@ int v7_del(struct v7 *v7, val_t obj, const char *name, size_t len) {
         v7_to_object(obj)->properties = prop->next;
       }
       v7_destroy_property(&prop);
+      obj_drop_shape(v7_to_object(obj));
       return 0;
     }
   }
@@ -17431,9 +19032,47 @@ clean:
   return rcode;
 }
 
+/*
+ * Handles of dense array elements returned by `v7_next_prop()`: the index of
+ * the element, tagged with the lowest bit, which is never set in a property
+ * pointer
+ */
+#define DENSE_ITER(idx) ((void *) (((uintptr_t)(idx) << 1) | 1))
+#define DENSE_ITER_IDX(h) ((uintptr_t)(h) >> 1)
+#define IS_DENSE_ITER(h) ((uintptr_t)(h) &1)
+
 void *v7_next_prop(void *handle, v7_val_t obj, v7_val_t *name, v7_val_t *value,
                    v7_prop_attr_t *attrs) {
   struct v7_property *p;
+
+  if ((v7_to_object(obj)->attributes & V7_OBJ_DENSE_ARRAY) &&
+      (handle == NULL || IS_DENSE_ITER(handle))) {
+    /* No `v7` to look up the backing store by name: it's the foreign one */
+    struct v7_dense_array *da = NULL;
+    size_t i = (handle == NULL) ? 0 : DENSE_ITER_IDX(handle) + 1, len;
+    for (p = v7_to_object(obj)->properties; p != NULL; p = p->next) {
+      if ((p->attributes & _V7_PROPERTY_HIDDEN) && v7_is_foreign(p->value)) {
+        da = (struct v7_dense_array *) v7_to_foreign(p->value);
+        break;
+      }
+    }
+    len = (da == NULL) ? 0 : DENSE_ARRAY_LEN(da);
+
+    while (i < len && DENSE_ARRAY_VALS(da)[i] == V7_TAG_NOVALUE) i++;
+    if (i < len) {
+      if (value != NULL) *value = DENSE_ARRAY_VALS(da)[i];
+      if (attrs != NULL) *attrs = 0;
+      if (name != NULL) {
+        char buf[20];
+        int n = v_sprintf_s(buf, sizeof(buf), "%lu", (unsigned long) i);
+        *name = v7_mk_string(da->v7, buf, n, 1);
+      }
+      return DENSE_ITER(i);
+    }
+    /* elements are over, go on with the property list */
+    handle = NULL;
+  }
+
   if (handle == NULL) {
     p = v7_to_object(obj)->properties;
   } else {
@@ -17454,12 +19093,12 @@ void *v7_next_prop(void *handle, v7_val_t obj, v7_val_t *name, v7_val_t *value,
 V7_PRIVATE int obj_prototype_set(struct v7 *v7, struct v7_object *obj,
                                  struct v7_object *proto) {
   int ret = -1;
-  (void) v7;
 
   if (obj->attributes & V7_OBJ_FUNCTION) {
     ret = -1;
   } else {
     ((struct v7_generic_object *) obj)->prototype = proto;
+    gc_write_barrier(v7, obj);
     ret = 0;
   }
 
@@ -17506,12 +19145,24 @@ V7_PRIVATE int is_prototype_of(struct v7 *v7, val_t o, val_t p) {
   return 0;
 }
 
+V7_PRIVATE val_t ctor_prototype(struct v7 *v7, val_t func) {
+  struct v7_property *p;
+
+  /* the hidden `bound` array of a bound function starts with the target */
+  while (v7_is_object(func) &&
+         (p = v7_get_own_property2(v7, func, "bound", 5,
+                                   _V7_PROPERTY_HIDDEN)) != NULL) {
+    func = v7_array_get(v7, p->value, 0);
+  }
+  return v7_get(v7, func, "prototype", 9);
+}
+
 int v7_is_instanceof(struct v7 *v7, val_t o, const char *c) {
   return v7_is_instanceof_v(v7, o, v7_get(v7, v7->vals.global_object, c, ~0));
 }
 
 int v7_is_instanceof_v(struct v7 *v7, val_t o, val_t c) {
-  return is_prototype_of(v7, o, v7_get(v7, c, "prototype", 9));
+  return is_prototype_of(v7, o, ctor_prototype(v7, c));
 }
 
 v7_val_t v7_set_proto(struct v7 *v7, v7_val_t obj, v7_val_t proto) {
@@ -18542,6 +20193,7 @@ void gc_mark_string(struct v7 *, val_t *);
 
 static struct gc_block *gc_new_block(struct gc_arena *a, size_t size);
 static void gc_free_block(struct gc_block *b);
+static void maybe_minor_gc(struct v7 *v7);
 static void gc_mark_mbuf_pt(struct v7 *v7, const struct mbuf *mbuf);
 static void gc_mark_mbuf_val(struct v7 *v7, const struct mbuf *mbuf);
 static void gc_mark_vec_val(struct v7 *v7, const struct v7_vec *vec);
@@ -18559,6 +20211,10 @@ V7_PRIVATE struct v7_js_function *new_function(struct v7 *v7) {
   return (struct v7_js_function *) gc_alloc_cell(v7, &v7->function_arena);
 }
 
+V7_PRIVATE struct v7_rope *new_rope(struct v7 *v7) {
+  return (struct v7_rope *) gc_alloc_cell(v7, &v7->rope_arena);
+}
+
 V7_PRIVATE struct gc_tmp_frame new_tmp_frame(struct v7 *v7) {
   struct gc_tmp_frame frame;
   frame.v7 = v7;
@@ -18590,6 +20246,7 @@ V7_PRIVATE void gc_arena_init(struct gc_arena *a, size_t cell_size,
   a->name = name;
   a->size_increment = size_increment;
   a->blocks = gc_new_block(a, initial_size);
+  mbuf_init(&a->young, 0);
 }
 
 V7_PRIVATE void gc_arena_destroy(struct v7 *v7, struct gc_arena *a) {
@@ -18604,6 +20261,7 @@ V7_PRIVATE void gc_arena_destroy(struct v7 *v7, struct gc_arena *a) {
       gc_free_block(tmp);
     }
   }
+  mbuf_free(&a->young);
 }
 
 static void gc_free_block(struct gc_block *b) {
@@ -18647,8 +20305,9 @@ V7_PRIVATE void *gc_alloc_cell(struct v7 *v7, struct gc_arena *a) {
   return r;
 #else
   struct gc_cell *r;
-  if (a->free == NULL) {
-    maybe_gc(v7);
+  if (a->free == NULL ||
+      (v7->gc_nursery_size > 0 && v7->gc_young_cnt >= v7->gc_nursery_size)) {
+    maybe_minor_gc(v7);
 
     if (a->free == NULL) {
       struct gc_block *b = gc_new_block(a, a->size_increment);
@@ -18672,6 +20331,11 @@ V7_PRIVATE void *gc_alloc_cell(struct v7 *v7, struct gc_arena *a) {
    * are overwritten downstream, but not worth the yak shave time
    * when fields are added to GC-able structures */
   memset(r, 0, a->cell_size);
+
+#ifndef V7_DISABLE_GC
+  mbuf_append(&a->young, &r, sizeof(r));
+  v7->gc_young_cnt++;
+#endif
   return (void *) r;
 #endif
 }
@@ -18700,15 +20364,17 @@ void gc_sweep_malloc(struct v7 *v7) {
 #endif
 
 /*
- * Scans the arena and add all unmarked cells to the free list.
+ * Scans the arena and add all unmarked cells to the free list. Returns the
+ * number of cells which are still in use.
  *
  * Empty blocks get deallocated. The head of the free list will contais cells
  * from the last (oldest) block. Cells will thus be allocated in block order.
  */
-void gc_sweep(struct v7 *v7, struct gc_arena *a, size_t start) {
+V7_PRIVATE size_t gc_sweep(struct v7 *v7, struct gc_arena *a, size_t start) {
   struct gc_block *b;
   struct gc_cell *cur;
   struct gc_block **prevp = &a->blocks;
+  size_t alive = 0;
 #if V7_ENABLE__Memory__stats
   a->alive = 0;
 #endif
@@ -18745,6 +20411,7 @@ void gc_sweep(struct v7 *v7, struct gc_arena *a, size_t start) {
       if (MARKED(cur)) {
         /* The cell is used and marked  */
         UNMARK(cur);
+        alive++;
 #if V7_ENABLE__Memory__stats
         a->alive++;
 #endif
@@ -18794,43 +20461,75 @@ void gc_sweep(struct v7 *v7, struct gc_arena *a, size_t start) {
       b = b->next;
     }
   }
+
+  return alive;
 }
 
 /*
- * dense arrays contain only one property pointing to an mbuf with array values.
+ * Marks the elements of a dense array, kept in an mbuf pointed to by the
+ * hidden "" property. Other properties are marked by `gc_mark()`.
+ *
+ * The element storage is looked up among own properties only: the prototype
+ * chain may be marked already, and marked cells can't be walked.
  */
 V7_PRIVATE void gc_mark_dense_array(struct v7 *v7,
                                     struct v7_generic_object *obj) {
-  val_t v;
-  struct mbuf *mbuf;
-  val_t *vp;
-
-#if 0
-  /* TODO(mkm): use this when dense array promotion is implemented */
-  v = obj->properties->value;
-#else
-  v = v7_get(v7, v7_object_to_value(&obj->base), "", 0);
-#endif
+  struct v7_dense_array *da;
+  val_t *vp, *end;
 
-  mbuf = (struct mbuf *) v7_to_foreign(v);
+  da = v7_to_dense_array(v7, v7_object_to_value(&obj->base));
 
   /* function scope pointer is aliased to the object's prototype pointer */
   gc_mark(v7, v7_object_to_value(obj_prototype(v7, &obj->base)));
-  MARK(obj);
+  if (da == NULL) return;
 
-  if (mbuf == NULL) return;
-  for (vp = (val_t *) mbuf->buf; (char *) vp < mbuf->buf + mbuf->len; vp++) {
+  MARK(obj);
+  /* dead slots before `head` are never read again, so they aren't marked */
+  end = DENSE_ARRAY_VALS(da) + DENSE_ARRAY_LEN(da);
+  for (vp = DENSE_ARRAY_VALS(da); vp < end; vp++) {
     gc_mark(v7, *vp);
     gc_mark_string(v7, vp);
   }
   UNMARK(obj);
 }
 
+/*
+ * Marks a rope and all strings it references. Recursion happens only along
+ * right children, and is bounded by `V7_ROPE_MAX_DEPTH`.
+ */
+static void gc_mark_rope(struct v7 *v7, val_t v) {
+  while (is_rope(v)) {
+    struct v7_rope *r = to_rope(v);
+
+    if (v7->is_minor_gc && r->old) {
+      return;
+    }
+
+    /* `flat` shares the word with the mark bit, so check it before marking */
+    if (MARKED(r) || r->flat != NULL) {
+      MARK(r);
+      return;
+    }
+    MARK(r);
+
+    gc_mark_rope(v7, r->right);
+    gc_mark_string(v7, &r->right);
+
+    v = r->left;
+    gc_mark_string(v7, &r->left);
+  }
+}
+
 V7_PRIVATE void gc_mark(struct v7 *v7, val_t v) {
   struct v7_object *obj_base;
   struct v7_property *prop;
   struct v7_property *next;
 
+  if (is_rope(v)) {
+    gc_mark_rope(v7, v);
+    return;
+  }
+
   if (!v7_is_object(v)) {
     return;
   }
@@ -18844,11 +20543,26 @@ V7_PRIVATE void gc_mark(struct v7 *v7, val_t v) {
     return;
   }
 
+  if (v7->is_minor_gc && (obj_base->attributes & V7_OBJ_OLD)) {
+    /*
+     * Old objects are not traversed by a minor GC, except for the literals
+     * of functions: the compiler keeps adding them to the bcode of a function
+     * which might have survived a GC already.
+     */
+    if (is_js_function(v) && to_js_function(v)->bcode != NULL) {
+      gc_mark_vec_val(v7, &to_js_function(v)->bcode->lit);
+    }
+    return;
+  }
+
   /*
    * we treat all object like things like objects but they might be functions,
    * gc_gheck_val checks the appropriate arena per actual value type.
+   *
+   * The check walks all the blocks of the arena, so it's left to major GC:
+   * it would dominate the pause of a minor one.
    */
-  if (!gc_check_val(v7, v)) {
+  if (!v7->is_minor_gc && !gc_check_val(v7, v)) {
     abort();
   }
 
@@ -18872,7 +20586,7 @@ V7_PRIVATE void gc_mark(struct v7 *v7, val_t v) {
       break;
     }
 
-    if (!gc_check_ptr(&v7->property_arena, prop)) {
+    if (!v7->is_minor_gc && !gc_check_ptr(&v7->property_arena, prop)) {
       abort();
     }
 
@@ -18885,6 +20599,7 @@ V7_PRIVATE void gc_mark(struct v7 *v7, val_t v) {
     gc_mark_string(v7, &prop->value);
     gc_mark_string(v7, &prop->name);
     gc_mark(v7, prop->value);
+    gc_mark(v7, prop->name);
 
     next = prop->next;
     MARK(prop);
@@ -18925,12 +20640,14 @@ int v7_heap_stat(struct v7 *v7, enum v7_heap_stat_what what) {
       return gc_arena_size(&v7->generic_object_arena) *
                  v7->generic_object_arena.cell_size +
              gc_arena_size(&v7->function_arena) * v7->function_arena.cell_size +
-             gc_arena_size(&v7->property_arena) * v7->property_arena.cell_size;
+             gc_arena_size(&v7->property_arena) * v7->property_arena.cell_size +
+             gc_arena_size(&v7->rope_arena) * v7->rope_arena.cell_size;
     case V7_HEAP_STAT_HEAP_USED:
       return v7->generic_object_arena.alive *
                  v7->generic_object_arena.cell_size +
              v7->function_arena.alive * v7->function_arena.cell_size +
-             v7->property_arena.alive * v7->property_arena.cell_size;
+             v7->property_arena.alive * v7->property_arena.cell_size +
+             v7->rope_arena.alive * v7->rope_arena.cell_size;
     case V7_HEAP_STAT_STRING_HEAP_RESERVED:
       return v7->owned_strings.size;
     case V7_HEAP_STAT_STRING_HEAP_USED:
@@ -19094,17 +20811,28 @@ void gc_mark_string(struct v7 *v7, val_t *v) {
 
 /* clang-format on */
 
+  /* Strings are collected by major GC only, see `gc_minor()` */
+  if (v7->is_minor_gc) {
+    return;
+  }
+
 /*
  * Freeze.
  */
 #ifdef V7_FREEZE
-  if (v7->freeze_file != NULL && (*v & V7_TAG_MASK) == V7_TAG_STRING_O) {
+  if (v7->freeze_file != NULL && ((*v & V7_TAG_MASK) == V7_TAG_STRING_O ||
+                                  (*v & V7_TAG_MASK) == V7_TAG_STRING_A)) {
     printf("Cannot freeze unless all strings are STRING_D or STRING_F:");
     v7_println(v7, *v);
     abort();
   }
 #endif
 
+  if (is_atom(*v)) {
+    to_atom(*v)->marked = 1;
+    return;
+  }
+
   if ((*v & V7_TAG_MASK) != V7_TAG_STRING_O) {
     return;
   }
@@ -19248,6 +20976,13 @@ V7_PRIVATE void maybe_gc(struct v7 *v7) {
     v7_gc(v7, 0);
   }
 }
+
+V7_PRIVATE void gc_write_barrier(struct v7 *v7, struct v7_object *obj) {
+  if ((obj->attributes & (V7_OBJ_OLD | V7_OBJ_REMEMBERED)) == V7_OBJ_OLD) {
+    obj->attributes |= V7_OBJ_REMEMBERED;
+    mbuf_append(&v7->remembered, &obj, sizeof(obj));
+  }
+}
 #if defined(V7_GC_VERBOSE)
 static int gc_pass = 0;
 #endif
@@ -19312,6 +21047,196 @@ static void gc_mark_call_stack(struct v7 *v7,
   }
 }
 
+/*
+ * mark everything which is reachable from the interpreter state
+ */
+static void gc_mark_roots(struct v7 *v7) {
+  gc_mark_call_stack(v7, v7->call_stack);
+
+  gc_mark_val_array(v7, (val_t *) &v7->vals, sizeof(v7->vals) / sizeof(val_t));
+  /* mark all items on bcode stack */
+  gc_mark_mbuf_val(v7, &v7->stack);
+
+  /* mark literals and names of all the active bcodes */
+  gc_mark_mbuf_bcode_pt(v7, &v7->act_bcodes);
+
+  gc_mark_mbuf_pt(v7, &v7->tmp_stack);
+  gc_mark_mbuf_pt(v7, &v7->owned_values);
+}
+
+/*
+ * Sets the flag of the cell which survived a GC, see `gc_minor()`. Properties
+ * don't have one: they are as old as the object they belong to.
+ */
+static void gc_promote(struct v7 *v7, struct gc_arena *a, struct gc_cell *c) {
+  if (a == &v7->rope_arena) {
+    ((struct v7_rope *) c)->old = 1;
+  } else if (a != &v7->property_arena) {
+    ((struct v7_object *) c)->attributes |= V7_OBJ_OLD;
+  }
+}
+
+/*
+ * Promotes the marked cells allocated since the last GC, and forgets them.
+ * Called by the major GC between marking and sweeping.
+ */
+static void gc_promote_young(struct v7 *v7, struct gc_arena *a) {
+  struct gc_cell **cp;
+  for (cp = (struct gc_cell **) a->young.buf;
+       (char *) cp < a->young.buf + a->young.len; cp++) {
+    if (MARKED(*cp)) {
+      gc_promote(v7, a, *cp);
+    }
+  }
+  a->young.len = 0;
+}
+
+#if !V7_MALLOC_GC && !defined(V7_DISABLE_GC)
+/*
+ * Sweeps the cells allocated since the last GC: marked ones get promoted,
+ * the rest go to the free list. Returns the number of promoted cells.
+ */
+static size_t gc_sweep_young(struct v7 *v7, struct gc_arena *a) {
+  struct gc_cell **cp;
+  size_t promoted = 0;
+
+  for (cp = (struct gc_cell **) a->young.buf;
+       (char *) cp < a->young.buf + a->young.len; cp++) {
+    struct gc_cell *cur = *cp;
+    if (MARKED(cur)) {
+      UNMARK(cur);
+      gc_promote(v7, a, cur);
+      promoted++;
+    } else {
+      if (a->destructor != NULL) {
+        a->destructor(v7, cur);
+      }
+      memset(cur, 0, a->cell_size);
+      cur->head.link = a->free;
+      a->free = cur;
+#if V7_ENABLE__Memory__stats
+      a->alive--;
+      a->garbage++;
+#endif
+    }
+  }
+  a->young.len = 0;
+
+  return promoted;
+}
+
+/*
+ * Performs a minor garbage collection.
+ *
+ * Cells which survive a GC are flagged as old (see `V7_OBJ_OLD`), and a minor
+ * GC only considers the cells allocated since the previous GC: it doesn't
+ * traverse old objects, and the sweeping goes through the list of young cells
+ * of each arena instead of the whole heap. Hence its pause depends on the
+ * amount of recently allocated data rather than on the size of the heap.
+ *
+ * The young cells which are referenced only from old objects are found via
+ * the remembered set: `gc_write_barrier()` has to be called whenever a value
+ * is stored into an object, and it records old objects in `v7->remembered`.
+ * Those are traversed as if they were young, and their marks are reset
+ * afterwards.
+ *
+ * Old garbage, as well as all the strings, is reclaimed by major GC only,
+ * i.e. by `v7_gc()`.
+ */
+static void gc_minor(struct v7 *v7) {
+  struct v7_object **rp;
+  struct v7_property *p;
+  size_t young_cnt = v7->gc_young_cnt;
+  size_t promoted = 0, young_ropes, promoted_ropes;
+  clock_t start = 0;
+
+  if (v7->gc_time_budget_us > 0) {
+    start = clock();
+  }
+
+#if defined(V7_GC_VERBOSE)
+  fprintf(stderr, "V7 minor GC pass %d\n", ++gc_pass);
+#endif
+
+  v7->is_minor_gc = 1;
+  for (rp = (struct v7_object **) v7->remembered.buf;
+       (char *) rp < v7->remembered.buf + v7->remembered.len; rp++) {
+    (*rp)->attributes &= ~V7_OBJ_OLD;
+    gc_mark(v7, v7_object_to_value(*rp));
+    (*rp)->attributes |= V7_OBJ_OLD;
+  }
+  gc_mark_roots(v7);
+  v7->is_minor_gc = 0;
+
+  promoted += gc_sweep_young(v7, &v7->generic_object_arena);
+  promoted += gc_sweep_young(v7, &v7->function_arena);
+  promoted += gc_sweep_young(v7, &v7->property_arena);
+  young_ropes = v7->rope_arena.young.len / sizeof(struct gc_cell *);
+  promoted_ropes = gc_sweep_young(v7, &v7->rope_arena);
+  promoted += promoted_ropes;
+
+  /* Remembered objects and their properties are old, so just unmark them */
+  for (rp = (struct v7_object **) v7->remembered.buf;
+       (char *) rp < v7->remembered.buf + v7->remembered.len; rp++) {
+    UNMARK(*rp);
+    for (p = (*rp)->properties; p != NULL; p = p->next) {
+      if (p->attributes & _V7_PROPERTY_OFF_HEAP) {
+        break;
+      }
+      UNMARK(p);
+    }
+    (*rp)->attributes &= ~V7_OBJ_REMEMBERED;
+  }
+  v7->remembered.len = 0;
+
+  v7->gc_young_cnt = 0;
+  v7->gc_promoted_cnt += promoted;
+
+  /* Freed ropes might get reused for other names cached by inline caches */
+  if (promoted_ropes < young_ropes) {
+    v7->ic_epoch++;
+  }
+
+  /*
+   * Adjust the number of allocations between minor passes, so that they fit
+   * into the time budget.
+   */
+  if (v7->gc_time_budget_us > 0) {
+    double us = (double) (clock() - start) * 1000000.0 / CLOCKS_PER_SEC;
+    if (us > v7->gc_time_budget_us) {
+      v7->gc_nursery_size = young_cnt / 2;
+      if (v7->gc_nursery_size < V7_GC_MIN_NURSERY_SIZE) {
+        v7->gc_nursery_size = V7_GC_MIN_NURSERY_SIZE;
+      }
+    } else if (us < v7->gc_time_budget_us / 2 &&
+               young_cnt >= v7->gc_nursery_size) {
+      v7->gc_nursery_size *= 2;
+    }
+  }
+}
+#endif
+
+/*
+ * Performs GC on allocation, if not inhibited: a minor one, unless the number
+ * of cells promoted since the last major GC exceeds the number of cells which
+ * survived it. That is, old garbage can at most double the heap.
+ */
+static void maybe_minor_gc(struct v7 *v7) {
+#if !V7_MALLOC_GC && !defined(V7_DISABLE_GC)
+  if (v7->inhibit_gc) {
+    return;
+  }
+
+  if (v7->gc_promoted_cnt > v7->gc_old_cnt) {
+    v7_gc(v7, 0);
+  } else {
+    gc_minor(v7);
+  }
+#else
+  (void) v7;
+#endif
+}
+
 /* Perform garbage collection */
 void v7_gc(struct v7 *v7, int full) {
 #ifdef V7_DISABLE_GC
@@ -19328,27 +21253,53 @@ void v7_gc(struct v7 *v7, int full) {
   gc_dump_arena_stats("Before GC functions", &v7->function_arena);
   gc_dump_arena_stats("Before GC properties", &v7->property_arena);
 
-  gc_mark_call_stack(v7, v7->call_stack);
-
-  gc_mark_val_array(v7, (val_t *) &v7->vals, sizeof(v7->vals) / sizeof(val_t));
-  /* mark all items on bcode stack */
-  gc_mark_mbuf_val(v7, &v7->stack);
-
-  /* mark literals and names of all the active bcodes */
-  gc_mark_mbuf_bcode_pt(v7, &v7->act_bcodes);
-
-  gc_mark_mbuf_pt(v7, &v7->tmp_stack);
-  gc_mark_mbuf_pt(v7, &v7->owned_values);
+  gc_mark_roots(v7);
 
   gc_compact_strings(v7);
+  v7->rope_flat_size = 0;
+
+  /*
+   * If live strings still fill up most of the buffer, make some room
+   * proportional to them: otherwise the very next string allocation would
+   * trigger GC again, e.g. while many small rope leaves are alive.
+   */
+  if ((double) v7->owned_strings.len / (double) v7->owned_strings.size > 0.9) {
+    heapusage_dont_count(1);
+    mbuf_resize(&v7->owned_strings, v7->owned_strings.len +
+                                        v7->owned_strings.len / 4 +
+                                        _V7_STRING_BUF_RESERVE);
+    heapusage_dont_count(0);
+  }
+
+  /* Owned strings got new values: invalidate inline caches keyed by them */
+  v7->ic_epoch++;
+
+  /* Everything that survives is old now, see `gc_minor()` */
+  gc_promote_young(v7, &v7->generic_object_arena);
+  gc_promote_young(v7, &v7->function_arena);
+  gc_promote_young(v7, &v7->property_arena);
+  gc_promote_young(v7, &v7->rope_arena);
+  {
+    struct v7_object **rp;
+    for (rp = (struct v7_object **) v7->remembered.buf;
+         (char *) rp < v7->remembered.buf + v7->remembered.len; rp++) {
+      (*rp)->attributes &= ~V7_OBJ_REMEMBERED;
+    }
+    v7->remembered.len = 0;
+  }
 
 #ifdef V7_MALLOC_GC
   gc_sweep_malloc(v7);
 #else
-  gc_sweep(v7, &v7->generic_object_arena, 0);
-  gc_sweep(v7, &v7->function_arena, 0);
-  gc_sweep(v7, &v7->property_arena, 0);
+  v7->gc_old_cnt = gc_sweep(v7, &v7->generic_object_arena, 0) +
+                   gc_sweep(v7, &v7->function_arena, 0) +
+                   gc_sweep(v7, &v7->property_arena, 0) +
+                   gc_sweep(v7, &v7->rope_arena, 0);
 #endif
+  v7->gc_young_cnt = 0;
+  v7->gc_promoted_cnt = 0;
+
+  atoms_sweep(v7);
 
   gc_dump_arena_stats("After GC objects", &v7->generic_object_arena);
   gc_dump_arena_stats("After GC functions", &v7->function_arena);
@@ -22354,7 +24305,80 @@ static lit_t string_lit(struct bcode_builder *bbuilder, struct ast *a,
   (void) v;
   (void) m;
 #endif
-  return bcode_add_lit(bbuilder, v7_mk_string(bbuilder->v7, name, name_len, 1));
+  return bcode_add_lit(bbuilder, v7_mk_atom(bbuilder->v7, name, name_len));
+}
+
+/*
+ * Reference to a variable: either a frame slot of the function being compiled
+ * (see `bcode::uses_slots`), or a name literal to look up in the scope chain.
+ */
+struct var_ref {
+  int slot; /* -1 if the variable is looked up by name */
+  lit_t lit;
+};
+
+/*
+ * Returns index of the frame slot which would hold the variable `name` if
+ * the function being compiled used frame slots, or -1 if there is no such
+ * slot.
+ *
+ * If the name is declared more than once, the last declaration wins, just
+ * like it does when the names are defined on a scope object.
+ */
+static int name_slot(struct bcode_builder *bbuilder, const char *name,
+                     size_t name_len) {
+  char *ops = bbuilder->ops.buf;
+  char *s;
+  size_t i, len;
+  int slot = -1;
+
+  for (i = 0; i < bbuilder->bcode->names_cnt; i++) {
+    ops = bcode_next_name(ops, &s, &len);
+    if (len == name_len && memcmp(s, name, len) == 0) {
+      slot = i;
+    }
+  }
+
+  if (slot < 0 && name_len == 9 && memcmp(name, "arguments", 9) == 0) {
+    slot = bbuilder->bcode->names_cnt;
+  }
+
+  return slot;
+}
+
+/*
+ * Fetches the name of the identifier at `pos` (which should point right after
+ * the tag), and resolves it to either a frame slot or a name literal.
+ */
+static void var_ref(struct bcode_builder *bbuilder, struct ast *a,
+                    ast_off_t *pos, struct var_ref *ref) {
+  size_t name_len;
+  char *name = ast_get_inlined_data(a, *pos, &name_len);
+
+  ref->slot = -1;
+  if (bbuilder->bcode->uses_slots) {
+    ref->slot = name_slot(bbuilder, name, name_len);
+  }
+
+  if (ref->slot < 0) {
+    ref->lit = string_lit(bbuilder, a, pos);
+  } else {
+    ast_move_to_children(a, pos);
+  }
+}
+
+/*
+ * Emits `op` (one of `OP_GET_VAR`, `OP_SAFE_GET_VAR`, `OP_SET_VAR`) for the
+ * given variable, or its frame slot counterpart.
+ */
+static void bcode_op_var(struct bcode_builder *bbuilder, enum opcode op,
+                         const struct var_ref *ref) {
+  if (ref->slot < 0) {
+    bcode_op_lit(bbuilder, op, ref->lit);
+  } else {
+    bcode_op(bbuilder, op == OP_SET_VAR ? OP_SET_LOCAL : OP_GET_LOCAL);
+    bcode_add_varint(bbuilder, ref->slot);
+  }
 }
 
 #if V7_ENABLE__RegExp
@@ -22436,6 +24460,7 @@ clean:
 static enum v7_err compile_assign(struct bcode_builder *bbuilder, struct ast *a,
                                   ast_off_t *pos, enum ast_tag tag) {
   lit_t lit;
+  struct var_ref ref;
   enum ast_tag ntag;
   enum v7_err rcode = V7_OK;
   struct v7 *v7 = bbuilder->v7;
@@ -22444,13 +24469,13 @@ static enum v7_err compile_assign(struct bcode_builder *bbuilder, struct ast *a,
 
   switch (ntag) {
     case AST_IDENT:
-      lit = string_lit(bbuilder, a, pos);
+      var_ref(bbuilder, a, pos, &ref);
       if (tag != AST_ASSIGN) {
-        bcode_op_lit(bbuilder, OP_GET_VAR, lit);
+        bcode_op_var(bbuilder, OP_GET_VAR, &ref);
       }
 
       V7_TRY(eval_assign_rhs(bbuilder, a, pos, tag));
-      bcode_op_lit(bbuilder, OP_SET_VAR, lit);
+      bcode_op_var(bbuilder, OP_SET_VAR, &ref);
 
       fixup_post_op(bbuilder, tag);
       break;
@@ -22659,9 +24684,16 @@ V7_PRIVATE enum v7_err compile_delete(struct bcode_builder *bbuilder,
     case AST_IDENT:
       /* Delete the scope variable (or throw an error if strict mode) */
       if (!bbuilder->bcode->strict_mode) {
-        /* put a property name */
-        bcode_push_lit(bbuilder, string_lit(bbuilder, a, pos));
-        bcode_op(bbuilder, OP_DELETE_VAR);
+        struct var_ref ref;
+        var_ref(bbuilder, a, pos, &ref);
+        if (ref.slot >= 0) {
+          /* function names are not configurable */
+          bcode_op(bbuilder, OP_PUSH_FALSE);
+        } else {
+          /* put a property name */
+          bcode_push_lit(bbuilder, ref.lit);
+          bcode_op(bbuilder, OP_DELETE_VAR);
+        }
       } else {
         rcode =
             v7_throwf(bbuilder->v7, SYNTAX_ERROR,
@@ -22740,9 +24772,12 @@ V7_PRIVATE enum v7_err compile_expr_builder(struct bcode_builder *bbuilder,
       V7_TRY(compile_expr_builder(bbuilder, a, pos));
       bcode_op(bbuilder, OP_NEG);
       break;
-    case AST_IDENT:
-      bcode_op_lit(bbuilder, OP_GET_VAR, string_lit(bbuilder, a, pos));
+    case AST_IDENT: {
+      struct var_ref ref;
+      var_ref(bbuilder, a, pos, &ref);
+      bcode_op_var(bbuilder, OP_GET_VAR, &ref);
       break;
+    }
     case AST_MEMBER:
     case AST_INDEX:
       /*
@@ -22764,8 +24799,10 @@ V7_PRIVATE enum v7_err compile_expr_builder(struct bcode_builder *bbuilder,
     case AST_TYPEOF: {
       ast_off_t peek = *pos;
       if ((tag = ast_fetch_tag(a, &peek)) == AST_IDENT) {
+        struct var_ref ref;
         *pos = peek;
-        bcode_op_lit(bbuilder, OP_SAFE_GET_VAR, string_lit(bbuilder, a, pos));
+        var_ref(bbuilder, a, pos, &ref);
+        bcode_op_var(bbuilder, OP_SAFE_GET_VAR, &ref);
       } else {
         V7_TRY(compile_expr_builder(bbuilder, a, pos));
       }
@@ -23643,7 +25680,7 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
        */
       if (tag == AST_VAR) {
         ast_off_t fvar_end;
-        lit_t lit;
+        struct var_ref ref;
 
         *pos = lookahead;
         fvar_end = ast_get_skip(a, *pos, AST_END_SKIP);
@@ -23657,11 +25694,11 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
           tag = ast_fetch_tag(a, pos);
           /* Only var declarations are allowed (not function declarations) */
           V7_CHECK_INTERNAL(tag == AST_VAR_DECL);
-          lit = string_lit(bbuilder, a, pos);
+          var_ref(bbuilder, a, pos, &ref);
           V7_TRY(compile_expr_builder(bbuilder, a, pos));
 
           /* Just like an assigment */
-          bcode_op_lit(bbuilder, OP_SET_VAR, lit);
+          bcode_op_var(bbuilder, OP_SET_VAR, &ref);
 
           /* INIT is stack-neutral */
           bcode_op(bbuilder, OP_DROP);
@@ -23754,7 +25791,7 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
      *
      */
     case AST_FOR_IN: {
-      lit_t lit;
+      struct var_ref ref;
       bcode_off_t loop_label, loop_target, end_label, brend_label,
           continue_label, pop_label, continue_target;
       ast_off_t end = ast_get_skip(a, *pos, AST_END_SKIP);
@@ -23767,11 +25804,11 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
         ast_move_to_children(a, pos);
         tag = ast_fetch_tag(a, pos);
         V7_CHECK_INTERNAL(tag == AST_VAR_DECL);
-        lit = string_lit(bbuilder, a, pos);
+        var_ref(bbuilder, a, pos, &ref);
         ast_skip_tree(a, pos);
       } else {
         V7_CHECK_INTERNAL(tag == AST_IDENT);
-        lit = string_lit(bbuilder, a, pos);
+        var_ref(bbuilder, a, pos, &ref);
       }
 
       /*
@@ -23811,7 +25848,7 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
 
       bcode_op(bbuilder, OP_NEXT_PROP);
       end_label = bcode_op_target(bbuilder, OP_JMP_FALSE);
-      bcode_op_lit(bbuilder, OP_SET_VAR, lit);
+      bcode_op_var(bbuilder, OP_SET_VAR, &ref);
 
       /*
        * The stash register contains the value of the previous statement,
@@ -23912,7 +25949,7 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
        * no new variables should be created in it. A var decl thus
        * behaves as a normal assignment at runtime.
        */
-      lit_t lit;
+      struct var_ref ref;
       end = ast_get_skip(a, *pos, AST_END_SKIP);
       ast_move_to_children(a, pos);
       while (*pos < end) {
@@ -23935,9 +25972,9 @@ V7_PRIVATE enum v7_err compile_stmt(struct bcode_builder *bbuilder,
            * stack-neutral: `1; var a = 5;` yields `1`, not `5`.
            */
           V7_CHECK_INTERNAL(tag == AST_VAR_DECL);
-          lit = string_lit(bbuilder, a, pos);
+          var_ref(bbuilder, a, pos, &ref);
           V7_TRY(compile_expr_builder(bbuilder, a, pos));
-          bcode_op_lit(bbuilder, OP_SET_VAR, lit);
+          bcode_op_var(bbuilder, OP_SET_VAR, &ref);
 
           /* `var` declaration is stack-neutral */
           bcode_op(bbuilder, OP_DROP);
@@ -23964,6 +26001,81 @@ clean:
   return rcode;
 }
 
+/*
+ * Returns non-zero if the function body in the range `[pos, end)` might need
+ * to look up the function's names in a scope object at runtime: nested
+ * functions (closures), `with` and `eval` do. So does a `catch` parameter
+ * which shadows one of the function's names, since that shadowing is
+ * resolved at runtime.
+ */
+static int scope_is_needed(struct bcode_builder *bbuilder, struct ast *a,
+                           ast_off_t pos, ast_off_t end) {
+  char *name;
+  size_t name_len;
+
+  if (name_slot(bbuilder, "arguments", 9) != bbuilder->bcode->names_cnt) {
+    /* `arguments` is redeclared */
+    return 1;
+  }
+
+  while (pos < end) {
+    enum ast_tag tag = ast_fetch_tag(a, &pos);
+    switch (tag) {
+      case AST_FUNC:
+      case AST_WITH:
+        return 1;
+      case AST_IDENT:
+      case AST_MEMBER:
+        name = ast_get_inlined_data(a, pos, &name_len);
+        if (name_len == 4 && memcmp(name, "eval", 4) == 0) {
+          return 1;
+        }
+        break;
+      case AST_TRY: {
+        ast_off_t acatch = ast_get_skip(a, pos, AST_TRY_CATCH_SKIP);
+        if (acatch != ast_get_skip(a, pos, AST_TRY_FINALLY_SKIP) &&
+            ast_fetch_tag(a, &acatch) == AST_IDENT) {
+          name = ast_get_inlined_data(a, acatch, &name_len);
+          if (name_slot(bbuilder, name, name_len) >= 0) {
+            return 1;
+          }
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    ast_move_to_children(a, &pos);
+  }
+
+  return 0;
+}
+
+/*
+ * Returns non-zero if the function body in the range `[pos, end)` might refer
+ * to the function's `arguments` object: either by name, or via `eval`.
+ * Nested functions are not skipped, so the answer is conservative.
+ */
+static int arguments_are_used(struct ast *a, ast_off_t pos, ast_off_t end) {
+  char *name;
+  size_t name_len;
+
+  while (pos < end) {
+    enum ast_tag tag = ast_fetch_tag(a, &pos);
+    if (tag == AST_IDENT || tag == AST_MEMBER) {
+      name = ast_get_inlined_data(a, pos, &name_len);
+      if ((tag == AST_IDENT && name_len == 9 &&
+           memcmp(name, "arguments", 9) == 0) ||
+          (name_len == 4 && memcmp(name, "eval", 4) == 0)) {
+        return 1;
+      }
+    }
+    ast_move_to_children(a, &pos);
+  }
+
+  return 0;
+}
+
 static enum v7_err compile_body(struct bcode_builder *bbuilder, struct ast *a,
                                 ast_off_t start, ast_off_t end, ast_off_t body,
                                 ast_off_t fvar, ast_off_t *pos) {
@@ -23993,6 +26105,19 @@ static enum v7_err compile_body(struct bcode_builder *bbuilder, struct ast *a,
    */
   V7_TRY(compile_local_vars(bbuilder, a, start, fvar));
 
+  /*
+   * If nothing in the function body needs a scope object, keep the
+   * function's names in frame slots, and resolve them right here. Also see
+   * whether the `arguments` object has to be created on calls.
+   */
+  {
+    ast_off_t tmp_pos = start;
+    if (ast_fetch_tag(a, &tmp_pos) == AST_FUNC) {
+      bbuilder->bcode->uses_slots = !scope_is_needed(bbuilder, a, body, end);
+      bbuilder->bcode->uses_arguments = arguments_are_used(a, body, end);
+    }
+  }
+
   /* compile body */
   *pos = body;
   V7_TRY(compile_stmts(bbuilder, a, pos, end));
@@ -24457,92 +26582,6 @@ V7_PRIVATE void init_stdlib(struct v7 *v7) {
 extern "C" {
 #endif /* __cplusplus */
 
-static const char js_array_indexOf[] = STRINGIFY(
-    Object.defineProperty(Array.prototype, "indexOf", {
-      writable:true,
-      configurable: true,
-      value: function(a, x) {
-        var i; var r = -1; var b = +x;
-        if (!b || b < 0) b = 0;
-        for (i in this) if (i >= b && (r < 0 || i < r) && this[i] === a) r = +i;
-        return r;
-    }}););
-
-static const char js_array_lastIndexOf[] = STRINGIFY(
-    Object.defineProperty(Array.prototype, "lastIndexOf", {
-      writable:true,
-      configurable: true,
-      value: function(a, x) {
-        var i; var r = -1; var b = +x;
-        if (isNaN(b) || b < 0 || b >= this.length) b = this.length - 1;
-        for (i in this) if (i <= b && (r < 0 || i > r) && this[i] === a) r = +i;
-        return r;
-    }}););
-
-#if V7_ENABLE__Array__reduce
-static const char js_array_reduce[] = STRINGIFY(
-    Object.defineProperty(Array.prototype, "reduce", {
-      writable:true,
-      configurable: true,
-      value: function(a, b) {
-        var f = 0;
-        if (typeof(a) != "function") {
-          throw new TypeError(a + " is not a function");
-        }
-        for (var k in this) {
-          if (k > this.length) break;
-          if (f == 0 && b === undefined) {
-            b = this[k];
-            f = 1;
-          } else {
-            b = a(b, this[k], k, this);
-          }
-        }
-        return b;
-    }}););
-#endif
-
-static const char js_array_pop[] = STRINGIFY(
-    Object.defineProperty(Array.prototype, "pop", {
-      writable:true,
-      configurable: true,
-      value: function() {
-      var i = this.length - 1;
-        return this.splice(i, 1)[0];
-    }}););
-
-static const char js_array_shift[] = STRINGIFY(
-    Object.defineProperty(Array.prototype, "shift", {
-      writable:true,
-      configurable: true,
-      value: function() {
-        return this.splice(0, 1)[0];
-    }}););
-
-#if V7_ENABLE__Function__call
-static const char js_function_call[] = STRINGIFY(
-    Object.defineProperty(Function.prototype, "call", {
-      writable:true,
-      configurable: true,
-      value: function() {
-        var t = arguments.splice(0, 1)[0];
-        return this.apply(t, arguments);
-    }}););
-#endif
-
-#if V7_ENABLE__Function__bind
-static const char js_function_bind[] = STRINGIFY(
-    Object.defineProperty(Function.prototype, "bind", {
-      writable:true,
-      configurable: true,
-      value: function(t) {
-        var f = this;
-        return function() {
-          return f.apply(t, arguments);
-        };
-    }}););
-#endif
-
 #if V7_ENABLE__Blob
 static const char js_Blob[] = STRINGIFY(
     function Blob(a) {
@@ -24554,42 +26593,19 @@ static const char * const js_functions[] = {
 #if V7_ENABLE__Blob
   js_Blob,
 #endif
-#if V7_ENABLE__Function__call
-  js_function_call,
-#endif
-#if V7_ENABLE__Function__bind
-  js_function_bind,
-#endif
-#if V7_ENABLE__Array__reduce
-  js_array_reduce,
-#endif
-  js_array_indexOf,
-  js_array_lastIndexOf,
-  js_array_pop,
-  js_array_shift
+  NULL
 };
 
  V7_PRIVATE void init_js_stdlib(struct v7 *v7) {
   val_t res;
   int i;
 
-  for(i = 0; i < (int) ARRAY_SIZE(js_functions); i++) {
+  for(i = 0; js_functions[i] != NULL; i++) {
     if (v7_exec(v7, js_functions[i], &res) != V7_OK) {
       fprintf(stderr, "ex: %s:\n", js_functions[i]);
       v7_fprintln(stderr, v7, res);
     }
   }
-
-  /* TODO(lsm): re-enable in a separate PR */
-#if 0
-  v7_exec(v7, &res, STRINGIFY(
-    Array.prototype.unshift = function() {
-      var a = new Array(0, 0);
-      Array.prototype.push.apply(a, arguments);
-      Array.prototype.splice.apply(this, a);
-      return this.length;
-    };));
-#endif
 }
 
 #if defined(__cplusplus)
@@ -26749,20 +28765,13 @@ V7_PRIVATE enum v7_err Obj_isPrototypeOf(struct v7 *v7, v7_val_t *res) {
  * with the iteration order if properties in `for in`
  * This will be obsoleted when arrays will have a special object type.
  */
-static void _Obj_append_reverse(struct v7 *v7, struct v7_property *p, val_t res,
-                                int i, v7_prop_attr_t ignore_flags) {
-  while (p && p->attributes & ignore_flags) p = p->next;
-  if (p == NULL) return;
-  if (p->next) _Obj_append_reverse(v7, p->next, res, i + 1, ignore_flags);
-
-  v7_array_set(v7, res, i, p->name);
-}
-
 WARN_UNUSED_RESULT
 static enum v7_err _Obj_ownKeys(struct v7 *v7, unsigned int ignore_flags,
                                 val_t *res) {
   enum v7_err rcode = V7_OK;
-  val_t obj = v7_arg(v7, 0);
+  val_t obj = v7_arg(v7, 0), name = v7_mk_undefined();
+  v7_prop_attr_t attrs;
+  void *h = NULL;
 
   *res = v7_mk_dense_array(v7);
 
@@ -26771,7 +28780,11 @@ static enum v7_err _Obj_ownKeys(struct v7 *v7, unsigned int ignore_flags,
     goto clean;
   }
 
-  _Obj_append_reverse(v7, v7_to_object(obj)->properties, *res, 0, ignore_flags);
+  while ((h = v7_next_prop(h, obj, &name, NULL, &attrs)) != NULL) {
+    if (!(attrs & ignore_flags)) {
+      v7_array_push(v7, *res, name);
+    }
+  }
 
 clean:
   return rcode;
@@ -27093,6 +29106,12 @@ V7_PRIVATE enum v7_err Obj_valueOf(struct v7 *v7, v7_val_t *res) {
     goto clean;
   }
 
+  /* The hidden "" property of a dense array is its backing mbuf */
+  if (v7_is_object(this_obj) &&
+      (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY)) {
+    goto clean;
+  }
+
   p = v7_get_own_property2(v7, this_obj, "", 0, _V7_PROPERTY_HIDDEN);
   if (p != NULL) {
     *res = p->value;
@@ -27612,18 +29631,477 @@ V7_PRIVATE void init_number(struct v7 *v7) {
  * All rights reserved
  */
 
+/* Amalgamated: #include "common/utf.h" */
 /* Amalgamated: #include "v7/src/internal.h" */
 /* Amalgamated: #include "v7/src/stdlib.h" */
 /* Amalgamated: #include "v7/src/core.h" */
 /* Amalgamated: #include "v7/src/object.h" */
+/* Amalgamated: #include "v7/src/array.h" */
 /* Amalgamated: #include "v7/src/conversion.h" */
 /* Amalgamated: #include "v7/src/string.h" */
 /* Amalgamated: #include "v7/src/primitive.h" */
+/* Amalgamated: #include "v7/src/exceptions.h" */
 
 #if defined(__cplusplus)
 extern "C" {
 #endif /* __cplusplus */
 
+/*
+ * JSON parser.
+ *
+ * It's a byte-driven state machine which keeps all of its state in
+ * `struct v7_json_parser`, so the text can be fed in arbitrary chunks. Arrays
+ * and objects are linked into their parents as soon as they are opened, and
+ * scalar values are put into the innermost open container right when they
+ * end, so the whole value is built in a single pass, with no AST or bytecode
+ * involved.
+ */
+
+enum json_parser_state {
+  JSON_ST_VALUE,        /* value is expected */
+  JSON_ST_ARRAY_FIRST,  /* after `[`: value or `]` is expected */
+  JSON_ST_OBJECT_FIRST, /* after `{`: key or `}` is expected */
+  JSON_ST_KEY,          /* after `,` in object: key is expected */
+  JSON_ST_COLON,        /* after key: `:` is expected */
+  JSON_ST_NEXT,         /* after value in container: `,` or end is expected */
+  JSON_ST_STRING,       /* inside a string */
+  JSON_ST_ESCAPE,       /* after `\` inside a string */
+  JSON_ST_UNICODE,      /* inside `\uXXXX` escape */
+  JSON_ST_NUMBER,       /* inside a number */
+  JSON_ST_LITERAL,      /* inside `true`, `false` or `null` */
+  JSON_ST_DONE,         /* value is complete, only whitespace may follow */
+  JSON_ST_ERROR
+};
+
+struct v7_json_parser {
+  struct v7 *v7;
+  /*
+   * Open arrays and objects, innermost last: item `(2 * i)` is a container,
+   * and item `(2 * i + 1)` is the name of its pending property.
+   */
+  val_t stack;
+  val_t value;     /* outermost value */
+  struct mbuf tok; /* text of the current string, number or literal */
+  size_t depth;    /* number of open containers */
+  size_t offset;   /* number of bytes consumed, for error messages */
+  Rune rune;       /* `\uXXXX` being decoded */
+  uint8_t hex_cnt; /* number of hex digits of `rune` seen so far */
+  uint8_t is_key;  /* the current string is a property name */
+  uint8_t state;   /* one of `enum json_parser_state` */
+};
+
+static enum v7_err json_syntax_error(struct v7_json_parser *jp) {
+  enum v7_err rcode = v7_throwf(jp->v7, SYNTAX_ERROR,
+                                "Invalid JSON at offset %lu",
+                                (unsigned long) jp->offset);
+  (void) rcode;
+  jp->state = JSON_ST_ERROR;
+  return V7_SYNTAX_ERROR;
+}
+
+static val_t json_container(struct v7_json_parser *jp) {
+  return v7_array_get(jp->v7, jp->stack, 2 * (jp->depth - 1));
+}
+
+/*
+ * Puts the complete value `v` into the innermost open container, or makes it
+ * the outermost value.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_add_value(struct v7_json_parser *jp, val_t v) {
+  enum v7_err rcode = V7_OK;
+  struct v7 *v7 = jp->v7;
+  val_t c;
+
+  if (jp->depth == 0) {
+    jp->value = v;
+    jp->state = JSON_ST_DONE;
+    goto clean;
+  }
+
+  c = json_container(jp);
+  if (v7_is_array(v7, c)) {
+    V7_TRY(v7_array_push_throwing(v7, c, v, NULL));
+  } else {
+    val_t name = v7_array_get(v7, jp->stack, 2 * jp->depth - 1);
+    V7_TRY(set_property_v(v7, c, name, v, NULL));
+  }
+  jp->state = JSON_ST_NEXT;
+
+clean:
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+static enum v7_err json_open(struct v7_json_parser *jp, int is_array) {
+  enum v7_err rcode = V7_OK;
+  struct v7 *v7 = jp->v7;
+  val_t c = is_array ? v7_mk_dense_array(v7) : v7_mk_object(v7);
+
+  V7_TRY(json_add_value(jp, c));
+
+  v7_array_set(v7, jp->stack, 2 * jp->depth, c);
+  v7_array_set(v7, jp->stack, 2 * jp->depth + 1, v7_mk_undefined());
+  jp->depth++;
+  jp->state = is_array ? JSON_ST_ARRAY_FIRST : JSON_ST_OBJECT_FIRST;
+
+clean:
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+static enum v7_err json_close(struct v7_json_parser *jp, int is_array) {
+  if (jp->depth == 0 || !!v7_is_array(jp->v7, json_container(jp)) != is_array) {
+    return json_syntax_error(jp);
+  }
+  jp->depth--;
+  jp->state = jp->depth > 0 ? JSON_ST_NEXT : JSON_ST_DONE;
+  return V7_OK;
+}
+
+static void json_start_token(struct v7_json_parser *jp,
+                             enum json_parser_state st, int c) {
+  char ch = (char) c;
+  jp->tok.len = 0;
+  if (c != '"') {
+    mbuf_append(&jp->tok, &ch, 1);
+  }
+  jp->state = st;
+}
+
+/*
+ * Skips decimal digits, returns the number of digits skipped
+ */
+static size_t json_skip_digits(const char **s, const char *end) {
+  const char *start = *s;
+  while (*s < end && isdigit((unsigned char) **s)) {
+    (*s)++;
+  }
+  return *s - start;
+}
+
+static int json_number_is_valid(const char *s, size_t len) {
+  const char *end = s + len;
+
+  if (s < end && *s == '-') {
+    s++;
+  }
+  if (s < end && *s == '0') {
+    s++;
+  } else if (json_skip_digits(&s, end) == 0) {
+    return 0;
+  }
+  if (s < end && *s == '.') {
+    s++;
+    if (json_skip_digits(&s, end) == 0) {
+      return 0;
+    }
+  }
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    s++;
+    if (s < end && (*s == '+' || *s == '-')) {
+      s++;
+    }
+    if (json_skip_digits(&s, end) == 0) {
+      return 0;
+    }
+  }
+
+  return s == end;
+}
+
+/*
+ * Completes a number or a literal, whose text is in `jp->tok`.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_end_token(struct v7_json_parser *jp) {
+  const char *s = jp->tok.buf;
+  size_t len = jp->tok.len;
+
+  if (jp->state == JSON_ST_NUMBER) {
+    if (!json_number_is_valid(s, len)) {
+      return json_syntax_error(jp);
+    }
+    mbuf_append(&jp->tok, "", 1);
+    return json_add_value(jp, v7_mk_number(strtod(jp->tok.buf, NULL)));
+  } else if (len == 4 && memcmp(s, "true", 4) == 0) {
+    return json_add_value(jp, v7_mk_boolean(1));
+  } else if (len == 5 && memcmp(s, "false", 5) == 0) {
+    return json_add_value(jp, v7_mk_boolean(0));
+  } else if (len == 4 && memcmp(s, "null", 4) == 0) {
+    return json_add_value(jp, v7_mk_null());
+  } else {
+    return json_syntax_error(jp);
+  }
+}
+
+/*
+ * Handles the first character `c` of a value.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_start_value(struct v7_json_parser *jp, int c) {
+  if (c == '{' || c == '[') {
+    return json_open(jp, c == '[');
+  } else if (c == '"') {
+    jp->is_key = 0;
+    json_start_token(jp, JSON_ST_STRING, c);
+  } else if (c == '-' || isdigit(c)) {
+    json_start_token(jp, JSON_ST_NUMBER, c);
+  } else if (c == 't' || c == 'f' || c == 'n') {
+    json_start_token(jp, JSON_ST_LITERAL, c);
+  } else {
+    return json_syntax_error(jp);
+  }
+  return V7_OK;
+}
+
+/*
+ * Handles a structural character `c`, outside of any token.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_structural(struct v7_json_parser *jp, int c) {
+  switch (jp->state) {
+    case JSON_ST_VALUE:
+      return json_start_value(jp, c);
+    case JSON_ST_ARRAY_FIRST:
+      return c == ']' ? json_close(jp, 1) : json_start_value(jp, c);
+    case JSON_ST_OBJECT_FIRST:
+      if (c == '}') {
+        return json_close(jp, 0);
+      }
+    /* fall through */
+    case JSON_ST_KEY:
+      if (c != '"') {
+        break;
+      }
+      jp->is_key = 1;
+      json_start_token(jp, JSON_ST_STRING, c);
+      return V7_OK;
+    case JSON_ST_COLON:
+      if (c != ':') {
+        break;
+      }
+      jp->state = JSON_ST_VALUE;
+      return V7_OK;
+    case JSON_ST_NEXT:
+      if (c == ',') {
+        jp->state = v7_is_array(jp->v7, json_container(jp)) ? JSON_ST_VALUE
+                                                             : JSON_ST_KEY;
+        return V7_OK;
+      } else if (c == ']' || c == '}') {
+        return json_close(jp, c == ']');
+      }
+      break;
+    default:
+      break;
+  }
+  return json_syntax_error(jp);
+}
+
+/*
+ * Handles the character `c` following a backslash in a string.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_escape(struct v7_json_parser *jp, int c) {
+  switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'n':
+      c = '\n';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    case 'u':
+      jp->rune = 0;
+      jp->hex_cnt = 0;
+      jp->state = JSON_ST_UNICODE;
+      return V7_OK;
+    default:
+      return json_syntax_error(jp);
+  }
+  {
+    char ch = (char) c;
+    mbuf_append(&jp->tok, &ch, 1);
+  }
+  jp->state = JSON_ST_STRING;
+  return V7_OK;
+}
+
+/*
+ * Handles the closing quote of a string.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err json_end_string(struct v7_json_parser *jp) {
+  struct v7 *v7 = jp->v7;
+  val_t s = v7_mk_string(v7, jp->tok.buf, jp->tok.len, 1);
+
+  if (jp->is_key) {
+    v7_array_set(v7, jp->stack, 2 * jp->depth - 1, s);
+    jp->state = JSON_ST_COLON;
+    return V7_OK;
+  }
+  return json_add_value(jp, s);
+}
+
+struct v7_json_parser *v7_json_parser_create(struct v7 *v7) {
+  struct v7_json_parser *jp =
+      (struct v7_json_parser *) calloc(1, sizeof(*jp));
+
+  jp->v7 = v7;
+  jp->stack = v7_mk_dense_array(v7);
+  jp->value = v7_mk_undefined();
+  mbuf_init(&jp->tok, 0);
+  jp->state = JSON_ST_VALUE;
+
+  v7_own(v7, &jp->stack);
+  v7_own(v7, &jp->value);
+
+  return jp;
+}
+
+void v7_json_parser_destroy(struct v7_json_parser *jp) {
+  if (jp == NULL) return;
+  v7_disown(jp->v7, &jp->value);
+  v7_disown(jp->v7, &jp->stack);
+  mbuf_free(&jp->tok);
+  free(jp);
+}
+
+enum v7_err v7_json_parser_feed(struct v7_json_parser *jp, const char *buf,
+                                size_t len) {
+  enum v7_err rcode = V7_OK;
+  const char *p = buf, *end = buf + len;
+
+  while (p < end && rcode == V7_OK) {
+    int c = (unsigned char) *p;
+
+    switch (jp->state) {
+      case JSON_ST_STRING: {
+        /* take the whole run of plain characters at once */
+        const char *s = p;
+        while (p < end && *p != '"' && *p != '\\' &&
+               (unsigned char) *p >= 0x20) {
+          p++;
+        }
+        if (p > s) {
+          mbuf_append(&jp->tok, s, p - s);
+          jp->offset += p - s;
+        }
+        if (p == end) {
+          continue;
+        }
+        c = (unsigned char) *p;
+        if (c == '"') {
+          rcode = json_end_string(jp);
+        } else if (c == '\\') {
+          jp->state = JSON_ST_ESCAPE;
+        } else {
+          rcode = json_syntax_error(jp);
+        }
+        break;
+      }
+      case JSON_ST_ESCAPE:
+        rcode = json_escape(jp, c);
+        break;
+      case JSON_ST_UNICODE:
+        if (!isxdigit(c)) {
+          rcode = json_syntax_error(jp);
+          break;
+        }
+        jp->rune = (Rune)((jp->rune << 4) |
+                          (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10));
+        if (++jp->hex_cnt == 4) {
+          char tmp[4];
+          mbuf_append(&jp->tok, tmp, runetochar(tmp, &jp->rune));
+          jp->state = JSON_ST_STRING;
+        }
+        break;
+      case JSON_ST_NUMBER:
+      case JSON_ST_LITERAL:
+        if (isalnum(c) || c == '.' || c == '+' || c == '-') {
+          mbuf_append(&jp->tok, p, 1);
+          break;
+        }
+        /* the token is over: complete it, and handle `c` in the new state */
+        rcode = json_end_token(jp);
+        continue;
+      case JSON_ST_ERROR:
+        rcode = json_syntax_error(jp);
+        continue;
+      default:
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+          rcode = json_structural(jp, c);
+        }
+        break;
+    }
+
+    p++;
+    jp->offset++;
+  }
+
+  return rcode;
+}
+
+enum v7_err v7_json_parser_finish(struct v7_json_parser *jp, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  struct v7 *v7 = jp->v7;
+
+  *res = v7_mk_undefined();
+
+  if (jp->state == JSON_ST_NUMBER || jp->state == JSON_ST_LITERAL) {
+    V7_TRY(json_end_token(jp));
+  }
+  if (jp->state != JSON_ST_DONE) {
+    rcode = json_syntax_error(jp);
+    goto clean;
+  }
+  *res = jp->value;
+
+clean:
+  return rcode;
+}
+
+V7_PRIVATE enum v7_err json_parse(struct v7 *v7, const char *buf, size_t len,
+                                  val_t *res) {
+  enum v7_err rcode = V7_OK;
+  struct v7_json_parser *jp = v7_json_parser_create(v7);
+  char *copy = NULL;
+
+  /*
+   * Every string the parser creates may relocate `owned_strings`, so the text
+   * of a JS string has to be copied out first
+   */
+  if (buf >= v7->owned_strings.buf &&
+      buf < v7->owned_strings.buf + v7->owned_strings.len) {
+    copy = (char *) malloc(len + 1);
+    memcpy(copy, buf, len);
+    buf = copy;
+  }
+
+  rcode = v7_json_parser_feed(jp, buf, len);
+  if (rcode == V7_OK) {
+    rcode = v7_json_parser_finish(jp, res);
+  } else {
+    *res = v7_mk_undefined();
+  }
+
+  v7_json_parser_destroy(jp);
+  free(copy);
+  return rcode;
+}
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err Json_stringify(struct v7 *v7, v7_val_t *res) {
   val_t arg0 = v7_arg(v7, 0);
@@ -27636,8 +30114,21 @@ V7_PRIVATE enum v7_err Json_stringify(struct v7 *v7, v7_val_t *res) {
 
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err Json_parse(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
   v7_val_t arg = v7_arg(v7, 0);
-  return std_eval(v7, arg, v7_mk_undefined(), 1, res);
+  const char *s;
+  size_t len;
+
+  rcode = to_string(v7, arg, &arg, NULL, 0, NULL);
+  if (rcode != V7_OK) {
+    goto clean;
+  }
+
+  s = v7_get_string_data(v7, &arg, &len);
+  rcode = json_parse(v7, s, len, res);
+
+clean:
+  return rcode;
 }
 
 V7_PRIVATE void init_json(struct v7 *v7) {
@@ -27684,12 +30175,7 @@ V7_PRIVATE enum v7_err Array_ctor(struct v7 *v7, v7_val_t *res) {
   unsigned long i, len;
 
   (void) v7;
-  *res = v7_mk_array(v7);
-  /*
-   * The interpreter passes dense array to C functions.
-   * However dense array implementation is not yet complete
-   * so we don't want to propagate them at each call to Array()
-   */
+  *res = v7_mk_dense_array(v7);
   len = v7_argc(v7);
   for (i = 0; i < len; i++) {
     rcode = v7_array_set_throwing(v7, *res, i, v7_arg(v7, i), NULL);
@@ -27761,11 +30247,21 @@ V7_PRIVATE enum v7_err Array_set_length(struct v7 *v7, v7_val_t *res) {
               (isnan(v7_to_number(arg0)) || isinf(v7_to_number(arg0))))) {
     rcode = v7_throwf(v7, RANGE_ERROR, "Invalid array length");
     goto clean;
+  } else if (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    struct v7_dense_array *da = v7_to_dense_array(v7, this_obj);
+    long len = (da == NULL) ? 0 : (long) DENSE_ARRAY_LEN(da);
+
+    if (new_len < len) {
+      da->vals.len -= (len - new_len) * sizeof(val_t);
+    } else if (new_len > len) {
+      v7_array_set(v7, this_obj, new_len - 1, V7_UNDEFINED);
+    }
   } else {
     struct v7_property **p, **next;
     long index, max_index = -1;
 
     /* Remove all items with an index higher than new_len */
+    obj_drop_shape(v7_to_object(this_obj));
     for (p = &v7_to_object(this_obj)->properties; *p != NULL; p = next) {
       size_t n;
       const char *s = v7_get_string_data(v7, &p[0]->name, &n);
@@ -28095,25 +30591,40 @@ static enum v7_err a_splice(struct v7 *v7, int mutate, v7_val_t *res) {
      * space allocated for future appends.
      * TODO(mkm): figure out if trimming is better
      */
-    struct v7_property *p =
-        v7_get_own_property2(v7, this_obj, "", 0, _V7_PROPERTY_HIDDEN);
-    struct mbuf *abuf;
-    if (p == NULL) {
-      goto clean;
-    }
-    abuf = (struct mbuf *) v7_to_foreign(p->value);
-    if (abuf == NULL) {
+    struct v7_dense_array *da = v7_to_dense_array(v7, this_obj);
+    val_t *vals;
+
+    if (da == NULL) {
+      /* empty array: just append the extra elements */
+      for (i = 2; i < num_args; i++) {
+        rcode = v7_array_push_throwing(v7, this_obj, v7_arg(v7, i), NULL);
+        if (rcode != V7_OK) {
+          goto clean;
+        }
+      }
       goto clean;
     }
 
-    memmove(abuf->buf + arg0 * sizeof(val_t), abuf->buf + arg1 * sizeof(val_t),
-            (len - arg1) * sizeof(val_t));
-    abuf->len -= (arg1 - arg0) * sizeof(val_t);
+    if (arg1 > len) arg1 = len;
+    vals = DENSE_ARRAY_VALS(da);
+    memmove(vals + arg0, vals + arg1, (len - arg1) * sizeof(val_t));
+    da->vals.len -= (arg1 - arg0) * sizeof(val_t);
+
+    /* Insert optional extra elements */
+    if (elems_to_insert > 0) {
+      mbuf_insert(&da->vals, (da->head + arg0) * sizeof(val_t), NULL,
+                  elems_to_insert * sizeof(val_t));
+      for (i = 2; i < num_args; i++) {
+        DENSE_ARRAY_VALS(da)[arg0 + i - 2] = v7_arg(v7, i);
+      }
+      gc_write_barrier(v7, v7_to_object(this_obj));
+    }
   } else if (mutate) {
     /* If splicing, modify this_obj array: remove spliced sub-array */
     struct v7_property **p, **next;
     long i;
 
+    obj_drop_shape(v7_to_object(this_obj));
     for (p = &v7_to_object(this_obj)->properties; *p != NULL; p = next) {
       size_t n;
       const char *s = v7_get_string_data(v7, &p[0]->name, &n);
@@ -28129,7 +30640,7 @@ static enum v7_err a_splice(struct v7 *v7, int mutate, v7_val_t *res) {
         char key[20];
         size_t n = c_snprintf(key, sizeof(key), "%ld",
                               i - (arg1 - arg0) + elems_to_insert);
-        p[0]->name = v7_mk_string(v7, key, n, 1);
+        p[0]->name = v7_mk_atom(v7, key, n);
       }
     }
 
@@ -28418,6 +30929,7 @@ V7_PRIVATE enum v7_err Array_concat(struct v7 *v7, v7_val_t *res) {
   val_t this_obj = v7_get_this(v7);
   size_t i, j, len;
   val_t saved_args;
+  unsigned long saved_argc;
 
   if (!v7_is_array(v7, this_obj)) {
     rcode = v7_throwf(v7, TYPE_ERROR, "Array expected");
@@ -28434,12 +30946,15 @@ V7_PRIVATE enum v7_err Array_concat(struct v7 *v7, v7_val_t *res) {
    * from a cfunction.
    */
   saved_args = v7->vals.arguments;
+  saved_argc = v7->argc;
   v7->vals.arguments = v7_mk_undefined();
+  v7->argc = 0;
   rcode = a_splice(v7, 1, res);
   if (rcode != V7_OK) {
     goto clean;
   }
   v7->vals.arguments = saved_args;
+  v7->argc = saved_argc;
 
   for (i = 0; i < len; i++) {
     val_t a = v7_arg(v7, i);
@@ -28463,6 +30978,295 @@ clean:
   return rcode;
 }
 
+/* Strict equality comparison, i.e. `===` */
+static int a_strict_eq(struct v7 *v7, val_t a, val_t b) {
+  if (v7_is_string(a) && v7_is_string(b)) {
+    return s_cmp(v7, a, b) == 0;
+  }
+  return a == b && a != V7_TAG_NAN;
+}
+
+WARN_UNUSED_RESULT
+static enum v7_err a_index_of(struct v7 *v7, int last, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  val_t el = v7_arg(v7, 0);
+  long i, from, len, found = -1;
+
+  if (!v7_is_object(this_obj)) {
+    goto clean;
+  }
+
+  len = v7_array_length(v7, this_obj);
+  rcode = to_long(v7, v7_arg(v7, 1), last ? len - 1 : 0, &from);
+  if (rcode != V7_OK) {
+    goto clean;
+  }
+  if (from < 0) from += len;
+  if (from >= len) from = last ? len - 1 : len;
+  if (from < 0) from = last ? -1 : 0;
+
+  if (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    struct v7_dense_array *da = v7_to_dense_array(v7, this_obj);
+    val_t *vals = (da == NULL) ? NULL : DENSE_ARRAY_VALS(da);
+    if (last) {
+      for (i = from; i >= 0 && found < 0; i--) {
+        if (a_strict_eq(v7, vals[i], el)) found = i;
+      }
+    } else {
+      for (i = from; i < len && found < 0; i++) {
+        if (a_strict_eq(v7, vals[i], el)) found = i;
+      }
+    }
+  } else {
+    /*
+     * Elements are kept in the property list in no particular order: scan it
+     * just once, instead of looking up each index in turn.
+     */
+    struct v7_property *p;
+    for (p = v7_to_object(this_obj)->properties; p != NULL; p = p->next) {
+      int ok;
+      size_t n;
+      const char *s;
+      val_t v;
+      if (p->attributes & _V7_PROPERTY_HIDDEN) continue;
+      s = v7_get_string_data(v7, &p->name, &n);
+      i = cstr_to_ulong(s, n, &ok);
+      if (!ok || (last ? i > from : i < from)) continue;
+      if (found >= 0 && (last ? i <= found : i >= found)) continue;
+      rcode = v7_property_value(v7, this_obj, p, &v);
+      if (rcode != V7_OK) {
+        goto clean;
+      }
+      if (a_strict_eq(v7, v, el)) found = i;
+    }
+  }
+
+clean:
+  *res = v7_mk_number(found);
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_indexOf(struct v7 *v7, v7_val_t *res) {
+  return a_index_of(v7, 0, res);
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_lastIndexOf(struct v7 *v7, v7_val_t *res) {
+  return a_index_of(v7, 1, res);
+}
+
+#if V7_ENABLE__Array__reduce
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_reduce(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  val_t cb = v7_arg(v7, 0), v = v7_mk_undefined(), args = v7_mk_undefined();
+  unsigned long len, i;
+  long generic_len;
+  int is_array = v7_is_array(v7, this_obj) ||
+                 (v7_is_object(this_obj) &&
+                  (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY));
+  int has, have_acc = v7_argc(v7) > 1;
+  int saved_inhibit_gc = v7->inhibit_gc;
+  /* GC is uninhibited when calling cb */
+  struct gc_tmp_frame vf = new_tmp_frame(v7);
+
+  *res = v7_arg(v7, 1);
+  tmp_stack_push(&vf, res);
+  tmp_stack_push(&vf, &v);
+  tmp_stack_push(&vf, &args);
+
+  if (v7_is_undefined(this_obj) || v7_is_null(this_obj)) {
+    rcode = v7_throwf(v7, TYPE_ERROR, "Array expected");
+    goto clean;
+  }
+
+  if (!v7_is_callable(v7, cb)) {
+    rcode = v7_throwf(v7, TYPE_ERROR, "Function expected");
+    goto clean;
+  }
+
+  if (is_array) {
+    len = v7_array_length(v7, this_obj);
+  } else {
+    /* Array-likes, e.g. strings or `arguments`: go by their `length` */
+    rcode = v7_get_throwing(v7, this_obj, "length", 6, &v);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+    rcode = to_long(v7, v, 0, &generic_len);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+    len = generic_len > 0 ? (unsigned long) generic_len : 0;
+  }
+
+  for (i = 0; i < len; i++) {
+    if (is_array) {
+      v = v7_array_get2(v7, this_obj, i, &has);
+    } else {
+      char key[20];
+      size_t n = c_snprintf(key, sizeof(key), "%lu", i);
+      has = !v7_is_object(this_obj) ||
+            v7_get_property(v7, this_obj, key, n) != NULL;
+      rcode = v7_get_throwing_v(v7, this_obj, v7_mk_number(i), &v);
+      if (rcode != V7_OK) {
+        goto clean;
+      }
+    }
+    if (!has) continue;
+    if (!have_acc) {
+      *res = v;
+      have_acc = 1;
+      continue;
+    }
+
+    /* cb(acc, v, n, this_obj) */
+    args = v7_mk_dense_array(v7);
+    v7_array_push(v7, args, *res);
+    v7_array_push(v7, args, v);
+    v7_array_push(v7, args, v7_mk_number(i));
+    v7_array_push(v7, args, this_obj);
+
+    v7->inhibit_gc = 0;
+    rcode = b_apply(v7, cb, V7_UNDEFINED, args, 0, res);
+    v7->inhibit_gc = saved_inhibit_gc;
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+  }
+
+  if (!have_acc) {
+    rcode = v7_throwf(v7, TYPE_ERROR,
+                      "Reduce of empty array with no initial value");
+    goto clean;
+  }
+
+clean:
+  tmp_frame_cleanup(&vf);
+  return rcode;
+}
+#endif
+
+/*
+ * Adds `delta` to the indices of the elements of an ordinary (non-dense)
+ * array, dropping the ones whose index would become negative.
+ */
+static void a_reindex(struct v7 *v7, val_t arr, long delta) {
+  struct v7_property **p, **next;
+
+  obj_drop_shape(v7_to_object(arr));
+  for (p = &v7_to_object(arr)->properties; *p != NULL; p = next) {
+    int ok;
+    size_t n;
+    const char *s;
+    long i;
+    next = &p[0]->next;
+    if (p[0]->attributes & _V7_PROPERTY_HIDDEN) continue;
+    s = v7_get_string_data(v7, &p[0]->name, &n);
+    i = cstr_to_ulong(s, n, &ok);
+    if (!ok) continue;
+    if (i + delta < 0) {
+      v7_destroy_property(p);
+      *p = *next;
+      next = p;
+    } else {
+      char key[20];
+      n = c_snprintf(key, sizeof(key), "%ld", i + delta);
+      p[0]->name = v7_mk_atom(v7, key, n);
+    }
+  }
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_pop(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  unsigned long len;
+
+  *res = v7_mk_undefined();
+
+  if (!v7_is_object(this_obj) || (len = v7_array_length(v7, this_obj)) == 0) {
+    goto clean;
+  }
+
+  *res = v7_array_get(v7, this_obj, len - 1);
+  if (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    v7_to_dense_array(v7, this_obj)->vals.len -= sizeof(val_t);
+  } else {
+    v7_array_del(v7, this_obj, len - 1);
+  }
+
+clean:
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_shift(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+
+  *res = v7_mk_undefined();
+
+  if (!v7_is_object(this_obj) || v7_array_length(v7, this_obj) == 0) {
+    goto clean;
+  }
+
+  *res = v7_array_get(v7, this_obj, 0);
+  if (v7_to_object(this_obj)->attributes & V7_OBJ_DENSE_ARRAY) {
+    dense_array_shift(v7_to_dense_array(v7, this_obj), 1);
+  } else {
+    a_reindex(v7, this_obj, -1);
+  }
+
+clean:
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Array_unshift(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  unsigned long i, argc = v7_argc(v7);
+  struct v7_object *o;
+
+  if (!v7_is_object(this_obj)) {
+    rcode = v7_throwf(v7, TYPE_ERROR, "Array expected");
+    goto clean;
+  }
+  o = v7_to_object(this_obj);
+
+  if (argc == 0) {
+    /* nothing to insert */
+  } else if ((o->attributes & V7_OBJ_DENSE_ARRAY) &&
+             !(o->attributes & V7_OBJ_NOT_EXTENSIBLE) &&
+             v7_to_dense_array(v7, this_obj) != NULL) {
+    struct v7_dense_array *da = v7_to_dense_array(v7, this_obj);
+    dense_array_unshift(da, argc);
+    for (i = 0; i < argc; i++) {
+      DENSE_ARRAY_VALS(da)[i] = v7_arg(v7, i);
+    }
+    gc_write_barrier(v7, o);
+  } else {
+    if (!(o->attributes & V7_OBJ_DENSE_ARRAY)) {
+      a_reindex(v7, this_obj, (long) argc);
+    }
+    for (i = 0; i < argc; i++) {
+      rcode = v7_array_set_throwing(v7, this_obj, i, v7_arg(v7, i), NULL);
+      if (rcode != V7_OK) {
+        goto clean;
+      }
+    }
+  }
+
+  *res = v7_mk_number(v7_array_length(v7, this_obj));
+
+clean:
+  return rcode;
+}
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err Array_isArray(struct v7 *v7, v7_val_t *res) {
   val_t arg0 = v7_arg(v7, 0);
@@ -28485,15 +31289,24 @@ V7_PRIVATE void init_array(struct v7 *v7) {
   set_method(v7, v7->vals.array_prototype, "every", Array_every, 1);
   set_method(v7, v7->vals.array_prototype, "filter", Array_filter, 1);
   set_method(v7, v7->vals.array_prototype, "forEach", Array_forEach, 1);
+  set_method(v7, v7->vals.array_prototype, "indexOf", Array_indexOf, 1);
   set_method(v7, v7->vals.array_prototype, "join", Array_join, 1);
+  set_method(v7, v7->vals.array_prototype, "lastIndexOf", Array_lastIndexOf,
+             1);
   set_method(v7, v7->vals.array_prototype, "map", Array_map, 1);
+  set_method(v7, v7->vals.array_prototype, "pop", Array_pop, 0);
   set_method(v7, v7->vals.array_prototype, "push", Array_push, 1);
+#if V7_ENABLE__Array__reduce
+  set_method(v7, v7->vals.array_prototype, "reduce", Array_reduce, 1);
+#endif
   set_method(v7, v7->vals.array_prototype, "reverse", Array_reverse, 0);
+  set_method(v7, v7->vals.array_prototype, "shift", Array_shift, 0);
   set_method(v7, v7->vals.array_prototype, "slice", Array_slice, 2);
   set_method(v7, v7->vals.array_prototype, "some", Array_some, 1);
   set_method(v7, v7->vals.array_prototype, "sort", Array_sort, 1);
   set_method(v7, v7->vals.array_prototype, "splice", Array_splice, 2);
   set_method(v7, v7->vals.array_prototype, "toString", Array_toString, 0);
+  set_method(v7, v7->vals.array_prototype, "unshift", Array_unshift, 1);
 
   v7_array_set(v7, length, 0, v7_mk_cfunction(Array_get_length));
   v7_array_set(v7, length, 1, v7_mk_cfunction(Array_set_length));
@@ -31442,6 +34255,116 @@ clean:
   return rcode;
 }
 
+#if V7_ENABLE__Function__call
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Function_call(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  val_t func_args = v7_mk_dense_array(v7);
+  unsigned long i, argc = v7_argc(v7);
+
+  rcode = obj_value_of(v7, this_obj, &this_obj);
+  if (rcode != V7_OK) {
+    goto clean;
+  }
+
+  for (i = 1; i < argc; i++) {
+    rcode = v7_array_push_throwing(v7, func_args, v7_arg(v7, i), NULL);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+  }
+
+  rcode = b_apply(v7, this_obj, v7_arg(v7, 0), func_args, 0, res);
+  if (rcode != V7_OK) {
+    goto clean;
+  }
+
+clean:
+  return rcode;
+}
+#endif
+
+#if V7_ENABLE__Function__bind
+/*
+ * Function returned by `bind()`. Its hidden `bound` property is an array:
+ * target function, `this` and the bound arguments.
+ *
+ * When called as a constructor, the bound `this` is ignored and the target
+ * is constructed: `this` is then the new object, created with the prototype
+ * of the target, see `ctor_prototype()`.
+ */
+WARN_UNUSED_RESULT
+static enum v7_err Function_bound(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  struct v7_property *p = v7_get_own_property2(v7, v7->vals.callee, "bound", 5,
+                                               _V7_PROPERTY_HIDDEN);
+  val_t bound, func_args = v7_mk_dense_array(v7);
+  unsigned long i, bound_cnt, argc = v7_argc(v7);
+
+  assert(p != NULL);
+  bound = p->value;
+  bound_cnt = v7_array_length(v7, bound);
+
+  for (i = 2; i < bound_cnt; i++) {
+    rcode = v7_array_push_throwing(v7, func_args, v7_array_get(v7, bound, i),
+                                   NULL);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+  }
+  for (i = 0; i < argc; i++) {
+    rcode = v7_array_push_throwing(v7, func_args, v7_arg(v7, i), NULL);
+    if (rcode != V7_OK) {
+      goto clean;
+    }
+  }
+
+  if (v7->is_constructor) {
+    rcode = b_apply(v7, v7_array_get(v7, bound, 0), v7_get_this(v7), func_args,
+                    1, res);
+  } else {
+    rcode = b_apply(v7, v7_array_get(v7, bound, 0), v7_array_get(v7, bound, 1),
+                    func_args, 0, res);
+  }
+  if (rcode != V7_OK) {
+    goto clean;
+  }
+
+clean:
+  return rcode;
+}
+
+WARN_UNUSED_RESULT
+V7_PRIVATE enum v7_err Function_bind(struct v7 *v7, v7_val_t *res) {
+  enum v7_err rcode = V7_OK;
+  val_t this_obj = v7_get_this(v7);
+  val_t bound = v7_mk_dense_array(v7);
+  unsigned long i, argc = v7_argc(v7);
+  struct gc_tmp_frame tf = new_tmp_frame(v7);
+
+  tmp_stack_push(&tf, &bound);
+
+  if (!v7_is_callable(v7, this_obj)) {
+    rcode = v7_throwf(v7, TYPE_ERROR, "Bind must be called on a function");
+    goto clean;
+  }
+
+  v7_array_push(v7, bound, this_obj);
+  v7_array_push(v7, bound, v7_arg(v7, 0));
+  for (i = 1; i < argc; i++) {
+    v7_array_push(v7, bound, v7_arg(v7, i));
+  }
+
+  *res = mk_cfunction_obj(v7, Function_bound, -1);
+  v7_def(v7, *res, "bound", 5, _V7_DESC_HIDDEN(1), bound);
+
+clean:
+  tmp_frame_cleanup(&tf);
+  return rcode;
+}
+#endif
+
 WARN_UNUSED_RESULT
 V7_PRIVATE enum v7_err Function_toString(struct v7 *v7, v7_val_t *res) {
   enum v7_err rcode = V7_OK;
@@ -31510,6 +34433,12 @@ V7_PRIVATE void init_function(struct v7 *v7) {
   v7_set(v7, ctor, "prototype", 9, v7->vals.function_prototype);
   v7_set(v7, v7->vals.global_object, "Function", 8, ctor);
   set_method(v7, v7->vals.function_prototype, "apply", Function_apply, 1);
+#if V7_ENABLE__Function__bind
+  set_method(v7, v7->vals.function_prototype, "bind", Function_bind, 1);
+#endif
+#if V7_ENABLE__Function__call
+  set_method(v7, v7->vals.function_prototype, "call", Function_call, 1);
+#endif
   set_method(v7, v7->vals.function_prototype, "toString", Function_toString, 0);
   v7_def(v7, v7->vals.function_prototype, "length", 6,
          (V7_DESC_ENUMERABLE(0) | V7_DESC_GETTER(1)),
@@ -31749,10 +34678,12 @@ V7_PRIVATE enum v7_err rx_exec(struct v7 *v7, val_t rx, val_t vstr, int lind,
       int i;
       val_t arr = v7_mk_array(v7);
       char *old_mbuf_base = v7->owned_strings.buf;
+      int is_owned = str >= old_mbuf_base &&
+                     str < old_mbuf_base + v7->owned_strings.len;
       ptrdiff_t rel = 0; /* creating strings might relocate the mbuf */
 
       for (i = 0; i < sub.num_captures; i++, ptok++) {
-        rel = v7->owned_strings.buf - old_mbuf_base;
+        if (is_owned) rel = v7->owned_strings.buf - old_mbuf_base;
         v7_array_push(v7, arr, v7_mk_string(v7, ptok->start + rel,
                                             ptok->end - ptok->start, 1));
       }
@@ -31913,6 +34844,7 @@ static void show_usage(char *argv[]) {
   fprintf(stderr, "%s\n", "  -vo <n>              object arena size");
   fprintf(stderr, "%s\n", "  -vf <n>              function arena size");
   fprintf(stderr, "%s\n", "  -vp <n>              property arena size");
+  fprintf(stderr, "%s\n", "  -vg <n>              GC time budget, in us");
 #ifdef V7_FREEZE
   fprintf(stderr, "%s\n", "  -freeze filename     dump JS heap into a file");
 #endif
@@ -31988,6 +34920,9 @@ int v7_main(int argc, char *argv[], void (*pre_freeze_init)(struct v7 *),
     } else if (strcmp(argv[i], "-vp") == 0 && i + 1 < argc) {
       opts.property_arena_size = atoi(argv[i + 1]);
       i++;
+    } else if (strcmp(argv[i], "-vg") == 0 && i + 1 < argc) {
+      opts.gc_time_budget_us = atoi(argv[i + 1]);
+      i++;
     }
 #ifdef V7_FREEZE
     else if (strcmp(argv[i], "-freeze") == 0 && i + 1 < argc) {
@@ -265,6 +265,14 @@ struct v7_create_opts {
   size_t object_arena_size;
   size_t function_arena_size;
   size_t property_arena_size;
+  /*
+   * Target pause of a minor GC pass, in microseconds. Minor passes only
+   * collect objects allocated since the previous pass; when this is non-zero,
+   * they are performed every N allocations, N being adjusted to keep the
+   * pause within the target. 0 means that GC runs only when the heap is
+   * exhausted.
+   */
+  unsigned long gc_time_budget_us;
 #ifdef V7_STACK_SIZE
   void *c_stack_base;
 #endif
@@ -485,6 +493,14 @@ struct v7_create_opts {
   size_t object_arena_size;
   size_t function_arena_size;
   size_t property_arena_size;
+  /*
+   * Target pause of a minor GC pass, in microseconds. Minor passes only
+   * collect objects allocated since the previous pass; when this is non-zero,
+   * they are performed every N allocations, N being adjusted to keep the
+   * pause within the target. 0 means that GC runs only when the heap is
+   * exhausted.
+   */
+  unsigned long gc_time_budget_us;
 #ifdef V7_STACK_SIZE
   void *c_stack_base;
 #endif
@@ -762,6 +778,9 @@ int v7_is_string(v7_val_t v);
  * Short JS strings are embedded inside the `v7_val_t` value itself. This is why
  * a pointer to a `v7_val_t` is required. It also means that the string data
  * will become invalid once that `v7_val_t` value goes out of scope.
+ *
+ * Long strings built by concatenation are kept as ropes and get flattened by
+ * the first call to `v7_get_string_data()`.
  */
 const char *v7_get_string_data(struct v7 *v7, v7_val_t *v, size_t *len);
 
@@ -1281,6 +1300,32 @@ enum v7_err v7_parse_json(struct v7 *v7, const char *str, v7_val_t *res);
 WARN_UNUSED_RESULT
 enum v7_err v7_parse_json_file(struct v7 *v7, const char *path, v7_val_t *res);
 
+/*
+ * Incremental JSON parser, for JSON text which arrives in chunks, e.g. from
+ * the network. Chunks are fed to `v7_json_parser_feed()` as they come, and
+ * the value is built while parsing, so the text never has to be kept as a
+ * whole. When the text is over, `v7_json_parser_finish()` yields the value.
+ *
+ * Both functions return `V7_SYNTAX_ERROR` (and throw `SyntaxError`) if the
+ * text is not a valid JSON. The parser must be freed with
+ * `v7_json_parser_destroy()`.
+ *
+ * Chunks must not point into the data of a JS string: it may move while the
+ * parser creates values.
+ */
+struct v7_json_parser;
+
+struct v7_json_parser *v7_json_parser_create(struct v7 *v7);
+
+WARN_UNUSED_RESULT
+enum v7_err v7_json_parser_feed(struct v7_json_parser *jp, const char *buf,
+                                size_t len);
+
+WARN_UNUSED_RESULT
+enum v7_err v7_json_parser_finish(struct v7_json_parser *jp, v7_val_t *res);
+
+void v7_json_parser_destroy(struct v7_json_parser *jp);
+
 /*
  * Compile JavaScript code `js_code` into the byte code and write generated
  * byte code into opened file stream `fp`. If `generate_binary_output` is 0,